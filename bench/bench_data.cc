@@ -0,0 +1,182 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <set>
+#include "bench_data.h"
+
+const char *const kDatasets[] = {"bytes", "words", "urls", "cjk", NULL};
+
+/// Syllables of English-like words, the common ones first.
+static const char *const kSyllables[] = {
+    "the", "in", "er", "an", "re", "on", "at", "en", "ed", "nd",
+    "ha", "es", "or", "ti", "is", "it", "al", "ar", "st", "to",
+    "nt", "ng", "se", "ou", "le", "ve", "co", "me", "de", "hi",
+    "ri", "ro", "ic", "ne", "ea", "ra", "ce", "li", "ch", "ll",
+    "be", "ma", "si", "om", "ur", "ca", "el", "ta", "la", "ns",
+    "di", "fo", "ho", "pe", "ec", "pr", "no", "ct", "us", "ac",
+    "ot", "il", "tr", "ly", "nc", "et", "ut", "ss", "so", "rs",
+    "un", "lo", "wa", "ge", "ie", "wh", "ee", "wi", "em", "ad",
+    "ol", "rt", "po", "we", "na", "ul", "ni", "ts", "mo", "ow",
+    "pa", "im", "mi", "ai", "sh", "ir", "su", "id", "os", "iv",
+};
+
+/// Endings of English-like words.
+static const char *const kEndings[] = {
+    "", "", "", "s", "ed", "ing", "er", "ly", "tion", "ness",
+};
+
+/// Top level domains of URLs.
+static const char *const kDomains[] = {
+    ".com", ".org", ".net", ".edu", ".io", ".co.uk", ".de", ".cn",
+};
+
+template<typename T, size_t N>
+static size_t countof(T (&)[N])
+{
+    return N;
+}
+
+/// Returns an index of n, small ones more likely.
+static size_t skewed(bench_random *random, size_t n)
+{
+    double r = random->real();
+    return static_cast<size_t>(r * r * n);
+}
+
+static std::string make_word(bench_random *random)
+{
+    std::string word;
+    size_t syllables = 1 + random->uniform(4);
+    for (size_t i = 0; i < syllables; i++)
+        word += kSyllables[skewed(random, countof(kSyllables))];
+    word += kEndings[random->uniform(countof(kEndings))];
+    return word;
+}
+
+static std::string make_bytes(bench_random *random)
+{
+    std::string key;
+    size_t length = 4 + random->uniform(13);
+    for (size_t i = 0; i < length; i++)
+        key.push_back(static_cast<char>(random->uniform(256)));
+    return key;
+}
+
+static std::string make_url(bench_random *random,
+                            const std::vector<std::string> &hosts)
+{
+    std::string url(random->uniform(4)?"https://":"http://");
+    url += hosts[skewed(random, hosts.size())];
+    size_t segments = random->uniform(4);
+    for (size_t i = 0; i < segments; i++) {
+        url.push_back('/');
+        url += make_word(random);
+    }
+    if (random->uniform(3) == 0) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "?id=%u",
+                 static_cast<unsigned>(random->uniform(100000)));
+        url += buf;
+    }
+    return url;
+}
+
+static std::string make_cjk(bench_random *random)
+{
+    std::string key;
+    size_t length = 2 + random->uniform(5);
+    for (size_t i = 0; i < length; i++) {
+        // CJK Unified Ideographs, U+4E00 to U+9FFF, in three bytes
+        unsigned code = 0x4e00 + skewed(random, 0x5200);
+        key.push_back(static_cast<char>(0xe0 | (code >> 12)));
+        key.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3f)));
+        key.push_back(static_cast<char>(0x80 | (code & 0x3f)));
+    }
+    return key;
+}
+
+bool make_dataset(const char *name, size_t count, uint64_t seed,
+                  std::vector<std::string> *keys)
+{
+    bench_random random(seed);
+    std::vector<std::string> hosts;
+    std::set<std::string> seen;
+    size_t kind;
+
+    for (kind = 0; kDatasets[kind]; kind++)
+        if (!strcmp(name, kDatasets[kind]))
+            break;
+    if (!kDatasets[kind])
+        return false;
+    if (kind == 2) {
+        for (size_t i = 0; i < count / 50 + 1; i++) {
+            std::string host(random.uniform(2)?"www.":"");
+            host += make_word(&random);
+            host += kDomains[random.uniform(countof(kDomains))];
+            hosts.push_back(host);
+        }
+    }
+    keys->clear();
+    while (keys->size() < count) {
+        std::string key;
+        switch (kind) {
+          case 0: key = make_bytes(&random); break;
+          case 1: key = make_word(&random); break;
+          case 2: key = make_url(&random, hosts); break;
+          default: key = make_cjk(&random); break;
+        }
+        // words run out of syllables, number the repeated ones
+        if (seen.count(key) && kind == 1) {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%u",
+                     static_cast<unsigned>(keys->size()));
+            key += buf;
+        }
+        if (seen.insert(key).second)
+            keys->push_back(key);
+    }
+    return true;
+}
+
+void make_misses(const std::vector<std::string> &keys, size_t count,
+                 uint64_t seed, std::vector<std::string> *misses)
+{
+    bench_random random(seed);
+    misses->clear();
+    if (keys.empty())
+        return;
+    while (misses->size() < count) {
+        std::string key = keys[random.uniform(keys.size())];
+        // change a byte or append one
+        size_t i = random.uniform(key.size() + 1);
+        if (i == key.size())
+            key.push_back(static_cast<char>(random.uniform(256)));
+        else
+            key[i] = static_cast<char>(key[i] + 1 + random.uniform(255));
+        if (!std::binary_search(keys.begin(), keys.end(), key))
+            misses->push_back(key);
+    }
+}
+
+void make_zipf_queries(size_t keys, size_t count, double s, uint64_t seed,
+                       std::vector<size_t> *queries)
+{
+    bench_random random(seed);
+    std::vector<double> cdf(keys);
+    double sum = 0;
+    for (size_t i = 0; i < keys; i++) {
+        sum += 1.0 / pow(static_cast<double>(i + 1), s);
+        cdf[i] = sum;
+    }
+    queries->clear();
+    for (size_t i = 0; i < count; i++) {
+        double r = random.real() * sum;
+        size_t k = std::upper_bound(cdf.begin(), cdf.end(), r) - cdf.begin();
+        queries->push_back(std::min(k, keys - 1));
+    }
+}
+
+// vim: ts=4 sw=4 ai et
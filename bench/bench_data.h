@@ -0,0 +1,94 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#ifndef BENCH_DATA_H_
+#define BENCH_DATA_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+/**
+ * A deterministic pseudo-random generator (splitmix64), so every run
+ * and every host sees the same datasets.
+ */
+class bench_random {
+  public:
+    /// Constructs a generator from a seed.
+    explicit bench_random(uint64_t seed)
+        :state_(seed)
+    {
+    }
+
+    /// Returns the next 64 random bits.
+    uint64_t next()
+    {
+        uint64_t z = (state_ += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    /// Returns a random number in [0, n).
+    size_t uniform(size_t n)
+    {
+        return next() % n;
+    }
+
+    /// Returns a random number in [0, 1).
+    double real()
+    {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+  private:
+    uint64_t state_;  ///< Current state.
+};
+
+/// Names of the datasets make_dataset() knows, terminated by NULL.
+extern const char *const kDatasets[];
+
+/**
+ * Generates count distinct keys of a dataset, in random order:
+ *
+ *   - bytes: 4 to 16 random bytes, 0 included;
+ *   - words: English-like words made of common syllables;
+ *   - urls: URLs sharing hosts and path segments;
+ *   - cjk: 2 to 6 CJK ideographs in UTF-8, frequent ones more likely.
+ *
+ * @param name Name of the dataset.
+ * @param count Number of keys.
+ * @param seed Seed of the generator.
+ * @param[out] keys The keys.
+ * @return false if the dataset is unknown.
+ */
+bool make_dataset(const char *name, size_t count, uint64_t seed,
+                  std::vector<std::string> *keys);
+
+/**
+ * Generates keys which are not in a dataset, each close to one which is.
+ *
+ * @param keys The dataset, sorted.
+ * @param count Number of keys.
+ * @param seed Seed of the generator.
+ * @param[out] misses The keys.
+ */
+void make_misses(const std::vector<std::string> &keys, size_t count,
+                 uint64_t seed, std::vector<std::string> *misses);
+
+/**
+ * Generates queries of a Zipf distribution over a dataset: the (i)th key
+ * is asked for in proportion to 1 / (i + 1)^s.
+ *
+ * @param keys Number of keys in the dataset.
+ * @param count Number of queries.
+ * @param s Exponent of the distribution, 1.0 for natural text.
+ * @param seed Seed of the generator.
+ * @param[out] queries Indexes of the keys asked for.
+ */
+void make_zipf_queries(size_t keys, size_t count, double s, uint64_t seed,
+                       std::vector<size_t> *queries);
+
+#endif  // BENCH_DATA_H_
+
+// vim: ts=4 sw=4 ai et
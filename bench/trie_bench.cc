@@ -0,0 +1,416 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <getopt.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "trie.h"
+#include "bench_data.h"
+
+using namespace dutil;
+
+/// Settings of a run.
+typedef struct {
+    size_t keys;      ///< Number of keys in a dataset.
+    size_t queries;   ///< Number of searches of each kind.
+    size_t repeat;    ///< Times to repeat each benchmark, the best counts.
+    uint64_t seed;    ///< Seed of the datasets.
+    double zipf;      ///< Exponent of the Zipf distribution of queries.
+    size_t filter;    ///< Bits per key of the filter of archives, 0 for none.
+    bool root;        ///< Archives have a table of the first two bytes.
+    bool chains;      ///< Archives have chains of single transitions.
+    bool relayout;    ///< Archives are renumbered, profiled by the hits.
+} settings_type;
+
+/// Keeps results from being optimized away.
+static volatile long sink;
+
+/// Calls of malloc(), calloc() and realloc() so far.
+static size_t allocations;
+
+#ifdef __GLIBC__
+// counted in front of the allocator of glibc
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+}
+#endif
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Prints a result as a line of JSON.
+ *
+ * @param dataset Name of the dataset.
+ * @param type Name of the trie.
+ * @param bench Name of the benchmark.
+ * @param keys Number of keys in the trie.
+ * @param ops Number of operations timed.
+ * @param seconds Time of all operations.
+ * @param bytes Size of the archive, 0 if unknown.
+ */
+static void report(const char *dataset, const char *type, const char *bench,
+                   size_t keys, size_t ops, double seconds, size_t bytes,
+                   double allocs = -1)
+{
+    printf("{\"dataset\": \"%s\", \"trie\": \"%s\", \"bench\": \"%s\", "
+           "\"keys\": %lu, \"ops\": %lu, \"ns_per_op\": %.1f, "
+           "\"ops_per_sec\": %.0f, \"bytes_per_key\": %.2f",
+           dataset, type, bench, static_cast<unsigned long>(keys),
+           static_cast<unsigned long>(ops), seconds * 1e9 / ops,
+           seconds > 0?ops / seconds:0.0,
+           keys?static_cast<double>(bytes) / keys:0.0);
+#ifdef __GLIBC__
+    if (allocs >= 0)
+        printf(", \"allocs_per_result\": %.3f", allocs);
+#endif
+    printf("}\n");
+    fflush(stdout);
+}
+
+static size_t file_size(const char *filename)
+{
+    struct stat st;
+    return stat(filename, &st) == 0?st.st_size:0;
+}
+
+/// Converts keys to key_type ahead, so conversion is not timed.
+static void make_key_types(const std::vector<std::string> &keys,
+                           std::vector<trie::key_type> *result)
+{
+    result->resize(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+        (*result)[i].assign(keys[i].data(), keys[i].size());
+}
+
+static double time_search(const trie *mtrie,
+                          const std::vector<trie::key_type> &keys)
+{
+    trie::value_type value;
+    long sum = 0;
+    double start = now();
+    for (size_t i = 0; i < keys.size(); i++)
+        if (mtrie->search(keys[i], &value))
+            sum += value;
+    double seconds = now() - start;
+    sink = sum;
+    return seconds;
+}
+
+static void run(const char *dataset, trie::trie_type type, const char *name,
+                const settings_type &settings)
+{
+    char archive[] = "/tmp/trie_bench.XXXXXX";
+    std::vector<std::string> keys, sorted, misses, prefixes;
+    std::vector<trie::key_type> inserts, hits, lookups, mixed, heads;
+    std::vector<size_t> zipf;
+    double best, seconds, start;
+    size_t i, r, bytes, found = 0, allocated = 0;
+
+    int fd = mkstemp(archive);
+    if (fd < 0) {
+        perror("mkstemp");
+        exit(1);
+    }
+    close(fd);
+    make_dataset(dataset, settings.keys, settings.seed, &keys);
+    sorted = keys;
+    std::sort(sorted.begin(), sorted.end());
+    make_misses(sorted, settings.queries, settings.seed + 1, &misses);
+    make_zipf_queries(keys.size(), settings.queries, settings.zipf,
+                      settings.seed + 2, &zipf);
+    make_key_types(keys, &inserts);
+    hits.resize(zipf.size());
+    for (i = 0; i < zipf.size(); i++)
+        hits[i] = inserts[zipf[i]];
+    make_key_types(misses, &lookups);
+    // most lookups of a spell checker or a blocklist miss
+    for (i = 0; i < hits.size() && i < lookups.size(); i++)
+        mixed.push_back(i % 5?lookups[i]:hits[i]);
+    // the first half of keys asked for, one in 64 queries
+    for (i = 0; i < zipf.size(); i += 64) {
+        const std::string &key = keys[zipf[i]];
+        prefixes.push_back(key.substr(0, std::max<size_t>(1, key.size() / 2)));
+    }
+    make_key_types(prefixes, &heads);
+
+    // keys inserted in random order, the LOUDS trie is converted
+    trie *mtrie = NULL;
+    best = 0;
+    for (r = 0; r < settings.repeat; r++) {
+        delete mtrie;
+        mtrie = trie::create_trie(type == trie::LOUDS_TRIE?trie::DOUBLE_TRIE
+                                                          :type);
+        mtrie->set_filter(settings.filter);
+        mtrie->set_root_table(settings.root);
+        mtrie->set_compress_chains(settings.chains);
+        mtrie->set_relayout(settings.relayout);
+        start = now();
+        for (i = 0; i < inserts.size(); i++)
+            mtrie->insert(inserts[i], i + 1);
+        seconds = now() - start;
+        if (!r || seconds < best)
+            best = seconds;
+    }
+    if (type == trie::LOUDS_TRIE) {
+        trie *louds = trie::create_trie(*mtrie, trie::LOUDS_TRIE);
+        delete mtrie;
+        mtrie = louds;
+    } else {
+        report(dataset, name, "insert", keys.size(), inserts.size(), best, 0);
+    }
+    if (settings.relayout)
+        for (i = 0; i < hits.size(); i++)
+            mtrie->profile(hits[i]);
+
+    best = 0;
+    for (r = 0; r < settings.repeat; r++) {
+        start = now();
+        mtrie->build(archive);
+        seconds = now() - start;
+        if (!r || seconds < best)
+            best = seconds;
+    }
+    bytes = file_size(archive);
+    delete mtrie;
+    report(dataset, name, "build", keys.size(), 1, best, bytes);
+
+    trie *loaded = NULL;
+    best = 0;
+    for (r = 0; r < settings.repeat; r++) {
+        delete loaded;
+        start = now();
+        loaded = trie::create_trie(archive);
+        seconds = now() - start;
+        if (!r || seconds < best)
+            best = seconds;
+    }
+    report(dataset, name, "load", keys.size(), 1, best, bytes);
+
+    best = 0;
+    for (r = 0; r < settings.repeat; r++) {
+        seconds = time_search(loaded, hits);
+        if (!r || seconds < best)
+            best = seconds;
+    }
+    report(dataset, name, "search_hit", keys.size(), hits.size(), best,
+           bytes);
+
+    best = 0;
+    for (r = 0; r < settings.repeat; r++) {
+        seconds = time_search(loaded, lookups);
+        if (!r || seconds < best)
+            best = seconds;
+    }
+    report(dataset, name, "search_miss", keys.size(), lookups.size(), best,
+           bytes);
+
+    // one hit in five
+    best = 0;
+    for (r = 0; r < settings.repeat; r++) {
+        seconds = time_search(loaded, mixed);
+        if (!r || seconds < best)
+            best = seconds;
+    }
+    report(dataset, name, "search_mixed", keys.size(), mixed.size(), best,
+           bytes);
+
+    best = 0;
+    for (r = 0; r < settings.repeat; r++) {
+        found = 0;
+        allocated = allocations;
+        start = now();
+        for (i = 0; i < heads.size(); i++) {
+            trie::result_type result;
+            found += loaded->prefix_search(heads[i], &result);
+        }
+        seconds = now() - start;
+        allocated = allocations - allocated;
+        if (!r || seconds < best)
+            best = seconds;
+    }
+    sink = found;
+    report(dataset, name, "prefix_search", keys.size(), heads.size(), best,
+           bytes, found?static_cast<double>(allocated) / found:0.0);
+
+    // every key, per key
+    best = 0;
+    for (r = 0; r < settings.repeat; r++) {
+        trie::result_type result;
+        allocated = allocations;
+        start = now();
+        found = loaded->prefix_search(trie::key_type("", 0), &result);
+        seconds = now() - start;
+        allocated = allocations - allocated;
+        if (!r || seconds < best)
+            best = seconds;
+    }
+    if (found != keys.size()) {
+        fprintf(stderr, "%s %s: %lu of %lu keys iterated\n", dataset, name,
+                static_cast<unsigned long>(found),
+                static_cast<unsigned long>(keys.size()));
+        exit(1);
+    }
+    report(dataset, name, "iterate", keys.size(), found, best, bytes,
+           found?static_cast<double>(allocated) / found:0.0);
+
+    delete loaded;
+    unlink(archive);
+}
+
+static void help_message()
+{
+    printf("Usage: triebench [OPTIONS]\n"
+           "Benchmarks of libtrie on synthetic datasets, one JSON line\n"
+           "per result\n"
+           "OPTIONS:\n"
+           "        -d|--dataset NAME     bytes, words, urls or cjk (all)\n"
+           "        --compress-chains     chains of single transitions in archives\n"
+           "        -f|--filter BITS      filter of BITS per key in archives\n"
+           "        -h|--help             help message\n"
+           "        -n|--keys COUNT       keys in a dataset (100000)\n"
+           "        -q|--queries COUNT    searches of each kind (200000)\n"
+           "        --relayout            archives renumbered by the hits\n"
+           "        -r|--repeat TIMES     repeat and take the best (3)\n"
+           "        --root-table          table of first two bytes in archives\n"
+           "        -s|--seed SEED        seed of datasets (1)\n"
+           "        -t|--type TYPE        1, 2 or 3 as trietool (1 and 2)\n"
+           "        -z|--zipf EXPONENT    skew of queries (1.0)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *names[] = {"tail", "two", "louds"};
+    static const trie::trie_type types[] = {
+        trie::SINGLE_TRIE, trie::DOUBLE_TRIE, trie::LOUDS_TRIE
+    };
+    settings_type settings = {100000, 200000, 3, 1, 1.0, 0, false, false,
+                              false};
+    const char *dataset = NULL;
+    int type = 0;
+    int c;
+
+    while (true) {
+        static struct option long_options[] =
+        {
+            {"compress-chains", no_argument, 0, 'C'},
+            {"dataset", required_argument, 0, 'd'},
+            {"filter", required_argument, 0, 'f'},
+            {"help", no_argument, 0, 'h'},
+            {"keys", required_argument, 0, 'n'},
+            {"queries", required_argument, 0, 'q'},
+            {"relayout", no_argument, 0, 'L'},
+            {"repeat", required_argument, 0, 'r'},
+            {"root-table", no_argument, 0, 'T'},
+            {"seed", required_argument, 0, 's'},
+            {"type", required_argument, 0, 't'},
+            {"zipf", required_argument, 0, 'z'},
+            {0, 0, 0, 0}
+        };
+        int option_index;
+
+        c = getopt_long(argc, argv, "d:f:hn:q:r:s:t:z:", long_options,
+                        &option_index);
+        if (c == -1) break;
+
+        switch (c) {
+            case 'd':
+                dataset = optarg;
+                break;
+            case 'f':
+                settings.filter = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                settings.keys = strtoul(optarg, NULL, 10);
+                break;
+            case 'q':
+                settings.queries = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                settings.repeat = strtoul(optarg, NULL, 10);
+                break;
+            case 'T':
+                settings.root = true;
+                break;
+            case 'C':
+                settings.chains = true;
+                break;
+            case 'L':
+                settings.relayout = true;
+                break;
+            case 's':
+                settings.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 't':
+                type = atoi(optarg);
+                break;
+            case 'z':
+                settings.zipf = atof(optarg);
+                break;
+            default:
+                help_message();
+                return 0;
+        }
+    }
+    std::vector<std::string> check;
+    if ((dataset && !make_dataset(dataset, 0, 0, &check))
+        || type < 0 || type > 3 || !settings.keys || !settings.queries
+        || !settings.repeat) {
+        help_message();
+        return 1;
+    }
+
+    for (size_t d = 0; kDatasets[d]; d++) {
+        if (dataset && strcmp(dataset, kDatasets[d]))
+            continue;
+        for (int t = 1; t <= 3; t++) {
+            if ((type && t != type) || (!type && t == 3))
+                continue;
+            // told apart from runs without a filter
+            std::string name(names[t - 1]);
+            if (settings.filter && t != 3)
+                name += "+filter";
+            if (settings.root && t != 3)
+                name += "+root";
+            if (settings.chains && t != 3)
+                name += "+chains";
+            if (settings.relayout && t != 3)
+                name += "+relayout";
+            run(kDatasets[d], types[t - 1], name.c_str(), settings);
+        }
+    }
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
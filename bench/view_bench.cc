@@ -0,0 +1,171 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "trie.h"
+#include "trie_view.h"
+
+using namespace dutil;
+
+static const int kKeys = 200000;
+static const int kRounds = 5;
+
+/// Length of prefixes to enumerate, keys are not shorter.
+static const size_t kPrefix = 4;
+
+/// Counts the keys visited.
+struct count_keys {
+    size_t *count;
+
+    void operator()(const char *key, size_t length, trie::value_type value)
+    {
+        (*count)++;
+    }
+};
+
+/// Sums the values visited.
+struct sum_values {
+    long *sum;
+
+    void operator()(size_t length, trie::value_type value)
+    {
+        *sum += value;
+    }
+};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/// Prints a result as a line of JSON, like trie_bench.
+static void report(const char *name, const char *path, double seconds,
+                   size_t ops, long checksum)
+{
+    printf("{\"dataset\": \"view\", \"trie\": \"%s\", \"bench\": \"%s\", "
+           "\"keys\": %d, \"ops\": %lu, \"ns_per_op\": %.1f, "
+           "\"ops_per_sec\": %.0f, \"checksum\": %ld}\n",
+           name, path, kKeys, static_cast<unsigned long>(ops),
+           seconds * 1e9 / ops, seconds > 0?ops / seconds:0.0, checksum);
+}
+
+/// Returns random keys sharing prefixes like words do.
+static std::vector<std::string> make_keys()
+{
+    std::vector<std::string> keys;
+    unsigned seed = 1;
+    for (int i = 0; i < kKeys; i++) {
+        std::string key;
+        int length = kPrefix + rand_r(&seed) % 9;
+        for (int j = 0; j < length; j++)
+            key.push_back('a' + rand_r(&seed) % (j < 3?4:26));
+        keys.push_back(key);
+    }
+    // sorted keys build fast, the searches below go in random order
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    return keys;
+}
+
+template<typename View>
+static void bench(trie::trie_type type, const char *name)
+{
+    const char *archive = "/tmp/view_bench.idx";
+    std::vector<std::string> keys = make_keys();
+    std::vector<std::string> queries(keys);
+    size_t i, r;
+    unsigned seed = 2;
+
+    trie *mtrie = trie::create_trie(type);
+    for (i = 0; i < keys.size(); i++)
+        mtrie->insert(keys[i].data(), keys[i].size(), i + 1);
+    mtrie->build(archive);
+    delete mtrie;
+    for (i = queries.size(); i > 1; i--)
+        std::swap(queries[i - 1], queries[rand_r(&seed) % i]);
+
+    struct stat st;
+    int fd = open(archive, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(archive);
+        exit(1);
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    const trie *loaded = trie::create_trie(archive);
+    View view(data, st.st_size);
+    size_t ops = queries.size() * kRounds;
+    trie::value_type value;
+    long sum;
+    double start;
+
+    sum = 0;
+    start = now();
+    for (r = 0; r < kRounds; r++)
+        for (i = 0; i < queries.size(); i++)
+            if (loaded->search(queries[i].data(), queries[i].size(), &value))
+                sum += value;
+    report(name, "trie::search", now() - start, ops, sum);
+
+    sum = 0;
+    start = now();
+    for (r = 0; r < kRounds; r++)
+        for (i = 0; i < queries.size(); i++)
+            if (view.search(queries[i].data(), queries[i].size(), &value))
+                sum += value;
+    report(name, "view.search", now() - start, ops, sum);
+
+    // all prefixes of a text, as a tokenizer would find them
+    sum = 0;
+    sum_values visit_value = {&sum};
+    start = now();
+    for (r = 0; r < kRounds; r++)
+        for (i = 0; i < queries.size(); i++)
+            view.common_prefix_search(queries[i].data(), queries[i].size(),
+                                      visit_value);
+    report(name, "view.common_prefix", now() - start, ops, sum);
+
+    size_t count = 0;
+    start = now();
+    for (i = 0; i < queries.size(); i += 64) {
+        trie::result_type result;
+        loaded->prefix_search(trie::key_type(queries[i].data(), kPrefix),
+                              &result);
+        count += result.size();
+    }
+    report(name, "trie::prefix_search", now() - start,
+           (queries.size() + 63) / 64, count);
+
+    count = 0;
+    count_keys visit_key = {&count};
+    start = now();
+    for (i = 0; i < queries.size(); i += 64)
+        view.prefix(queries[i].data(), kPrefix, visit_key);
+    report(name, "view.prefix", now() - start,
+           (queries.size() + 63) / 64, count);
+
+    delete loaded;
+    munmap(data, st.st_size);
+    unlink(archive);
+}
+
+int main(int argc, char *argv[])
+{
+    bench<double_trie_view>(trie::DOUBLE_TRIE, "two");
+    bench<single_trie_view>(trie::SINGLE_TRIE, "tail");
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
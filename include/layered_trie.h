@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef LAYERED_TRIE_H_
+#define LAYERED_TRIE_H_
+
+#include "trie.h"
+
+BEGIN_TRIE_NAMESPACE
+
+/**
+ * @addtogroup libtrie_api
+ *
+ * @{
+ */
+
+/**
+ * A trie which takes updates on top of a read-only archive.
+ *
+ * Inserts and removals go to a small in-memory overlay, removals as
+ * tombstones. Lookups check the overlay first and fall back to the base
+ * archive; prefix_search() merges both and returns keys in byte order.
+ *
+ * Compaction folds the overlay into a new archive in three steps, so the
+ * slow one can run off the request path:
+ *
+ * - begin_compact() freezes the overlay and starts an empty one.
+ * - write_compact() writes the base and the frozen overlay into a new
+ *   archive. It only reads layers which do not change any more, so it
+ *   can run in a background thread while the owner keeps updating and
+ *   searching.
+ * - end_compact() loads the new archive as base and drops the frozen
+ *   overlay.
+ *
+ * Apart from write_compact(), calls are not synchronized, like any
+ * other trie. Publish layered tries through a trie_handle to swap them
+ * under concurrent readers.
+ *
+ * @code
+ * layered_trie words("words.idx");
+ * words.insert(key, value);
+ * words.remove(old_key);
+ * if (words.updates() > 100000)
+ *     words.compact("words.idx.new");
+ * @endcode
+ */
+class layered_trie: public trie {
+  public:
+    using trie::insert;
+    using trie::search;
+
+    /**
+     * Constructs a layered_trie over a base trie.
+     *
+     * @param base The base trie, owned by the layered_trie since then.
+     * @param type Type of archives written by compaction, SINGLE_TRIE,
+     *             DOUBLE_TRIE or LOUDS_TRIE.
+     */
+    explicit layered_trie(trie *base, trie_type type = DOUBLE_TRIE);
+
+    /**
+     * Constructs a layered_trie over a trie archive.
+     *
+     * @param archive The filename of the archive.
+     * @param options Options for loading the archive.
+     * @param type Type of archives written by compaction.
+     */
+    explicit layered_trie(const char *archive,
+                          const load_options &options = load_options(),
+                          trie_type type = DOUBLE_TRIE);
+
+    /// Destructs a layered_trie.
+    ~layered_trie();
+
+    void insert(const key_type &key, const value_type &value);
+    bool search(const key_type &key, value_type *value) const;
+    void insert_payload(const key_type &key,
+                        const char *payload, size_t length);
+    bool search_payload(const key_type &key,
+                        const char **payload, size_t *length) const;
+
+    /**
+     * Retrieves all key-value pairs match given prefix, merged from all
+     * layers and sorted by key. Values referring to payloads are only
+     * meaningful to search_payload().
+     */
+    size_t prefix_search(const key_type &key, result_type *result) const;
+
+    /// Builds an archive holding all layers.
+    void build(const char *filename, bool verbose = false);
+
+    /// Writes an archive holding all layers to a file descriptor.
+    void serialize(int fd);
+
+    /// Not supported, labels of the base can not change.
+    void remap_labels(const size_t *frequency);
+
+    /// Not supported, an update changes several tries one by one.
+    void set_concurrent(bool concurrent);
+
+    /**
+     * Removes a key by adding a tombstone to the overlay.
+     *
+     * @param key The key.
+     * @return true if the key existed.
+     */
+    bool remove(const key_type &key);
+
+    /// Returns the number of inserts and removals not compacted yet.
+    size_t updates() const;
+
+    /**
+     * Compacts all updates so far into a new archive and loads it as
+     * base, @see begin_compact().
+     *
+     * @param filename Filename of the new archive.
+     * @param options Options for loading the new archive.
+     */
+    void compact(const char *filename,
+                 const load_options &options = load_options());
+
+    /// Freezes the overlay and starts an empty one.
+    void begin_compact();
+
+    /**
+     * Writes the base and the frozen overlay into a new archive. It can
+     * run in another thread until end_compact().
+     *
+     * @param filename Filename of the new archive.
+     */
+    void write_compact(const char *filename) const;
+
+    /**
+     * Loads the archive written by write_compact() as base and drops
+     * the frozen overlay.
+     *
+     * @param filename Filename of the new archive.
+     * @param options Options for loading the new archive.
+     */
+    void end_compact(const char *filename,
+                     const load_options &options = load_options());
+
+  private:
+    /// Represents an overlay.
+    struct overlay_type;
+
+    /// Constructs a copy, not allowed.
+    layered_trie(const layered_trie &);
+
+    /// Copies a layered_trie, not allowed.
+    layered_trie &operator=(const layered_trie &);
+
+    /**
+     * Merges layers into a new trie.
+     *
+     * @param top The topmost overlay to merge, active_ or frozen_.
+     * @return The merged trie of type_.
+     */
+    trie *merge(const overlay_type *top) const;
+
+    trie *base_;             ///< Base trie, usually a mapped archive.
+    overlay_type *frozen_;   ///< Overlay being compacted, can be NULL.
+    overlay_type *active_;   ///< Overlay taking updates.
+    trie_type type_;         ///< Type of archives written by compaction.
+};
+
+/** @} */
+
+END_TRIE_NAMESPACE
+
+#endif  // LAYERED_TRIE_H_
+
+// vim: ts=4 sw=4 ai et
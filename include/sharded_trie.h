@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef SHARDED_TRIE_H_
+#define SHARDED_TRIE_H_
+
+#include <vector>
+
+#include "trie.h"
+
+BEGIN_TRIE_NAMESPACE
+
+/**
+ * @addtogroup libtrie_api
+ *
+ * @{
+ */
+
+/**
+ * A trie which takes inserts from many threads at once.
+ *
+ * Keys are partitioned across independent two-tries (shards) by a hash of
+ * their leading bytes. Each shard has a lock of its own, so threads
+ * inserting keys of different shards do not wait for each other.
+ * search(), search_payload() and prefix_search() take no lock at all:
+ * the shards are in concurrent mode, @see trie::set_concurrent().
+ *
+ * A lookup goes straight to the owning shard, and so does prefix_search()
+ * for a prefix as long as the hashed leading bytes. A shorter prefix
+ * merges all shards, keys of different shards coming shard by shard.
+ *
+ * build() and serialize() merge the shards into one archive, which is
+ * loaded by trie::create_trie() like any other. Inserts wait while they
+ * merge.
+ *
+ * @code
+ * sharded_trie words(16);
+ * // any number of threads
+ * words.insert(key, value);
+ * // when done
+ * words.build("words.idx");
+ * @endcode
+ */
+class sharded_trie: public trie {
+  public:
+    using trie::insert;
+    using trie::search;
+
+    /**
+     * Constructs an empty sharded_trie.
+     *
+     * @param shards Number of shards.
+     * @param prefix_length Number of leading bytes of a key hashed to
+     *                      choose its shard.
+     * @param type Type of archives written by build(), SINGLE_TRIE,
+     *             DOUBLE_TRIE or LOUDS_TRIE.
+     */
+    explicit sharded_trie(size_t shards = 16, size_t prefix_length = 1,
+                          trie_type type = DOUBLE_TRIE);
+
+    /// Destructs a sharded_trie.
+    ~sharded_trie();
+
+    void insert(const key_type &key, const value_type &value);
+    bool search(const key_type &key, value_type *value) const;
+    void insert_payload(const key_type &key,
+                        const char *payload, size_t length);
+    bool search_payload(const key_type &key,
+                        const char **payload, size_t *length) const;
+    size_t prefix_search(const key_type &key, result_type *result) const;
+
+    /// Builds an archive holding all shards.
+    void build(const char *filename, bool verbose = false);
+
+    /// Writes an archive holding all shards to a file descriptor.
+    void serialize(int fd);
+
+    /// Remaps labels of all shards and of archives written, @see trie.
+    void remap_labels(const size_t *frequency);
+
+    /**
+     * Frees buffers kept for searching threads in all shards. Inserts
+     * wait while their shard is reclaimed; no thread may be searching,
+     * @see trie::reclaim().
+     */
+    void reclaim();
+
+    /// Returns the number of shards.
+    size_t shards() const
+    {
+        return shards_.size();
+    }
+
+    /// Returns the shard holding a key.
+    size_t shard_of(const key_type &key) const;
+
+  private:
+    /// Represents a shard.
+    struct shard_type;
+
+    /// Constructs a copy, not allowed.
+    sharded_trie(const sharded_trie &);
+
+    /// Copies a sharded_trie, not allowed.
+    sharded_trie &operator=(const sharded_trie &);
+
+    /// Copies all shards into a trie in order of keys, locks must be held.
+    void copy_shards(trie *target) const;
+
+    /// Merges all shards into a new trie of type_.
+    trie *merge() const;
+
+    std::vector<shard_type *> shards_;  ///< The shards.
+    size_t prefix_length_;              ///< Bytes hashed to choose a shard.
+    trie_type type_;                    ///< Type of archives written.
+    std::vector<size_t> frequency_;     ///< Label frequency if remapped.
+};
+
+/** @} */
+
+END_TRIE_NAMESPACE
+
+#endif  // SHARDED_TRIE_H_
+
+// vim: ts=4 sw=4 ai et
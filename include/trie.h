@@ -32,6 +32,8 @@
 #include <map>
 #include <vector>
 #include <cstdlib>
+#include <cstring>
+#include <new>
 #include <stdexcept>
 
 #define BEGIN_TRIE_NAMESPACE namespace dutil {
@@ -103,7 +105,96 @@ class trie {
     enum trie_type {
         UNKNOW = 0,   /**< Unknow. */
         SINGLE_TRIE,  /**< Tail Trie. */
-        DOUBLE_TRIE   /**< Two Trie. */
+        DOUBLE_TRIE,  /**< Two Trie. */
+        LOUDS_TRIE    /**< Read-only succinct trie. */
+    };
+
+    /// Represents the expected access pattern of an archive.
+    enum advice_type {
+        ADVICE_NORMAL = 0,   /**< No advice. */
+        ADVICE_RANDOM,       /**< Random access, no read ahead. */
+        ADVICE_SEQUENTIAL,   /**< Sequential access, aggressive read ahead. */
+        ADVICE_WILLNEED      /**< Read pages ahead of use. */
+    };
+
+    /// Represents metrics collected while loading a trie archive.
+    struct load_metrics {
+        double ready_time;      ///< Seconds from opening to ready.
+        size_t mapped_bytes;    ///< Size of the mapped archive.
+        size_t resident_bytes;  ///< Bytes of the archive resident in memory.
+    };
+
+    /// Represents options for loading a trie archive.
+    struct load_options {
+        /// Verifies checksums of all sections, it reads the whole archive.
+        bool verify;
+
+        /// Prefaults the whole archive while mapping it, see MAP_POPULATE.
+        bool populate;
+
+        /// Locks the archive in memory, see mlock(2).
+        bool lock;
+
+        /**
+         * Access pattern advised for sections larger than a page. Smaller
+         * sections, e.g. headers, are always read ahead.
+         */
+        advice_type advice;
+
+        /// Number of threads touching every page before loading returns.
+        int warmup_threads;
+
+        /// Receives metrics of loading if not NULL.
+        load_metrics *metrics;
+
+        /// Constructs the default options.
+        load_options()
+            :verify(false), populate(false), lock(false),
+             advice(ADVICE_NORMAL), warmup_threads(0), metrics(NULL) {}
+    };
+
+    /// Represents statistics of a double-array, @see stats_type.
+    struct array_stats {
+        size_t used;       ///< States in use, the root included.
+        size_t allocated;  ///< States allocated.
+        size_t holes;      ///< Free states below the last one in use.
+        double fill;       ///< Ratio of used to allocated states.
+    };
+
+    /// Represents statistics of a trie, @see stats().
+    struct stats_type {
+        trie_type type;           ///< Type of the trie, UNKNOW if none.
+        size_t keys;              ///< Number of keys.
+        array_stats front;        ///< The trie, front trie of a two-trie.
+        array_stats rear;         ///< Rear trie of a two-trie.
+        size_t index_live;        ///< Index entries of keys, two-trie.
+        size_t index_allocated;   ///< Index entries handed out, two-trie.
+        size_t accept_live;       ///< Accept entries of keys, two-trie.
+        size_t accept_allocated;  ///< Accept entries handed out, two-trie.
+        double rear_sharing;      ///< Keys per accept state with a tail.
+        size_t tail_bytes;        ///< Bytes holding tails of keys.
+        double average_depth;     ///< Average depth of keys in the trie.
+        size_t max_depth;         ///< Maximal depth of keys in the trie.
+        size_t bytes;             ///< Bytes of the trie or its archive.
+        double bytes_per_key;     ///< Ratio of bytes to keys.
+
+        /// Constructs empty statistics.
+        stats_type()
+            :type(UNKNOW), keys(0), index_live(0), index_allocated(0),
+             accept_live(0), accept_allocated(0), rear_sharing(0),
+             tail_bytes(0), average_depth(0), max_depth(0), bytes(0),
+             bytes_per_key(0)
+        {
+            array_stats empty = {0, 0, 0, 0};
+            front = rear = empty;
+        }
+    };
+
+    /// Represents who releases the memory holding an archive.
+    enum ownership_type {
+        BORROW_MEMORY = 0,  /**< The caller releases it after the trie. */
+        ADOPT_MAPPING,      /**< The trie releases it by munmap(2). */
+        ADOPT_MALLOC        /**< The trie releases it by free(3). */
     };
 
 
@@ -162,6 +253,36 @@ class trie {
     virtual bool search(const char *inputs, size_t length,
                         value_type *value) const;
 
+    /**
+     * Stores a variable-length payload into trie using a key_type as key.
+     * The payload is copied into the payload heap of the trie and the
+     * value of the key refers to it.
+     *
+     * @param key The key.
+     * @param payload Buffer of the payload.
+     * @param length Length of the payload buffer.
+     */
+    virtual void insert_payload(const key_type &key,
+                                const char *payload, size_t length) = 0;
+
+    /**
+     * Retrieves a payload from trie using a key_type as key. A key refers
+     * to a payload if it was last inserted by insert_payload(), never if
+     * by insert(). The returned buffer points into the trie (or its
+     * archive) and stays valid until the next insert_payload(), which
+     * may move the heap, or the first update of a trie loaded from an
+     * archive. In concurrent mode replaced heaps are kept until
+     * reclaim(), @see set_concurrent().
+     *
+     * @param key The key.
+     * @param[out] payload Pointer to the payload buffer.
+     * @param[out] length Length of the payload buffer.
+     * @return true if found and the key refers to a payload.
+     */
+    virtual bool search_payload(const key_type &key,
+                                const char **payload,
+                                size_t *length) const = 0;
+
     /**
      * Retrieves all key-value pairs match given prefix.
      *
@@ -172,7 +293,9 @@ class trie {
     virtual size_t prefix_search(const key_type &key,
                                  result_type *result) const = 0;
     /**
-     * Builds a trie archive.
+     * Builds a trie archive. The archive is written to a temporary file,
+     * synced and renamed to filename, so filename holds either the old
+     * archive or the complete new one.
      *
      * @param filename Filename of the archive.
      * @param verbose Display detail information while building
@@ -180,14 +303,137 @@ class trie {
      */
     virtual void build(const char *filename, bool verbose = false) = 0;
 
+    /**
+     * Writes a trie archive to a file descriptor, e.g. a pipe to a
+     * compressor. The archive is written sequentially by writev(2), so
+     * the descriptor need not be seekable. It is not closed.
+     *
+     * @param fd The file descriptor.
+     */
+    virtual void serialize(int fd) = 0;
+
     /**
      * Updates a trie from a formatted text file.
      *
      * @param source Filename of the text file.
      * @param verbose Display detail information while reading
      *                if it sets to true.
+     * @param remap Remaps labels by their frequency in source before
+     *              inserting, @see remap_labels. The trie must be empty.
+     */
+    virtual void read_from_text(const char *source, bool verbose = false,
+                                bool remap = false);
+
+    /**
+     * Remaps the labels of an empty trie by frequency.
+     *
+     * The most frequent byte is given the code next to the terminator, the
+     * second one the code next to it and so on. Children of a state are
+     * therefore close to each other, which makes the double-array denser.
+     * Keys are encoded transparently while inserting and searching, and
+     * the table is stored in the archive.
+     *
+     * @param frequency Occurrences of each byte in the keys, 256 elements.
      */
-    virtual void read_from_text(const char *source, bool verbose = false);
+    virtual void remap_labels(const size_t *frequency) = 0;
+
+    /**
+     * Makes build() and serialize() write a blocked Bloom filter of all
+     * keys into the archive. A trie loaded from such an archive consults
+     * the filter before searching, so most missing keys are answered by
+     * reading one cache line. Archives without a filter and readers not
+     * knowing it work as before. Tries without a filter ignore it.
+     *
+     * @param bits_per_key Bits of the filter per key, e.g. 10 for about
+     *                     1% false positives; 0 writes no filter.
+     */
+    virtual void set_filter(size_t bits_per_key);
+
+    /**
+     * Makes build() and serialize() write a table of the states reached
+     * from the root by the first two bytes of keys, 256K bytes, into the
+     * archive. A trie loaded from such an archive starts searching keys
+     * of two bytes or more from the table, and refuses a key whose first
+     * two bytes start no key by reading it alone. Archives without a
+     * table and readers not knowing it work as before. Tries without a
+     * table ignore it.
+     *
+     * @param enable Writes the table if true.
+     */
+    virtual void set_root_table(bool enable);
+
+    /**
+     * Makes build() and serialize() collapse chains of single transitions
+     * of four labels or more (e.g. a shared "https://www.") in the front
+     * trie of a two trie or the trie of a tail trie. The labels of a chain
+     * are stored together, so a search compares them instead of reading a
+     * state per label, and the states inside chains are left out. Keys
+     * inserted into a loaded archive with chains expand them first. Old
+     * readers and trie_view.h refuse such archives. Tries without chains
+     * ignore it.
+     *
+     * @param enable Collapses chains if true.
+     */
+    virtual void set_compress_chains(bool enable);
+
+    /**
+     * Makes build() and serialize() renumber the states of the tries of a
+     * two trie or tail trie before writing them. The top levels are
+     * placed together and the children of a deeper state next to it, so
+     * a search reads fewer cache lines than in the order keys were
+     * inserted. The states counted by profile() are placed first. The
+     * archive format is unchanged. Loaded archives keep their layout.
+     * Tries without states ignore it.
+     *
+     * @param enable Renumbers states if true.
+     */
+    virtual void set_relayout(bool enable);
+
+    /**
+     * Counts the states a search of key visits, so that set_relayout()
+     * places the most visited ones first. Keys are profiled after the
+     * last insert, a stale profile only places states worse.
+     *
+     * @param key A key searched in production, found or not.
+     */
+    virtual void profile(const key_type &key);
+
+    /**
+     * Lets other threads search while one thread inserts, neither of
+     * them locking.
+     *
+     * A search overlapping an insert is retried, so it sees the trie
+     * either before or after the insert. Buffers replaced while growing
+     * are kept until reclaim(), so payloads returned by search_payload()
+     * stay valid until then as well. Only insert() and insert_payload()
+     * may run concurrently with searching; other updates, build() and
+     * serialize() need searching stopped. A trie loaded from an archive
+     * is copied into memory of its own first. Read-only tries are always
+     * safe to share and ignore it.
+     *
+     * @param concurrent true to keep replaced buffers for searching
+     *                   threads.
+     */
+    virtual void set_concurrent(bool concurrent);
+
+    /**
+     * Frees buffers kept for concurrent searching, @see set_concurrent().
+     * No thread may be searching.
+     */
+    virtual void reclaim();
+
+    /**
+     * Collects statistics of the trie in one linear pass, e.g. to size
+     * hosts or to choose between tail-trie and two-trie. The depth of a
+     * key is the number of states walked in the (front) trie before its
+     * tail. No thread may insert meanwhile.
+     *
+     * The default counts keys and their lengths by prefix_search(), trie
+     * types knowing their layout fill in the rest.
+     *
+     * @return The statistics.
+     */
+    virtual stats_type stats() const;
 
     /**
      * Destruct a trie interface.
@@ -207,15 +453,55 @@ class trie {
     /**
      * Creates a trie from a trie archive.
      *
+     * A SINGLE_TRIE or DOUBLE_TRIE created this way can still be updated.
+     * The first insert or build copies the archive into memory of its own
+     * and rebuilds the free lists, so keys can be appended to an archive
+     * without reading its source again. The archive file is never written
+     * to. A LOUDS_TRIE is read-only.
+     *
      * @param archive The filename of the archive.
+     * @param options Options for loading the archive.
      */
-    static trie *create_trie(const char *archive);
+    static trie *create_trie(const char *archive,
+                             const load_options &options = load_options());
+
+    /**
+     * Creates a trie from a trie archive already in memory, e.g. a shared
+     * memory segment or a memfd mapped by several processes. The archive
+     * is used in place and never written to.
+     *
+     * The layout of the archive is validated against size before use.
+     * Set options.verify to validate checksums of a sectioned archive as
+     * well. If creating fails, the memory is left to the caller whatever
+     * ownership is.
+     *
+     * @param data Pointer to the archive, aligned to 8 bytes at least.
+     * @param size Size of the archive.
+     * @param ownership Who releases the memory.
+     * @param options Options for loading, populate is ignored.
+     */
+    static trie *create_trie_from_memory(const void *data, size_t size,
+                                         ownership_type ownership
+                                             = BORROW_MEMORY,
+                                         const load_options &options
+                                             = load_options());
+
+    /**
+     * Creates a trie holding all keys, values and payloads of another trie.
+     *
+     * @param source The trie to be copied.
+     * @param type The type of the trie to be created, only LOUDS_TRIE is
+     *             supported.
+     */
+    static trie *create_trie(const trie &source, trie_type type);
 };
 
 /**
  * Represents a key to access trie.
  *
- * This class can convert other data format to trie's key.
+ * This class can convert other data format to trie's key. Keys of up to
+ * kInlineSize labels are kept inside the object, so copying them, e.g.
+ * into a result_type, does not allocate.
  */
 class trie::key_type {
   public:
@@ -228,12 +514,14 @@ class trie::key_type {
     /// Terminator character (character not in charset).
     static const char_type kTerminator = kCharsetSize;
 
+    /// Number of labels stored without allocating.
+    static const size_t kInlineSize = 32;
+
     /// Constructs an empty key_type.
     key_type()
-        :cstr_(NULL), cstr_capacity_(0),
-         data_(NULL), data_capacity_(0),
-         length_(0)
-    {}
+    {
+        init();
+    }
 
     /**
      * Constructs a key_type from a c-style data.
@@ -242,10 +530,8 @@ class trie::key_type {
      * @param length Length of the c-style data.
      */
     explicit key_type(const char *data, size_t length)
-        :cstr_(NULL), cstr_capacity_(0),
-         data_(NULL), data_capacity_(0),
-         length_(0)
     {
+        init();
         assign(data, length);
     }
 
@@ -255,13 +541,39 @@ class trie::key_type {
      * @param key The key
      */
     explicit key_type(const key_type &key)
-        :cstr_(NULL), cstr_capacity_(0),
-         data_(NULL), data_capacity_(0),
-         length_(0)
     {
+        init();
         assign(key.data(), key.length());
     }
 
+#if __cplusplus >= 201103L
+    /**
+     * Takes the buffers of a key, leaving it empty.
+     *
+     * @param key The key
+     */
+    key_type(key_type &&key) noexcept
+    {
+        init();
+        take(&key);
+    }
+
+    /**
+     * Takes the buffers of a key, leaving it empty.
+     *
+     * @param rhs The key
+     */
+    key_type &operator=(key_type &&rhs) noexcept
+    {
+        if (this != &rhs) {
+            release();
+            init();
+            take(&rhs);
+        }
+        return *this;
+    }
+#endif
+
     /**
      * Copies from a key.
      *
@@ -269,7 +581,8 @@ class trie::key_type {
      */
     const key_type &operator=(const key_type &rhs)
     {
-        assign(rhs.data(), rhs.length());
+        if (this != &rhs)
+            assign(rhs.data(), rhs.length());
         return *this;
     }
 
@@ -278,10 +591,7 @@ class trie::key_type {
      */
     ~key_type()
     {
-        free(data_);
-        free(cstr_);
-        data_capacity_ = 0;
-        cstr_capacity_ = 0;
+        release();
     }
 
     /**
@@ -315,10 +625,11 @@ class trie::key_type {
     /// Appends a char_type to the end of a key_type.
     void push(char_type ch)
     {
-        if (length_ + 1 >= data_capacity_)
-            resize_data(1);
+        if (length_ + 2 > data_capacity_)
+            resize_data(length_ + 2);
         data_[length_++] = ch;
         data_[length_] = kTerminator;
+        cstr_valid_ = false;
     }
 
     /**
@@ -328,8 +639,9 @@ class trie::key_type {
     char_type pop()
     {
         char_type ch;
-        ch = data_[length_--];
+        ch = data_[--length_];
         data_[length_] = kTerminator;
+        cstr_valid_ = false;
         return ch;
     }
 
@@ -338,21 +650,26 @@ class trie::key_type {
     {
         data_[0] = kTerminator;
         length_ = 0;
+        cstr_valid_ = false;
     }
 
     /**
-     * Returns a key_type as c-style string.
+     * Returns a key_type as c-style string. The string is converted once
+     * and stays valid until the key_type changes.
      *
      * @return Pointer to buffer of the c-style string.
      */
     const char *c_str() const
     {
         size_t i;
-        if (cstr_capacity_ < data_capacity_)
-            resize_cstr();
-        for (i = 0; data_[i] != kTerminator ; i++)
+        if (cstr_valid_)
+            return cstr_;
+        if (cstr_capacity_ < length_ + 1)
+            resize_cstr(length_ + 1);
+        for (i = 0; data_[i] != kTerminator; i++)
             cstr_[i] = char_out(data_[i]);
         cstr_[i] = '\0';
+        cstr_valid_ = true;
         return cstr_;
     }
 
@@ -365,12 +682,13 @@ class trie::key_type {
     void assign(const char *data, size_t length)
     {
         size_t i;
-        if (length + 1 >= data_capacity_)
-            resize_data(length);
+        if (length + 1 > data_capacity_)
+            resize_data(length + 1);
         for (i = 0; i < length; i++)
             data_[i] = char_in(data[i]);
         data_[i] = kTerminator;
         length_ = length;
+        cstr_valid_ = false;
     }
 
     /**
@@ -381,16 +699,55 @@ class trie::key_type {
      */
     void assign(const char_type *data, size_t length)
     {
-        size_t i;
-        if (length + 1 >= data_capacity_)
-            resize_data(length);
-        for (i = 0; i < length; i++)
-            data_[i] = data[i];
-        data_[i] = kTerminator;
+        if (length + 1 > data_capacity_)
+            resize_data(length + 1);
+        memmove(data_, data, length * sizeof(char_type));
+        data_[length] = kTerminator;
         length_ = length;
+        cstr_valid_ = false;
     }
 
   protected:
+    /// Points an empty key_type at its inline buffers.
+    void init()
+    {
+        data_ = inline_data_;
+        data_capacity_ = kInlineSize + 1;
+        data_[0] = kTerminator;
+        length_ = 0;
+        cstr_ = inline_cstr_;
+        cstr_capacity_ = kInlineSize + 1;
+        cstr_valid_ = false;
+    }
+
+    /// Frees the buffers which are not inline.
+    void release()
+    {
+        if (data_ != inline_data_)
+            free(data_);
+        if (cstr_ != inline_cstr_)
+            free(cstr_);
+    }
+
+    /// Moves the contents of an other key_type into an empty one.
+    void take(key_type *other)
+    {
+        if (other->data_ != other->inline_data_) {
+            data_ = other->data_;
+            data_capacity_ = other->data_capacity_;
+        } else {
+            memcpy(data_, other->data_,
+                   (other->length_ + 1) * sizeof(char_type));
+        }
+        length_ = other->length_;
+        if (other->cstr_ != other->inline_cstr_) {
+            cstr_ = other->cstr_;
+            cstr_capacity_ = other->cstr_capacity_;
+            cstr_valid_ = other->cstr_valid_;
+        }
+        other->init();
+    }
+
     /**
      * Resizes the internal data buffer of a key_type.
      *
@@ -398,32 +755,57 @@ class trie::key_type {
      */
     void resize_data(size_t size)
     {
-        size_t nsize = (data_capacity_ + size + 1) * 2;
-        data_ = static_cast<char_type *>
-            (realloc(data_, nsize * sizeof(char_type)));
+        size_t nsize = data_capacity_ * 2;
+        if (nsize < size)
+            nsize = size;
+        if (data_ == inline_data_) {
+            char_type *data = static_cast<char_type *>
+                (malloc(nsize * sizeof(char_type)));
+            if (!data)
+                throw std::bad_alloc();
+            memcpy(data, data_, (length_ + 1) * sizeof(char_type));
+            data_ = data;
+        } else {
+            char_type *data = static_cast<char_type *>
+                (realloc(data_, nsize * sizeof(char_type)));
+            if (!data)
+                throw std::bad_alloc();
+            data_ = data;
+        }
         data_capacity_ = nsize;
     }
 
     /**
      * Resizes the buffer which is used to convert key_type to c-style
      * string.
+     *
+     * @param size Expected size.
      */
-    void resize_cstr() const
+    void resize_cstr(size_t size) const
     {
-        cstr_ = static_cast<char *>
-            (realloc(cstr_, data_capacity_ * sizeof(char)));
-        cstr_capacity_ = data_capacity_;
+        size_t nsize = cstr_capacity_ * 2;
+        if (nsize < size)
+            nsize = size;
+        char *cstr = static_cast<char *>(malloc(nsize));
+        if (!cstr)
+            throw std::bad_alloc();
+        if (cstr_ != inline_cstr_)
+            free(cstr_);
+        cstr_ = cstr;
+        cstr_capacity_ = nsize;
     }
 
   private:
     mutable char *cstr_;  ///< a C-style buffer for converting.
     mutable size_t cstr_capacity_;  ///< Size of cstr_.
+    mutable bool cstr_valid_;  ///< Whether cstr_ holds data_.
     char_type *data_;  ///< Internal data buffer.
     size_t data_capacity_;  ///< Size of data_.
     size_t length_;  ///< Length of data_.
+    char_type inline_data_[kInlineSize + 1];  ///< data_ of short keys.
+    mutable char inline_cstr_[kInlineSize + 1];  ///< cstr_ of short keys.
 };
 
-
 END_TRIE_NAMESPACE
 
 /** @} */
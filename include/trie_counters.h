@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef TRIE_COUNTERS_H_
+#define TRIE_COUNTERS_H_
+
+#include <stdint.h>
+
+#include "trie.h"
+
+BEGIN_TRIE_NAMESPACE
+
+/**
+ * @addtogroup libtrie_api
+ *
+ * @{
+ */
+
+/**
+ * Counts of events on the hot paths of inserting and searching, to tell
+ * why a build is slow.
+ *
+ * Counting is compiled in only by `configure --enable-counters`, which
+ * defines TRIE_COUNTERS; otherwise it costs nothing and all counts stay
+ * 0. Each thread counts into a block of its own, so counting threads do
+ * not contend; read_counters() sums the blocks of all threads, those
+ * exited included.
+ */
+struct trie_counters {
+    uint64_t relocations;     ///< Calls of relocate().
+    uint64_t states_moved;    ///< States moved by relocate().
+    uint64_t base_probes;     ///< BASE values tried by find_base().
+    uint64_t state_grows;     ///< Growths of state buffers.
+    uint64_t suffix_grows;    ///< Growths of suffix buffers.
+    uint64_t bytes_copied;    ///< Bytes copied by growths.
+    uint64_t rear_cleans;     ///< Calls of rhs_clean_more() in two-tries.
+    uint64_t branches;        ///< Calls of create_branch() in tail-tries.
+    uint64_t searches;        ///< Calls of search().
+    uint64_t states_visited;  ///< Transitions taken by search().
+};
+
+/// Returns true if counting is compiled in.
+bool counters_enabled();
+
+/**
+ * Sums the counts of all threads since the last reset_counters().
+ * Events of threads counting meanwhile may be seen or not.
+ *
+ * @param[out] counters The counts.
+ */
+void read_counters(trie_counters *counters);
+
+/// Starts counting from 0 again, for all threads.
+void reset_counters();
+
+/** @} */
+
+END_TRIE_NAMESPACE
+
+#endif  // TRIE_COUNTERS_H_
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef TRIE_FORMAT_H_
+#define TRIE_FORMAT_H_
+
+/*
+ * Layout of a sectioned archive:
+ *
+ *   +----------------------+  offset 0
+ *   | archive_header       |
+ *   +----------------------+
+ *   | section_entry[0..n)  |
+ *   +----------------------+  aligned to section_entry::align
+ *   | section 0            |
+ *   +----------------------+  aligned to section_entry::align
+ *   | ...                  |
+ *   +----------------------+
+ *
+ * All integers are stored in host byte order. A reader ignores sections
+ * it does not know unless they are marked kSectionRequired, so a writer
+ * can add optional sections without breaking old readers.
+ */
+
+#include <stdint.h>
+
+#include "trie.h"
+
+BEGIN_TRIE_NAMESPACE
+
+/// Identifiers of archive sections.
+enum archive_section {
+    SECTION_HEADER = 1,  /**< Header of a trie, e.g. double_trie::header_type */
+    SECTION_INDEX,       /**< index_ of double_trie. */
+    SECTION_ACCEPT,      /**< accept_ of double_trie. */
+    SECTION_FRONT,       /**< Front trie of double_trie. */
+    SECTION_REAR,        /**< Rear trie of double_trie. */
+    SECTION_TRIE,        /**< Trie of single_trie. */
+    SECTION_SUFFIX,      /**< suffix_ of single_trie. */
+    SECTION_PAYLOAD,     /**< Payload heap. */
+    SECTION_ALPHABET,    /**< Label remapping table. */
+    SECTION_LOUDS,       /**< Degree bits of louds_trie. */
+    SECTION_TERMINAL,    /**< Terminal bits of louds_trie. */
+    SECTION_LINK,        /**< Tail bits of louds_trie. */
+    SECTION_LABEL,       /**< Edge labels of louds_trie. */
+    SECTION_VALUE,       /**< Packed values of louds_trie. */
+    SECTION_TAIL,        /**< Tails of louds_trie. */
+    SECTION_TAIL_END,    /**< Ends of tails of louds_trie. */
+    SECTION_FILTER,      /**< Bloom filter of keys, optional. */
+    SECTION_TAIL_VALUE,  /**< Values by state of single_trie sharing tails. */
+    SECTION_ROOT,        /**< States by the first two labels, optional. */
+    SECTION_CHAIN,       /**< Collapsed single transitions of a front trie. */
+    SECTION_PAYLOAD_FLAG, /**< Values referring to payloads, optional. */
+    SECTION_MAX          /**< One past the last known section. */
+};
+
+/**
+ * Represents the header of a sectioned archive.
+ */
+typedef struct {
+    char magic[8];           ///< Archive magic, kArchiveMagic.
+    uint32_t version;        ///< Format version.
+    uint32_t section_count;  ///< Number of entries in section table.
+    char type[16];           ///< Magic of the trie stored in archive.
+    uint64_t size;           ///< Size of the whole archive.
+    uint32_t crc;            ///< CRC32C of header(crc = 0) and table.
+    char unused[12];         ///< for 32/64 bits compatible.
+} archive_header;
+
+/**
+ * Represents an entry in the section table.
+ */
+typedef struct {
+    uint32_t id;      ///< Section identifier, @see archive_section.
+    uint32_t flags;   ///< Section flags.
+    uint64_t offset;  ///< Offset from the beginning of archive.
+    uint64_t length;  ///< Length of the section in bytes.
+    uint32_t align;   ///< Alignment of the offset.
+    uint32_t crc;     ///< CRC32C of the section.
+} section_entry;
+
+/// Archive magic.
+static const char kArchiveMagic[8] = "LIBTRIE";
+
+/// Latest archive version.
+static const uint32_t kArchiveVersion = 1;
+
+/// Default section alignment, a page on most platforms.
+static const uint32_t kSectionAlign = 4096;
+
+/// The section must be understood by a reader.
+static const uint32_t kSectionRequired = 0x1;
+
+END_TRIE_NAMESPACE
+
+#endif  // TRIE_FORMAT_H_
+
+// vim: ts=4 sw=4 ai et
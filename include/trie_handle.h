@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef TRIE_HANDLE_H_
+#define TRIE_HANDLE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+#include "trie.h"
+
+BEGIN_TRIE_NAMESPACE
+
+/**
+ * @addtogroup libtrie_api
+ *
+ * @{
+ */
+
+/**
+ * Publishes a trie to many reader threads and swaps it while they read.
+ *
+ * Readers pin the current trie with a trie_handle::reader. A trie
+ * replaced by publish() is retired and deleted only after every reader
+ * which might see it has left, which is tracked by epochs:
+ *
+ * - A reader stores the global epoch in its own slot, then loads the
+ *   current trie. Leaving clears the slot.
+ * - A writer swaps the current trie, advances the global epoch and tags
+ *   the old trie with it. The old trie is deleted once no slot holds an
+ *   epoch older than its tag.
+ *
+ * Pinning costs a thread-specific lookup and a store. Where membarrier(2)
+ * is available the store needs no fence, since writers fence all
+ * readers at once; otherwise it is a fenced store. Either way it is
+ * cheap enough to wrap every lookup. Writers are serialized by a mutex.
+ *
+ * @code
+ * trie_handle handle(trie::create_trie("words.idx"));
+ * // reader threads
+ * {
+ *     trie_handle::reader current(handle);
+ *     current->search(key, &value);
+ * }
+ * // a writer thread
+ * handle.reload("words.idx");
+ * @endcode
+ */
+class trie_handle {
+  private:
+    /**
+     * Represents a reader slot. It fills a cache line so readers do not
+     * share lines.
+     */
+    typedef struct {
+        uint64_t epoch;  ///< Epoch when pinned, 0 if not pinned.
+        size_t depth;    ///< Nesting level of readers.
+        int used;        ///< Non-zero if a thread owns the slot.
+        char unused[64 - sizeof(uint64_t) - sizeof(size_t) - sizeof(int)];
+    } slot_type;
+
+  public:
+    /**
+     * Pins the current trie of a handle while it is alive. Readers can be
+     * nested in a thread and cost nothing but a counter when nested.
+     */
+    class reader {
+      public:
+        /**
+         * Pins the current trie.
+         *
+         * @param handle The handle.
+         */
+        explicit reader(const trie_handle &handle);
+
+        /// Unpins the trie.
+        ~reader()
+        {
+            if (--slot_->depth == 0)
+                __atomic_store_n(&slot_->epoch, 0, __ATOMIC_RELEASE);
+        }
+
+        /// Returns the pinned trie.
+        const trie *get() const
+        {
+            return trie_;
+        }
+
+        /// Accesses the pinned trie.
+        const trie *operator->() const
+        {
+            return trie_;
+        }
+
+        /// Accesses the pinned trie.
+        const trie &operator*() const
+        {
+            return *trie_;
+        }
+
+      private:
+        /// Constructs a copy, not allowed.
+        reader(const reader &);
+
+        /// Copies a reader, not allowed.
+        reader &operator=(const reader &);
+
+        slot_type *slot_;  ///< Slot of the calling thread.
+        const trie *trie_;        ///< The pinned trie.
+    };
+
+    /**
+     * Constructs a trie_handle.
+     *
+     * @param initial The first trie to publish, can be NULL. It is owned
+     *                by the handle.
+     */
+    explicit trie_handle(trie *initial = NULL);
+
+    /**
+     * Destructs a trie_handle and deletes all its tries. No reader may
+     * be alive.
+     */
+    ~trie_handle();
+
+    /**
+     * Publishes a trie and retires the previous one.
+     *
+     * @param next The trie to publish, owned by the handle since then.
+     */
+    void publish(trie *next);
+
+    /**
+     * Loads an archive and publishes it.
+     *
+     * @param archive The filename of the archive.
+     * @param options Options for loading the archive.
+     */
+    void reload(const char *archive,
+                const trie::load_options &options = trie::load_options());
+
+    /**
+     * Deletes retired tries no reader can see.
+     *
+     * @return Number of tries still waiting for readers.
+     */
+    size_t reclaim();
+
+    /// Waits until all retired tries are deleted.
+    void synchronize();
+
+  private:
+    friend class reader;
+
+    /// Constructs a copy, not allowed.
+    trie_handle(const trie_handle &);
+
+    /// Copies a trie_handle, not allowed.
+    trie_handle &operator=(const trie_handle &);
+
+    /// Returns the slot of the calling thread, registers it if needed.
+    slot_type *slot() const;
+
+    /// Releases the slot of an exiting thread.
+    static void release_slot(void *slot);
+
+    trie *current_;                 ///< The published trie.
+    uint64_t epoch_;                ///< Global epoch, starts from 1.
+    bool fence_;                    ///< Readers fence by themselves.
+    mutable pthread_mutex_t mutex_; ///< Serializes writers and slots.
+    pthread_key_t key_;             ///< Slot of each thread.
+    mutable std::vector<slot_type *> slots_; ///< All slots.
+
+    /// Retired tries and their epochs.
+    std::vector<std::pair<trie *, uint64_t> > retired_;
+};
+
+inline trie_handle::reader::reader(const trie_handle &handle)
+    :slot_(handle.slot()), trie_(NULL)
+{
+    if (slot_->depth++ == 0) {
+        uint64_t epoch = __atomic_load_n(&handle.epoch_, __ATOMIC_ACQUIRE);
+        // the slot must be visible before current_ is read
+        if (handle.fence_) {
+            __atomic_store_n(&slot_->epoch, epoch, __ATOMIC_SEQ_CST);
+        } else {
+            __atomic_store_n(&slot_->epoch, epoch, __ATOMIC_RELAXED);
+            __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        }
+    }
+    trie_ = __atomic_load_n(&handle.current_, __ATOMIC_SEQ_CST);
+}
+
+/** @} */
+
+END_TRIE_NAMESPACE
+
+#endif  // TRIE_HANDLE_H_
+
+// vim: ts=4 sw=4 ai et
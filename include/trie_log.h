@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef TRIE_LOG_H_
+#define TRIE_LOG_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <string>
+
+#include "trie.h"
+
+BEGIN_TRIE_NAMESPACE
+
+class layered_trie;
+
+/**
+ * @addtogroup libtrie_api
+ *
+ * @{
+ */
+
+/**
+ * A write-ahead log of updates to a layered_trie.
+ *
+ * Updates are appended to the log before they are applied to the trie,
+ * and become durable by commit(). Appending only fills a buffer; commit()
+ * writes the buffer and syncs the file once for every record appended so
+ * far, so threads committing at the same time share one sync (group
+ * commit). The buffer is committed by itself once it grows beyond the
+ * group size.
+ *
+ * After a crash, replay() applies all committed records onto the last
+ * snapshot, and checkpoint() writes a new snapshot and empties the log.
+ * Records are checksummed; a torn record at the end is dropped.
+ *
+ * @code
+ * layered_trie words("words.idx");
+ * trie_log log("words.log");
+ * log.replay(&words);
+ * // updating
+ * log.insert(key, value);
+ * words.insert(key, value);
+ * log.commit();
+ * // from time to time
+ * log.checkpoint(&words, "words.idx");
+ * @endcode
+ */
+class trie_log {
+  public:
+    /// Represents the operation of a record.
+    enum op_type {
+        LOG_INSERT = 1,  /**< Inserts a value. */
+        LOG_PAYLOAD,     /**< Inserts a payload. */
+        LOG_REMOVE       /**< Removes a key. */
+    };
+
+    /// Default size of the buffer committed by itself, in bytes.
+    static const size_t kDefaultGroupSize = 1 << 20;
+
+    /**
+     * Opens a log, it is created if it does not exist.
+     *
+     * @param filename Filename of the log.
+     * @param group_size Size of the buffer committed by itself.
+     */
+    explicit trie_log(const char *filename,
+                      size_t group_size = kDefaultGroupSize);
+
+    /// Commits all records and closes the log.
+    ~trie_log();
+
+    /**
+     * Appends an insert.
+     *
+     * @param key The key.
+     * @param value The value.
+     * @return Sequence number of the record, @see commit().
+     */
+    uint64_t insert(const trie::key_type &key, trie::value_type value);
+
+    /**
+     * Appends an insert of a payload.
+     *
+     * @param key The key.
+     * @param payload Buffer of the payload.
+     * @param length Length of the payload buffer.
+     * @return Sequence number of the record.
+     */
+    uint64_t insert_payload(const trie::key_type &key,
+                            const char *payload, size_t length);
+
+    /**
+     * Appends a removal.
+     *
+     * @param key The key.
+     * @return Sequence number of the record.
+     */
+    uint64_t remove(const trie::key_type &key);
+
+    /**
+     * Makes records up to a sequence number durable. If another thread
+     * is syncing, it waits and takes the records left by that sync.
+     * Once a sync fails, the log takes no more records until reset();
+     * otherwise it must be reopened, and replay() drops a torn record
+     * left by the failure. Records appended before reset() count as
+     * durable.
+     *
+     * @param sequence Sequence number of the last record to commit.
+     */
+    void commit(uint64_t sequence);
+
+    /// Makes all records durable.
+    void commit();
+
+    /**
+     * Applies all records in the log to a trie. Call it after opening
+     * and before appending. A torn or damaged record ends the log, it is
+     * cut off with all records after it.
+     *
+     * @param target The trie.
+     * @return Number of records applied.
+     */
+    size_t replay(layered_trie *target);
+
+    /**
+     * Compacts a trie into a new snapshot, replaces the archive with it
+     * and empties the log. No record may be appended meanwhile.
+     *
+     * @param target The trie.
+     * @param archive Filename of the snapshot.
+     * @param options Options for loading the snapshot.
+     */
+    void checkpoint(layered_trie *target, const char *archive,
+                    const trie::load_options &options = trie::load_options());
+
+    /**
+     * Empties the log, e.g. after a snapshot is durable. Sequence numbers
+     * keep growing across it.
+     */
+    void reset();
+
+    /// Returns the number of syncs so far.
+    uint64_t syncs() const;
+
+  private:
+    /// Constructs a copy, not allowed.
+    trie_log(const trie_log &);
+
+    /// Copies a trie_log, not allowed.
+    trie_log &operator=(const trie_log &);
+
+    /**
+     * Appends a record to the buffer.
+     *
+     * @param op Operation of the record.
+     * @param key The key.
+     * @param data Data following the key.
+     * @param length Length of the data.
+     * @return Sequence number of the record.
+     */
+    uint64_t append(op_type op, const trie::key_type &key,
+                    const void *data, size_t length);
+
+    std::string filename_;          ///< Filename of the log.
+    int fd_;                        ///< File descriptor of the log.
+    size_t group_size_;             ///< Size of buffer committed by itself.
+    std::string buffer_;            ///< Records not written yet.
+    uint64_t base_;                 ///< Sequence number at file offset 0.
+    uint64_t appended_;             ///< End of all appended records.
+    uint64_t durable_;              ///< End of all synced records.
+    uint64_t syncs_;                ///< Number of syncs.
+    bool syncing_;                  ///< A thread is syncing.
+    int error_;                     ///< errno of a failed sync.
+    mutable pthread_mutex_t mutex_; ///< Protects all above.
+    pthread_cond_t synced_;         ///< Signaled after a sync.
+};
+
+/** @} */
+
+END_TRIE_NAMESPACE
+
+#endif  // TRIE_LOG_H_
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,1101 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef TRIE_VIEW_H_
+#define TRIE_VIEW_H_
+
+/*
+ * Read-only views of trie archives for the hottest lookups.
+ *
+ * trie::search() is virtual and basic_trie_impl lives in the library, so
+ * a caller's loop can neither inline a lookup nor see through it. The
+ * views below are plain classes in this header, without virtual
+ * functions, reading an archive in place: the compiler inlines search(),
+ * common_prefix_search() and prefix() into the caller and optimizes the
+ * walk together with the loop around it.
+ *
+ * A view never owns the archive. Map it or load it into memory, e.g.
+ * by mmap(2), and keep it alive as long as the view.
+ */
+
+#include <stdint.h>
+
+#include <cstring>
+#include <string>
+
+#include "trie.h"
+#include "trie_format.h"
+
+#if __cplusplus >= 201103L
+#define TRIE_FINAL final
+#else
+#define TRIE_FINAL
+#endif
+
+BEGIN_TRIE_NAMESPACE
+
+/**
+ * @addtogroup libtrie_api
+ *
+ * @{
+ */
+
+/**
+ * Sections of an archive in memory.
+ *
+ * The header and the section table are checked against the size of the
+ * archive, checksums are not. Load the archive by trie::create_trie()
+ * with load_options::verify once to verify them. A required section
+ * unknown to the format, or left unread by a view, refuses the archive,
+ * @see check_required().
+ */
+class archive_sections {
+  public:
+    /**
+     * Locates the sections of an archive.
+     *
+     * @param data Pointer to the archive, aligned to 8 bytes at least.
+     * @param size Size of the archive.
+     * @param type Magic of the trie expected in the archive.
+     */
+    archive_sections(const void *data, size_t size, const char *type)
+        :data_(static_cast<const char *>(data)),
+         header_(static_cast<const archive_header *>(data)),
+         table_(reinterpret_cast<const section_entry *>(header_ + 1)),
+         read_(0)
+    {
+        if (size < sizeof(archive_header)
+            || memcmp(header_->magic, kArchiveMagic, sizeof(kArchiveMagic)))
+            throw bad_trie_archive("bad archive magic");
+        if (header_->version > kArchiveVersion)
+            throw bad_trie_archive("unsupported archive version");
+        if (header_->section_count > (size - sizeof(archive_header))
+                                     / sizeof(section_entry))
+            throw bad_trie_archive("file corrupted");
+        if (header_->size > size)
+            throw bad_trie_archive("file truncated");
+        for (uint32_t i = 0; i < header_->section_count; i++) {
+            const section_entry &entry = table_[i];
+            if (entry.offset > header_->size
+                || entry.length > header_->size - entry.offset
+                || !entry.align || entry.offset % entry.align)
+                throw bad_trie_archive("file corrupted");
+            if ((entry.flags & kSectionRequired)
+                && (entry.id == 0 || entry.id >= SECTION_MAX))
+                throw bad_trie_archive("unknown required section");
+        }
+        if (strncmp(header_->type, type, sizeof(header_->type)))
+            throw bad_trie_archive("file magic error");
+    }
+
+    /**
+     * Finds a section.
+     *
+     * @param id Section identifier.
+     * @param[out] length Length of the section.
+     * @return Pointer to the section, NULL if it does not exist.
+     */
+    const void *section(uint32_t id, size_t *length) const
+    {
+        if (id < SECTION_MAX)
+            read_ |= static_cast<uint64_t>(1) << id;
+        for (uint32_t i = 0; i < header_->section_count; i++) {
+            if (table_[i].id == id) {
+                *length = table_[i].length;
+                return data_ + table_[i].offset;
+            }
+        }
+        *length = 0;
+        return NULL;
+    }
+
+    /**
+     * Finds a section which must exist and hold count elements at least.
+     *
+     * @param id Section identifier.
+     * @param count Minimal number of elements.
+     * @param[out] length Length of the section in bytes, can be NULL.
+     * @return Pointer to the first element.
+     */
+    template<typename T>
+    const T *require(uint32_t id, size_t count, size_t *length = NULL) const
+    {
+        size_t n;
+        const void *p = section(id, &n);
+        if (!p)
+            throw bad_trie_archive("missing section");
+        if (n / sizeof(T) < count)
+            throw bad_trie_archive("file corrupted");
+        if (length)
+            *length = n;
+        return static_cast<const T *>(p);
+    }
+
+    /**
+     * Refuses the archive if a required section has not been looked up,
+     * e.g. chains which a view does not follow. Call it once all
+     * sections are read.
+     */
+    void check_required() const
+    {
+        for (uint32_t i = 0; i < header_->section_count; i++) {
+            if ((table_[i].flags & kSectionRequired)
+                && !((read_ >> table_[i].id) & 1))
+                throw bad_trie_archive("unsupported required section");
+        }
+    }
+
+  private:
+    const char *data_;              ///< Pointer to archive.
+    const archive_header *header_;  ///< Pointer to header.
+    const section_entry *table_;    ///< Pointer to section table.
+    mutable uint64_t read_;         ///< Sections looked up, a bit per id.
+};
+
+/**
+ * A read-only double-array in an archive section. The section holds a
+ * header and the states, as basic_trie_impl writes them.
+ */
+class double_array_view {
+  public:
+    /// Shortcut for trie::size_type.
+    typedef trie::size_type size_type;
+
+    /// Shortcut for trie::char_type.
+    typedef trie::char_type char_type;
+
+    /// Constructs an empty double_array_view.
+    double_array_view()
+        :states_(NULL), size_(0)
+    {
+    }
+
+    /**
+     * Locates the double-array of a section.
+     *
+     * @param sections Sections of the archive.
+     * @param id Section identifier.
+     */
+    void assign(const archive_sections &sections, uint32_t id)
+    {
+        size_t length;
+        const header_type *header
+            = sections.require<header_type>(id, 1, &length);
+        if (header->size < 0
+            || static_cast<size_t>(header->size)
+               > (length - sizeof(header_type)) / sizeof(state_type))
+            throw bad_trie_archive("file corrupted");
+        states_ = reinterpret_cast<const state_type *>(header + 1);
+        size_ = header->size;
+    }
+
+    /// Returns the number of states.
+    size_type size() const
+    {
+        return size_;
+    }
+
+    /// Returns true if there is no root state.
+    bool empty() const
+    {
+        return size_ <= 1;
+    }
+
+    /// Returns the BASE value of state s.
+    size_type base(size_type s) const
+    {
+        return states_[s].base;
+    }
+
+    /// Returns the CHECK value of state s.
+    size_type check(size_type s) const
+    {
+        return states_[s].check;
+    }
+
+    /// Returns the state reached from s by ch, 0 if there is none.
+    size_type next(size_type s, char_type ch) const
+    {
+        size_type t = states_[s].base + ch;
+        return (t > 0 && t < size_ && states_[t].check == s)?t:0;
+    }
+
+    /// Returns the label leading to state s, 0 if s is out of range.
+    char_type label(size_type s) const
+    {
+        if (s <= 1 || s >= size_)
+            return 0;
+        size_type p = states_[s].check;
+        if (p <= 0 || p >= size_)
+            return 0;
+        return s - states_[p].base;
+    }
+
+  private:
+    /// Represents a state, @see basic_trie_impl::state_type.
+    typedef struct {
+        size_type base;   ///< The BASE value.
+        size_type check;  ///< The CHECK value.
+    } state_type;
+
+    /// Represents a header, @see basic_trie_impl::header_type.
+    typedef struct {
+        size_type size;    ///< Number of states.
+        char unused[60];   ///< Unused.
+    } header_type;
+
+    const state_type *states_;  ///< Pointer to states.
+    size_type size_;            ///< Number of states.
+};
+
+/**
+ * A label remapping table in an archive, @see trie::remap_labels().
+ */
+class alphabet_view {
+  public:
+    /// Shortcut for trie::char_type.
+    typedef trie::char_type char_type;
+
+    /// Represents a stored label.
+    typedef uint16_t label_type;
+
+    /// Number of elements in a table.
+    static const size_t kTableSize = trie::key_type::kCharsetSize + 1;
+
+    /// Constructs an identity alphabet_view.
+    alphabet_view()
+        :code_(NULL)
+    {
+    }
+
+    /**
+     * Uses the table of an archive, if there is one.
+     *
+     * @param sections Sections of the archive.
+     */
+    void assign(const archive_sections &sections)
+    {
+        size_t length;
+        const void *table = sections.section(SECTION_ALPHABET, &length);
+        code_ = NULL;
+        if (!table)
+            return;
+        if (length != sizeof(label_type) * kTableSize)
+            throw bad_trie_archive("file corrupted");
+        code_ = static_cast<const label_type *>(table);
+        memset(label_, 0, sizeof(label_));
+        for (size_t i = 1; i < kTableSize; i++) {
+            if (!code_[i] || code_[i] >= kTableSize || label_[code_[i]])
+                throw bad_trie_archive("file corrupted");
+            label_[code_[i]] = i;
+        }
+    }
+
+    /// Converts a label, @see key_type::char_in(), to its code.
+    char_type encode(char_type ch) const
+    {
+        return code_?code_[ch]:ch;
+    }
+
+    /// Converts a code back to the byte it stands for.
+    char decode(char_type code) const
+    {
+        return trie::key_type::char_out(code_?label_[code]:code);
+    }
+
+  private:
+    const label_type *code_;       ///< Table from label to code.
+    label_type label_[kTableSize]; ///< Table from code to label.
+};
+
+/**
+ * A payload heap in an archive, @see trie::insert_payload().
+ */
+class payload_view {
+  public:
+    /// Constructs an empty payload_view.
+    payload_view()
+        :data_(NULL), size_(0), flags_(NULL), flags_size_(0)
+    {
+    }
+
+    /**
+     * Uses the payload heap of an archive and its flags, if there are.
+     *
+     * @param sections Sections of the archive.
+     */
+    void assign(const archive_sections &sections)
+    {
+        size_t length;
+        data_ = static_cast<const char *>(
+                    sections.section(SECTION_PAYLOAD, &size_));
+        flags_ = static_cast<const uint32_t *>(
+                     sections.section(SECTION_PAYLOAD_FLAG, &length));
+        flags_size_ = length / sizeof(uint32_t);
+        if (size_ && !flags_)
+            throw bad_trie_archive("file corrupted");
+    }
+
+    /**
+     * Returns true if the value in a slot refers to a payload.
+     *
+     * @param slot The slot, @see trie::search_payload().
+     */
+    bool flagged(trie::size_type slot) const
+    {
+        size_t w = slot / 32;
+        return slot >= 0 && w < flags_size_
+               && ((flags_[w] >> (slot % 32)) & 1);
+    }
+
+    /**
+     * Retrieves a payload by the offset of its record.
+     *
+     * @param offset Offset of the record.
+     * @param[out] payload Pointer to the payload buffer.
+     * @param[out] length Length of the payload buffer.
+     * @return false if offset does not refer to a valid record.
+     */
+    bool get(trie::value_type offset,
+             const char **payload, size_t *length) const
+    {
+        uint32_t len;
+        if (offset < static_cast<trie::value_type>(sizeof(len))
+            || offset % sizeof(len)
+            || static_cast<size_t>(offset) + sizeof(len) > size_)
+            return false;
+        memcpy(&len, data_ + offset, sizeof(len));
+        if (len > size_ - offset - sizeof(len))
+            return false;
+        if (payload)
+            *payload = data_ + offset + sizeof(len);
+        if (length)
+            *length = len;
+        return true;
+    }
+
+  private:
+    const char *data_;  ///< Pointer to the heap.
+    size_t size_;       ///< Size of the heap.
+    const uint32_t *flags_;  ///< Payload flags, a bit per slot.
+    size_t flags_size_;      ///< Number of flag words.
+};
+
+/// Labels of a key given as bytes.
+struct byte_labels {
+    const char *data;  ///< The bytes.
+    size_t length;     ///< Number of bytes.
+
+    /// Returns the (i)th label, @see key_type::char_in().
+    trie::char_type operator[](size_t i) const
+    {
+        return trie::key_type::char_in(data[i]);
+    }
+};
+
+/// Labels of a key_type.
+struct key_labels {
+    const trie::char_type *data;  ///< The labels.
+    size_t length;                ///< Number of labels.
+
+    /// Returns the (i)th label.
+    trie::char_type operator[](size_t i) const
+    {
+        return data[i];
+    }
+
+    /**
+     * Returns the labels of a key, leaving out the terminators it ends
+     * in, e.g. a key found by trie::prefix_search().
+     */
+    static key_labels of(const trie::key_type &key)
+    {
+        key_labels labels = {key.data(), key.length()};
+        while (labels.length
+               && labels.data[labels.length - 1] == trie::key_type::kTerminator)
+            labels.length--;
+        return labels;
+    }
+};
+
+/**
+ * A read-only view of a two-trie archive, @see trie::DOUBLE_TRIE.
+ *
+ * All lookups are inline and non-virtual. Keys are found in the front
+ * trie, then the rest of a key is matched against its tail, which is read
+ * backward from an accept state of the rear trie.
+ *
+ * @code
+ * double_trie_view words(data, size);
+ * trie::value_type value;
+ * if (words.search("apple", 5, &value))
+ *     ...
+ * @endcode
+ */
+class double_trie_view TRIE_FINAL {
+  public:
+    /// Shortcut for trie::value_type.
+    typedef trie::value_type value_type;
+
+    /// Shortcut for trie::size_type.
+    typedef trie::size_type size_type;
+
+    /// Shortcut for trie::char_type.
+    typedef trie::char_type char_type;
+
+    /// Terminator of keys.
+    static const char_type kTerminator = trie::key_type::kTerminator;
+
+    /**
+     * Constructs a view of a two-trie archive in memory.
+     *
+     * @param data Pointer to the archive, aligned to 8 bytes at least.
+     * @param size Size of the archive.
+     */
+    double_trie_view(const void *data, size_t size)
+    {
+        archive_sections sections(data, size, "TWO_TRIE");
+        const header_type *header
+            = sections.require<header_type>(SECTION_HEADER, 1);
+        if (header->index_size < 0 || header->accept_size < 0)
+            throw bad_trie_archive("file corrupted");
+        index_ = sections.require<index_type>(SECTION_INDEX,
+                                              header->index_size);
+        index_size_ = header->index_size;
+        accept_ = sections.require<accept_type>(SECTION_ACCEPT,
+                                                header->accept_size);
+        accept_size_ = header->accept_size;
+        lhs_.assign(sections, SECTION_FRONT);
+        rhs_.assign(sections, SECTION_REAR);
+        payload_.assign(sections);
+        alphabet_.assign(sections);
+        // a view reads a state per label, it refuses chains
+        sections.check_required();
+    }
+
+    /**
+     * Retrieves the value of a key.
+     *
+     * @param key Buffer of the key.
+     * @param length Length of the key buffer.
+     * @param[out] value The value if found, can be NULL.
+     * @return true if found.
+     */
+    bool search(const char *key, size_t length, value_type *value) const
+    {
+        byte_labels labels = {key, length};
+        return lookup(labels, value, NULL);
+    }
+
+    /// Retrieves the value of a key_type, @see search().
+    bool search(const trie::key_type &key, value_type *value) const
+    {
+        return lookup(key_labels::of(key), value, NULL);
+    }
+
+    /**
+     * Retrieves the payload of a key, @see trie::search_payload().
+     *
+     * @param key Buffer of the key.
+     * @param length Length of the key buffer.
+     * @param[out] payload Pointer to the payload buffer.
+     * @param[out] payload_length Length of the payload buffer.
+     * @return true if found and the key refers to a payload.
+     */
+    bool search_payload(const char *key, size_t length,
+                        const char **payload, size_t *payload_length) const
+    {
+        byte_labels labels = {key, length};
+        value_type offset;
+        size_type slot;
+        return lookup(labels, &offset, &slot) && payload_.flagged(slot)
+               && payload_.get(offset, payload, payload_length);
+    }
+
+    /**
+     * Finds all keys which are prefixes of a key, shortest first.
+     *
+     * @param key Buffer of the key.
+     * @param length Length of the key buffer.
+     * @param visit Called as visit(size_t length, value_type value) for
+     *              each key found, length being the length of the key.
+     * @return The number of keys found.
+     */
+    template<typename F>
+    size_t common_prefix_search(const char *key, size_t length,
+                                F visit) const
+    {
+        byte_labels labels = {key, length};
+        size_t count = 0, i;
+        size_type s = 1, t;
+        value_type value;
+
+        if (lhs_.empty())
+            return 0;
+        for (i = 0; ; i++) {
+            if (lhs_.base(s) < 0) {
+                // a separator has one key below it
+                if (match_tail(s, labels, &i, true, &value)) {
+                    visit(i, value);
+                    count++;
+                }
+                return count;
+            }
+            if (accept(lhs_.next(s, kTerminator), &value)) {
+                visit(i, value);
+                count++;
+            }
+            if (i == length
+                || !(t = lhs_.next(s, alphabet_.encode(labels[i]))))
+                return count;
+            s = t;
+        }
+    }
+
+    /**
+     * Enumerates all keys beginning with a prefix, in the order of their
+     * codes like trie::prefix_search(): a key goes after the keys it is
+     * a prefix of.
+     *
+     * @param prefix Buffer of the prefix.
+     * @param length Length of the prefix buffer.
+     * @param visit Called as visit(const char *key, size_t length,
+     *              value_type value) for each key found.
+     * @return The number of keys found.
+     */
+    template<typename F>
+    size_t prefix(const char *prefix, size_t length, F visit) const
+    {
+        byte_labels labels = {prefix, length};
+        std::string key(prefix, length);
+        size_type s = 1, t;
+        size_t i;
+
+        if (lhs_.empty())
+            return 0;
+        for (i = 0; i < length && lhs_.base(s) >= 0; i++) {
+            if (!(t = lhs_.next(s, alphabet_.encode(labels[i]))))
+                return 0;
+            s = t;
+        }
+        key.resize(i);
+        return walk(s, labels, i, &key, visit);
+    }
+
+  private:
+    /// Represents a header, @see double_trie_impl::header_type.
+    typedef struct {
+        char magic[16];           ///< Archive magic.
+        size_type index_size;     ///< Index array size.
+        size_type accept_size;    ///< Accept array size.
+        size_type payload_size;   ///< Payload heap size in bytes.
+        size_type alphabet_size;  ///< Number of elements in alphabet.
+        char unused[32];          ///< Unused.
+    } header_type;
+
+    /// Represents an index entry, @see double_trie_impl.
+    typedef struct {
+        value_type data;  ///< The value.
+        size_type index;  ///< The accept entry, 0 if there is none.
+    } index_type;
+
+    /// Represents an accept entry, @see double_trie_impl.
+    typedef struct {
+        size_type accept;  ///< Accept state in the rear trie.
+    } accept_type;
+
+    /// Reads the index entry of separator s, false if it has none.
+    bool read_index(size_type s, value_type *value, size_type *a) const
+    {
+        size_type i = -lhs_.base(s);
+        if (i <= 0 || i >= index_size_)
+            return false;
+        *value = index_[i].data;
+        *a = index_[i].index;
+        return true;
+    }
+
+    /// Reads the value of state t reached by a terminator, if it is one.
+    bool accept(size_type t, value_type *value) const
+    {
+        size_type a;
+        return t && lhs_.base(t) < 0 && read_index(t, value, &a);
+    }
+
+    /**
+     * Matches the rest of a key against the tail of separator s.
+     *
+     * @param s The separator.
+     * @param key Labels of the key.
+     * @param[in,out] i Position in the key, moved to the end of the
+     *                  key found.
+     * @param prefix Matches a key which is a prefix of the rest if true,
+     *               the whole rest otherwise.
+     * @param[out] value The value if it matches.
+     * @return true if it matches.
+     */
+    template<typename K>
+    bool match_tail(size_type s, const K &key, size_t *i, bool prefix,
+                    value_type *value) const
+    {
+        size_type a, r;
+        if (!read_index(s, value, &a) || a <= 0 || a >= accept_size_)
+            return false;
+        r = accept_[a].accept;
+        // skip a terminator, unless it is all the tail has
+        if (rhs_.label(r) == kTerminator && rhs_.check(r) > 1)
+            r = rhs_.check(r);
+        for (size_t j = *i; ; j++) {
+            char_type ch = rhs_.label(r);
+            if (ch == kTerminator) {
+                if (!prefix && j < key.length)
+                    return false;
+                *i = j;
+                return true;
+            }
+            if (!ch || j >= key.length || ch != alphabet_.encode(key[j]))
+                return false;
+            r = rhs_.check(r);
+        }
+    }
+
+    /**
+     * Enumerates keys below state s, @see prefix().
+     *
+     * @param s The state.
+     * @param prefix Labels of the prefix.
+     * @param i Number of labels of prefix consumed in the front trie.
+     * @param[in,out] key Bytes of the key so far, restored on return.
+     * @param visit The visitor.
+     * @return The number of keys found.
+     */
+    template<typename K, typename F>
+    size_t walk(size_type s, const K &prefix, size_t i, std::string *key,
+                F &visit) const
+    {
+        size_t count = 0, depth = key->size();
+        size_type base = lhs_.base(s), t;
+        value_type value;
+
+        if (base < 0) {
+            size_type a, r;
+            if (!read_index(s, &value, &a))
+                return 0;
+            if (a > 0 && a < accept_size_) {
+                r = accept_[a].accept;
+                if (rhs_.label(r) == kTerminator && rhs_.check(r) > 1)
+                    r = rhs_.check(r);
+                for (char_type ch; (ch = rhs_.label(r)) != kTerminator;
+                     r = rhs_.check(r), i++) {
+                    if (!ch || (i < prefix.length
+                                && ch != alphabet_.encode(prefix[i]))) {
+                        key->resize(depth);
+                        return 0;
+                    }
+                    key->push_back(alphabet_.decode(ch));
+                }
+            }
+            if (i >= prefix.length) {
+                visit(key->data(), key->size(), value);
+                count++;
+            }
+            key->resize(depth);
+            return count;
+        }
+        if (!base)
+            return 0;  // the bare root of an empty trie
+        for (char_type ch = 1; ch < kTerminator; ch++) {
+            if (!(t = lhs_.next(s, ch)))
+                continue;
+            key->push_back(alphabet_.decode(ch));
+            count += walk(t, prefix, i, key, visit);
+            key->resize(depth);
+        }
+        // the terminator has the largest code, the key ending here is last
+        if (accept(lhs_.next(s, kTerminator), &value)) {
+            visit(key->data(), key->size(), value);
+            count++;
+        }
+        return count;
+    }
+
+    /**
+     * Retrieves the value of a key, @see search().
+     *
+     * @param key Labels of the key.
+     * @param[out] value The value if found, can be NULL.
+     * @param[out] slot The index entry of the key, can be NULL.
+     * @return true if found.
+     */
+    template<typename K>
+    bool lookup(const K &key, value_type *value, size_type *slot) const
+    {
+        size_type s = 1, t;
+        size_t i;
+        value_type found;
+
+        if (lhs_.empty())
+            return false;
+        for (i = 0; i < key.length; i++) {
+            if (lhs_.base(s) < 0)
+                break;
+            if (!(t = lhs_.next(s, alphabet_.encode(key[i]))))
+                return false;
+            s = t;
+        }
+        if (lhs_.base(s) < 0) {
+            if (!match_tail(s, key, &i, false, &found))
+                return false;
+        } else if (!accept(s = lhs_.next(s, kTerminator), &found)) {
+            return false;
+        }
+        if (value)
+            *value = found;
+        if (slot)
+            *slot = -lhs_.base(s);
+        return true;
+    }
+
+    double_array_view lhs_;   ///< Front trie.
+    double_array_view rhs_;   ///< Rear trie.
+    const index_type *index_;    ///< Index entries.
+    size_type index_size_;       ///< Number of index entries.
+    const accept_type *accept_;  ///< Accept entries.
+    size_type accept_size_;      ///< Number of accept entries.
+    payload_view payload_;    ///< Payload heap.
+    alphabet_view alphabet_;  ///< Label remapping table.
+};
+
+/**
+ * A read-only view of a tail-trie archive, @see trie::SINGLE_TRIE.
+ *
+ * All lookups are inline and non-virtual. Keys are found in the trie,
+ * then the rest of a key is matched against its suffix, which is followed
+ * by the value of the key, or which is shared by keys whose values are
+ * then kept by leaf state.
+ */
+class single_trie_view TRIE_FINAL {
+  public:
+    /// Shortcut for trie::value_type.
+    typedef trie::value_type value_type;
+
+    /// Shortcut for trie::size_type.
+    typedef trie::size_type size_type;
+
+    /// Shortcut for trie::char_type.
+    typedef trie::char_type char_type;
+
+    /// Terminator of keys.
+    static const char_type kTerminator = trie::key_type::kTerminator;
+
+    /**
+     * Constructs a view of a tail-trie archive in memory.
+     *
+     * @param data Pointer to the archive, aligned to 8 bytes at least.
+     * @param size Size of the archive.
+     */
+    single_trie_view(const void *data, size_t size)
+    {
+        archive_sections sections(data, size, "TAIL_TRIE_16");
+        const header_type *header
+            = sections.require<header_type>(SECTION_HEADER, 1);
+        if (header->suffix_size < 0)
+            throw bad_trie_archive("file corrupted");
+        suffix_ = sections.require<suffix_type>(SECTION_SUFFIX,
+                                                header->suffix_size);
+        suffix_size_ = header->suffix_size;
+        trie_.assign(sections, SECTION_TRIE);
+        size_t length;
+        values_ = static_cast<const value_type *>(
+                      sections.section(SECTION_TAIL_VALUE, &length));
+        if (values_ && length != sizeof(value_type) * trie_.size())
+            throw bad_trie_archive("file corrupted");
+        payload_.assign(sections);
+        alphabet_.assign(sections);
+        sections.check_required();
+    }
+
+    /// Retrieves the value of a key, @see double_trie_view::search().
+    bool search(const char *key, size_t length, value_type *value) const
+    {
+        byte_labels labels = {key, length};
+        return lookup(labels, value, NULL);
+    }
+
+    /// Retrieves the value of a key_type, @see search().
+    bool search(const trie::key_type &key, value_type *value) const
+    {
+        return lookup(key_labels::of(key), value, NULL);
+    }
+
+    /// Retrieves the payload of a key, @see trie::search_payload().
+    bool search_payload(const char *key, size_t length,
+                        const char **payload, size_t *payload_length) const
+    {
+        byte_labels labels = {key, length};
+        value_type offset;
+        size_type slot;
+        return lookup(labels, &offset, &slot) && payload_.flagged(slot)
+               && payload_.get(offset, payload, payload_length);
+    }
+
+    /**
+     * Finds all keys which are prefixes of a key, shortest first,
+     * @see double_trie_view::common_prefix_search().
+     */
+    template<typename F>
+    size_t common_prefix_search(const char *key, size_t length,
+                                F visit) const
+    {
+        byte_labels labels = {key, length};
+        size_t count = 0, i;
+        size_type s = 1, t;
+        value_type value;
+
+        if (trie_.empty())
+            return 0;
+        for (i = 0; ; i++) {
+            if (trie_.base(s) < 0) {
+                size_type start = -trie_.base(s);
+                if (match_suffix(&start, labels, &i, true)
+                    && read_value(s, start, &value)) {
+                    visit(i, value);
+                    count++;
+                }
+                return count;
+            }
+            if (accept(trie_.next(s, kTerminator), &value)) {
+                visit(i, value);
+                count++;
+            }
+            if (i == length
+                || !(t = trie_.next(s, alphabet_.encode(labels[i]))))
+                return count;
+            s = t;
+        }
+    }
+
+    /**
+     * Enumerates all keys beginning with a prefix,
+     * @see double_trie_view::prefix().
+     */
+    template<typename F>
+    size_t prefix(const char *prefix, size_t length, F visit) const
+    {
+        byte_labels labels = {prefix, length};
+        std::string key(prefix, length);
+        size_type s = 1, t;
+        size_t i;
+
+        if (trie_.empty())
+            return 0;
+        for (i = 0; i < length && trie_.base(s) >= 0; i++) {
+            if (!(t = trie_.next(s, alphabet_.encode(labels[i]))))
+                return 0;
+            s = t;
+        }
+        key.resize(i);
+        return walk(s, labels, i, &key, visit);
+    }
+
+  private:
+    /// Represents an element in suffix buffer.
+    typedef uint16_t suffix_type;
+
+    /// Number of suffix elements used to store a value.
+    static const size_type kValueSize =
+        (sizeof(value_type) + sizeof(suffix_type) - 1) / sizeof(suffix_type);
+
+    /// Represents a header, @see single_trie_impl::header_type.
+    typedef struct {
+        char magic[16];           ///< Archive magic.
+        size_type suffix_size;    ///< Size of suffix buffer.
+        size_type payload_size;   ///< Payload heap size in bytes.
+        size_type alphabet_size;  ///< Number of elements in alphabet.
+        char unused[36];          ///< Unused.
+    } header_type;
+
+    /// Returns the (i)th element of suffix, 0 if it is out of range.
+    char_type suffix(size_type i) const
+    {
+        return (i > 0 && i < suffix_size_)?suffix_[i]:0;
+    }
+
+    /**
+     * Reads the value of leaf state s, kept by state if tails are shared,
+     * at start of suffix otherwise.
+     */
+    bool read_value(size_type s, size_type start, value_type *value) const
+    {
+        if (values_) {
+            *value = values_[s];
+            return true;
+        }
+        if (start <= 0 || start > suffix_size_ - kValueSize)
+            return false;
+        memcpy(value, suffix_ + start, sizeof(*value));
+        return true;
+    }
+
+    /// Reads the value of state t reached by a terminator, if it is one.
+    bool accept(size_type t, value_type *value) const
+    {
+        return t && trie_.base(t) < 0 && read_value(t, -trie_.base(t), value);
+    }
+
+    /**
+     * Matches the rest of a key against a suffix.
+     *
+     * @param[in,out] start Start of the suffix, moved to its value.
+     * @param key Labels of the key.
+     * @param[in,out] i Position in the key, moved to the end of the
+     *                  key found.
+     * @param prefix Matches a key which is a prefix of the rest if true,
+     *               the whole rest otherwise.
+     * @return true if it matches.
+     */
+    template<typename K>
+    bool match_suffix(size_type *start, const K &key, size_t *i,
+                      bool prefix) const
+    {
+        size_type p = *start;
+        for (size_t j = *i; ; j++, p++) {
+            char_type ch = suffix(p);
+            if (ch == kTerminator) {
+                if (!prefix && j < key.length)
+                    return false;
+                *start = p + 1;
+                *i = j;
+                return true;
+            }
+            if (!ch || j >= key.length || ch != alphabet_.encode(key[j]))
+                return false;
+        }
+    }
+
+    /// Enumerates keys below state s, @see double_trie_view::walk().
+    template<typename K, typename F>
+    size_t walk(size_type s, const K &prefix, size_t i, std::string *key,
+                F &visit) const
+    {
+        size_t count = 0, depth = key->size();
+        size_type base = trie_.base(s), t;
+        value_type value;
+
+        if (base < 0) {
+            size_type p = -base;
+            char_type ch;
+            for (; (ch = suffix(p)) != kTerminator; p++, i++) {
+                if (!ch || (i < prefix.length
+                            && ch != alphabet_.encode(prefix[i]))) {
+                    key->resize(depth);
+                    return 0;
+                }
+                key->push_back(alphabet_.decode(ch));
+            }
+            if (i >= prefix.length && read_value(s, p + 1, &value)) {
+                visit(key->data(), key->size(), value);
+                count++;
+            }
+            key->resize(depth);
+            return count;
+        }
+        if (!base)
+            return 0;  // the bare root of an empty trie
+        for (char_type ch = 1; ch < kTerminator; ch++) {
+            if (!(t = trie_.next(s, ch)))
+                continue;
+            key->push_back(alphabet_.decode(ch));
+            count += walk(t, prefix, i, key, visit);
+            key->resize(depth);
+        }
+        // the terminator has the largest code, the key ending here is last
+        if (accept(trie_.next(s, kTerminator), &value)) {
+            visit(key->data(), key->size(), value);
+            count++;
+        }
+        return count;
+    }
+
+    /**
+     * Retrieves the value of a key, @see search().
+     *
+     * @param key Labels of the key.
+     * @param[out] value The value if found, can be NULL.
+     * @param[out] slot The leaf state of the key if tails are shared,
+     *                  the position of its value otherwise, can be NULL.
+     * @return true if found.
+     */
+    template<typename K>
+    bool lookup(const K &key, value_type *value, size_type *slot) const
+    {
+        size_type s = 1, t, start;
+        size_t i;
+        value_type found;
+
+        if (trie_.empty())
+            return false;
+        for (i = 0; i < key.length; i++) {
+            if (trie_.base(s) < 0)
+                break;
+            if (!(t = trie_.next(s, alphabet_.encode(key[i]))))
+                return false;
+            s = t;
+        }
+        if (trie_.base(s) < 0) {
+            start = -trie_.base(s);
+            if (!match_suffix(&start, key, &i, false)
+                || !read_value(s, start, &found))
+                return false;
+        } else if (accept(s = trie_.next(s, kTerminator), &found)) {
+            start = -trie_.base(s);
+        } else {
+            return false;
+        }
+        if (value)
+            *value = found;
+        if (slot)
+            *slot = values_?s:start;
+        return true;
+    }
+
+    double_array_view trie_;     ///< The trie.
+    const suffix_type *suffix_;  ///< Suffix buffer.
+    size_type suffix_size_;      ///< Size of suffix buffer.
+    const value_type *values_;   ///< Values by state if tails are shared.
+    payload_view payload_;       ///< Payload heap.
+    alphabet_view alphabet_;     ///< Label remapping table.
+};
+
+/** @} */
+
+END_TRIE_NAMESPACE
+
+#endif  // TRIE_VIEW_H_
+
+// vim: ts=4 sw=4 ai et
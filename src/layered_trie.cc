@@ -0,0 +1,391 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#include <map>
+#include <set>
+#include <string>
+#include <stdexcept>
+
+#include "layered_trie.h"
+#include "trie_impl.h"
+
+BEGIN_TRIE_NAMESPACE
+
+/**
+ * Represents an overlay: keys inserted into it and marks of keys. A mark
+ * tells whether a key is removed, values tell whether it refers to a
+ * payload.
+ */
+struct layered_trie::overlay_type {
+    /// Marks of keys.
+    enum {
+        kLive = 0,  /**< Inserted, or never marked. */
+        kRemoved    /**< Removed, hides the key in lower layers. */
+    };
+
+    trie *values;    ///< Inserted keys and their values.
+    trie *marks;     ///< Marks of keys.
+    size_t marked;   ///< Number of keys in marks.
+    size_t updates;  ///< Number of inserts and removals.
+
+    /// Constructs an empty overlay.
+    overlay_type()
+        :values(trie::create_trie(DOUBLE_TRIE)),
+         marks(trie::create_trie(DOUBLE_TRIE)), marked(0), updates(0) {}
+
+    /// Destructs an overlay.
+    ~overlay_type()
+    {
+        delete values;
+        delete marks;
+    }
+
+    /// Returns the mark of a key.
+    value_type mark(const key_type &key) const
+    {
+        value_type value;
+        return (marked && marks->search(key, &value))?value:kLive;
+    }
+
+    /// Marks a key.
+    void set_mark(const key_type &key, value_type value)
+    {
+        if (!marked || !marks->search(key, NULL)) {
+            if (value == kLive)
+                return;
+            marked++;
+        }
+        marks->insert(key, value);
+    }
+
+    /// Returns true if the overlay holds or removes a key.
+    bool shadows(const key_type &key) const
+    {
+        return values->search(key, NULL) || mark(key) == kRemoved;
+    }
+};
+
+/// Returns the bytes of a key found by prefix_search().
+static std::string key_string(const trie::key_type &key)
+{
+    std::string bytes;
+    for (size_t i = 0; i < key.length()
+                       && key.data()[i] != trie::key_type::kTerminator; i++)
+        bytes.push_back(trie::key_type::char_out(key.data()[i]));
+    return bytes;
+}
+
+layered_trie::layered_trie(trie *base, trie_type type)
+    :base_(base), frozen_(NULL), active_(new overlay_type()), type_(type)
+{
+}
+
+layered_trie::layered_trie(const char *archive, const load_options &options,
+                           trie_type type)
+    :base_(NULL), frozen_(NULL), active_(NULL), type_(type)
+{
+    base_ = trie::create_trie(archive, options);
+    active_ = new overlay_type();
+}
+
+layered_trie::~layered_trie()
+{
+    delete active_;
+    delete frozen_;
+    delete base_;
+}
+
+void layered_trie::insert(const key_type &key, const value_type &value)
+{
+    active_->values->insert(key, value);
+    active_->set_mark(key, overlay_type::kLive);
+    active_->updates++;
+}
+
+bool layered_trie::search(const key_type &key, value_type *value) const
+{
+    const overlay_type *layers[] = {active_, frozen_};
+    for (size_t i = 0; i < sizeof(layers) / sizeof(layers[0]); i++) {
+        if (!layers[i])
+            continue;
+        if (layers[i]->mark(key) == overlay_type::kRemoved)
+            return false;
+        if (layers[i]->values->search(key, value))
+            return true;
+    }
+    return base_->search(key, value);
+}
+
+void layered_trie::insert_payload(const key_type &key,
+                                  const char *payload, size_t length)
+{
+    active_->values->insert_payload(key, payload, length);
+    active_->set_mark(key, overlay_type::kLive);
+    active_->updates++;
+}
+
+bool layered_trie::search_payload(const key_type &key,
+                                  const char **payload, size_t *length) const
+{
+    const overlay_type *layers[] = {active_, frozen_};
+    for (size_t i = 0; i < sizeof(layers) / sizeof(layers[0]); i++) {
+        if (!layers[i])
+            continue;
+        if (layers[i]->mark(key) == overlay_type::kRemoved)
+            return false;
+        if (layers[i]->values->search(key, NULL))
+            return layers[i]->values->search_payload(key, payload, length);
+    }
+    return base_->search_payload(key, payload, length);
+}
+
+size_t layered_trie::prefix_search(const key_type &key,
+                                   result_type *result) const
+{
+    std::map<std::string, value_type> merged;
+    std::map<std::string, value_type>::const_iterator m;
+    result_type found;
+    result_type::const_iterator it;
+    const overlay_type *layers[] = {frozen_, active_};
+
+    base_->prefix_search(key, &found);
+    for (it = found.begin(); it != found.end(); it++)
+        merged[key_string(it->first)] = it->second;
+    // upper layers override lower ones
+    for (size_t i = 0; i < sizeof(layers) / sizeof(layers[0]); i++) {
+        std::set<std::string> removed;
+        std::set<std::string>::const_iterator r;
+        if (!layers[i])
+            continue;
+        if (layers[i]->marked) {
+            found.clear();
+            layers[i]->marks->prefix_search(key, &found);
+            for (it = found.begin(); it != found.end(); it++) {
+                if (it->second == overlay_type::kRemoved)
+                    removed.insert(key_string(it->first));
+            }
+        }
+        found.clear();
+        layers[i]->values->prefix_search(key, &found);
+        for (it = found.begin(); it != found.end(); it++) {
+            std::string bytes = key_string(it->first);
+            if (!removed.count(bytes))
+                merged[bytes] = it->second;
+        }
+        for (r = removed.begin(); r != removed.end(); r++)
+            merged.erase(*r);
+    }
+    for (m = merged.begin(); m != merged.end(); m++)
+        result->push_back(std::pair<key_type, value_type>(
+                              key_type(m->first.data(), m->first.size()),
+                              m->second));
+    return result->size();
+}
+
+void layered_trie::build(const char *filename, bool verbose)
+{
+    trie *merged = merge(active_);
+    try {
+        merged->build(filename, verbose);
+    } catch (...) {
+        delete merged;
+        throw;
+    }
+    delete merged;
+}
+
+void layered_trie::serialize(int fd)
+{
+    trie *merged = merge(active_);
+    try {
+        merged->serialize(fd);
+    } catch (...) {
+        delete merged;
+        throw;
+    }
+    delete merged;
+}
+
+void layered_trie::remap_labels(const size_t *frequency)
+{
+    throw std::runtime_error("layered_trie::remap_labels: not supported");
+}
+
+void layered_trie::set_concurrent(bool concurrent)
+{
+    throw std::runtime_error("layered_trie::set_concurrent: not supported");
+}
+
+bool layered_trie::remove(const key_type &key)
+{
+    if (!search(key, NULL))
+        return false;
+    active_->set_mark(key, overlay_type::kRemoved);
+    active_->updates++;
+    return true;
+}
+
+size_t layered_trie::updates() const
+{
+    return active_->updates + (frozen_?frozen_->updates:0);
+}
+
+void layered_trie::compact(const char *filename, const load_options &options)
+{
+    begin_compact();
+    write_compact(filename);
+    end_compact(filename, options);
+}
+
+void layered_trie::begin_compact()
+{
+    if (frozen_)
+        throw std::runtime_error("layered_trie::begin_compact: "
+                                 "compaction in progress");
+    frozen_ = active_;
+    active_ = new overlay_type();
+}
+
+void layered_trie::write_compact(const char *filename) const
+{
+    if (!frozen_)
+        throw std::runtime_error("layered_trie::write_compact: "
+                                 "no compaction in progress");
+    trie *merged = merge(frozen_);
+    try {
+        merged->build(filename);
+    } catch (...) {
+        delete merged;
+        throw;
+    }
+    delete merged;
+}
+
+void layered_trie::end_compact(const char *filename,
+                               const load_options &options)
+{
+    if (!frozen_)
+        throw std::runtime_error("layered_trie::end_compact: "
+                                 "no compaction in progress");
+    trie *next = trie::create_trie(filename, options);
+    delete base_;
+    base_ = next;
+    delete frozen_;
+    frozen_ = NULL;
+}
+
+/**
+ * Copies keys of a layer into a trie, unless an upper layer holds or
+ * removes them.
+ *
+ * @param source Keys of the layer.
+ * @param layer The layer if it is an overlay, NULL for the base.
+ *              Payloads of the base keep their offsets.
+ * @param upper Upper layers.
+ * @param count Number of upper layers.
+ * @param target The trie.
+ */
+template<typename T, typename L>
+static void merge_layer(const trie *source, const L *layer,
+                        const L *const *upper, size_t count, T *target)
+{
+    trie::result_type found;
+    trie::result_type::const_iterator it;
+    trie::key_type empty("", 0);
+    const char *payload;
+    size_t length;
+
+    source->prefix_search(empty, &found);
+    for (it = found.begin(); it != found.end(); it++) {
+        std::string bytes = key_string(it->first);
+        trie::key_type key(bytes.data(), bytes.size());
+        size_t i;
+        for (i = 0; i < count && !upper[i]->shadows(key); i++) {
+            // empty
+        }
+        if (i < count)
+            continue;
+        if (layer && layer->mark(key) == L::kRemoved)
+            continue;
+        if (!source->search_payload(key, &payload, &length))
+            target->insert(key, it->second);
+        else if (!layer)
+            target->copy_payload(key, it->second, payload, length);
+        else
+            target->insert_payload(key, payload, length);
+    }
+}
+
+/// Merges layers into a trie which supports copy_payload().
+template<typename T, typename L>
+static T *merge_layers(const trie *base, const L *const *layers,
+                       size_t count)
+{
+    T *target = new T();
+    try {
+        // the base goes first, so its payloads keep their offsets
+        merge_layer<T, L>(base, NULL, layers, count, target);
+        for (size_t i = 0; i < count; i++)
+            merge_layer<T, L>(layers[i]->values, layers[i], layers + i + 1,
+                              count - i - 1, target);
+    } catch (...) {
+        delete target;
+        throw;
+    }
+    return target;
+}
+
+trie *layered_trie::merge(const overlay_type *top) const
+{
+    const overlay_type *layers[2];
+    size_t count = 0;
+
+    if (frozen_)
+        layers[count++] = frozen_;
+    if (top == active_)
+        layers[count++] = active_;
+    if (type_ == SINGLE_TRIE)
+        return merge_layers<single_trie>(base_, layers, count);
+    trie *merged = merge_layers<double_trie>(base_, layers, count);
+    if (type_ == LOUDS_TRIE) {
+        trie *louds;
+        try {
+            louds = trie::create_trie(*merged, LOUDS_TRIE);
+        } catch (...) {
+            delete merged;
+            throw;
+        }
+        delete merged;
+        merged = louds;
+    }
+    return merged;
+}
+
+END_TRIE_NAMESPACE
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,589 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#include "louds_trie.h"
+
+BEGIN_TRIE_NAMESPACE
+
+const char louds_trie::magic_[16] = "LOUDS_TRIE";
+
+const size_t succinct_bits::kBlockBits;
+const size_t succinct_bits::kSelectSample;
+
+// ************************************************************************
+// * Implementation of succinct_bits                                      *
+// ************************************************************************
+
+succinct_bits::succinct_bits()
+    :words_(NULL), rank_(NULL), samples_(NULL)
+{
+    memset(&header_, 0, sizeof(header_));
+}
+
+void succinct_bits::freeze()
+{
+    size_t b, i, zeros = 0;
+
+    // pad one word so that scanning never runs off the end
+    bits_.resize(words() + 1, 0);
+    header_.samples = (header_.size - header_.ones + kSelectSample - 1)
+                      / kSelectSample;
+    directory_.resize(blocks() + 1 + header_.samples);
+    uint32_t *rank = &directory_[0];
+    uint32_t *samples = rank + blocks() + 1;
+    rank[0] = 0;
+    for (b = 0; b < blocks(); b++) {
+        uint32_t ones = 0;
+        for (i = b * (kBlockBits / 64);
+             i < std::min((b + 1) * (kBlockBits / 64), words()); i++)
+            ones += __builtin_popcountll(bits_[i]);
+        // a zero numbered by a multiple of kSelectSample lies in block b
+        size_t nzeros = zeros + kBlockBits - ones;
+        for (i = (zeros + kSelectSample - 1) / kSelectSample;
+             i * kSelectSample < nzeros && i < header_.samples; i++)
+            samples[i] = b;
+        zeros = nzeros;
+        rank[b + 1] = rank[b] + ones;
+    }
+    words_ = &bits_[0];
+    rank_ = rank;
+    samples_ = samples;
+}
+
+void succinct_bits::attach(const void *data, size_t length)
+{
+    const char *p = static_cast<const char *>(data);
+    if (length < sizeof(header_type))
+        throw bad_trie_archive("file corrupted");
+    memcpy(&header_, p, sizeof(header_type));
+    if (header_.size > UINT32_MAX || header_.ones > header_.size
+        || header_.samples != (header_.size - header_.ones
+                               + kSelectSample - 1) / kSelectSample
+        || bytes() + sizeof(uint64_t) > length - sizeof(header_type))
+        throw bad_trie_archive("file corrupted");
+    words_ = reinterpret_cast<const uint64_t *>(p + sizeof(header_type));
+    rank_ = reinterpret_cast<const uint32_t *>(words_ + words() + 1);
+    samples_ = rank_ + blocks() + 1;
+}
+
+void succinct_bits::archive(archive_writer *writer, uint32_t id) const
+{
+    writer->add(id, &header_, sizeof(header_));
+    writer->add(id, words_, sizeof(uint64_t) * (words() + 1));
+    writer->add(id, rank_, sizeof(uint32_t)
+                           * (blocks() + 1 + header_.samples));
+}
+
+size_t succinct_bits::select0(size_t k) const
+{
+    size_t b = samples_[k / kSelectSample];
+    while (zeros_before(b + 1) <= k)
+        b++;
+    k -= zeros_before(b);
+
+    size_t w = b * (kBlockBits / 64);
+    for (;; w++) {
+        size_t zeros = 64 - __builtin_popcountll(words_[w]);
+        if (k < zeros)
+            break;
+        k -= zeros;
+    }
+    uint64_t x = ~words_[w];
+    size_t shift = 0;
+    for (;; shift += 8) {
+        size_t zeros = __builtin_popcountll((x >> shift) & 0xff);
+        if (k < zeros)
+            break;
+        k -= zeros;
+    }
+    x >>= shift;
+    while (k--)
+        x &= x - 1;
+    return w * 64 + shift + __builtin_ctzll(x);
+}
+
+// ************************************************************************
+// * Implementation of louds trie                                         *
+// ************************************************************************
+
+louds_trie::louds_trie(const trie &source)
+    :header_(NULL), labels_(NULL), values_(NULL), tails_(NULL), payload_(NULL),
+     flags_(NULL), mmap_(NULL), mmap_size_(0), ownership_(BORROW_MEMORY)
+{
+    std::vector<entry_type> entries;
+    std::vector<bool> payloads;
+    result_type result;
+    result_type::const_iterator it;
+    key_type empty("", 0);
+    size_t i;
+
+    source.prefix_search(empty, &result);
+    entries.reserve(result.size());
+    for (it = result.begin(); it != result.end(); it++) {
+        char buffer[256];
+        std::string storage;
+        size_t length;
+        const char *p = key_bytes(it->first, buffer, sizeof(buffer),
+                                  &storage, &length);
+        entries.push_back(entry_type(std::string(p, length), it->second));
+    }
+    std::sort(entries.begin(), entries.end());
+    entries.erase(std::unique(entries.begin(), entries.end()),
+                  entries.end());
+
+    // copy payload records to the same offsets, so values are kept
+    payloads.assign(entries.size(), false);
+    for (i = 0; i < entries.size(); i++) {
+        const char *payload;
+        size_t length;
+        key_type key(entries[i].first.data(), entries[i].first.size());
+        if (!source.search_payload(key, &payload, &length))
+            continue;
+        payloads[i] = true;
+        payload_heap::length_type len = length;
+        size_t offset = entries[i].second;
+        size_t end = offset + sizeof(len) + (length + sizeof(len) - 1)
+                                             / sizeof(len) * sizeof(len);
+        if (payload_buf_.size() < end)
+            payload_buf_.resize(end);
+        memcpy(&payload_buf_[offset], &len, sizeof(len));
+        memcpy(&payload_buf_[offset + sizeof(len)], payload, length);
+    }
+
+    header_ = new header_type();
+    memset(header_, 0, sizeof(header_type));
+    snprintf(header_->magic, sizeof(header_->magic), "%s", magic_);
+    flags_ = new payload_flags();
+    build_nodes(entries, payloads);
+    header_->keys = entries.size();
+    header_->payload_size = payload_buf_.size();
+    payload_ = new payload_heap(payload_buf_.empty()?NULL:&payload_buf_[0],
+                                payload_buf_.size());
+}
+
+louds_trie::louds_trie(const char *filename, const load_options &options)
+    :header_(NULL), labels_(NULL), values_(NULL), tails_(NULL), payload_(NULL),
+     flags_(NULL), mmap_(NULL), mmap_size_(0), ownership_(BORROW_MEMORY)
+{
+    struct timeval begin;
+
+    gettimeofday(&begin, NULL);
+    mmap_ = map_archive(filename, &mmap_size_, options);
+    try {
+        load(options, begin);
+    } catch (...) {
+        release_archive(mmap_, mmap_size_, ADOPT_MAPPING);
+        throw;
+    }
+    ownership_ = ADOPT_MAPPING;
+}
+
+louds_trie::louds_trie(const void *data, size_t size,
+                       ownership_type ownership, const load_options &options)
+    :header_(NULL), labels_(NULL), values_(NULL), tails_(NULL), payload_(NULL),
+     flags_(NULL), mmap_(NULL), mmap_size_(0), ownership_(BORROW_MEMORY)
+{
+    struct timeval begin;
+
+    gettimeofday(&begin, NULL);
+    check_archive_memory(data, size);
+    mmap_ = const_cast<void *>(data);
+    mmap_size_ = size;
+    load(options, begin);
+    ownership_ = ownership;
+}
+
+void louds_trie::load(const load_options &options, const struct timeval &begin)
+{
+    size_t length, flags_length;
+    const void *start, *flags;
+
+    archive_reader reader(mmap_, mmap_size_, options.verify);
+    if (strcmp(reader.type(), magic_))
+        throw bad_trie_archive("file magic error");
+    header_ = static_cast<header_type *>(const_cast<void *>(
+                  reader.require(SECTION_HEADER, sizeof(header_type))));
+    start = reader.require(SECTION_LOUDS, 0, &length);
+    louds_.attach(start, length);
+    start = reader.require(SECTION_TERMINAL, 0, &length);
+    terminal_.attach(start, length);
+    start = reader.require(SECTION_LINK, 0, &length);
+    tail_.attach(start, length);
+    start = reader.require(SECTION_TAIL_END, 0, &length);
+    tail_end_.attach(start, length);
+    if (louds_.size() != 2 * header_->nodes + 1
+        || terminal_.size() != header_->nodes
+        || tail_.size() != header_->nodes
+        || tail_end_.size() != header_->tail_size
+        || header_->value_bits > 32)
+        throw bad_trie_archive("file corrupted");
+    labels_ = static_cast<const uint8_t *>(
+                  reader.require(SECTION_LABEL, header_->nodes));
+    values_ = static_cast<const uint64_t *>(
+                  reader.require(SECTION_VALUE, sizeof(uint64_t)
+                                 * ((static_cast<uint64_t>(header_->keys)
+                                     * header_->value_bits + 63) / 64 + 1)));
+    tails_ = static_cast<const char *>(
+                 reader.require(SECTION_TAIL, header_->tail_size));
+    start = reader.section(SECTION_PAYLOAD, &length);
+    flags = reader.section(SECTION_PAYLOAD_FLAG, &flags_length);
+    // an archive having payloads has flags telling which values they are
+    if (start && length && !flags)
+        throw bad_trie_archive("file corrupted");
+    payload_ = new payload_heap(start, length);
+    flags_ = new payload_flags(flags, flags_length);
+    prepare_archive(mmap_, mmap_size_, &reader, options, begin);
+}
+louds_trie::~louds_trie()
+{
+    if (mmap_)
+        release_archive(mmap_, mmap_size_, ownership_);
+    else
+        delete header_;
+    delete payload_;
+    delete flags_;
+}
+
+void louds_trie::build_nodes(const std::vector<entry_type> &entries,
+                             const std::vector<bool> &payloads)
+{
+    /// Represents a node whose keys are entries[begin, end).
+    typedef struct {
+        size_t begin, end, depth;
+    } range_type;
+    std::vector<range_type> queue;
+    std::vector<value_type> values;
+    range_type root = {0, entries.size(), 0};
+    size_t i;
+
+    // super root
+    louds_.push(true);
+    louds_.push(false);
+    label_buf_.push_back(0);
+    queue.push_back(root);
+    // queue is never popped, nodes are numbered by their index in queue
+    for (size_t v = 0; v < queue.size(); v++) {
+        range_type node = queue[v];
+        bool terminal = node.begin < node.end
+                        && entries[node.begin].first.size() == node.depth;
+        if (v && node.end - node.begin == 1) {
+            // a single key below, keep the rest as tail
+            const std::string &key = entries[node.begin].first;
+            bool has_tail = key.size() > node.depth;
+            louds_.push(false);
+            terminal_.push(true);
+            tail_.push(has_tail);
+            flags_->set(values.size(), payloads[node.begin]);
+            values.push_back(entries[node.begin].second);
+            if (has_tail) {
+                tail_buf_.append(key, node.depth, std::string::npos);
+                for (i = node.depth + 1; i < key.size(); i++)
+                    tail_end_.push(true);
+                tail_end_.push(false);
+                header_->tails++;
+            }
+            continue;
+        }
+        terminal_.push(terminal);
+        tail_.push(false);
+        if (terminal) {
+            flags_->set(values.size(), payloads[node.begin]);
+            values.push_back(entries[node.begin].second);
+        }
+        for (i = node.begin + (terminal?1:0); i < node.end; ) {
+            uint8_t ch = entries[i].first[node.depth];
+            range_type next = {i, i, node.depth + 1};
+            while (next.end < node.end
+                   && static_cast<uint8_t>(entries[next.end].first[node.depth])
+                      == ch)
+                next.end++;
+            louds_.push(true);
+            label_buf_.push_back(ch);
+            queue.push_back(next);
+            i = next.end;
+        }
+        louds_.push(false);
+    }
+    louds_.freeze();
+    terminal_.freeze();
+    tail_.freeze();
+    tail_end_.freeze();
+    pack_values(values);
+
+    header_->nodes = queue.size();
+    header_->tail_size = tail_buf_.size();
+    labels_ = &label_buf_[0];
+    tails_ = tail_buf_.data();
+}
+
+void louds_trie::pack_values(const std::vector<value_type> &values)
+{
+    int64_t base = 0, range = 0;
+    size_t bits = 0, i;
+
+    if (!values.empty()) {
+        base = *std::min_element(values.begin(), values.end());
+        range = *std::max_element(values.begin(), values.end()) - base;
+    }
+    while (bits < 32 && (range >> bits))
+        bits++;
+    // one more word so that a value never straddles the end
+    value_buf_.assign((values.size() * bits + 63) / 64 + 1, 0);
+    for (i = 0; i < values.size() && bits; i++) {
+        uint64_t x = values[i] - base;
+        size_t pos = i * bits;
+        value_buf_[pos / 64] |= x << (pos % 64);
+        if (pos % 64 + bits > 64)
+            value_buf_[pos / 64 + 1] |= x >> (64 - pos % 64);
+    }
+    header_->value_base = base;
+    header_->value_bits = bits;
+    values_ = &value_buf_[0];
+}
+
+const char *louds_trie::key_bytes(const key_type &key, char *buffer,
+                                  size_t size, std::string *bytes,
+                                  size_t *length)
+{
+    size_t n;
+    for (n = 0; n < key.length() && key.data()[n] != key_type::kTerminator;
+         n++) {
+        // empty
+    }
+    if (n > size) {
+        bytes->resize(n);
+        buffer = &(*bytes)[0];
+    }
+    for (size_t i = 0; i < n; i++)
+        buffer[i] = key_type::char_out(key.data()[i]);
+    *length = n;
+    return buffer;
+}
+
+size_t louds_trie::child(size_t v, uint8_t ch) const
+{
+    size_t count, first = children(v, &count);
+    const uint8_t *begin = labels_ + first, *end = begin + count;
+    const uint8_t *p = std::lower_bound(begin, end, ch);
+    return (p != end && *p == ch)?p - labels_:0;
+}
+
+size_t louds_trie::find(const char *key, size_t length, size_t *depth) const
+{
+    size_t v = 0, i;
+    for (i = 0; i < length && !tail_.test(v); i++) {
+        if (!(v = child(v, key[i])))
+            break;
+    }
+    *depth = i;
+    return v;
+}
+
+void louds_trie::insert(const key_type &key, const value_type &value)
+{
+    throw std::runtime_error("louds_trie::insert: read-only trie");
+}
+
+bool louds_trie::search(const key_type &key, value_type *value) const
+{
+    size_t v;
+    if (!locate(key, &v))
+        return false;
+    if (value)
+        *value = this->value(v);
+    return true;
+}
+
+bool louds_trie::locate(const key_type &key, size_t *node) const
+{
+    char buffer[256];
+    std::string storage;
+    size_t size, depth, length;
+    const char *bytes = key_bytes(key, buffer, sizeof(buffer), &storage,
+                                  &size);
+    size_t v = find(bytes, size, &depth);
+    if (!v && depth < size)
+        return false;
+    if (tail_.test(v)) {
+        const char *t = tail(v, &length);
+        if (length != size - depth || memcmp(t, bytes + depth, length))
+            return false;
+    } else if (depth < size || !terminal_.test(v)) {
+        return false;
+    }
+    *node = v;
+    return true;
+}
+
+void louds_trie::collect(size_t v, std::string *prefix,
+                         result_type *result) const
+{
+    size_t count, first, length, i;
+
+    if (tail_.test(v)) {
+        const char *t = tail(v, &length);
+        size_t n = prefix->size();
+        prefix->append(t, length);
+        result->push_back(std::make_pair(key_type(prefix->data(),
+                                                  prefix->size()),
+                                         value(v)));
+        prefix->resize(n);
+        return;
+    }
+    if (terminal_.test(v))
+        result->push_back(std::make_pair(key_type(prefix->data(),
+                                                  prefix->size()),
+                                         value(v)));
+    first = children(v, &count);
+    for (i = first; i < first + count; i++) {
+        prefix->push_back(labels_[i]);
+        collect(i, prefix, result);
+        prefix->resize(prefix->size() - 1);
+    }
+}
+
+size_t louds_trie::prefix_search(const key_type &key,
+                                 result_type *result) const
+{
+    std::string storage, bytes;
+    size_t size, depth, length;
+    char buffer[256];
+    const char *p = key_bytes(key, buffer, sizeof(buffer), &storage, &size);
+    bytes.assign(p, size);
+    size_t v = find(bytes.data(), size, &depth);
+    if (!v && depth < size)
+        return result->size();
+    if (depth < bytes.size()) {
+        // the rest of prefix must be a prefix of the tail
+        const char *t = tail(v, &length);
+        if (length < bytes.size() - depth
+            || memcmp(t, bytes.data() + depth, bytes.size() - depth))
+            return result->size();
+        bytes.resize(depth);
+    }
+    collect(v, &bytes, result);
+    return result->size();
+}
+
+void louds_trie::archive(archive_writer *writer)
+{
+    writer->add(SECTION_HEADER, header_, sizeof(header_type));
+    louds_.archive(writer, SECTION_LOUDS);
+    terminal_.archive(writer, SECTION_TERMINAL);
+    tail_.archive(writer, SECTION_LINK);
+    tail_end_.archive(writer, SECTION_TAIL_END);
+    writer->add(SECTION_LABEL, labels_, header_->nodes);
+    writer->add(SECTION_VALUE, values_, sizeof(uint64_t)
+                * ((static_cast<uint64_t>(header_->keys)
+                    * header_->value_bits + 63) / 64 + 1));
+    writer->add(SECTION_TAIL, tails_, header_->tail_size);
+    if (header_->payload_size) {
+        writer->add(SECTION_PAYLOAD, payload_->data(), header_->payload_size);
+        flags_->archive(writer);
+    }
+}
+
+void louds_trie::serialize(int fd)
+{
+    archive_writer writer(magic_);
+    archive(&writer);
+    writer.write(fd);
+}
+
+void louds_trie::build(const char *filename, bool verbose)
+{
+    if (!filename)
+        throw std::runtime_error("can not save to file (null)");
+
+    archive_writer writer(magic_);
+    archive(&writer);
+    writer.write(filename);
+    if (verbose) {
+        std::cerr << "nodes = " << header_->nodes
+                  << ", keys = " << header_->keys
+                  << ", tails = " << header_->tails
+                  << ", louds = " << louds_.bytes() + terminal_.bytes()
+                                     + tail_.bytes()
+                  << ", labels = " << header_->nodes
+                  << ", values = " << header_->value_bits << " bits"
+                  << ", tail = " << header_->tail_size
+                                    + tail_end_.bytes()
+                  << std::endl;
+    }
+}
+
+void louds_trie::insert_payload(const key_type &key,
+                                const char *payload, size_t length)
+{
+    throw std::runtime_error("louds_trie::insert_payload: read-only trie");
+}
+
+bool louds_trie::search_payload(const key_type &key,
+                                const char **payload, size_t *length) const
+{
+    size_t v;
+    if (!locate(key, &v) || !flags_->test(terminal_.rank1(v)))
+        return false;
+    return payload_->get(value(v), payload, length);
+}
+
+void louds_trie::remap_labels(const size_t *frequency)
+{
+    throw std::runtime_error("louds_trie::remap_labels: read-only trie");
+}
+
+trie::stats_type louds_trie::stats() const
+{
+    // nodes have no states, depths are the lengths of the keys
+    stats_type stats = trie::stats();
+    stats.type = LOUDS_TRIE;
+    stats.tail_bytes = header_->tail_size;
+    if (mmap_) {
+        stats.bytes = mmap_size_;
+    } else {
+        stats.bytes = sizeof(header_type) + louds_.bytes()
+                      + terminal_.bytes() + tail_.bytes() + tail_end_.bytes()
+                      + header_->nodes
+                      + sizeof(uint64_t)
+                        * ((static_cast<uint64_t>(header_->keys)
+                            * header_->value_bits + 63) / 64 + 1)
+                      + header_->tail_size + header_->payload_size
+                      + flags_->size();
+    }
+    if (stats.keys)
+        stats.bytes_per_key = static_cast<double>(stats.bytes) / stats.keys;
+    return stats;
+}
+
+END_TRIE_NAMESPACE
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,388 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef LOUDS_TRIE_H_
+#define LOUDS_TRIE_H_
+
+/*
+ * Reference:
+ * [1] G.Jacobson Space-efficient Static Trees and Graphs
+ * [2] S.Vigna Broadword Implementation of Rank/Select Queries
+ *
+ */
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "trie.h"
+#include "trie_impl.h"
+#include "trie_archive.h"
+
+BEGIN_TRIE_NAMESPACE
+
+/**
+ * A static bit vector with rank and select support.
+ *
+ * Bits are appended by push() and the directories are built by freeze().
+ * A frozen vector can be stored in one archive section and be attached
+ * to it again without copying.
+ */
+class succinct_bits {
+  public:
+    /// Represents the header of an archived bit vector.
+    typedef struct {
+        uint64_t size;     ///< Number of bits.
+        uint64_t ones;     ///< Number of 1 bits.
+        uint64_t samples;  ///< Number of select samples.
+        uint64_t unused;   ///< Unused, for 32/64 bits compatible.
+    } header_type;
+
+    /// Number of bits covered by an entry of rank directory.
+    static const size_t kBlockBits = 256;
+
+    /// Number of 0 bits between two select samples.
+    static const size_t kSelectSample = 256;
+
+    /// Constructs an empty succinct_bits.
+    succinct_bits();
+
+    /// Appends a bit.
+    void push(bool bit)
+    {
+        if (header_.size % 64 == 0)
+            bits_.push_back(0);
+        if (bit) {
+            bits_.back() |= static_cast<uint64_t>(1) << (header_.size % 64);
+            header_.ones++;
+        }
+        header_.size++;
+    }
+
+    /// Builds rank directory and select samples.
+    void freeze();
+
+    /**
+     * Attaches to an archived bit vector.
+     *
+     * @param data Pointer to the archived bit vector.
+     * @param length Length of the archived bit vector.
+     */
+    void attach(const void *data, size_t length);
+
+    /**
+     * Adds the bit vector to an archive as a section.
+     *
+     * @param writer The archive writer.
+     * @param id Section identifier.
+     */
+    void archive(archive_writer *writer, uint32_t id) const;
+
+    /// Returns the (i)th bit.
+    bool test(size_t i) const
+    {
+        return (words_[i / 64] >> (i % 64)) & 1;
+    }
+
+    /// Returns the number of 1 bits in [0, i).
+    size_t rank1(size_t i) const
+    {
+        size_t w = i / 64, r = rank_[i / kBlockBits];
+        for (size_t k = i / kBlockBits * (kBlockBits / 64); k < w; k++)
+            r += __builtin_popcountll(words_[k]);
+        if (i % 64)
+            r += __builtin_popcountll(words_[w]
+                                      << (64 - i % 64));
+        return r;
+    }
+
+    /// Returns the position of the (k)th 0 bit, counting from 0.
+    size_t select0(size_t k) const;
+
+    /// Returns the position of the first 0 bit at or after i.
+    size_t next_zero(size_t i) const
+    {
+        size_t w = i / 64;
+        uint64_t x = ~words_[w] >> (i % 64);
+        if (x)
+            return i + __builtin_ctzll(x);
+        for (w++; !~words_[w]; w++) {
+            // empty
+        }
+        return w * 64 + __builtin_ctzll(~words_[w]);
+    }
+
+    /// Returns the number of bits.
+    size_t size() const
+    {
+        return header_.size;
+    }
+
+    /// Returns the number of bytes used by bits and directories.
+    size_t bytes() const
+    {
+        return sizeof(uint64_t) * words() + sizeof(uint32_t)
+               * (blocks() + 1 + header_.samples);
+    }
+
+  private:
+    /// Constructs a copy, not allowed.
+    succinct_bits(const succinct_bits &);
+
+    /// Copies a succinct_bits, not allowed.
+    succinct_bits &operator=(const succinct_bits &);
+
+    /// Returns the number of 64-bit words.
+    size_t words() const
+    {
+        return (header_.size + 63) / 64;
+    }
+
+    /// Returns the number of rank blocks.
+    size_t blocks() const
+    {
+        return (header_.size + kBlockBits - 1) / kBlockBits;
+    }
+
+    /// Returns the number of 0 bits before block b.
+    size_t zeros_before(size_t b) const
+    {
+        return b * kBlockBits - rank_[b];
+    }
+
+    header_type header_;            ///< Sizes of the bit vector.
+    const uint64_t *words_;         ///< Pointer to bits.
+    const uint32_t *rank_;          ///< Ones before each block.
+    const uint32_t *samples_;       ///< Block of every kSelectSample zeros.
+    std::vector<uint64_t> bits_;    ///< Bits while building.
+    std::vector<uint32_t> directory_; ///< Directories while building.
+};
+
+/**
+ * A read-only trie encoded by LOUDS(Level-Order Unary Degree Sequence).
+ *
+ * Nodes are numbered in breadth-first order. Each node is described by
+ * its degree in unary, so the tree takes about two bits per node plus
+ * one byte for the label of the incoming edge. A node whose subtree holds
+ * a single key keeps the rest of the key as a tail instead of a chain of
+ * nodes.
+ *
+ * A louds_trie can not be changed once it is built. It is created from
+ * another trie or loaded from an archive. Values are packed in as few
+ * bits as the range of values needs.
+ */
+class louds_trie: public trie {
+  public:
+    /**
+     * Represents information about louds_trie.
+     */
+    typedef struct {
+        char magic[16];      ///< Archive magic.
+        uint32_t nodes;      ///< Number of nodes.
+        uint32_t keys;       ///< Number of keys.
+        uint32_t tails;      ///< Number of tails.
+        uint32_t tail_size;  ///< Size of all tails in bytes.
+        uint32_t payload_size; ///< Size of payload heap.
+        int32_t value_base;  ///< Minimal value.
+        uint32_t value_bits; ///< Width of a packed value in bits.
+        char unused[20];     ///< Unused, for 32/64 bits compatible.
+    } header_type;
+
+    /**
+     * Constructs a louds_trie holding all keys of another trie.
+     *
+     * @param source The trie to be copied.
+     */
+    explicit louds_trie(const trie &source);
+
+    /**
+     * Constructs a louds_trie from archive.
+     *
+     * @param filename Filename of the archive.
+     * @param options Options for loading the archive.
+     */
+    explicit louds_trie(const char *filename,
+                        const load_options &options = load_options());
+
+    /**
+     * Constructs a louds_trie from archive in memory, without copying.
+     *
+     * @param data Pointer to the archive.
+     * @param size Size of the archive.
+     * @param ownership Who releases the memory, it applies only if
+     *                  constructing succeeds.
+     * @param options Options for loading the archive.
+     */
+    louds_trie(const void *data, size_t size, ownership_type ownership,
+               const load_options &options = load_options());
+
+    /// Destructs a louds_trie.
+    ~louds_trie();
+
+    void insert(const key_type &key, const value_type &value);
+    bool search(const key_type &key, value_type *value) const;
+    size_t prefix_search(const key_type &key, result_type *result) const;
+    void build(const char *filename, bool verbose = false);
+    void serialize(int fd);
+    void insert_payload(const key_type &key,
+                        const char *payload, size_t length);
+    bool search_payload(const key_type &key,
+                        const char **payload, size_t *length) const;
+    void remap_labels(const size_t *frequency);
+    stats_type stats() const;
+
+  private:
+    /// Represents a key being built.
+    typedef std::pair<std::string, value_type> entry_type;
+
+    /// Constructs a copy, not allowed.
+    louds_trie(const louds_trie &);
+
+    /// Copies a louds_trie, not allowed.
+    louds_trie &operator=(const louds_trie &);
+
+    /**
+     * Builds all nodes from sorted and unique entries.
+     *
+     * @param entries The entries.
+     * @param payloads true for entries whose value refers to a payload.
+     */
+    void build_nodes(const std::vector<entry_type> &entries,
+                     const std::vector<bool> &payloads);
+
+    /// Returns the first child of node v and number of its children.
+    size_t children(size_t v, size_t *count) const
+    {
+        size_t p = louds_.select0(v) + 1;
+        *count = louds_.next_zero(p) - p;
+        return p - v - 1;
+    }
+
+    /// Returns the child of node v labeled by ch, 0 if not exists.
+    size_t child(size_t v, uint8_t ch) const;
+
+    /// Returns tail of node v, which must have one.
+    const char *tail(size_t v, size_t *length) const
+    {
+        size_t t = tail_.rank1(v);
+        size_t begin = t?tail_end_.select0(t - 1) + 1:0;
+        *length = tail_end_.next_zero(begin) - begin + 1;
+        return tails_ + begin;
+    }
+
+    /// Returns value of node v, which must be terminal.
+    value_type value(size_t v) const
+    {
+        size_t bits = header_->value_bits;
+        if (!bits)
+            return header_->value_base;
+        size_t pos = terminal_.rank1(v) * bits;
+        uint64_t x = values_[pos / 64] >> (pos % 64);
+        if (pos % 64 + bits > 64)
+            x |= values_[pos / 64 + 1] << (64 - pos % 64);
+        x &= (static_cast<uint64_t>(1) << bits) - 1;
+        return static_cast<value_type>(header_->value_base
+                                       + static_cast<int64_t>(x));
+    }
+
+    /// Packs values of terminal nodes in value_buf_.
+    void pack_values(const std::vector<value_type> &values);
+
+    /**
+     * Finds the node which key goes to.
+     *
+     * @param key Bytes of the key.
+     * @param length Length of the key.
+     * @param[out] depth Number of key bytes consumed by nodes.
+     * @return The node, 0 if key does not exist.
+     */
+    size_t find(const char *key, size_t length, size_t *depth) const;
+
+    /**
+     * Finds the terminal node of a key.
+     *
+     * @param key The key.
+     * @param[out] node The node.
+     * @return false if key does not exist.
+     */
+    bool locate(const key_type &key, size_t *node) const;
+
+    /// Collects all keys in the subtree of node v.
+    void collect(size_t v, std::string *prefix, result_type *result) const;
+
+    /**
+     * Converts a key_type to bytes.
+     *
+     * @param key The key.
+     * @param[out] buffer Buffer for short keys.
+     * @param size Size of the buffer.
+     * @param[out] bytes Storage for long keys.
+     * @param[out] length Length of the bytes.
+     * @return Pointer to the bytes.
+     */
+    static const char *key_bytes(const key_type &key, char *buffer,
+                                 size_t size, std::string *bytes,
+                                 size_t *length);
+
+    header_type *header_;           ///< Pointer to header.
+    succinct_bits louds_;           ///< Degrees of all nodes.
+    succinct_bits terminal_;        ///< Nodes where a key ends.
+    succinct_bits tail_;            ///< Nodes having a tail.
+    succinct_bits tail_end_;        ///< Last bytes of tails, as 0 bits.
+    const uint8_t *labels_;         ///< Label of incoming edge of nodes.
+    const uint64_t *values_;        ///< Packed values of terminal nodes.
+    const char *tails_;             ///< All tails.
+    payload_heap *payload_;         ///< Heap of payloads referred by values.
+    payload_flags *flags_;          ///< Payload flags by terminal rank.
+
+    /// Buffers while building.
+    std::vector<uint8_t> label_buf_;
+    std::vector<uint64_t> value_buf_;
+    std::string tail_buf_;
+    std::vector<char> payload_buf_;
+
+    void *mmap_;          ///< Pointer to mmapped buffer.
+    size_t mmap_size_;    ///< Length of mmapped buffer.
+    ownership_type ownership_;  ///< Who releases mmap_.
+
+    /// Loads the archive in mmap_ and makes it ready as options asks for.
+    void load(const load_options &options, const struct timeval &begin);
+
+    /// Adds all sections of the trie to writer.
+    void archive(archive_writer *writer);
+
+    /// Archive magic
+    static const char magic_[16];
+};
+
+END_TRIE_NAMESPACE
+
+#endif  // LOUDS_TRIE_H_
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#include <pthread.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <string>
+#include <stdexcept>
+
+#include "sharded_trie.h"
+
+BEGIN_TRIE_NAMESPACE
+
+/**
+ * Represents a shard: its keys and the lock taken by inserts.
+ */
+struct sharded_trie::shard_type {
+    trie *values;    ///< Inserted keys and their values.
+    mutable pthread_mutex_t mutex;  ///< Serializes updates.
+
+    /// Constructs an empty shard.
+    shard_type()
+        :values(trie::create_trie(DOUBLE_TRIE))
+    {
+        values->set_concurrent(true);
+        pthread_mutex_init(&mutex, NULL);
+    }
+
+    /// Destructs a shard.
+    ~shard_type()
+    {
+        delete values;
+        pthread_mutex_destroy(&mutex);
+    }
+};
+
+/// Holds a mutex while it is alive.
+class mutex_guard {
+  public:
+    /// Locks a mutex.
+    explicit mutex_guard(pthread_mutex_t *mutex)
+        :mutex_(mutex)
+    {
+        pthread_mutex_lock(mutex_);
+    }
+
+    /// Unlocks the mutex.
+    ~mutex_guard()
+    {
+        pthread_mutex_unlock(mutex_);
+    }
+
+  private:
+    /// Constructs a copy, not allowed.
+    mutex_guard(const mutex_guard &);
+
+    /// Copies a mutex_guard, not allowed.
+    mutex_guard &operator=(const mutex_guard &);
+
+    pthread_mutex_t *mutex_;  ///< The mutex.
+};
+
+/// Returns the bytes of a key found by prefix_search().
+static std::string key_string(const trie::key_type &key)
+{
+    std::string bytes;
+    for (size_t i = 0; i < key.length()
+                       && key.data()[i] != trie::key_type::kTerminator; i++)
+        bytes.push_back(trie::key_type::char_out(key.data()[i]));
+    return bytes;
+}
+
+sharded_trie::sharded_trie(size_t shards, size_t prefix_length,
+                           trie_type type)
+    :prefix_length_(prefix_length), type_(type)
+{
+    if (!shards)
+        throw std::runtime_error("sharded_trie: no shard");
+    try {
+        for (size_t i = 0; i < shards; i++)
+            shards_.push_back(new shard_type());
+    } catch (...) {
+        for (size_t i = 0; i < shards_.size(); i++)
+            delete shards_[i];
+        throw;
+    }
+}
+
+sharded_trie::~sharded_trie()
+{
+    for (size_t i = 0; i < shards_.size(); i++)
+        delete shards_[i];
+}
+
+size_t sharded_trie::shard_of(const key_type &key) const
+{
+    // FNV-1a over the leading bytes, keys found by prefix_search() end
+    // in terminators which are not part of them
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < prefix_length_ && i < key.length()
+                       && key.data()[i] != key_type::kTerminator; i++) {
+        hash ^= static_cast<uint32_t>(key.data()[i]);
+        hash *= 16777619U;
+    }
+    return hash % shards_.size();
+}
+
+void sharded_trie::insert(const key_type &key, const value_type &value)
+{
+    shard_type *shard = shards_[shard_of(key)];
+    mutex_guard guard(&shard->mutex);
+    shard->values->insert(key, value);
+}
+
+bool sharded_trie::search(const key_type &key, value_type *value) const
+{
+    return shards_[shard_of(key)]->values->search(key, value);
+}
+
+void sharded_trie::insert_payload(const key_type &key,
+                                  const char *payload, size_t length)
+{
+    shard_type *shard = shards_[shard_of(key)];
+    mutex_guard guard(&shard->mutex);
+    shard->values->insert_payload(key, payload, length);
+}
+
+bool sharded_trie::search_payload(const key_type &key,
+                                  const char **payload, size_t *length) const
+{
+    return shards_[shard_of(key)]->values->search_payload(key, payload,
+                                                           length);
+}
+
+size_t sharded_trie::prefix_search(const key_type &key,
+                                   result_type *result) const
+{
+    size_t length = 0;
+    while (length < key.length()
+           && key.data()[length] != key_type::kTerminator)
+        length++;
+    // keys sharing a hashed prefix share a shard
+    if (length >= prefix_length_)
+        return shards_[shard_of(key)]->values->prefix_search(key, result);
+    for (size_t i = 0; i < shards_.size(); i++)
+        shards_[i]->values->prefix_search(key, result);
+    return result->size();
+}
+
+void sharded_trie::build(const char *filename, bool verbose)
+{
+    trie *merged = merge();
+    try {
+        merged->build(filename, verbose);
+    } catch (...) {
+        delete merged;
+        throw;
+    }
+    delete merged;
+}
+
+void sharded_trie::serialize(int fd)
+{
+    trie *merged = merge();
+    try {
+        merged->serialize(fd);
+    } catch (...) {
+        delete merged;
+        throw;
+    }
+    delete merged;
+}
+
+void sharded_trie::remap_labels(const size_t *frequency)
+{
+    for (size_t i = 0; i < shards_.size(); i++) {
+        mutex_guard guard(&shards_[i]->mutex);
+        shards_[i]->values->remap_labels(frequency);
+    }
+    frequency_.assign(frequency, frequency + 256);
+}
+
+void sharded_trie::reclaim()
+{
+    for (size_t i = 0; i < shards_.size(); i++) {
+        mutex_guard guard(&shards_[i]->mutex);
+        shards_[i]->values->reclaim();
+    }
+}
+
+/// Represents a key of a shard found by merge().
+struct shard_key {
+    std::string bytes;         ///< Bytes of the key.
+    size_t shard;              ///< The shard.
+    trie::value_type value;    ///< Value of the key.
+
+    /// Orders keys by their bytes.
+    bool operator<(const shard_key &rhs) const
+    {
+        return bytes < rhs.bytes;
+    }
+};
+
+void sharded_trie::copy_shards(trie *target) const
+{
+    std::vector<shard_key> keys;
+    trie::result_type found;
+    trie::result_type::const_iterator it;
+    trie::key_type empty("", 0);
+    const char *payload;
+    size_t length;
+
+    for (size_t i = 0; i < shards_.size(); i++) {
+        found.clear();
+        shards_[i]->values->prefix_search(empty, &found);
+        for (it = found.begin(); it != found.end(); it++) {
+            shard_key key = {key_string(it->first), i, it->second};
+            keys.push_back(key);
+        }
+    }
+    // two tries take sorted keys much faster than runs of sorted keys
+    std::sort(keys.begin(), keys.end());
+    std::vector<shard_key>::const_iterator k;
+    for (k = keys.begin(); k != keys.end(); k++) {
+        const shard_type *shard = shards_[k->shard];
+        key_type key(k->bytes.data(), k->bytes.size());
+        if (shard->values->search_payload(key, &payload, &length))
+            target->insert_payload(key, payload, length);
+        else
+            target->insert(key, k->value);
+    }
+}
+
+trie *sharded_trie::merge() const
+{
+    trie *merged = trie::create_trie(type_ == SINGLE_TRIE?SINGLE_TRIE
+                                                         :DOUBLE_TRIE);
+    size_t i;
+
+    for (i = 0; i < shards_.size(); i++)
+        pthread_mutex_lock(&shards_[i]->mutex);
+    try {
+        if (!frequency_.empty())
+            merged->remap_labels(&frequency_[0]);
+        copy_shards(merged);
+    } catch (...) {
+        for (i = 0; i < shards_.size(); i++)
+            pthread_mutex_unlock(&shards_[i]->mutex);
+        delete merged;
+        throw;
+    }
+    for (i = 0; i < shards_.size(); i++)
+        pthread_mutex_unlock(&shards_[i]->mutex);
+    if (type_ == LOUDS_TRIE) {
+        trie *louds;
+        try {
+            louds = trie::create_trie(*merged, LOUDS_TRIE);
+        } catch (...) {
+            delete merged;
+            throw;
+        }
+        delete merged;
+        merged = louds;
+    }
+    return merged;
+}
+
+END_TRIE_NAMESPACE
+
+// vim: ts=4 sw=4 ai et
@@ -30,52 +30,114 @@
 #include <stdint.h>
 #include <limits.h>
 
+#include <algorithm>
 #include <iostream>
 #include <cstdlib>
 #include <cstdio>
 
 #include "trie.h"
 #include "trie_impl.h"
+#include "louds_trie.h"
 
 BEGIN_TRIE_NAMESPACE
 
-static trie::trie_type find_archive_type(const char *archive)
+/**
+ * Gets the magic of an archive from its beginning. For a sectioned
+ * archive, it is the magic of the trie stored in it.
+ *
+ * @param data Beginning of the archive.
+ * @param length Length of data.
+ * @param[out] magic Buffer of the magic, it will be NUL-terminated.
+ * @param size Size of the buffer.
+ */
+static void get_archive_magic(const void *data, size_t length,
+                              char *magic, size_t size)
+{
+    memset(magic, 0, size);
+    if (archive_reader::match(data, length))
+        memcpy(magic, static_cast<const archive_header *>(data)->type,
+               std::min(size, sizeof(archive_header().type)) - 1);
+    else
+        memcpy(magic, data, std::min(size, length + 1) - 1);
+}
+
+/**
+ * Reads the magic of an archive file.
+ *
+ * @param archive The filename of the archive.
+ * @param[out] magic Buffer of the magic, it will be NUL-terminated.
+ * @param size Size of the buffer.
+ */
+static void read_archive_magic(const char *archive, char *magic, size_t size)
 {
     FILE *fp;
-    char magic[16] = {0};
+    archive_header header;
+    size_t n;
+
+    memset(&header, 0, sizeof(header));
     if ((fp = fopen(archive, "r"))) {
-        size_t length = fread(magic, 1, sizeof(magic) / sizeof(char) - 1, fp);
+        n = fread(&header, 1, sizeof(header), fp);
         fclose(fp);
-        if (strncmp(magic, "TWO_TRIE", length) == 0)
-            return trie::DOUBLE_TRIE;
-        else if (strncmp(magic, "TAIL_TRIE", length) == 0)
-            return trie::SINGLE_TRIE;
-        else
-            return trie::UNKNOW;
     } else {
         throw bad_trie_archive("file error");
     }
+    get_archive_magic(&header, n, magic, size);
 }
 
 trie* trie::create_trie(trie_type type, size_t size)
 {
-    if (type == SINGLE_TRIE)
+    if (type == LOUDS_TRIE)
+        throw std::runtime_error("louds trie is read-only, "
+                                 "create it from another trie");
+    else if (type == SINGLE_TRIE)
         return new single_trie(size);
     else
         return new double_trie(size);
 }
 
-trie* trie::create_trie(const char *archive)
+trie* trie::create_trie(const char *archive, const load_options &options)
 {
-    trie_type type = find_archive_type(archive);
-    if (type  == SINGLE_TRIE)
-        return new single_trie(archive);
-    else if (type == DOUBLE_TRIE)
-        return new double_trie(archive);
+    char magic[16];
+    read_archive_magic(archive, magic, sizeof(magic));
+    if (strcmp(magic, "TAIL_TRIE_16") == 0)
+        return new single_trie(archive, options);
+    else if (strcmp(magic, "TAIL_TRIE") == 0)
+        return new wide_single_trie(archive, options);
+    else if (strcmp(magic, "TWO_TRIE") == 0)
+        return new double_trie(archive, options);
+    else if (strcmp(magic, "LOUDS_TRIE") == 0)
+        return new louds_trie(archive, options);
     else
         throw bad_trie_archive("file magic error");
 }
 
+trie* trie::create_trie_from_memory(const void *data, size_t size,
+                                   ownership_type ownership,
+                                   const load_options &options)
+{
+    char magic[16];
+    check_archive_memory(data, size);
+    get_archive_magic(data, size, magic, sizeof(magic));
+    if (strcmp(magic, "TAIL_TRIE_16") == 0)
+        return new single_trie(data, size, ownership, options);
+    else if (strcmp(magic, "TAIL_TRIE") == 0)
+        return new wide_single_trie(data, size, ownership, options);
+    else if (strcmp(magic, "TWO_TRIE") == 0)
+        return new double_trie(data, size, ownership, options);
+    else if (strcmp(magic, "LOUDS_TRIE") == 0)
+        return new louds_trie(data, size, ownership, options);
+    else
+        throw bad_trie_archive("file magic error");
+}
+
+trie* trie::create_trie(const trie &source, trie_type type)
+{
+    if (type == LOUDS_TRIE)
+        return new louds_trie(source);
+    else
+        throw std::runtime_error("can only create louds trie from a trie");
+}
+
 void trie::insert(const char *inputs, size_t length,
                             value_type value)
 {
@@ -90,7 +152,87 @@ bool trie::search(const char *inputs, size_t length,
     return search(key, value);
 }
 
-void trie::read_from_text(const char *source, bool verbose)
+void trie::set_filter(size_t bits_per_key)
+{
+    // searched without a filter
+}
+
+void trie::set_root_table(bool enable)
+{
+    // searched from the root
+}
+
+void trie::set_compress_chains(bool enable)
+{
+    // a state per label
+}
+
+void trie::set_relayout(bool enable)
+{
+    // no states to renumber
+}
+
+void trie::profile(const key_type &key)
+{
+    // nor to count
+}
+
+void trie::set_concurrent(bool concurrent)
+{
+    // nothing is updated in a read-only trie
+}
+
+void trie::reclaim()
+{
+}
+
+trie::stats_type trie::stats() const
+{
+    stats_type stats;
+    result_type result;
+    size_t depth = 0;
+    prefix_search(key_type("", 0), &result);
+    for (size_t i = 0; i < result.size(); i++) {
+        const key_type &key = result[i].first;
+        size_t length = key.length();
+        // keys found may keep their terminators
+        while (length && key.data()[length - 1] == key_type::kTerminator)
+            length--;
+        depth += length;
+        stats.max_depth = std::max(stats.max_depth, length);
+    }
+    stats.keys = result.size();
+    if (stats.keys)
+        stats.average_depth = static_cast<double>(depth) / stats.keys;
+    return stats;
+}
+
+/**
+ * Counts occurrences of each byte in keys of a formatted text file.
+ *
+ * @param file The text file.
+ * @param fmt Format of a line.
+ * @param[out] frequency Occurrences of each byte, 256 elements.
+ * @return Number of the first line not matching fmt, 0 if all do.
+ */
+static size_t count_labels(FILE *file, const char *fmt, size_t *frequency)
+{
+    char cstr[LINE_MAX];
+    int val;
+    size_t lineno = 0;
+
+    memset(frequency, 0, 256 * sizeof(size_t));
+    while (!feof(file)) {
+        ++lineno;
+        if (fscanf(file, fmt, &val, cstr) != 2)
+            return lineno;
+        for (const char *p = cstr; *p; p++)
+            frequency[static_cast<unsigned char>(*p)]++;
+    }
+    return 0;
+}
+
+void trie::read_from_text(const char *source, bool verbose, bool remap)
 {
     FILE *file;
     if ((file = fopen(source, "r"))) {
@@ -102,9 +244,31 @@ void trie::read_from_text(const char *source, bool verbose)
         struct timezone tz;
         struct timeval total = {0, 0}, tv[2];
 
+        // leave room for the NUL scanf appends
+        snprintf(fmt, LINE_MAX, "%%d %%%d[^\n] ", LINE_MAX - 1);
+        if (remap) {
+            size_t frequency[256];
+            if ((lineno = count_labels(file, fmt, frequency))) {
+                fclose(file);
+                if (verbose) {
+                    std::cerr << "build_trie: format error at line "
+                              << lineno
+                              << std::endl;
+                }
+                throw bad_trie_source("format error");
+            }
+            remap_labels(frequency);
+            rewind(file);
+            if (verbose) {
+                size_t distinct = 0;
+                for (size_t i = 0; i < 256; i++)
+                    distinct += frequency[i]?1:0;
+                std::cerr << "remapped " << distinct << " distinct labels"
+                          << std::endl;
+            }
+        }
         if (verbose)
             std::cerr <<  "building";
-        snprintf(fmt, LINE_MAX, "%%d %%%d[^\n] ", LINE_MAX);
         while (!feof(file)) {
             if (verbose && lineno > 0) {
                 if (lineno % 500 == 0)
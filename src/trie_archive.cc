@@ -0,0 +1,571 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define HAVE_CRC32C_SSE42 1
+#  include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#  define HAVE_CRC32C_ARMV8 1
+#  include <arm_acle.h>
+#endif
+
+#include "trie_archive.h"
+
+BEGIN_TRIE_NAMESPACE
+
+/// CRC32C polynomial in reversed bit order.
+static const uint32_t kCrc32cPoly = 0x82f63b78;
+
+/// Lookup table of the software CRC32C, built at static initialization.
+static class crc32c_table {
+  public:
+    crc32c_table()
+    {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1)?(c >> 1) ^ kCrc32cPoly:c >> 1;
+            table_[i] = c;
+        }
+    }
+
+    uint32_t operator[](size_t i) const
+    {
+        return table_[i];
+    }
+
+  private:
+    uint32_t table_[256];
+} crc32c_lookup;
+
+/**
+ * Computes CRC32C byte by byte. It is the fallback when the CPU does not
+ * have a CRC32 instruction.
+ */
+static uint32_t crc32c_software(uint32_t crc, const uint8_t *p, size_t length)
+{
+    while (length--)
+        crc = crc32c_lookup[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(HAVE_CRC32C_SSE42)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware(uint32_t crc, const uint8_t *p, size_t length)
+{
+    for (; length && (reinterpret_cast<uintptr_t>(p) & 7); length--)
+        crc = _mm_crc32_u8(crc, *p++);
+#if defined(__x86_64__)
+    uint64_t c = crc;
+    for (; length >= 8; length -= 8, p += 8)
+        c = _mm_crc32_u64(c, *reinterpret_cast<const uint64_t *>(p));
+    crc = static_cast<uint32_t>(c);
+#endif
+    for (; length >= 4; length -= 4, p += 4)
+        crc = _mm_crc32_u32(crc, *reinterpret_cast<const uint32_t *>(p));
+    while (length--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+
+static bool has_crc32c_hardware()
+{
+    static int supported = -1;
+    if (supported < 0)
+        supported = __builtin_cpu_supports("sse4.2")?1:0;
+    return supported;
+}
+#elif defined(HAVE_CRC32C_ARMV8)
+static uint32_t crc32c_hardware(uint32_t crc, const uint8_t *p, size_t length)
+{
+    for (; length && (reinterpret_cast<uintptr_t>(p) & 7); length--)
+        crc = __crc32cb(crc, *p++);
+    for (; length >= 8; length -= 8, p += 8)
+        crc = __crc32cd(crc, *reinterpret_cast<const uint64_t *>(p));
+    while (length--)
+        crc = __crc32cb(crc, *p++);
+    return crc;
+}
+
+static bool has_crc32c_hardware()
+{
+    return true;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length)
+{
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    crc = ~crc;
+#if defined(HAVE_CRC32C_SSE42) || defined(HAVE_CRC32C_ARMV8)
+    if (has_crc32c_hardware())
+        return ~crc32c_hardware(crc, p, length);
+#endif
+    return ~crc32c_software(crc, p, length);
+}
+
+/// Rounds offset up to a multiple of align.
+static uint64_t align_offset(uint64_t offset, uint32_t align)
+{
+    return (offset + align - 1) / align * align;
+}
+
+/// Computes checksum of an archive header and its section table.
+static uint32_t header_checksum(const archive_header *header,
+                                const section_entry *table)
+{
+    archive_header copy = *header;
+    copy.crc = 0;
+    uint32_t crc = crc32c(0, &copy, sizeof(copy));
+    return crc32c(crc, table, sizeof(section_entry) * header->section_count);
+}
+
+void *map_archive(const char *filename, size_t *size,
+                  const trie::load_options &options)
+{
+    struct stat sb;
+    int fd, retval, error = 0, flags = MAP_PRIVATE;
+    void *start = MAP_FAILED;
+
+    if (!filename)
+        throw std::runtime_error("can not load from file (null)");
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error(strerror(errno));
+    if (fstat(fd, &sb) < 0) {
+        error = errno;
+    } else {
+#ifdef MAP_POPULATE
+        if (options.populate)
+            flags |= MAP_POPULATE;
+#endif
+        start = mmap(NULL, sb.st_size, PROT_READ, flags, fd, 0);
+        if (start == MAP_FAILED)
+            error = errno;
+    }
+    // the mapping keeps the file, fd is closed either way
+    while (retval = close(fd), retval == -1 && errno == EINTR) {
+        // exmpty
+    }
+    if (start == MAP_FAILED)
+        throw std::runtime_error(strerror(error));
+    *size = sb.st_size;
+    return start;
+}
+
+void check_archive_memory(const void *data, size_t size)
+{
+    if (!data)
+        throw bad_trie_archive("archive is null");
+    if (reinterpret_cast<uintptr_t>(data) % sizeof(uint64_t))
+        throw bad_trie_archive("archive is misaligned");
+    if (size < sizeof(uint64_t))
+        throw bad_trie_archive("file corrupted");
+}
+
+void release_archive(void *data, size_t size, trie::ownership_type ownership)
+{
+    // called from destructors, munmap only fails on a bad range
+    if (ownership == trie::ADOPT_MAPPING)
+        munmap(data, size);
+    else if (ownership == trie::ADOPT_MALLOC)
+        free(data);
+}
+
+/// Converts advice_type to advice of madvise(2).
+static int madvise_advice(trie::advice_type advice)
+{
+    switch (advice) {
+        case trie::ADVICE_RANDOM:
+            return MADV_RANDOM;
+        case trie::ADVICE_SEQUENTIAL:
+            return MADV_SEQUENTIAL;
+        case trie::ADVICE_WILLNEED:
+            return MADV_WILLNEED;
+        default:
+            return MADV_NORMAL;
+    }
+}
+
+/// Advises the kernel about pages covering [data + offset, + length).
+static void advise_range(char *data, size_t offset, size_t length,
+                         int advice)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t begin = offset / page * page;
+    if (length)
+        madvise(data + begin, offset + length - begin, advice);
+}
+
+/// Represents pages touched by a warm-up thread.
+typedef struct {
+    const char *begin;  ///< First byte.
+    const char *end;    ///< One past the last byte.
+    size_t page;        ///< Page size.
+    size_t sum;         ///< Sum of touched bytes, keeps reads alive.
+} warmup_type;
+
+/// Touches a byte of every page in a warm-up range.
+static void *warmup_pages(void *arg)
+{
+    warmup_type *range = static_cast<warmup_type *>(arg);
+    const volatile char *p;
+    for (p = range->begin; p < range->end; p += range->page)
+        range->sum += *p;
+    return NULL;
+}
+
+/// Touches every page of [data, data + size) from threads.
+static void warmup_archive(const char *data, size_t size, int threads)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t pages = (size + page - 1) / page;
+    size_t chunk = (pages + threads - 1) / threads * page;
+    std::vector<warmup_type> ranges(threads);
+    std::vector<pthread_t> tids(threads);
+    int i, started = 0;
+
+    for (i = 0; i < threads; i++) {
+        warmup_type range = {data + std::min(size, chunk * i),
+                             data + std::min(size, chunk * (i + 1)),
+                             page, 0};
+        ranges[i] = range;
+    }
+    // the calling thread takes the first range itself
+    for (i = 1; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, warmup_pages, &ranges[i]))
+            break;
+        started++;
+    }
+    warmup_pages(&ranges[0]);
+    for (i = started + 1; i < threads; i++)
+        warmup_pages(&ranges[i]);
+    for (i = 1; i <= started; i++)
+        pthread_join(tids[i], NULL);
+}
+
+/// Counts bytes of [data, data + size) resident in memory.
+static size_t resident_bytes(void *data, size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> pages((size + page - 1) / page);
+    size_t i, resident = 0;
+
+    if (pages.empty() || mincore(data, size, &pages[0]) < 0)
+        return 0;
+    for (i = 0; i < pages.size(); i++) {
+        if (pages[i] & 1)
+            resident += page;
+    }
+    return std::min(resident, size);
+}
+
+void prepare_archive(void *data, size_t size, const archive_reader *reader,
+                     const trie::load_options &options,
+                     const struct timeval &start)
+{
+    char *base = static_cast<char *>(data);
+
+    if (options.lock && mlock(data, size) < 0)
+        throw std::runtime_error(strerror(errno));
+    if (!reader) {
+        if (options.advice != trie::ADVICE_NORMAL)
+            advise_range(base, 0, size, madvise_advice(options.advice));
+    } else {
+        // headers and the like are small and needed at once
+        for (size_t i = 0; i < reader->section_count(); i++) {
+            const section_entry &entry = reader->entry(i);
+            if (entry.length <= kSectionAlign)
+                advise_range(base, entry.offset, entry.length,
+                             MADV_WILLNEED);
+            else if (options.advice != trie::ADVICE_NORMAL)
+                advise_range(base, entry.offset, entry.length,
+                             madvise_advice(options.advice));
+        }
+    }
+    if (options.warmup_threads > 0)
+        warmup_archive(base, size, options.warmup_threads);
+#ifndef MAP_POPULATE
+    else if (options.populate)
+        warmup_archive(base, size, 1);
+#endif
+
+    if (options.metrics) {
+        struct timeval ready;
+        gettimeofday(&ready, NULL);
+        options.metrics->ready_time = (ready.tv_sec - start.tv_sec)
+                                      + (ready.tv_usec - start.tv_usec)
+                                        / 1000000.0;
+        options.metrics->mapped_bytes = size;
+        options.metrics->resident_bytes = resident_bytes(data, size);
+    }
+}
+
+void sync_directory(const char *filename)
+{
+    std::string directory(filename);
+    size_t slash = directory.rfind('/');
+    directory = slash == std::string::npos?".":directory.substr(0, slash + 1);
+    int fd = open(directory.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error(strerror(errno));
+    // some file systems do not sync directories, nothing to do then
+    fsync(fd);
+    close(fd);
+}
+
+// ************************************************************************
+// * Implementation of archive_writer                                     *
+// ************************************************************************
+
+archive_writer::archive_writer(const char *type)
+{
+    memset(&header_, 0, sizeof(header_));
+    memcpy(header_.magic, kArchiveMagic, sizeof(header_.magic));
+    header_.version = kArchiveVersion;
+    strncpy(header_.type, type, sizeof(header_.type) - 1);
+}
+
+void archive_writer::add(uint32_t id, const void *data, size_t length,
+                         uint32_t flags)
+{
+    if (sections_.empty() || sections_.back().id != id) {
+        section_entry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.id = id;
+        entry.flags = flags;
+        entry.align = kSectionAlign;
+        sections_.push_back(entry);
+    }
+    sections_.back().length += length;
+    piece_type piece = {sections_.size() - 1, data, length};
+    pieces_.push_back(piece);
+}
+
+void archive_writer::layout()
+{
+    uint64_t offset = sizeof(archive_header)
+                      + sizeof(section_entry) * sections_.size();
+    std::vector<piece_type>::const_iterator piece = pieces_.begin();
+
+    for (size_t i = 0; i < sections_.size(); i++) {
+        section_entry &entry = sections_[i];
+        entry.offset = align_offset(offset, entry.align);
+        entry.crc = 0;
+        for (; piece != pieces_.end() && piece->section == i; ++piece)
+            entry.crc = crc32c(entry.crc, piece->data, piece->length);
+        offset = entry.offset + entry.length;
+    }
+    header_.section_count = sections_.size();
+    header_.size = offset;
+    header_.crc = header_checksum(&header_,
+                                  sections_.empty()?NULL:&sections_[0]);
+}
+
+/// Appends a buffer to an I/O vector, empty buffers are skipped.
+static void push_vector(std::vector<struct iovec> *vector,
+                        const void *data, size_t length)
+{
+    if (!length)
+        return;
+    struct iovec iov;
+    iov.iov_base = const_cast<void *>(data);
+    iov.iov_len = length;
+    vector->push_back(iov);
+}
+
+void archive_writer::write(int fd)
+{
+    // IOV_MAX on Linux and the BSDs
+    static const size_t kMaxVectors = 1024;
+    static const char padding[kSectionAlign] = {0};
+    std::vector<struct iovec> vector;
+    uint64_t offset;
+
+    layout();
+    push_vector(&vector, &header_, sizeof(header_));
+    if (!sections_.empty())
+        push_vector(&vector, &sections_[0],
+                    sizeof(section_entry) * sections_.size());
+    offset = sizeof(header_) + sizeof(section_entry) * sections_.size();
+
+    std::vector<piece_type>::const_iterator piece = pieces_.begin();
+    for (size_t i = 0; i < sections_.size(); i++) {
+        push_vector(&vector, padding, sections_[i].offset - offset);
+        for (; piece != pieces_.end() && piece->section == i; ++piece)
+            push_vector(&vector, piece->data, piece->length);
+        offset = sections_[i].offset + sections_[i].length;
+    }
+
+    struct iovec *iov = vector.empty()?NULL:&vector[0];
+    size_t count = vector.size();
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, std::min(count, kMaxVectors));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw std::runtime_error(std::string("archive_writer::write: ")
+                                     + strerror(errno));
+        // skip what is written, a pipe may take part of a buffer
+        for (; count > 0 && static_cast<size_t>(n) >= iov->iov_len; count--)
+            n -= (iov++)->iov_len;
+        if (n > 0) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+void archive_writer::write(const char *filename)
+{
+    static unsigned int serial = 0;
+    char temp[PATH_MAX];
+    int fd, retval, error;
+
+    // write next to filename, so the rename never crosses file systems
+    snprintf(temp, sizeof(temp), "%s.%ld.%u.tmp", filename,
+             static_cast<long>(getpid()),
+             __atomic_add_fetch(&serial, 1, __ATOMIC_RELAXED));
+    if ((fd = open(temp, O_WRONLY | O_CREAT | O_EXCL, 0666)) < 0)
+        throw bad_trie_archive("file error");
+    try {
+        write(fd);
+    } catch (...) {
+        close(fd);
+        unlink(temp);
+        throw;
+    }
+    retval = fsync(fd);
+    error = errno;
+    if (close(fd) < 0 && !retval) {
+        retval = -1;
+        error = errno;
+    }
+    if (!retval && rename(temp, filename) < 0) {
+        retval = -1;
+        error = errno;
+    }
+    if (retval < 0) {
+        unlink(temp);
+        throw std::runtime_error(std::string("archive_writer::write: ")
+                                 + strerror(error));
+    }
+    sync_directory(filename);
+}
+
+// ************************************************************************
+// * Implementation of archive_reader                                     *
+// ************************************************************************
+
+bool archive_reader::match(const void *data, size_t size)
+{
+    return size >= sizeof(archive_header)
+           && !memcmp(data, kArchiveMagic, sizeof(kArchiveMagic));
+}
+
+archive_reader::archive_reader(const void *data, size_t size, bool verify)
+    :data_(static_cast<const char *>(data)), size_(size),
+     header_(static_cast<const archive_header *>(data)), table_(NULL)
+{
+    if (!match(data, size))
+        throw bad_trie_archive("bad archive magic");
+    if (header_->version > kArchiveVersion)
+        throw bad_trie_archive("unsupported archive version");
+    if (header_->section_count > (size_ - sizeof(archive_header))
+                                 / sizeof(section_entry))
+        throw bad_trie_archive("file corrupted");
+    if (header_->size > size_)
+        throw bad_trie_archive("file truncated");
+    table_ = reinterpret_cast<const section_entry *>(data_
+                                                     + sizeof(archive_header));
+    if (header_checksum(header_, table_) != header_->crc)
+        throw bad_trie_archive("header checksum mismatch");
+
+    for (size_t i = 0; i < header_->section_count; i++) {
+        const section_entry &entry = table_[i];
+        if (entry.offset > header_->size
+            || entry.length > header_->size - entry.offset
+            || !entry.align || entry.offset % entry.align)
+            throw bad_trie_archive("file corrupted");
+        if ((entry.flags & kSectionRequired)
+            && (entry.id == 0 || entry.id >= SECTION_MAX))
+            throw bad_trie_archive("unknown required section");
+        if (verify && crc32c(0, data_ + entry.offset, entry.length)
+                      != entry.crc)
+            throw bad_trie_archive("section checksum mismatch");
+    }
+}
+
+const void *archive_reader::section(uint32_t id, size_t *length) const
+{
+    for (size_t i = 0; i < header_->section_count; i++) {
+        if (table_[i].id == id) {
+            *length = table_[i].length;
+            return data_ + table_[i].offset;
+        }
+    }
+    *length = 0;
+    return NULL;
+}
+
+const void *archive_reader::require(uint32_t id, size_t min_length,
+                                    size_t *length) const
+{
+    size_t n;
+    const void *p = section(id, &n);
+    if (!p)
+        throw bad_trie_archive("missing section");
+    if (n < min_length)
+        throw bad_trie_archive("file corrupted");
+    if (length)
+        *length = n;
+    return p;
+}
+
+END_TRIE_NAMESPACE
+
+// vim: ts=4 sw=4 ai et
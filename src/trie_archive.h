@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef TRIE_ARCHIVE_H_
+#define TRIE_ARCHIVE_H_
+
+#include <sys/time.h>
+#include <stdint.h>
+
+#include <cstddef>
+#include <vector>
+
+#include "trie.h"
+#include "trie_format.h"
+
+BEGIN_TRIE_NAMESPACE
+
+/**
+ * Computes CRC32C (Castagnoli) of a buffer. It uses the CRC32 instruction
+ * of SSE4.2 or ARMv8 if the CPU supports it.
+ *
+ * @param crc CRC of the preceding data, 0 for the first buffer.
+ * @param data Pointer to the buffer.
+ * @param length Length of the buffer.
+ * @return The updated CRC.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+/**
+ * Maps an archive file into memory, read-only.
+ *
+ * @param filename Filename of the archive.
+ * @param[out] size Size of the archive.
+ * @param options Options for loading, only populate is used here.
+ * @return Pointer to the mapped archive.
+ */
+void *map_archive(const char *filename, size_t *size,
+                  const trie::load_options &options);
+
+/**
+ * Checks that a caller-supplied archive can be used in place.
+ *
+ * @param data Pointer to the archive.
+ * @param size Size of the archive.
+ */
+void check_archive_memory(const void *data, size_t size);
+
+/**
+ * Releases the memory of an archive as its ownership says.
+ *
+ * @param data Pointer to the archive.
+ * @param size Size of the archive.
+ * @param ownership Who releases the memory.
+ */
+void release_archive(void *data, size_t size, trie::ownership_type ownership);
+
+/**
+ * Syncs the directory holding a file, which makes a rename of the file
+ * durable.
+ *
+ * @param filename Filename of the file.
+ */
+void sync_directory(const char *filename);
+
+/**
+ * Checks that count elements start at p and end within an archive.
+ *
+ * @param data Pointer to the archive.
+ * @param size Size of the archive.
+ * @param p Pointer to the first element.
+ * @param count Number of elements, a negative count never fits.
+ * @return true if all elements lie in the archive.
+ */
+template<typename T, typename N>
+inline bool archive_contains(const void *data, size_t size,
+                             const T *p, N count)
+{
+    const char *begin = static_cast<const char *>(data);
+    const char *q = reinterpret_cast<const char *>(p);
+    if (count < 0 || q < begin || q > begin + size)
+        return false;
+    return static_cast<size_t>(count) <= (begin + size - q) / sizeof(T);
+}
+
+class archive_reader;
+
+/**
+ * Makes a mapped archive ready as options asks for. It locks the
+ * archive, advises the kernel about each section, touches all pages and
+ * fills metrics.
+ *
+ * @param data Pointer to the archive.
+ * @param size Size of the archive.
+ * @param reader Reader of the archive, NULL for an archive without
+ *               sections.
+ * @param options Options for loading.
+ * @param start Time when loading started.
+ */
+void prepare_archive(void *data, size_t size, const archive_reader *reader,
+                     const trie::load_options &options,
+                     const struct timeval &start);
+
+/**
+ * Writes a sectioned archive.
+ *
+ * Sections are collected by add() and written by write(). The buffers
+ * passed to add() are not copied and must be alive until write() returns.
+ * The section table is computed before anything is written, so an
+ * archive is written from the first byte to the last without seeking.
+ */
+class archive_writer {
+  public:
+    /**
+     * Constructs an archive_writer.
+     *
+     * @param type Magic of the trie to be stored.
+     */
+    explicit archive_writer(const char *type);
+
+    /**
+     * Appends a buffer to a section. Consecutive calls with the same id
+     * append to the same section.
+     *
+     * @param id Section identifier.
+     * @param data Pointer to the buffer.
+     * @param length Length of the buffer.
+     * @param flags Section flags.
+     */
+    void add(uint32_t id, const void *data, size_t length,
+             uint32_t flags = kSectionRequired);
+
+    /**
+     * Writes the archive to a file. It is written to a temporary file in
+     * the same directory, synced and renamed to filename, so a reader
+     * never sees a partial archive and one still mapping the old file
+     * keeps it. A symbolic link at filename is replaced, not followed.
+     *
+     * @param filename Filename of the archive.
+     */
+    void write(const char *filename);
+
+    /**
+     * Writes the archive to a file descriptor, e.g. a pipe, by writev(2)
+     * straight from the buffers. The descriptor is neither seeked, synced
+     * nor closed.
+     *
+     * @param fd The file descriptor.
+     */
+    void write(int fd);
+
+  private:
+    /// Represents a piece of a section.
+    typedef struct {
+        size_t section;    ///< Index in sections_.
+        const void *data;  ///< Pointer to the buffer.
+        size_t length;     ///< Length of the buffer.
+    } piece_type;
+
+    /// Computes offsets and checksums of all sections.
+    void layout();
+
+    archive_header header_;               ///< Archive header.
+    std::vector<section_entry> sections_; ///< Section table.
+    std::vector<piece_type> pieces_;      ///< Buffers of all sections.
+};
+
+/**
+ * Reads a sectioned archive from a memory region.
+ *
+ * The header and the section table are always validated, including
+ * their checksum and the bounds of every section. Checksums of sections
+ * are validated only if it is asked for, since it reads every page.
+ */
+class archive_reader {
+  public:
+    /**
+     * Constructs an archive_reader.
+     *
+     * @param data Pointer to the archive.
+     * @param size Size of the archive.
+     * @param verify Validates checksums of all sections if sets to true.
+     */
+    archive_reader(const void *data, size_t size, bool verify);
+
+    /// Returns true if data starts with a sectioned archive header.
+    static bool match(const void *data, size_t size);
+
+    /// Returns the magic of the trie stored in archive.
+    const char *type() const
+    {
+        return header_->type;
+    }
+
+    /**
+     * Finds a section.
+     *
+     * @param id Section identifier.
+     * @param[out] length Length of the section.
+     * @return Pointer to the section, NULL if it does not exist.
+     */
+    const void *section(uint32_t id, size_t *length) const;
+
+    /**
+     * Finds a section which must exist and be at least length bytes.
+     *
+     * @param id Section identifier.
+     * @param min_length Minimal length of the section.
+     * @param[out] length Length of the section, can be NULL.
+     * @return Pointer to the section.
+     */
+    const void *require(uint32_t id, size_t min_length,
+                        size_t *length = NULL) const;
+
+    /// Returns the number of sections.
+    size_t section_count() const
+    {
+        return header_->section_count;
+    }
+
+    /// Returns the (i)th entry of the section table.
+    const section_entry &entry(size_t i) const
+    {
+        return table_[i];
+    }
+
+  private:
+    const char *data_;               ///< Pointer to archive.
+    size_t size_;                    ///< Size of archive.
+    const archive_header *header_;   ///< Pointer to header.
+    const section_entry *table_;     ///< Pointer to section table.
+};
+
+END_TRIE_NAMESPACE
+
+#endif  // TRIE_ARCHIVE_H_
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <cstring>
+#include <new>
+#include <vector>
+
+#include "trie_impl.h"
+#include "trie_counters.h"
+
+BEGIN_TRIE_NAMESPACE
+
+/// Number of counts in a trie_counters.
+static const size_t kCounts = sizeof(trie_counters) / sizeof(uint64_t);
+
+/// Size of a block of a thread, whole cache lines of its own.
+static const size_t kBlockSize = (sizeof(trie_counters) + 63) / 64 * 64;
+
+/// Guards blocks, exited and baseline.
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/// Blocks of running threads.
+static std::vector<trie_counters *> blocks;
+
+/// Sums of exited threads.
+static trie_counters exited;
+
+/// Sums at the last reset_counters().
+static trie_counters baseline;
+
+/// Slot of the block of each thread.
+static pthread_key_t key;
+
+/// Creates key once.
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+/// Adds counts of from to to, from being counted meanwhile.
+static void add_counters(trie_counters *to, const trie_counters *from)
+{
+    uint64_t *p = reinterpret_cast<uint64_t *>(to);
+    const uint64_t *q = reinterpret_cast<const uint64_t *>(from);
+    for (size_t i = 0; i < kCounts; i++)
+        p[i] += __atomic_load_n(q + i, __ATOMIC_RELAXED);
+}
+
+/// Sums all threads, the mutex held.
+static void sum_counters(trie_counters *counters)
+{
+    *counters = exited;
+    for (size_t i = 0; i < blocks.size(); i++)
+        add_counters(counters, blocks[i]);
+}
+
+/// Keeps the counts of an exiting thread and frees its block.
+static void release_block(void *p)
+{
+    trie_counters *block = static_cast<trie_counters *>(p);
+    pthread_mutex_lock(&mutex);
+    add_counters(&exited, block);
+    blocks.erase(std::find(blocks.begin(), blocks.end(), block));
+    pthread_mutex_unlock(&mutex);
+    free(block);
+}
+
+static void create_key()
+{
+    pthread_key_create(&key, release_block);
+}
+
+trie_counters *thread_counters()
+{
+    trie_counters *block;
+    void *p;
+
+    pthread_once(&key_once, create_key);
+    block = static_cast<trie_counters *>(pthread_getspecific(key));
+    if (block)
+        return block;
+    if (posix_memalign(&p, 64, kBlockSize))
+        throw std::bad_alloc();
+    block = static_cast<trie_counters *>(p);
+    memset(block, 0, kBlockSize);
+    pthread_mutex_lock(&mutex);
+    blocks.push_back(block);
+    pthread_mutex_unlock(&mutex);
+    pthread_setspecific(key, block);
+    return block;
+}
+
+bool counters_enabled()
+{
+#ifdef TRIE_COUNTERS
+    return true;
+#else
+    return false;
+#endif
+}
+
+void read_counters(trie_counters *counters)
+{
+    pthread_mutex_lock(&mutex);
+    sum_counters(counters);
+    uint64_t *p = reinterpret_cast<uint64_t *>(counters);
+    const uint64_t *q = reinterpret_cast<const uint64_t *>(&baseline);
+    for (size_t i = 0; i < kCounts; i++)
+        p[i] -= q[i];
+    pthread_mutex_unlock(&mutex);
+}
+
+void reset_counters()
+{
+    // blocks belong to their threads, they are never written here
+    pthread_mutex_lock(&mutex);
+    sum_counters(&baseline);
+    pthread_mutex_unlock(&mutex);
+}
+
+END_TRIE_NAMESPACE
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include <cstring>
+#include <new>
+
+#include "trie_handle.h"
+
+BEGIN_TRIE_NAMESPACE
+
+#ifdef __NR_membarrier
+/// Commands of membarrier(2), from linux/membarrier.h of Linux 4.14.
+enum {
+    kMembarrierPrivateExpedited = 1 << 3,
+    kMembarrierRegisterPrivateExpedited = 1 << 4
+};
+
+/// Registers the process for expedited membarrier.
+static bool register_membarrier()
+{
+    return syscall(__NR_membarrier,
+                   kMembarrierRegisterPrivateExpedited, 0) == 0;
+}
+
+/// Issues a full memory barrier on all running threads of the process.
+static void membarrier()
+{
+    syscall(__NR_membarrier, kMembarrierPrivateExpedited, 0);
+}
+#else
+static bool register_membarrier()
+{
+    return false;
+}
+
+static void membarrier()
+{
+}
+#endif
+
+trie_handle::trie_handle(trie *initial)
+    :current_(initial), epoch_(1), fence_(!register_membarrier())
+{
+    pthread_mutex_init(&mutex_, NULL);
+    if (pthread_key_create(&key_, release_slot))
+        throw std::runtime_error("trie_handle: can not create thread key");
+}
+
+trie_handle::~trie_handle()
+{
+    std::vector<std::pair<trie *, uint64_t> >::iterator it;
+    std::vector<slot_type *>::iterator slot;
+
+    for (it = retired_.begin(); it != retired_.end(); it++)
+        delete it->first;
+    delete current_;
+    pthread_key_delete(key_);
+    for (slot = slots_.begin(); slot != slots_.end(); slot++)
+        free(*slot);
+    pthread_mutex_destroy(&mutex_);
+}
+
+trie_handle::slot_type *trie_handle::slot() const
+{
+    slot_type *slot = static_cast<slot_type *>(pthread_getspecific(key_));
+    void *p;
+
+    if (slot)
+        return slot;
+    pthread_mutex_lock(&mutex_);
+    for (size_t i = 0; i < slots_.size(); i++) {
+        if (!__atomic_load_n(&slots_[i]->used, __ATOMIC_ACQUIRE)) {
+            slot = slots_[i];
+            break;
+        }
+    }
+    if (!slot) {
+        // a slot owns a whole cache line
+        if (posix_memalign(&p, sizeof(slot_type), sizeof(slot_type))) {
+            pthread_mutex_unlock(&mutex_);
+            throw std::bad_alloc();
+        }
+        slot = static_cast<slot_type *>(p);
+        memset(slot, 0, sizeof(slot_type));
+        slots_.push_back(slot);
+    }
+    slot->depth = 0;
+    __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->used, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mutex_);
+    pthread_setspecific(key_, slot);
+    return slot;
+}
+
+void trie_handle::release_slot(void *p)
+{
+    slot_type *slot = static_cast<slot_type *>(p);
+    __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->used, 0, __ATOMIC_RELEASE);
+}
+
+void trie_handle::publish(trie *next)
+{
+    pthread_mutex_lock(&mutex_);
+    trie *prev = __atomic_exchange_n(&current_, next, __ATOMIC_SEQ_CST);
+    // readers pinned before this epoch may still see prev
+    uint64_t epoch = __atomic_add_fetch(&epoch_, 1, __ATOMIC_SEQ_CST);
+    if (prev)
+        retired_.push_back(std::make_pair(prev, epoch));
+    pthread_mutex_unlock(&mutex_);
+    reclaim();
+}
+
+void trie_handle::reload(const char *archive,
+                         const trie::load_options &options)
+{
+    publish(trie::create_trie(archive, options));
+}
+
+size_t trie_handle::reclaim()
+{
+    std::vector<trie *> garbage;
+    uint64_t oldest = UINT64_MAX;
+    size_t i, left;
+
+    pthread_mutex_lock(&mutex_);
+    if (retired_.empty()) {
+        pthread_mutex_unlock(&mutex_);
+        return 0;
+    }
+    // make slots stored by unfenced readers visible, the stores of
+    // fenced readers are ordered against the scan by a full fence
+    if (!fence_)
+        membarrier();
+    else
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (i = 0; i < slots_.size(); i++) {
+        uint64_t epoch = __atomic_load_n(&slots_[i]->epoch, __ATOMIC_ACQUIRE);
+        if (epoch && epoch < oldest)
+            oldest = epoch;
+    }
+    for (i = 0, left = 0; i < retired_.size(); i++) {
+        if (retired_[i].second <= oldest)
+            garbage.push_back(retired_[i].first);
+        else
+            retired_[left++] = retired_[i];
+    }
+    retired_.resize(left);
+    pthread_mutex_unlock(&mutex_);
+
+    for (i = 0; i < garbage.size(); i++)
+        delete garbage[i];
+    return left;
+}
+
+void trie_handle::synchronize()
+{
+    while (reclaim())
+        usleep(100);
+}
+
+END_TRIE_NAMESPACE
+
+// vim: ts=4 sw=4 ai et
@@ -39,13 +39,244 @@
 
 BEGIN_TRIE_NAMESPACE
 
-const char double_trie::magic_[16] = "TWO_TRIE";
-const char single_trie::magic_[16] = "TAIL_TRIE";
+template<typename Traits>
+const size_t basic_trie_impl<Traits>::kDefaultStateSize;
+
+template<>
+const char double_trie_impl<byte_trie_traits>::magic_[16] = "TWO_TRIE";
+template<>
+const char double_trie_impl<wide_trie_traits>::magic_[16] = "TWO_TRIE";
+template<>
+const char single_trie_impl<byte_trie_traits>::magic_[16] = "TAIL_TRIE_16";
+template<>
+const char single_trie_impl<wide_trie_traits>::magic_[16] = "TAIL_TRIE";
 
 // ************************************************************************
 // * Implementation of helper functions                                   *
 // ************************************************************************
 
+/**
+ * Loads a basic_trie from a section which holds a header and states.
+ *
+ * @param reader Reader of the archive.
+ * @param id Section identifier.
+ * @return Pointer to the basic_trie.
+ */
+template<typename T>
+static T *load_basic_trie(const archive_reader &reader, uint32_t id)
+{
+    size_t length;
+    typename T::header_type *header;
+
+    header = static_cast<typename T::header_type *>(const_cast<void *>(
+                 reader.require(id, sizeof(typename T::header_type),
+                                &length)));
+    if ((header->size < 0)
+        || static_cast<size_t>(header->size)
+           > (length - sizeof(typename T::header_type))
+             / sizeof(typename T::state_type))
+        throw bad_trie_archive("file corrupted");
+    return new T(header, header + 1);
+}
+
+/**
+ * Loads a basic trie stored in an archive without sections.
+ *
+ * @param data Pointer to the archive.
+ * @param size Size of the archive.
+ * @param[in,out] start Where the basic trie starts, moved past its end.
+ * @return The basic trie.
+ */
+template<typename T>
+static T *load_legacy_trie(void *data, size_t size, void **start)
+{
+    typename T::header_type *header;
+
+    header = static_cast<typename T::header_type *>(*start);
+    if (!archive_contains(data, size, header, 1)
+        || !archive_contains(data, size,
+                             reinterpret_cast<typename T::state_type *>(
+                                 header + 1),
+                             header->size))
+        throw std::runtime_error("file corrupted");
+    *start = reinterpret_cast<typename T::state_type *>(header + 1)
+             + header->size;
+    return new T(header, header + 1);
+}
+
+/**
+ * Loads the label remapping table of an archive, if there is one.
+ *
+ * @param reader Reader of the archive.
+ * @param alphabet The alphabet to attach the table to.
+ */
+template<typename Traits>
+static void load_alphabet(const archive_reader &reader,
+                          trie_alphabet<Traits> *alphabet)
+{
+    typedef typename Traits::label_type label_type;
+    size_t length;
+    const void *table = reader.section(SECTION_ALPHABET, &length);
+
+    if (!table)
+        return;
+    if (length != sizeof(label_type) * trie_alphabet<Traits>::kTableSize)
+        throw bad_trie_archive("file corrupted");
+    alphabet->attach(static_cast<label_type *>(const_cast<void *>(table)));
+}
+
+/**
+ * Loads the payload flags of an archive. An archive having payloads
+ * always has flags telling which values refer to them.
+ *
+ * @param reader Reader of the archive.
+ * @return The flags.
+ */
+static payload_flags *load_payload_flags(const archive_reader &reader)
+{
+    size_t length;
+    bool payloads = reader.section(SECTION_PAYLOAD, &length) && length;
+    const void *data = reader.section(SECTION_PAYLOAD_FLAG, &length);
+
+    if (payloads && !data)
+        throw bad_trie_archive("file corrupted");
+    return new payload_flags(data, length);
+}
+
+/**
+ * Loads the filter of missing keys of an archive, if there is one.
+ *
+ * @param reader Reader of the archive.
+ * @param filter The filter to attach the section to.
+ * @return Bits per key of the filter, 0 if there is none.
+ */
+static size_t load_filter(const archive_reader &reader, key_filter *filter)
+{
+    size_t length;
+    const void *data = reader.section(SECTION_FILTER, &length);
+
+    if (!data)
+        return 0;
+    filter->attach(data, length);
+    return filter->bits_per_key();
+}
+
+/**
+ * Builds a filter of all keys of a trie.
+ *
+ * @param mtrie The trie.
+ * @param bits_per_key Bits of the filter per key.
+ * @param filter The filter to build.
+ */
+static void build_filter(const trie &mtrie, size_t bits_per_key,
+                         key_filter *filter)
+{
+    trie::result_type result;
+    mtrie.prefix_search(trie::key_type("", 0), &result);
+    std::vector<uint64_t> hashes(result.size());
+    for (size_t i = 0; i < result.size(); i++)
+        hashes[i] = key_filter::hash(result[i].first);
+    filter->build(hashes, bits_per_key);
+}
+
+/// A tail of single_trie_impl, @see single_trie_impl::share_tails().
+typedef struct {
+    trie::size_type state;   ///< Leaf state of the tail.
+    trie::size_type start;   ///< Start of the tail in suffix.
+    trie::size_type length;  ///< Number of labels before the terminator.
+    trie::size_type value;   ///< Where the value is in suffix.
+    uint64_t last;           ///< Last labels backwards, to compare quickly.
+} tail_entry;
+
+/// Orders tails by their labels read backwards.
+template<typename T>
+class reversed_tail_less {
+  public:
+    explicit reversed_tail_less(const T *suffix)
+        :suffix_(suffix)
+    {
+    }
+
+    bool operator()(const tail_entry &lhs, const tail_entry &rhs) const
+    {
+        if (lhs.last != rhs.last)
+            return lhs.last < rhs.last;
+        const T *x = suffix_ + lhs.start + lhs.length;
+        const T *y = suffix_ + rhs.start + rhs.length;
+        trie::size_type n = std::min(lhs.length, rhs.length);
+        for (trie::size_type i = 1; i <= n; i++)
+            if (x[-i] != y[-i])
+                return x[-i] < y[-i];
+        return lhs.length < rhs.length;
+    }
+
+  private:
+    const T *suffix_;
+};
+
+/**
+ * Loads the table of states by the first two labels of an archive, if
+ * there is one.
+ *
+ * @param reader Reader of the archive.
+ * @param states Number of states of the trie the table refers to.
+ * @param table The table to attach the section to.
+ * @return true if there is a table.
+ */
+static bool load_root_table(const archive_reader &reader,
+                            trie::size_type states, root_table *table)
+{
+    size_t length;
+    const void *data = reader.section(SECTION_ROOT, &length);
+
+    if (!data)
+        return false;
+    table->attach(data, length, states);
+    return true;
+}
+
+/**
+ * Uses the chains of a basic trie in an archive, if there are some.
+ *
+ * @param reader The archive.
+ * @param[out] trie The basic trie using the chains.
+ * @return true if the archive has chains.
+ */
+template<typename T>
+static bool load_chains(const archive_reader &reader, T *trie)
+{
+    size_t length;
+    const void *data = reader.section(SECTION_CHAIN, &length);
+
+    if (!data)
+        return false;
+    if (length % sizeof(trie::size_type)
+        || reinterpret_cast<uintptr_t>(data) % sizeof(trie::size_type))
+        throw bad_trie_archive("file corrupted");
+    trie->attach_chains(static_cast<const trie::size_type *>(data),
+                        length / sizeof(trie::size_type));
+    return true;
+}
+
+/**
+ * Returns a copy of a basic trie owning its states, with its chains
+ * expanded to single transitions, so that keys can be inserted.
+ */
+template<typename T>
+static T *flatten_basic_trie(const T &trie)
+{
+    if (!trie.chain_size())
+        return new T(trie);
+    T *flat = new T();
+    try {
+        flat->copy_from(trie, 0, NULL, NULL);
+    } catch (...) {
+        delete flat;
+        throw;
+    }
+    return flat;
+}
+
 static const char* pretty_size(size_t size, char *buf, size_t buflen)
 {
     assert(buf);
@@ -71,40 +302,48 @@ trie::~trie()
 // * Implementation of basic_trie                                         *
 // ************************************************************************
 
-basic_trie::basic_trie(size_type size,
-                       trie_relocator_interface<size_type> *relocator)
+template<typename Traits>
+basic_trie_impl<Traits>::basic_trie_impl(
+    size_type size, trie_relocator_interface<size_type> *relocator)
     :header_(NULL), states_(NULL), last_base_(0), max_state_(0), owner_(true),
-     relocator_(relocator)
+     relocator_(relocator), chains_(NULL), chain_size_(0)
 {
-    if (size < key_type::kCharsetSize)
+    if (size < Traits::kCharsetSize)
         size = kDefaultStateSize;
     header_ = new header_type();
     memset(header_, 0, sizeof(header_type));
     resize_state(size);
 }
 
-basic_trie::basic_trie(void *header, void *states)
+template<typename Traits>
+basic_trie_impl<Traits>::basic_trie_impl(void *header, void *states)
     :header_(NULL), states_(NULL), last_base_(0), max_state_(0), owner_(false),
-     relocator_(NULL)
+     relocator_(NULL), chains_(NULL), chain_size_(0)
 {
     header_ = static_cast<header_type *>(header);
     states_ = static_cast<state_type *>(states);
+    if (header_->size > 0)
+        max_state_ = header_->size - 1;
 }
 
-basic_trie::basic_trie(const basic_trie &trie)
+template<typename Traits>
+basic_trie_impl<Traits>::basic_trie_impl(const basic_trie_impl &trie)
     :header_(NULL), states_(NULL), last_base_(0), max_state_(0), owner_(false),
-     relocator_(NULL)
+     relocator_(NULL), chains_(NULL), chain_size_(0)
 {
     clone(trie);
 }
 
-basic_trie &basic_trie::operator=(const basic_trie &trie)
+template<typename Traits>
+basic_trie_impl<Traits> &
+basic_trie_impl<Traits>::operator=(const basic_trie_impl &trie)
 {
     clone(trie);
     return *this;
 }
 
-void basic_trie::clone(const basic_trie &trie)
+template<typename Traits>
+void basic_trie_impl<Traits>::clone(const basic_trie_impl &trie)
 {
     if (owner_) {
         if (header_) {
@@ -121,9 +360,13 @@ void basic_trie::clone(const basic_trie &trie)
     states_ = resize(states_, 0, trie.header()->size);
     memcpy(header_, trie.header(), sizeof(header_type));
     memcpy(states_, trie.states(), trie.header()->size * sizeof(state_type));
+    chain_buffer_.assign(trie.chains(), trie.chains() + trie.chain_size());
+    chains_ = chain_buffer_.empty()?NULL:&chain_buffer_[0];
+    chain_size_ = chain_buffer_.size();
 }
 
-basic_trie::~basic_trie()
+template<typename Traits>
+basic_trie_impl<Traits>::~basic_trie_impl()
 {
     if (owner_) {
         sanity_delete(header_);
@@ -131,12 +374,14 @@ basic_trie::~basic_trie()
     }
 }
 
+template<typename Traits>
 trie::size_type
-basic_trie::find_base(const char_type *inputs, const extremum_type &extremum)
+basic_trie_impl<Traits>::find_base(const label_type *inputs,
+                                   const extremum_type &extremum)
 {
     bool found;
     size_type i;
-    const char_type *p;
+    const label_type *p;
 
     for (i = last_base_, found = false; !found; /* empty */) {
         i++;
@@ -154,30 +399,35 @@ basic_trie::find_base(const char_type *inputs, const extremum_type &extremum)
         }
     }
 
-    last_base_ = (i > 256)?i - 255:i;
+    TRIE_COUNT(base_probes, i - last_base_);
+    last_base_ = (i > Traits::kCharsetSize - 1)?
+                 i - (Traits::kCharsetSize - 2):i;
 
     return i;
 }
 
+template<typename Traits>
 trie::size_type
-basic_trie::relocate(size_type stand,
-                     size_type s,
-                     const char_type *inputs,
-                     const extremum_type &extremum)
+basic_trie_impl<Traits>::relocate(size_type stand,
+                                  size_type s,
+                                  const label_type *inputs,
+                                  const extremum_type &extremum)
 {
     size_type obase, nbase, i;
-    char_type targets[key_type::kCharsetSize + 1];
+    label_type targets[Traits::kCharsetSize + 1];
 
+    TRIE_COUNT(relocations, 1);
     obase = base(s);  // save old base value
     nbase = find_base(inputs, extremum);  // find a new base
 
     for (i = 0; inputs[i]; i++) {
         if (check(obase + inputs[i]) != s)  // find old links
             continue;
+        TRIE_COUNT(states_moved, 1);
         set_base(nbase + inputs[i], base(obase + inputs[i]));
         set_check(nbase + inputs[i], check(obase + inputs[i]));
         find_exist_target(obase + inputs[i], targets, NULL);
-        for (char_type *p = targets; *p; p++) {
+        for (label_type *p = targets; *p; p++) {
             set_check(base(obase + inputs[i]) + *p, nbase + inputs[i]);
         }
         // if where we are standing is moving, we move with it
@@ -196,11 +446,12 @@ basic_trie::relocate(size_type stand,
     return stand;
 }
 
+template<typename Traits>
 trie::size_type
-basic_trie::create_transition(size_type s, char_type ch)
+basic_trie_impl<Traits>::create_transition(size_type s, char_type ch)
 {
-    char_type targets[key_type::kCharsetSize + 1];
-    char_type parent_targets[key_type::kCharsetSize + 1];
+    label_type targets[Traits::kCharsetSize + 1];
+    label_type parent_targets[Traits::kCharsetSize + 1];
     extremum_type extremum = {0, 0}, parent_extremum = {0, 0};
 
     size_type t = next(s, ch);
@@ -235,7 +486,99 @@ basic_trie::create_transition(size_type s, char_type ch)
 }
 
 
-void basic_trie::insert(const key_type &key, const value_type &value)
+template<typename Traits>
+void basic_trie_impl<Traits>::copy_from(const basic_trie_impl &source,
+                                        size_type min_chain,
+                                        std::vector<size_type> *renumber,
+                                        const std::vector<size_type> *heat)
+{
+    std::priority_queue<placement> queue;
+    std::vector<label_type> labels;
+    label_type targets[Traits::kCharsetSize + 1];
+    size_type order = 0;
+
+    chain_buffer_.clear();
+    if (renumber)
+        renumber->assign(source.max_state() + 1, 0);
+    // BASE values of a larger trie could be taken for chains
+    if (source.max_state() >= kChainBase / 2)
+        min_chain = 0;
+    queue.push(placement(heat, 1, 1, 0, order++));
+    while (!queue.empty()) {
+        size_type s = queue.top().from, t = queue.top().to;
+        size_type level = queue.top().level + 1;
+        queue.pop();
+        if (renumber)
+            (*renumber)[s] = t;
+        if (source.base(s) <= 0) {
+            set_base(t, source.base(s));  // a leaf keeps its value
+            continue;
+        }
+        // follow single transitions and chains of source
+        size_type u = s, num_targets;
+        labels.clear();
+        for (;;) {
+            const size_type *chain = source.chain(u);
+            if (chain) {
+                labels.insert(labels.end(), chain + 2, chain + 2 + chain[1]);
+                u = chain[0];
+            } else if (min_chain > 0 && source.base(u) > 0
+                       && source.find_exist_target(u, targets, NULL) == 1
+                       && targets[0] != Traits::kTerminator) {
+                labels.push_back(targets[0]);
+                u = source.next(u, targets[0]);
+            } else {
+                break;
+            }
+        }
+        if (min_chain > 0
+            && labels.size() >= static_cast<size_t>(min_chain)) {
+            label_type first[2] = {1, 0};
+            extremum_type extremum = {1, 1};
+            size_type offset = chain_buffer_.size();
+            size_type end = find_base(first, extremum) + 1;
+            set_base(t, kChainBase + offset);
+            set_check(end, t);
+            chain_buffer_.push_back(end);
+            chain_buffer_.push_back(labels.size());
+            chain_buffer_.insert(chain_buffer_.end(),
+                                 labels.begin(), labels.end());
+            queue.push(placement(heat, u, end, level, order++));
+            continue;
+        }
+        // a chain too short is copied as single transitions
+        for (size_t i = 0; i < labels.size(); i++) {
+            label_type single[2] = {labels[i], 0};
+            extremum_type extremum = {labels[i], labels[i]};
+            size_type b = find_base(single, extremum);
+            set_base(t, b);
+            set_check(b + labels[i], t);
+            t = b + labels[i];
+        }
+        if (renumber)
+            (*renumber)[u] = t;
+        if (source.base(u) <= 0) {
+            set_base(t, source.base(u));
+            continue;
+        }
+        extremum_type extremum = {0, Traits::kCharsetSize};
+        if (!(num_targets = source.find_exist_target(u, targets, &extremum)))
+            continue;
+        size_type b = find_base(targets, extremum);
+        set_base(t, b);
+        for (size_type i = 0; i < num_targets; i++) {
+            set_check(b + targets[i], t);
+            queue.push(placement(heat, source.next(u, targets[i]),
+                                 b + targets[i], level, order++));
+        }
+    }
+    chains_ = chain_buffer_.empty()?NULL:&chain_buffer_[0];
+    chain_size_ = chain_buffer_.size();
+}
+
+template<typename Traits>
+void basic_trie_impl<Traits>::insert(const key_type &key,
+                                     const value_type &value)
 {
     if (value < 1)
         throw std::runtime_error("basic_trie::insert: value must > 0");
@@ -244,12 +587,14 @@ void basic_trie::insert(const key_type &key, const value_type &value)
     size_type s = go_forward(1, key.data(), &p);
     do {
         s = create_transition(s, *p);
-    } while (*p++ != key_type::kTerminator);
+    } while (*p++ != Traits::kTerminator);
     set_base(s, value);
 }
 
 
-bool basic_trie::search(const key_type &key, value_type *value) const
+template<typename Traits>
+bool basic_trie_impl<Traits>::search(const key_type &key,
+                                     value_type *value) const
 {
     const char_type *p = NULL;
     size_type s = go_forward(1, key.data(), &p);
@@ -260,50 +605,85 @@ bool basic_trie::search(const key_type &key, value_type *value) const
     return true;
 }
 
+template<typename Traits>
 size_t
-basic_trie::prefix_search(const key_type &prefix, result_type *result) const
+basic_trie_impl<Traits>::prefix_search(const key_type &prefix,
+                                       result_type *result) const
 {
     const char_type *p;
     size_type s = go_forward(1, prefix.data(), &p);
     key_type store(prefix);
+    size_t first = result->size();
     prefix_search_aux(s, p, &store, result);
+    // values of a basic trie are kept in BASE
+    for (size_t i = first; i < result->size(); i++)
+        (*result)[i].second = base((*result)[i].second);
     return result->size();
 }
 
-size_t basic_trie::prefix_search_aux(size_type s,
-                                     const char_type *miss,
-                                     key_type *store,
-                                     result_type *result) const
+template<typename Traits>
+bool basic_trie_impl<Traits>::prefix_search_aux(
+    size_type s, const char_type *miss, key_type *store, result_type *result,
+    const sequence_lock *lock, sequence_lock::sequence_type sequence) const
 {
-    char_type targets[key_type::kCharsetSize + 1];
+    label_type targets[Traits::kCharsetSize + 1];
 
+    // a partial update may even link states into a cycle
+    if (lock && !lock->read_validate(sequence))
+        return false;
+    if (base(s) >= kChainBase) {
+        const size_type *chain = this->chain(s);
+        if (!chain || !check_transition(s, chain[0]))
+            return true;  // a damaged chain leads nowhere
+        size_type i, length = chain[1];
+        const size_type *labels = chain + 2;
+        for (i = 0; i < length; i++) {
+            if (!miss || *miss == Traits::kTerminator)
+                break;
+            if (*miss++ != labels[i])
+                return true;
+        }
+        for (i = 0; i < length; i++)
+            store->push(labels[i]);
+        bool done = prefix_search_aux(chain[0], miss, store, result,
+                                      lock, sequence);
+        for (i = 0; i < length; i++)
+            store->pop();
+        return done;
+    }
     if (find_exist_target(s, targets, NULL)) {
-        for (char_type *p = targets; *p; p++) {
-            if (miss && *miss != key_type::kTerminator && *miss != *p)
+        for (label_type *p = targets; *p; p++) {
+            if (miss && *miss != Traits::kTerminator && *miss != *p)
                 continue;
             size_type t = next(s, *p);
+            bool done;
             store->push(*p);
-            if (!miss || *miss == key_type::kTerminator)
-                prefix_search_aux(t, miss, store, result);
+            if (!miss || *miss == Traits::kTerminator)
+                done = prefix_search_aux(t, miss, store, result,
+                                         lock, sequence);
             else
-                prefix_search_aux(t, miss + 1, store, result);
+                done = prefix_search_aux(t, miss + 1, store, result,
+                                         lock, sequence);
             store->pop();
+            if (!done)
+                return false;
         }
     } else {
-        result->push_back(std::pair<key_type, value_type>(*store, base(s)));
+        result->push_back(std::pair<key_type, value_type>(*store, s));
     }
-    return 0;
+    return true;
 }
 
-void basic_trie::trace(size_type s) const
+template<typename Traits>
+void basic_trie_impl<Traits>::trace(size_type s) const
 {
     size_type num_target;
-    char_type targets[key_type::kCharsetSize + 1];
+    label_type targets[Traits::kCharsetSize + 1];
     static std::vector<size_type> trace_stack;
 
     trace_stack.push_back(s);
     if ((num_target = find_exist_target(s, targets, NULL))) {
-        for (char_type *p = targets; *p; p++) {
+        for (label_type *p = targets; *p; p++) {
             size_type t = next(s, *p);
             if (t < header_->size)
                 trace(next(s, *p));
@@ -315,7 +695,7 @@ void basic_trie::trace(size_type s) const
         for (it = trace_stack.begin();it != trace_stack.end(); it++) {
             cbase = base(*it);
             if (obase) {
-                if (*it - obase == key_type::kTerminator) {
+                if (*it - obase == Traits::kTerminator) {
                     std::cerr << "-#->";
                 } else {
                     char ch = key_type::char_out(*it - obase);
@@ -338,87 +718,245 @@ void basic_trie::trace(size_type s) const
 // * Implementation of two trie                                           *
 // ************************************************************************
 
-double_trie::double_trie(size_t size)
+template<typename Traits>
+double_trie_impl<Traits>::double_trie_impl(size_t size)
     :header_(NULL), lhs_(NULL), rhs_(NULL), index_(NULL), accept_(NULL),
      next_accept_(1), next_index_(1), front_relocator_(NULL),
-     rear_relocator_(NULL), mmap_(NULL), mmap_size_(0)
+     rear_relocator_(NULL), payload_(NULL), flags_(NULL), alphabet_(NULL),
+     filter_bits_(0), use_root_table_(false), compress_chains_(false),
+     compressed_(NULL), relayout_(false), relaid_rear_(NULL),
+     concurrent_(false), mmap_(NULL), mmap_size_(0),
+     ownership_(BORROW_MEMORY)
 {
     header_ = new header_type();
     memset(header_, 0, sizeof(header_type));
     snprintf(header_->magic, sizeof(header_->magic), "%s", magic_);
-    front_relocator_ = new trie_relocator<double_trie>
-                           (this, &double_trie::relocate_front);
-    rear_relocator_ = new trie_relocator<double_trie>
-                          (this, &double_trie::relocate_rear);
-    lhs_ = new basic_trie(size);
-    rhs_ = new basic_trie(size);
+    front_relocator_ = new trie_relocator<double_trie_impl>
+                           (this, &double_trie_impl::relocate_front);
+    rear_relocator_ = new trie_relocator<double_trie_impl>
+                          (this, &double_trie_impl::relocate_rear);
+    lhs_ = new basic_trie_type(size);
+    rhs_ = new basic_trie_type(size);
     lhs_->set_relocator(front_relocator_);
     rhs_->set_relocator(rear_relocator_);
-    header_->index_size = size?size:basic_trie::kDefaultStateSize;
+    header_->index_size = size?size:basic_trie_type::kDefaultStateSize;
     index_ = resize(index_, 0, header_->index_size);
-    header_->accept_size = size?size:basic_trie::kDefaultStateSize;
+    header_->accept_size = size?size:basic_trie_type::kDefaultStateSize;
     accept_ = resize(accept_, 0, header_->accept_size);
     watcher_[0] = 0;
     watcher_[1] = 0;
+    payload_ = new payload_heap();
+    flags_ = new payload_flags();
+    alphabet_ = new trie_alphabet<Traits>();
 }
 
-double_trie::double_trie(const char *filename)
+template<typename Traits>
+double_trie_impl<Traits>::double_trie_impl(const char *filename,
+                                           const load_options &options)
     :header_(NULL), lhs_(NULL), rhs_(NULL), index_(NULL), accept_(NULL),
      next_accept_(1), next_index_(1), front_relocator_(NULL),
-     rear_relocator_(NULL), mmap_(NULL), mmap_size_(0)
+     rear_relocator_(NULL), payload_(NULL), flags_(NULL), alphabet_(NULL),
+     filter_bits_(0), use_root_table_(false), compress_chains_(false),
+     compressed_(NULL), relayout_(false), relaid_rear_(NULL),
+     concurrent_(false), mmap_(NULL), mmap_size_(0),
+     ownership_(BORROW_MEMORY)
 {
-    struct stat sb;
-    int fd, retval;
-
-    if (!filename)
-        throw std::runtime_error(std::string("can not load from file ")
-                                 + filename);
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    mmap_ = map_archive(filename, &mmap_size_, options);
+    try {
+        load(options, start);
+    } catch (...) {
+        release_archive(mmap_, mmap_size_, ADOPT_MAPPING);
+        throw;
+    }
+    ownership_ = ADOPT_MAPPING;
+}
 
-    fd = open(filename, O_RDONLY);
-    if (fd < 0)
-        throw std::runtime_error(strerror(errno));
-    if (fstat(fd, &sb) < 0)
-        throw std::runtime_error(strerror(errno));
+template<typename Traits>
+double_trie_impl<Traits>::double_trie_impl(const void *data, size_t size,
+                                           ownership_type ownership,
+                                           const load_options &options)
+    :header_(NULL), lhs_(NULL), rhs_(NULL), index_(NULL), accept_(NULL),
+     next_accept_(1), next_index_(1), front_relocator_(NULL),
+     rear_relocator_(NULL), payload_(NULL), flags_(NULL), alphabet_(NULL),
+     filter_bits_(0), use_root_table_(false), compress_chains_(false),
+     compressed_(NULL), relayout_(false), relaid_rear_(NULL),
+     concurrent_(false), mmap_(NULL), mmap_size_(0),
+     ownership_(BORROW_MEMORY)
+{
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    check_archive_memory(data, size);
+    mmap_ = const_cast<void *>(data);
+    mmap_size_ = size;
+    load(options, start);
+    ownership_ = ownership;
+}
 
-    mmap_ = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (mmap_ == MAP_FAILED)
-        throw std::runtime_error(strerror(errno));
-    while (retval = close(fd), retval == -1 && errno == EINTR) {
-        // exmpty
+template<typename Traits>
+void double_trie_impl<Traits>::load(const load_options &options,
+                                      const struct timeval &start)
+{
+    try {
+        if (archive_reader::match(mmap_, mmap_size_)) {
+            archive_reader reader(mmap_, mmap_size_, options.verify);
+            load_sections(reader);
+            prepare_archive(mmap_, mmap_size_, &reader, options, start);
+        } else {
+            load_legacy();
+            prepare_archive(mmap_, mmap_size_, NULL, options, start);
+        }
+    } catch (...) {
+        // the destructor will not run, free what is loaded so far
+        sanity_delete(lhs_);
+        sanity_delete(rhs_);
+        sanity_delete(payload_);
+        sanity_delete(flags_);
+        sanity_delete(alphabet_);
+        throw;
     }
-    mmap_size_ = sb.st_size;
+}
+
+template<typename Traits>
+void double_trie_impl<Traits>::load_sections(const archive_reader &reader)
+{
+    size_t length;
+    const void *start;
+
+    if (strcmp(reader.type(), magic_))
+        throw bad_trie_archive("file magic error");
+    header_ = static_cast<header_type *>(const_cast<void *>(
+                  reader.require(SECTION_HEADER, sizeof(header_type))));
+    index_ = static_cast<index_type *>(const_cast<void *>(
+                 reader.require(SECTION_INDEX, sizeof(index_type)
+                                               * header_->index_size)));
+    accept_ = static_cast<accept_type *>(const_cast<void *>(
+                  reader.require(SECTION_ACCEPT, sizeof(accept_type)
+                                                 * header_->accept_size)));
+    lhs_ = load_basic_trie<basic_trie_type>(reader, SECTION_FRONT);
+    rhs_ = load_basic_trie<basic_trie_type>(reader, SECTION_REAR);
+    start = reader.section(SECTION_PAYLOAD, &length);
+    payload_ = new payload_heap(const_cast<void *>(start), length);
+    flags_ = load_payload_flags(reader);
+    alphabet_ = new trie_alphabet<Traits>();
+    load_alphabet(reader, alphabet_);
+    filter_bits_ = load_filter(reader, &filter_);
+    use_root_table_ = load_root_table(reader, lhs_->max_state() + 1,
+                                      &root_table_);
+    compress_chains_ = load_chains(reader, lhs_);
+}
 
+template<typename Traits>
+void double_trie_impl<Traits>::load_legacy()
+{
     void *start;
     start = header_ = reinterpret_cast<header_type *>(mmap_);
-    if (strcmp(header_->magic, magic_))
+    if (!archive_contains(mmap_, mmap_size_, header_, 1)
+        || strncmp(header_->magic, magic_, sizeof(header_->magic)))
         throw std::runtime_error("file corrupted");
     // load index
     start = index_ = reinterpret_cast<index_type *>(
                      reinterpret_cast<header_type *>(start) + 1);
+    if (!archive_contains(mmap_, mmap_size_, index_, header_->index_size))
+        throw std::runtime_error("file corrupted");
     // load accept
     start = accept_ = reinterpret_cast<accept_type *>(
                       reinterpret_cast<index_type *>(start)
                       + header_->index_size);
+    if (!archive_contains(mmap_, mmap_size_, accept_, header_->accept_size))
+        throw std::runtime_error("file corrupted");
     // load front trie
     start = reinterpret_cast<accept_type *>(start) + header_->accept_size;
-    lhs_ = new basic_trie(start,
-                          reinterpret_cast<basic_trie::header_type *>(start)
-                          + 1);
+    lhs_ = load_legacy_trie<basic_trie_type>(mmap_, mmap_size_, &start);
     // load rear trie
-    start = reinterpret_cast<basic_trie::state_type *>
-            ((basic_trie::header_type *)start + 1)
-            + lhs_->header()->size;
-    rhs_ = new basic_trie(start,
-                          reinterpret_cast<basic_trie::header_type *>(start)
-                          + 1);
+    rhs_ = load_legacy_trie<basic_trie_type>(mmap_, mmap_size_, &start);
+    // this layout never carried payloads or an alphabet
+    if (header_->payload_size || header_->alphabet_size)
+        throw std::runtime_error("file corrupted");
+    payload_ = new payload_heap();
+    flags_ = new payload_flags();
+    alphabet_ = new trie_alphabet<Traits>();
 }
 
 
-double_trie::~double_trie()
+template<typename Traits>
+void double_trie_impl<Traits>::detach_archive()
+{
+    if (!mmap_)
+        return;
+
+    basic_trie_type *lhs = flatten_basic_trie(*lhs_);
+    basic_trie_type *rhs = NULL;
+    try {
+        rhs = new basic_trie_type(*rhs_);
+        front_relocator_ = new trie_relocator<double_trie_impl>
+                               (this, &double_trie_impl::relocate_front);
+        rear_relocator_ = new trie_relocator<double_trie_impl>
+                              (this, &double_trie_impl::relocate_rear);
+    } catch (...) {
+        delete lhs;
+        delete rhs;
+        sanity_delete(front_relocator_);
+        throw;
+    }
+    delete lhs_;
+    delete rhs_;
+    lhs_ = lhs;
+    rhs_ = rhs;
+    lhs_->set_relocator(front_relocator_);
+    rhs_->set_relocator(rear_relocator_);
+    payload_->detach();
+    flags_->detach();
+    alphabet_->detach();
+    // the filter would miss keys inserted from now on
+    filter_.clear();
+    root_table_.clear();
+    index_ = duplicate(index_, header_->index_size);
+    accept_ = duplicate(accept_, header_->accept_size);
+    header_ = new header_type(*header_);
+    release_archive(mmap_, mmap_size_, ownership_);
+    mmap_ = NULL;
+    mmap_size_ = 0;
+    ownership_ = BORROW_MEMORY;
+
+    // build() leaves no room after the last entries
+    next_index_ = std::max<size_type>(header_->index_size, 1);
+    next_accept_ = std::max<size_type>(header_->accept_size, 1);
+    watcher_[0] = 0;
+    watcher_[1] = 0;
+
+    // rebuild back references from separators in front trie
+    std::vector<bool> index_used(next_index_), accept_used(next_accept_);
+    size_type s, i, a;
+    for (s = 1; s < lhs_->header()->size; s++) {
+        if (lhs_->check(s) <= 0 || lhs_->base(s) >= 0)
+            continue;
+        i = -lhs_->base(s);
+        if (i >= next_index_ || index_[i].index >= next_accept_)
+            throw bad_trie_archive("file corrupted");
+        index_used[i] = true;
+        if (!(a = index_[i].index))
+            continue;
+        accept_used[a] = true;
+        refer_[accept_[a].accept].accept_index = a;
+        refer_[accept_[a].accept].referer.insert(s);
+    }
+    for (i = 1; i < next_index_; i++) {
+        if (!index_used[i])
+            free_index_.push_back(i);
+    }
+    for (a = 1; a < next_accept_; a++) {
+        if (!accept_used[a])
+            free_accept_.push_back(a);
+    }
+}
+
+template<typename Traits>
+double_trie_impl<Traits>::~double_trie_impl()
 {
     if (mmap_) {
-        if (munmap(mmap_, mmap_size_) < 0)
-            throw std::runtime_error(strerror(errno));
+        release_archive(mmap_, mmap_size_, ownership_);
     } else {
         sanity_delete(header_);
         resize(index_, 0, 0);  // free index_
@@ -428,10 +966,16 @@ double_trie::~double_trie()
     }
     sanity_delete(lhs_);
     sanity_delete(rhs_);
+    sanity_delete(compressed_);
+    sanity_delete(relaid_rear_);
+    sanity_delete(payload_);
+    sanity_delete(flags_);
+    sanity_delete(alphabet_);
 }
 
+template<typename Traits>
 trie::size_type
-double_trie::rhs_append(const char_type *inputs)
+double_trie_impl<Traits>::rhs_append(const char_type *inputs)
 {
     const char_type *p;
     size_type s = 1, t;
@@ -441,14 +985,14 @@ double_trie::rhs_append(const char_type *inputs)
         if (outdegree(s) == 0) {
             return s;
         } else {
-            t = rhs_->next(s, key_type::kTerminator);
+            t = rhs_->next(s, Traits::kTerminator);
             if (!rhs_->check_transition(s, t))
-                return rhs_->create_transition(s, key_type::kTerminator);
+                return rhs_->create_transition(s, Traits::kTerminator);
             return t;
         }
     }
     if (outdegree(s) == 0) {
-        t = rhs_->create_transition(s, key_type::kTerminator);
+        t = rhs_->create_transition(s, Traits::kTerminator);
         std::set<size_type>::const_iterator it;
         if (refer_.find(s) != refer_.end()) {
             for (it = refer_[s].referer.begin();
@@ -465,22 +1009,26 @@ double_trie::rhs_append(const char_type *inputs)
     return s;
 }
 
+template<typename Traits>
 void
-double_trie::lhs_insert(size_type s, const char_type *inputs, value_type value)
+double_trie_impl<Traits>::lhs_insert(size_type s, const char_type *inputs,
+                                     value_type value, bool payload)
 {
     size_t i;
     s = lhs_->create_transition(s, inputs[0]);
-    if (*inputs == key_type::kTerminator) {
+    if (*inputs == Traits::kTerminator) {
         i = find_index_entry(s);
-        index_[i].index = 0;
+        set_index_accept(i, 0);
     } else {
         i = set_link(s, rhs_append(inputs + 1));
     }
-    index_[i].data = value;
+    set_index_data(i, value, payload);
 }
 
-void double_trie::rhs_clean_more(size_type t)
+template<typename Traits>
+void double_trie_impl<Traits>::rhs_clean_more(size_type t)
 {
+    TRIE_COUNT(rear_cleans, 1);
     if (outdegree(t) == 0 && count_referer(t) == 0) {
         assert(rhs_->check(t) > 0);
         size_type s = rhs_->prev(t);
@@ -488,7 +1036,7 @@ void double_trie::rhs_clean_more(size_type t)
         assert(s > 0);
         rhs_clean_more(s);
     } else if (outdegree(t) == 1) {
-        size_type r = rhs_->next(t, key_type::kTerminator);
+        size_type r = rhs_->next(t, Traits::kTerminator);
         if (rhs_->check_transition(t, r)) {
             // delete transition 't -#-> r'
             if (refer_.find(r) != refer_.end()) {
@@ -498,7 +1046,7 @@ void double_trie::rhs_clean_more(size_type t)
                         it++)
                     set_link(*it, t);
                 assert (refer_.find(t) != refer_.end());
-                accept_[refer_[t].accept_index].accept = t;
+                set_accept(refer_[t].accept_index, t);
             }
             if (rhs_->base(r) > 1)
                 rhs_->set_last_base(rhs_->base(r));
@@ -507,18 +1055,21 @@ void double_trie::rhs_clean_more(size_type t)
     }
 }
 
-void double_trie::rhs_insert(size_type s, size_type r,
-                             const std::vector<char_type> &match,
-                             const char_type *remain,
-                             char_type ch, size_type value)
+template<typename Traits>
+void double_trie_impl<Traits>::rhs_insert(size_type s, size_type r,
+                                          const std::vector<label_type> &match,
+                                          const char_type *remain,
+                                          char_type ch, size_type value,
+                                          bool payload)
 {
     // R-1
     size_type u = link_state(s);
     assert(u > 0);
     assert(rhs_->check(u) > 0);
     value_type oval = index_[-lhs_->base(s)].data;
-    index_[-lhs_->base(s)].index = 0;
-    index_[-lhs_->base(s)].data = 0;
+    bool oflag = flags_->test(-lhs_->base(s));
+    set_index_accept(-lhs_->base(s), 0);
+    set_index_data(-lhs_->base(s), 0, false);
     free_index_.push_back(-lhs_->base(s));
     // s is separator which implies base(s) < 0, so we need to set base(s) = 0
     lhs_->set_base(s, 0);
@@ -532,33 +1083,33 @@ void double_trie::rhs_insert(size_type s, size_type r,
     }
 
     // R-2
-    std::vector<char_type>::const_iterator it;
+    typename std::vector<label_type>::const_iterator it;
     for (it = match.begin(); it != match.end(); it++) {
         s = lhs_->create_transition(s, *it);
     }
 
     size_type t = lhs_->create_transition(s, *remain);
     size_type i;
-    if (*remain == key_type::kTerminator) {
+    if (*remain == Traits::kTerminator) {
         i = find_index_entry(t);
-        index_[-lhs_->base(t)].data = value;
-        index_[-lhs_->base(t)].index = 0;
+        set_index_data(-lhs_->base(t), value, payload);
+        set_index_accept(-lhs_->base(t), 0);
     } else {
         size_type a = rhs_append(remain + 1);
         assert(rhs_->check(watcher_[0]) > 0);
         i = set_link(t, a);
-        index_[i].data = value;
+        set_index_data(i, value, payload);
     }
 
     // R-3
     t = lhs_->create_transition(s, ch);
     size_type v = rhs_->prev(watcher_[1]);  // v -ch-> r
-    if (!rhs_->check_transition(v, rhs_->next(v, key_type::kTerminator)))
-        r = rhs_->create_transition(v, key_type::kTerminator);
+    if (!rhs_->check_transition(v, rhs_->next(v, Traits::kTerminator)))
+        r = rhs_->create_transition(v, Traits::kTerminator);
     else
-        r = rhs_->next(v, key_type::kTerminator);
+        r = rhs_->next(v, Traits::kTerminator);
     i = set_link(t, r);
-    index_[i].data = oval;
+    set_index_data(i, oval, oflag);
 
     // R-4
     u = watcher_[0];
@@ -566,25 +1117,37 @@ void double_trie::rhs_insert(size_type s, size_type r,
         rhs_clean_more(u);
 }
 
-void double_trie::insert(const key_type &key, const value_type &value)
+template<typename Traits>
+void double_trie_impl<Traits>::insert(const key_type &key,
+                                      const value_type &value)
 {
+    store(key, value, false);
+}
+
+template<typename Traits>
+void double_trie_impl<Traits>::store(const key_type &key, value_type value,
+                                     bool payload)
+{
+    detach_archive();
     const char_type *p;
-    size_type s = lhs_->go_forward(1, key.data(), &p);
+    encoded_key<Traits> code(*alphabet_, key);
+    sequence_lock::writer writer(&lock_);
+    size_type s = lhs_->go_forward(1, code.data(), &p);
 
     if (!p) {
         // duplicated key found
-        index_[-lhs_->base(s)].data = value;
+        set_index_data(-lhs_->base(s), value, payload);
         return;
     }
 
     if (!check_separator(s)) {
-        lhs_insert(s, p, value);
+        lhs_insert(s, p, value, payload);
         return;
     }
     assert(index_[-lhs_->base(s)].index > 0);
     size_type r = link_state(s);
     // skip dummy terminator
-    if (rhs_->check_reverse_transition(r, key_type::kTerminator)
+    if (rhs_->check_reverse_transition(r, Traits::kTerminator)
         && rhs_->prev(r) > 1)
         r = rhs_->prev(r);
 
@@ -598,70 +1161,220 @@ void double_trie::insert(const key_type &key, const value_type &value)
             break;
         }
         if (r == 1) {  // duplicated key
-            index_[-lhs_->base(s)].data = value;
+            set_index_data(-lhs_->base(s), value, payload);
             return;
         }
-    } while (*p++ != key_type::kTerminator);
+    } while (*p++ != Traits::kTerminator);
     char_type mismatch = r - rhs_->base(rhs_->prev(r));
-    rhs_insert(s, r, exists_, p, mismatch, value);
+    rhs_insert(s, r, exists_, p, mismatch, value, payload);
     return;
 }
 
-bool double_trie::search(const key_type &key, value_type *value) const
+template<typename Traits>
+bool double_trie_impl<Traits>::search(const key_type &key,
+                                      value_type *value) const
+{
+    return lookup(key, value, NULL);
+}
+
+template<typename Traits>
+bool double_trie_impl<Traits>::lookup(const key_type &key, value_type *value,
+                                      bool *payload) const
+{
+    TRIE_COUNT(searches, 1);
+    // only a loaded archive is as old as its filter
+    if (mmap_ && filter_.enabled()
+        && !filter_.may_contain(key_filter::hash(key)))
+        return false;
+    encoded_key<Traits> code(*alphabet_, key);
+    value_type found_value;
+    bool found;
+    if (!concurrent_) {
+        // no insert runs meanwhile
+        found = search_aux<plain_loads>(code.data(), &found_value, payload);
+    } else {
+        sequence_lock::sequence_type sequence;
+        do {
+            sequence = lock_.read_begin();
+            found = search_aux<shared_loads>(code.data(), &found_value,
+                                             payload);
+        } while (!lock_.read_validate(sequence));
+    }
+    if (found && value)
+        *value = found_value;
+    return found;
+}
+
+template<typename Traits>
+template<typename L>
+bool double_trie_impl<Traits>::search_aux(const char_type *inputs,
+                                          value_type *value,
+                                          bool *payload) const
 {
     const char_type *p, *mismatch;
-    size_type s = lhs_->go_forward(1, key.data(), &p);
-    if (!p) {
-        if (value)
-            *value = index_[-lhs_->base(s)].data;
+    size_type s = root_table_.template go_forward<L>(*lhs_, inputs, &p), a;
+    TRIE_COUNT(states_visited, labels_walked(inputs, p, Traits::kTerminator));
+    size_type i = -lhs_->template base<L>(s);
+    if (!read_index<L>(i, value, &a))
+        return false;
+    if (payload)
+        *payload = flags_->template test<L>(i);
+    if (!p)
         return true;
-    }
-    if (!check_separator(s))
+    if (!a)
         return false;
-    assert(index_[-lhs_->base(s)].index > 0);
-    size_type r = link_state(s);
-    // skip a terminator
-    if (rhs_->check_reverse_transition(r, key_type::kTerminator))
+    size_type r = read_accept<L>(a);
+    // skip a terminator, unless it is all the suffix has
+    if (rhs_->template check_reverse_transition<L>(r, Traits::kTerminator)
+        && rhs_->template prev<L>(r) > 1)
+        r = rhs_->template prev<L>(r);
+    r = rhs_->template go_backward<L>(r, p, &mismatch);
+    TRIE_COUNT(states_visited, labels_walked(p, mismatch, Traits::kTerminator));
+    return r == 1;
+}
+
+template<typename Traits>
+void double_trie_impl<Traits>::insert_payload(const key_type &key,
+                                              const char *payload,
+                                              size_t length)
+{
+    detach_archive();
+    store(key, payload_->append(payload, length), true);
+}
+
+template<typename Traits>
+bool double_trie_impl<Traits>::search_payload(const key_type &key,
+                                              const char **payload,
+                                              size_t *length) const
+{
+    value_type offset;
+    bool flagged;
+    if (!lookup(key, &offset, &flagged) || !flagged)
+        return false;
+    return payload_->get(offset, payload, length);
+}
+
+template<typename Traits>
+void double_trie_impl<Traits>::set_filter(size_t bits_per_key)
+{
+    filter_bits_ = bits_per_key;
+}
+
+template<typename Traits>
+void double_trie_impl<Traits>::set_root_table(bool enable)
+{
+    use_root_table_ = enable;
+}
+
+template<typename Traits>
+void double_trie_impl<Traits>::set_compress_chains(bool enable)
+{
+    compress_chains_ = enable;
+}
+
+template<typename Traits>
+void double_trie_impl<Traits>::set_relayout(bool enable)
+{
+    relayout_ = enable;
+}
+
+template<typename Traits>
+void double_trie_impl<Traits>::profile(const key_type &key)
+{
+    encoded_key<Traits> code(*alphabet_, key);
+    const char_type *p, *mismatch;
+    size_type s = lhs_->go_forward(1, code.data(), &p), a;
+    value_type value;
+
+    lhs_->count_path(s, 1, &front_heat_);
+    if (!p || !read_index(-lhs_->base(s), &value, &a) || !a)
+        return;
+    // the rear trie is walked up from the accept state, @see search_aux()
+    size_type r = read_accept(a), start = r;
+    if (rhs_->check_reverse_transition(r, Traits::kTerminator)
+        && rhs_->prev(r) > 1)
         r = rhs_->prev(r);
     r = rhs_->go_backward(r, p, &mismatch);
-    if (r == 1) {
-        if (value)
-            *value = index_[-lhs_->base(s)].data;
-        return true;
-    }
-    return false;
+    rhs_->count_path(start, r, &rear_heat_);
+}
+
+template<typename Traits>
+void double_trie_impl<Traits>::remap_labels(const size_t *frequency)
+{
+    if (mmap_ || next_index_ > 1)
+        throw std::runtime_error("remap_labels: trie is not empty");
+    alphabet_->assign(frequency);
 }
 
+template<typename Traits>
 size_t
-double_trie::prefix_search(const key_type &key, result_type *result) const
+double_trie_impl<Traits>::prefix_search(const key_type &key,
+                                        result_type *result) const
+{
+    encoded_key<Traits> code(*alphabet_, key);
+    size_t first = result->size();
+    sequence_lock::sequence_type sequence;
+    for (;;) {
+        sequence = lock_.read_begin();
+        if (prefix_search_aux(code, result, sequence)
+            && lock_.read_validate(sequence))
+            break;
+        result->erase(result->begin() + first, result->end());
+    }
+    if (!alphabet_->identity())
+        alphabet_->decode(result, first);
+
+    return result->size();
+}
+
+template<typename Traits>
+bool
+double_trie_impl<Traits>::prefix_search_aux(
+    const encoded_key<Traits> &code, result_type *result,
+    sequence_lock::sequence_type sequence) const
 {
     const char_type *p;
-    size_type s = lhs_->go_forward(1, key.data(), &p);
+    size_type s = root_table_.go_forward(*lhs_, code.data(), &p);
     key_type store;
-    if (lhs_->check_reverse_transition(s, key_type::kTerminator))
+    size_t first = result->size();
+    // the keys of a prefix ending inside a chain follow all of it
+    const char_type *rest = p;
+    if (p && lhs_->chain(s) && !(rest = lhs_->chain_end(s, p)))
+        return true;
+    if (lhs_->check_reverse_transition(s, Traits::kTerminator))
         s = lhs_->prev(s);
     if (p)
-        store.assign(key.data(), p - key.data());
+        store.assign(code.data(), p - code.data());
     else
-        store.assign(key.data(), key.length());
-    lhs_->prefix_search_aux(s, p, &store, result);
+        store.assign(code.data(), code.length());
+    // the bare root of an empty trie is neither a leaf nor has children
+    if (!lhs_->base(s))
+        return true;
+    if (!lhs_->prefix_search_aux(s, p, &store, result, &lock_, sequence))
+        return false;
     result_type::iterator it;
-    for (it = result->begin(); it != result->end(); it++) {
-        size_t i = -it->second;
-        if (index_[i].index == 0) {
-            it->second = index_[i].data;
+    for (it = result->begin() + first; it != result->end(); it++) {
+        value_type data;
+        size_type a;
+        if (!read_index(-lhs_->base(it->second), &data, &a))
+            return false;
+        it->second = data;
+        if (a == 0)
             continue;
-        }
-        const char_type *miss = p;
+        const char_type *miss = rest;
         bool fail = false;
-        size_type r = accept_[index_[i].index].accept;
-        // skip a terminator
-        if (rhs_->check_reverse_transition(r, key_type::kTerminator))
+        size_type r = read_accept(a);
+        // skip a terminator, unless it is all the suffix has
+        if (rhs_->check_reverse_transition(r, Traits::kTerminator)
+            && rhs_->prev(r) > 1)
             r = rhs_->prev(r);
         do {
+            // a partial update may even link states into a cycle
+            if (!lock_.read_validate(sequence))
+                return false;
             char_type ch = r - rhs_->base(rhs_->prev(r));
             r = rhs_->prev(r);
-            if (miss && *miss != key_type::kTerminator) {
+            if (miss && *miss != Traits::kTerminator) {
                 if (!rhs_->check_transition(r, rhs_->next(r, *miss))) {
                     fail = true;
                     break;
@@ -670,154 +1383,465 @@ double_trie::prefix_search(const key_type &key, result_type *result) const
             }
             it->first.push(ch);
         } while (r > 1);
-        if (fail || (miss && *miss != key_type::kTerminator)) {
+        if (fail || (miss && *miss != Traits::kTerminator)) {
             --it;
             result->erase(it + 1);
             continue;
         }
-        it->second = index_[i].data;
     }
+    return true;
+}
 
-    return result->size();
+template<typename Traits>
+void double_trie_impl<Traits>::set_concurrent(bool concurrent)
+{
+    // an archive would be released by the first insert
+    detach_archive();
+    concurrent_ = concurrent;
+    retired_.enable(concurrent);
+    lhs_->set_concurrent(concurrent);
+    rhs_->set_concurrent(concurrent);
+    payload_->set_concurrent(concurrent);
+    flags_->set_concurrent(concurrent);
 }
 
-void double_trie::build(const char *filename, bool verbose)
+template<typename Traits>
+void double_trie_impl<Traits>::reclaim()
 {
-    FILE *out;
+    retired_.reclaim();
+    lhs_->reclaim();
+    rhs_->reclaim();
+    payload_->reclaim();
+    flags_->reclaim();
+}
 
-    if (!filename)
-        throw std::runtime_error(std::string("can not save to file ")
-                                 + filename);
+template<typename Traits>
+trie::stats_type double_trie_impl<Traits>::stats() const
+{
+    typedef typename basic_trie_type::state_type state_type;
+    stats_type stats;
+    // entries handed out, a loaded archive holds no more
+    size_type indexes = mmap_?header_->index_size:next_index_;
+    size_type accepts = mmap_?header_->accept_size:next_accept_;
+    std::vector<size_type> depths(lhs_->max_state() + 1, -1);
+    std::vector<bool> accepted(std::max<size_type>(accepts, 1));
+    size_t depth = 0, tails = 0;
+
+    stats.type = DOUBLE_TRIE;
+    lhs_->collect_stats(&stats.front);
+    rhs_->collect_stats(&stats.rear);
+    // every key ends at a separator of the front trie
+    for (size_type s = 2; s <= lhs_->max_state(); s++) {
+        size_type i = -lhs_->base(s);
+        if (lhs_->check(s) <= 0 || i <= 0 || i >= indexes)
+            continue;
+        size_t d = lhs_->depth(s, &depths);
+        depth += d;
+        stats.max_depth = std::max(stats.max_depth, d);
+        stats.keys++;
+        size_type a = index_[i].index;
+        if (a > 0 && a < accepts) {
+            tails++;
+            if (!accepted[a]) {
+                accepted[a] = true;
+                stats.accept_live++;
+            }
+        }
+    }
+    stats.index_live = stats.keys;
+    stats.index_allocated = std::max<size_type>(indexes - 1, 0);
+    stats.accept_allocated = std::max<size_type>(accepts - 1, 0);
+    if (stats.accept_live)
+        stats.rear_sharing = static_cast<double>(tails) / stats.accept_live;
+    stats.tail_bytes = sizeof(state_type) * stats.rear.used
+                       + sizeof(accept_type) * stats.accept_live;
+    if (stats.keys)
+        stats.average_depth = static_cast<double>(depth) / stats.keys;
+    if (mmap_) {
+        stats.bytes = mmap_size_;
+    } else {
+        stats.bytes = sizeof(header_type)
+                      + sizeof(state_type) * (stats.front.allocated
+                                              + stats.rear.allocated)
+                      + sizeof(index_type) * header_->index_size
+                      + sizeof(accept_type) * header_->accept_size
+                      + payload_->size() + flags_->size()
+                      + sizeof(label_type) * alphabet_->size();
+    }
+    if (stats.keys)
+        stats.bytes_per_key = static_cast<double>(stats.bytes) / stats.keys;
+    return stats;
+}
 
-    if ((out = fopen(filename, "w+"))) {
+template<typename Traits>
+void double_trie_impl<Traits>::archive(archive_writer *writer)
+{
+    // a loaded archive is consistent already
+    if (!mmap_) {
         header_->index_size = next_index_;
         header_->accept_size = next_accept_;
-        fwrite(header_, sizeof(header_type), 1, out);
-        fwrite(index_, sizeof(index_type) * header_->index_size, 1, out);
-        fwrite(accept_, sizeof(accept_type) * header_->accept_size, 1, out);
-        fwrite(lhs_->compact_header(),
-               sizeof(basic_trie::header_type), 1, out);
-        fwrite(lhs_->states(), sizeof(basic_trie::state_type)
-                               * lhs_->compact_header()->size, 1, out);
-        fwrite(rhs_->compact_header(),
-               sizeof(basic_trie::header_type), 1, out);
-        fwrite(rhs_->states(), sizeof(basic_trie::state_type)
-                               * rhs_->compact_header()->size, 1, out);
-        fclose(out);
-        if (verbose) {
-            char buf[256];
-            size_t size[4];
-            size[0] = sizeof(index_type) * header_->index_size;
-            size[1] = sizeof(accept_type) * header_->accept_size;
-            size[2] = sizeof(basic_trie::state_type)
-                      * lhs_->compact_header()->size;
-            size[3] = sizeof(basic_trie::state_type)
-                      * rhs_->compact_header()->size;
-
-            std::cerr << "index = "
-                      << pretty_size(size[0], buf, sizeof(buf));
-            std::cerr << ", accept = "
-                      << pretty_size(size[1], buf, sizeof(buf));
-            std::cerr << ", front = "
-                      << pretty_size(size[2], buf, sizeof(buf));
-            std::cerr << ", rear = "
-                      << pretty_size(size[3], buf, sizeof(buf));
-            std::cerr << ", total = "
-                      << pretty_size(size[0] + size[1] + size[2] + size[3],
-                                     buf, sizeof(buf))
-                      << std::endl;
+        header_->payload_size = payload_->size();
+        header_->alphabet_size = alphabet_->size();
+    }
+
+    // a loaded archive keeps the chains and the layout it has
+    const basic_trie_type *lhs = lhs_, *rhs = rhs_;
+    const accept_type *accept = accept_;
+    if (!mmap_ && (compress_chains_ || relayout_)) {
+        sanity_delete(compressed_);
+        compressed_ = new basic_trie_type();
+        compressed_->copy_from(*lhs_, compress_chains_?
+                                      basic_trie_type::kMinChain:0,
+                               NULL, relayout_?&front_heat_:NULL);
+        lhs = compressed_;
+    }
+    if (!mmap_ && relayout_) {
+        std::vector<size_type> renumber;
+        sanity_delete(relaid_rear_);
+        relaid_rear_ = new basic_trie_type();
+        relaid_rear_->copy_from(*rhs_, 0, &renumber, &rear_heat_);
+        // accept entries follow their states, free ones point nowhere
+        relaid_accept_.assign(accept_, accept_ + header_->accept_size);
+        for (size_t a = 0; a < relaid_accept_.size(); a++) {
+            size_type r = relaid_accept_[a].accept;
+            relaid_accept_[a].accept =
+                (r > 0 && static_cast<size_t>(r) < renumber.size())?
+                renumber[r]:0;
         }
+        rhs = relaid_rear_;
+        if (!relaid_accept_.empty())
+            accept = &relaid_accept_[0];
+    }
+
+    writer->add(SECTION_HEADER, header_, sizeof(header_type));
+    writer->add(SECTION_INDEX, index_,
+                sizeof(index_type) * header_->index_size);
+    writer->add(SECTION_ACCEPT, accept,
+                sizeof(accept_type) * header_->accept_size);
+    writer->add(SECTION_FRONT, lhs->compact_header(),
+                sizeof(typename basic_trie_type::header_type));
+    writer->add(SECTION_FRONT, lhs->states(),
+                sizeof(typename basic_trie_type::state_type)
+                * lhs->compact_header()->size);
+    // old readers would miss keys behind chains, they must fail
+    if (lhs->chain_size())
+        writer->add(SECTION_CHAIN, lhs->chains(),
+                    sizeof(size_type) * lhs->chain_size());
+    writer->add(SECTION_REAR, rhs->compact_header(),
+                sizeof(typename basic_trie_type::header_type));
+    writer->add(SECTION_REAR, rhs->states(),
+                sizeof(typename basic_trie_type::state_type)
+                * rhs->compact_header()->size);
+    if (header_->payload_size) {
+        writer->add(SECTION_PAYLOAD, payload_->data(), header_->payload_size);
+        flags_->archive(writer);
+    }
+    if (header_->alphabet_size)
+        writer->add(SECTION_ALPHABET, alphabet_->table(),
+                    sizeof(label_type) * header_->alphabet_size);
+    if (filter_bits_) {
+        // the filter of a loaded archive is reused if it is as large
+        if (!mmap_ || filter_.bits_per_key() != filter_bits_)
+            build_filter(*this, filter_bits_, &filter_);
+        // old readers skip it
+        writer->add(SECTION_FILTER, filter_.data(), filter_.size(), 0);
+    }
+    if (use_root_table_) {
+        // so is the table of a loaded archive
+        if (!mmap_ || !root_table_.enabled())
+            root_table_.build(*lhs);
+        writer->add(SECTION_ROOT, root_table_.data(), root_table_.size(), 0);
     }
 }
 
+template<typename Traits>
+void double_trie_impl<Traits>::serialize(int fd)
+{
+    archive_writer writer(magic_);
+    archive(&writer);
+    writer.write(fd);
+    release_relayout();
+    if (!mmap_) {
+        filter_.clear();
+        root_table_.clear();
+    }
+}
+
+template<typename Traits>
+void double_trie_impl<Traits>::build(const char *filename, bool verbose)
+{
+    if (!filename)
+        throw std::runtime_error("can not save to file (null)");
+
+    archive_writer writer(magic_);
+    archive(&writer);
+    writer.write(filename);
+    // the filter of keys in memory is stale after the next insert
+    if (!mmap_) {
+        filter_.clear();
+        root_table_.clear();
+    }
+    if (verbose) {
+        const basic_trie_type *lhs = compressed_?compressed_:lhs_;
+        const basic_trie_type *rhs = relaid_rear_?relaid_rear_:rhs_;
+        char buf[256];
+        size_t size[5];
+        size[0] = sizeof(index_type) * header_->index_size;
+        size[1] = sizeof(accept_type) * header_->accept_size;
+        size[2] = sizeof(typename basic_trie_type::state_type)
+                  * lhs->compact_header()->size
+                  + sizeof(size_type) * lhs->chain_size();
+        size[3] = sizeof(typename basic_trie_type::state_type)
+                  * rhs->compact_header()->size;
+        size[4] = header_->payload_size;
+
+        std::cerr << "index = "
+                  << pretty_size(size[0], buf, sizeof(buf));
+        std::cerr << ", accept = "
+                  << pretty_size(size[1], buf, sizeof(buf));
+        std::cerr << ", front = "
+                  << pretty_size(size[2], buf, sizeof(buf));
+        std::cerr << ", rear = "
+                  << pretty_size(size[3], buf, sizeof(buf));
+        std::cerr << ", payload = "
+                  << pretty_size(size[4], buf, sizeof(buf));
+        std::cerr << ", total = "
+                  << pretty_size(size[0] + size[1] + size[2] + size[3]
+                                 + size[4], buf, sizeof(buf))
+                  << std::endl;
+    }
+    release_relayout();
+}
+
+template<typename Traits>
+void double_trie_impl<Traits>::release_relayout()
+{
+    sanity_delete(compressed_);
+    sanity_delete(relaid_rear_);
+    std::vector<accept_type>().swap(relaid_accept_);
+}
+
 // ************************************************************************
 // * Implementation of suffix trie                                        *
 // ************************************************************************
 
-single_trie::single_trie(size_t size)
+template<typename Traits>
+single_trie_impl<Traits>::single_trie_impl(size_t size)
     :trie_(NULL), suffix_(NULL), header_(NULL), next_suffix_(1),
-     mmap_(NULL), mmap_size_(0)
+     payload_(NULL), flags_(NULL), alphabet_(NULL), filter_bits_(0),
+     use_root_table_(false), compress_chains_(false), compressed_(NULL),
+     relayout_(false), values_(NULL), concurrent_(false), mmap_(NULL),
+     mmap_size_(0), ownership_(BORROW_MEMORY)
 {
-    trie_ = new basic_trie(size);
+    trie_ = new basic_trie_type(size);
+    payload_ = new payload_heap();
+    flags_ = new payload_flags();
+    alphabet_ = new trie_alphabet<Traits>();
     header_ = new header_type();
     memset(&common_, 0, sizeof(common_));
-    resize_suffix(size?size:basic_trie::kDefaultStateSize);
+    resize_suffix(size?size:basic_trie_type::kDefaultStateSize);
     resize_common(kDefaultCommonSize);
 }
 
-single_trie::single_trie(const char *filename)
+template<typename Traits>
+single_trie_impl<Traits>::single_trie_impl(const char *filename,
+                                           const load_options &options)
     :trie_(NULL), suffix_(NULL), header_(NULL), next_suffix_(1),
-     mmap_(NULL), mmap_size_(0)
+     payload_(NULL), flags_(NULL), alphabet_(NULL), filter_bits_(0),
+     use_root_table_(false), compress_chains_(false), compressed_(NULL),
+     relayout_(false), values_(NULL), concurrent_(false), mmap_(NULL),
+     mmap_size_(0), ownership_(BORROW_MEMORY)
 {
-    struct stat sb;
-    int fd, retval;
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    mmap_ = map_archive(filename, &mmap_size_, options);
+    try {
+        load(options, start);
+    } catch (...) {
+        release_archive(mmap_, mmap_size_, ADOPT_MAPPING);
+        throw;
+    }
+    ownership_ = ADOPT_MAPPING;
+}
 
-    if (!filename)
-        throw std::runtime_error(std::string("can not load from file ")
-                                 + filename);
+template<typename Traits>
+single_trie_impl<Traits>::single_trie_impl(const void *data, size_t size,
+                                           ownership_type ownership,
+                                           const load_options &options)
+    :trie_(NULL), suffix_(NULL), header_(NULL), next_suffix_(1),
+     payload_(NULL), flags_(NULL), alphabet_(NULL), filter_bits_(0),
+     use_root_table_(false), compress_chains_(false), compressed_(NULL),
+     relayout_(false), values_(NULL), concurrent_(false), mmap_(NULL),
+     mmap_size_(0), ownership_(BORROW_MEMORY)
+{
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    check_archive_memory(data, size);
+    mmap_ = const_cast<void *>(data);
+    mmap_size_ = size;
+    load(options, start);
+    ownership_ = ownership;
+}
 
-    fd = open(filename, O_RDONLY);
-    if (fd < 0)
-        throw std::runtime_error(strerror(errno));
-    if (fstat(fd, &sb) < 0)
-        throw std::runtime_error(strerror(errno));
+template<typename Traits>
+void single_trie_impl<Traits>::load(const load_options &options,
+                                      const struct timeval &start)
+{
+    try {
+        if (archive_reader::match(mmap_, mmap_size_)) {
+            archive_reader reader(mmap_, mmap_size_, options.verify);
+            load_sections(reader);
+            prepare_archive(mmap_, mmap_size_, &reader, options, start);
+        } else {
+            load_legacy();
+            prepare_archive(mmap_, mmap_size_, NULL, options, start);
+        }
+    } catch (...) {
+        // the destructor will not run, free what is loaded so far
+        sanity_delete(trie_);
+        sanity_delete(payload_);
+        sanity_delete(flags_);
+        sanity_delete(alphabet_);
+        throw;
+    }
+}
 
-    mmap_ = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (mmap_ == MAP_FAILED)
-        throw std::runtime_error(strerror(errno));
-    while (retval = close(fd), retval == -1 && errno == EINTR) {
-        // exmpty
+template<typename Traits>
+void single_trie_impl<Traits>::load_sections(const archive_reader &reader)
+{
+    size_t length;
+    const void *start;
+
+    if (strcmp(reader.type(), magic_))
+        throw bad_trie_archive("file magic error");
+    header_ = static_cast<header_type *>(const_cast<void *>(
+                  reader.require(SECTION_HEADER, sizeof(header_type))));
+    suffix_ = static_cast<suffix_type *>(const_cast<void *>(
+                  reader.require(SECTION_SUFFIX, sizeof(suffix_type)
+                                                 * header_->suffix_size)));
+    trie_ = load_basic_trie<basic_trie_type>(reader, SECTION_TRIE);
+    start = reader.section(SECTION_TAIL_VALUE, &length);
+    if (start) {
+        if (length != sizeof(value_type) * (trie_->max_state() + 1))
+            throw bad_trie_archive("file corrupted");
+        values_ = static_cast<const value_type *>(start);
     }
-    mmap_size_ = sb.st_size;
+    start = reader.section(SECTION_PAYLOAD, &length);
+    payload_ = new payload_heap(const_cast<void *>(start), length);
+    flags_ = load_payload_flags(reader);
+    alphabet_ = new trie_alphabet<Traits>();
+    load_alphabet(reader, alphabet_);
+    filter_bits_ = load_filter(reader, &filter_);
+    use_root_table_ = load_root_table(reader, trie_->max_state() + 1,
+                                      &root_table_);
+    compress_chains_ = load_chains(reader, trie_);
+}
 
+template<typename Traits>
+void single_trie_impl<Traits>::load_legacy()
+{
     void *start;
     start = header_ = reinterpret_cast<header_type *>(mmap_);
-    if (strcmp(header_->magic, magic_))
+    if (!archive_contains(mmap_, mmap_size_, header_, 1)
+        || strncmp(header_->magic, magic_, sizeof(header_->magic)))
         throw std::runtime_error("file corrupted");
     // load suffix
     suffix_ = reinterpret_cast<suffix_type *>(
               reinterpret_cast<header_type *>(start) + 1);
+    if (!archive_contains(mmap_, mmap_size_, suffix_, header_->suffix_size))
+        throw std::runtime_error("file corrupted");
     // load trie
     start = suffix_ + header_->suffix_size;
-    trie_ = new basic_trie(start,
-                          reinterpret_cast<basic_trie::header_type *>(start)
-                          + 1);
+    trie_ = load_legacy_trie<basic_trie_type>(mmap_, mmap_size_, &start);
+    // this layout never carried payloads or an alphabet
+    if (header_->payload_size || header_->alphabet_size)
+        throw std::runtime_error("file corrupted");
+    payload_ = new payload_heap();
+    flags_ = new payload_flags();
+    alphabet_ = new trie_alphabet<Traits>();
 }
 
 
-single_trie::~single_trie()
+template<typename Traits>
+void single_trie_impl<Traits>::detach_archive()
+{
+    if (!mmap_)
+        return;
+
+    basic_trie_type *trie = new basic_trie_type(*trie_);
+    delete trie_;
+    trie_ = trie;
+    payload_->detach();
+    alphabet_->detach();
+    // the filter would miss keys inserted from now on
+    filter_.clear();
+    root_table_.clear();
+    size_type suffix_size = header_->suffix_size;
+    // insert_suffix() and create_branch() need a tail per key
+    if (values_)
+        suffix_ = unshare_tails(&suffix_size);
+    else
+        suffix_ = duplicate(suffix_, suffix_size);
+    values_ = NULL;
+    flags_->detach();
+    // unshare_tails() takes states as they are loaded
+    if (trie_->chain_size()) {
+        trie = flatten_basic_trie(*trie_);
+        delete trie_;
+        trie_ = trie;
+    }
+    header_ = new header_type(*header_);
+    header_->suffix_size = suffix_size;
+    release_archive(mmap_, mmap_size_, ownership_);
+    mmap_ = NULL;
+    mmap_size_ = 0;
+    ownership_ = BORROW_MEMORY;
+
+    // build() leaves no room after the last suffix
+    next_suffix_ = std::max<size_type>(header_->suffix_size, 1);
+    memset(&common_, 0, sizeof(common_));
+    resize_common(kDefaultCommonSize);
+}
+
+template<typename Traits>
+single_trie_impl<Traits>::~single_trie_impl()
 {
     if (mmap_) {
-        if (munmap(mmap_, mmap_size_) < 0)
-            throw std::runtime_error(strerror(errno));
+        release_archive(mmap_, mmap_size_, ownership_);
     } else {
         sanity_delete(header_);
         resize(suffix_, 0, 0);   // free suffix_
         resize(common_.data, 0, 0);  // free common_.data
     }
     sanity_delete(trie_);
+    sanity_delete(compressed_);
+    sanity_delete(payload_);
+    sanity_delete(flags_);
+    sanity_delete(alphabet_);
 }
 
-void single_trie::insert_suffix(size_type s,
-                                const char_type *inputs,
-                                value_type value)
+template<typename Traits>
+void single_trie_impl<Traits>::insert_suffix(size_type s,
+                                             const char_type *inputs,
+                                             value_type value, bool payload)
 {
     trie_->set_base(s, -next_suffix_);
     const char_type *p = inputs;
     do {
-        // +1 for value
         if (next_suffix_ + 1 >= header_->suffix_size)
             resize_suffix(next_suffix_ + 1);
-        suffix_[next_suffix_++] = *p;
-    } while (*p++ != key_type::kTerminator);
-    suffix_[next_suffix_++] = value;
+        set_suffix(next_suffix_++, *p);
+    } while (*p++ != Traits::kTerminator);
+    append_suffix_value(value, payload);
 }
 
-void single_trie::create_branch(size_type s,
-                                const char_type *inputs,
-                                value_type value)
+template<typename Traits>
+void single_trie_impl<Traits>::create_branch(size_type s,
+                                             const char_type *inputs,
+                                             value_type value, bool payload)
 {
-    basic_trie::extremum_type extremum = {0, 0};
+    TRIE_COUNT(branches, 1);
+    typename basic_trie_type::extremum_type extremum = {0, 0};
     size_type start = -trie_->base(s);
 
     // find common string
@@ -834,14 +1858,14 @@ void single_trie::create_branch(size_type s,
         if (*p < extremum.min || !extremum.min)
             extremum.min = *p;
         ++start;
-    } while (*p++ != key_type::kTerminator);
+    } while (*p++ != Traits::kTerminator);
     common_.data[i] = 0;  // end common string
 
     // check if already exists by checking if the last common char is
     // terminator
-    if (i > 0 && common_.data[i - 1] == key_type::kTerminator) {
+    if (i > 0 && common_.data[i - 1] == Traits::kTerminator) {
         // duplicated key
-        suffix_[start] = value;
+        set_suffix_value(start, value, payload);
         return;
     }
 
@@ -860,134 +1884,566 @@ void single_trie::create_branch(size_type s,
 
     // create twig for new suffix
     t = trie_->create_transition(s, *p);
-    if (*p == key_type::kTerminator) {
-        trie_->set_base(t, -next_suffix_);
-        suffix_[next_suffix_++] = value;
+    if (*p == Traits::kTerminator) {
+        trie_->set_base(t, -append_suffix_value(value, payload));
     } else {
-        insert_suffix(t, p + 1, value);
+        insert_suffix(t, p + 1, value, payload);
     }
 }
 
 
-void single_trie::insert(const key_type &key, const value_type &value)
+template<typename Traits>
+void single_trie_impl<Traits>::insert(const key_type &key,
+                                      const value_type &value)
 {
+    store(key, value, false);
+}
+
+template<typename Traits>
+void single_trie_impl<Traits>::store(const key_type &key, value_type value,
+                                     bool payload)
+{
+    detach_archive();
     const char_type *p;
-    size_type s = trie_->go_forward(1, key.data(), &p);
+    encoded_key<Traits> code(*alphabet_, key);
+    sequence_lock::writer writer(&lock_);
+    size_type s = trie_->go_forward(1, code.data(), &p);
     if (trie_->base(s) < 0) {
         if (p) {
-            create_branch(s, p, value);
+            create_branch(s, p, value, payload);
         } else {
             // duplicated key
-            suffix_[-trie_->base(s)] = value;
+            set_suffix_value(-trie_->base(s), value, payload);
         }
     } else {
         s = trie_->create_transition(s, *p);
-        if (*p == key_type::kTerminator) {
-            trie_->set_base(s, -next_suffix_);
-            suffix_[next_suffix_++] = value;
+        if (*p == Traits::kTerminator) {
+            trie_->set_base(s, -append_suffix_value(value, payload));
         } else {
-            insert_suffix(s, p + 1, value);
+            insert_suffix(s, p + 1, value, payload);
         }
     }
 }
 
-bool single_trie::search(const key_type &key, value_type *value) const
+template<typename Traits>
+bool single_trie_impl<Traits>::search(const key_type &key,
+                                      value_type *value) const
+{
+    return lookup(key, value, NULL);
+}
+
+template<typename Traits>
+bool single_trie_impl<Traits>::lookup(const key_type &key, value_type *value,
+                                      bool *payload) const
+{
+    TRIE_COUNT(searches, 1);
+    // only a loaded archive is as old as its filter
+    if (mmap_ && filter_.enabled()
+        && !filter_.may_contain(key_filter::hash(key)))
+        return false;
+    encoded_key<Traits> code(*alphabet_, key);
+    value_type found_value;
+    bool found;
+    if (!concurrent_) {
+        // no insert runs meanwhile
+        found = search_aux<plain_loads>(code.data(), &found_value, payload);
+    } else {
+        sequence_lock::sequence_type sequence;
+        do {
+            sequence = lock_.read_begin();
+            found = search_aux<shared_loads>(code.data(), &found_value,
+                                             payload);
+        } while (!lock_.read_validate(sequence));
+    }
+    if (found && value)
+        *value = found_value;
+    return found;
+}
+
+template<typename Traits>
+template<typename L>
+bool single_trie_impl<Traits>::search_aux(const char_type *inputs,
+                                          value_type *value,
+                                          bool *payload) const
 {
     const char_type *p;
-    size_type s = trie_->go_forward(1, key.data(), &p);
-    if (trie_->base(s) < 0) {
-        size_type start = -trie_->base(s);
-        if (p) {
-            do {
-                if (*p != suffix_[start++])
-                    return false;
-            } while (*p++ != key_type::kTerminator);
-        }
-        if (value)
-            *value = suffix_[start];
-        return true;
+    size_type s = root_table_.template go_forward<L>(*trie_, inputs, &p);
+    TRIE_COUNT(states_visited, labels_walked(inputs, p, Traits::kTerminator));
+    size_type start = -trie_->template base<L>(s);
+    if (start <= 0)
+        return false;
+    if (p) {
+        do {
+            if (*p != read_suffix<L>(start++))
+                return false;
+        } while (*p++ != Traits::kTerminator);
     }
-    return false;
+    *value = tail_value<L>(s, start);
+    if (payload)
+        *payload = tail_flag<L>(s, start);
+    return true;
 }
 
+template<typename Traits>
+void single_trie_impl<Traits>::insert_payload(const key_type &key,
+                                              const char *payload,
+                                              size_t length)
+{
+    detach_archive();
+    store(key, payload_->append(payload, length), true);
+}
+
+template<typename Traits>
+bool single_trie_impl<Traits>::search_payload(const key_type &key,
+                                              const char **payload,
+                                              size_t *length) const
+{
+    value_type offset;
+    bool flagged;
+    if (!lookup(key, &offset, &flagged) || !flagged)
+        return false;
+    return payload_->get(offset, payload, length);
+}
+
+template<typename Traits>
+void single_trie_impl<Traits>::set_filter(size_t bits_per_key)
+{
+    filter_bits_ = bits_per_key;
+}
+
+template<typename Traits>
+void single_trie_impl<Traits>::set_root_table(bool enable)
+{
+    use_root_table_ = enable;
+}
+
+template<typename Traits>
+void single_trie_impl<Traits>::set_compress_chains(bool enable)
+{
+    compress_chains_ = enable;
+}
+
+template<typename Traits>
+void single_trie_impl<Traits>::set_relayout(bool enable)
+{
+    relayout_ = enable;
+}
+
+template<typename Traits>
+void single_trie_impl<Traits>::profile(const key_type &key)
+{
+    encoded_key<Traits> code(*alphabet_, key);
+    const char_type *p;
+
+    trie_->count_path(trie_->go_forward(1, code.data(), &p), 1, &heat_);
+}
+
+template<typename Traits>
+void single_trie_impl<Traits>::remap_labels(const size_t *frequency)
+{
+    if (mmap_ || next_suffix_ > 1)
+        throw std::runtime_error("remap_labels: trie is not empty");
+    alphabet_->assign(frequency);
+}
+
+template<typename Traits>
 size_t
-single_trie::prefix_search(const key_type &key, result_type *result) const
+single_trie_impl<Traits>::prefix_search(const key_type &key,
+                                        result_type *result) const
+{
+    encoded_key<Traits> code(*alphabet_, key);
+    size_t first = result->size();
+    sequence_lock::sequence_type sequence;
+    for (;;) {
+        sequence = lock_.read_begin();
+        if (prefix_search_aux(code, result, sequence)
+            && lock_.read_validate(sequence))
+            break;
+        result->erase(result->begin() + first, result->end());
+    }
+    if (!alphabet_->identity())
+        alphabet_->decode(result, first);
+    return result->size();
+}
+
+template<typename Traits>
+bool
+single_trie_impl<Traits>::prefix_search_aux(
+    const encoded_key<Traits> &code, result_type *result,
+    sequence_lock::sequence_type sequence) const
 {
     const char_type *p;
-    size_type s = trie_->go_forward(1, key.data(), &p);
+    size_type s = root_table_.go_forward(*trie_, code.data(), &p);
     key_type store;
-    if (trie_->check_reverse_transition(s, key_type::kTerminator))
+    size_t first = result->size();
+    // the keys of a prefix ending inside a chain follow all of it
+    const char_type *rest = p;
+    if (p && trie_->chain(s) && !(rest = trie_->chain_end(s, p)))
+        return true;
+    if (trie_->check_reverse_transition(s, Traits::kTerminator))
         s = trie_->prev(s);
     if (p)
-        store.assign(key.data(), p - key.data());
+        store.assign(code.data(), p - code.data());
     else
-        store.assign(key.data(), key.length());
-    trie_->prefix_search_aux(s, p, &store, result);
+        store.assign(code.data(), code.length());
+    if (!trie_->prefix_search_aux(s, p, &store, result, &lock_, sequence))
+        return false;
     result_type::iterator it;
-    for (it = result->begin(); it != result->end(); it++) {
-        size_t start = -it->second;
-        const char_type *miss = p;
+    for (it = result->begin() + first; it != result->end(); it++) {
+        size_type leaf = it->second;
+        size_type start = -trie_->base(leaf);
+        const char_type *miss = rest;
         bool fail = false;
+        suffix_type label;
         if (it->first.data()[it->first.length() - 1]
-            == key_type::kTerminator) {
-            it->second = suffix_[start];
+            == Traits::kTerminator) {
+            it->second = tail_value(leaf, start);
             continue;
         }
-        for (; suffix_[start] != key_type::kTerminator; start++) {
-            if (miss && *miss != key_type::kTerminator) {
-                if (*miss != suffix_[start]) {
+        for (; (label = read_suffix(start)) != Traits::kTerminator; start++) {
+            if (!label)
+                return false;  // out of range in a partial update
+            if (miss && *miss != Traits::kTerminator) {
+                if (*miss != label) {
                     fail = true;
                     break;
                 }
                 miss++;
             }
-            it->first.push(suffix_[start]);
+            it->first.push(label);
         }
-        if (fail || (miss && *miss != key_type::kTerminator)) {
+        if (fail || (miss && *miss != Traits::kTerminator)) {
             --it;
             result->erase(it + 1);
             continue;
         }
-        it->second = suffix_[start + 1];
+        it->second = tail_value(leaf, start + 1);
     }
-    return result->size();
+    return true;
 }
 
-void single_trie::build(const char *filename, bool verbose)
+template<typename Traits>
+void single_trie_impl<Traits>::set_concurrent(bool concurrent)
 {
-    FILE *out;
+    // an archive would be released by the first insert
+    detach_archive();
+    concurrent_ = concurrent;
+    retired_.enable(concurrent);
+    trie_->set_concurrent(concurrent);
+    payload_->set_concurrent(concurrent);
+    flags_->set_concurrent(concurrent);
+}
 
-    if (!filename)
-        throw std::runtime_error(std::string("can not save to file ")
-                                 + filename);
+template<typename Traits>
+void single_trie_impl<Traits>::reclaim()
+{
+    retired_.reclaim();
+    trie_->reclaim();
+    payload_->reclaim();
+    flags_->reclaim();
+}
 
-    if ((out = fopen(filename, "w+"))) {
+template<typename Traits>
+trie::stats_type single_trie_impl<Traits>::stats() const
+{
+    typedef typename basic_trie_type::state_type state_type;
+    stats_type stats;
+    std::vector<size_type> depths(trie_->max_state() + 1, -1);
+    size_t depth = 0;
+
+    stats.type = SINGLE_TRIE;
+    trie_->collect_stats(&stats.front);
+    // every key ends at a separator, its suffix follows
+    for (size_type s = 2; s <= trie_->max_state(); s++) {
+        if (trie_->check(s) <= 0 || trie_->base(s) >= 0)
+            continue;
+        size_t d = trie_->depth(s, &depths);
+        depth += d;
+        stats.max_depth = std::max(stats.max_depth, d);
+        stats.keys++;
+    }
+    size_type suffixes = mmap_?header_->suffix_size:next_suffix_;
+    stats.tail_bytes = sizeof(suffix_type) * std::max<size_type>(suffixes - 1,
+                                                                 0);
+    if (values_)
+        stats.tail_bytes += sizeof(value_type) * (trie_->max_state() + 1);
+    if (stats.keys)
+        stats.average_depth = static_cast<double>(depth) / stats.keys;
+    if (mmap_) {
+        stats.bytes = mmap_size_;
+    } else {
+        stats.bytes = sizeof(header_type)
+                      + sizeof(state_type) * stats.front.allocated
+                      + sizeof(suffix_type) * header_->suffix_size
+                      + payload_->size() + flags_->size()
+                      + sizeof(label_type) * alphabet_->size();
+    }
+    if (stats.keys)
+        stats.bytes_per_key = static_cast<double>(stats.bytes) / stats.keys;
+    return stats;
+}
+
+template<typename Traits>
+void single_trie_impl<Traits>::archive(archive_writer *writer)
+{
+    // a loaded archive is consistent already
+    if (!mmap_) {
         snprintf(header_->magic, sizeof(header_->magic), "%s", magic_);
         header_->suffix_size = next_suffix_;
-        fwrite(header_, sizeof(header_type), 1, out);
-        fwrite(suffix_, sizeof(suffix_type) * header_->suffix_size, 1, out);
-        fwrite(trie_->compact_header(),
-               sizeof(basic_trie::header_type), 1, out);
-        fwrite(trie_->states(), sizeof(basic_trie::state_type)
-                               * trie_->compact_header()->size, 1, out);
-
-        fclose(out);
-        if (verbose) {
-            char buf[256];
-            size_t size[2];
+        header_->payload_size = payload_->size();
+        header_->alphabet_size = alphabet_->size();
+    }
+
+    const header_type *header = header_;
+    const suffix_type *suffix = suffix_;
+    const typename basic_trie_type::state_type *states = trie_->states();
+    const value_type *values = values_;
+    const payload_flags *flags = flags_;
+    if (!values_ && share_tails(header_->suffix_size)) {
+        shared_.header = *header_;
+        shared_.header.suffix_size = shared_.suffix.size();
+        header = &shared_.header;
+        suffix = &shared_.suffix[0];
+        states = &shared_.states[0];
+        values = &shared_.values[0];
+        flags = &shared_.flags;
+    }
+    // a loaded archive keeps the chains and the layout it has
+    const basic_trie_type *trie = trie_;
+    if (!mmap_ && (compress_chains_ || relayout_)) {
+        typename basic_trie_type::header_type source_header
+            = *trie_->compact_header();
+        basic_trie_type source(&source_header,
+            const_cast<typename basic_trie_type::state_type *>(states));
+        std::vector<size_type> renumber;
+        sanity_delete(compressed_);
+        compressed_ = new basic_trie_type();
+        compressed_->copy_from(source, compress_chains_?
+                                       basic_trie_type::kMinChain:0,
+                               values?&renumber:NULL,
+                               relayout_?&heat_:NULL);
+        if (values) {
+            // values and their flags follow their states
+            std::vector<value_type> moved(compressed_->max_state() + 1, 0);
+            std::vector<bool> flagged(moved.size(), false);
+            for (size_t s = 0; s < renumber.size(); s++) {
+                if (renumber[s]) {
+                    moved[renumber[s]] = values[s];
+                    flagged[renumber[s]] = shared_.flags.test(s);
+                }
+            }
+            shared_.values.swap(moved);
+            values = &shared_.values[0];
+            shared_.flags.clear();
+            for (size_t s = 0; s < flagged.size(); s++)
+                shared_.flags.set(s, flagged[s]);
+        }
+        states = compressed_->states();
+        trie = compressed_;
+    }
+
+    writer->add(SECTION_HEADER, header, sizeof(header_type));
+    writer->add(SECTION_SUFFIX, suffix,
+                sizeof(suffix_type) * header->suffix_size);
+    writer->add(SECTION_TRIE, trie->compact_header(),
+                sizeof(typename basic_trie_type::header_type));
+    writer->add(SECTION_TRIE, states,
+                sizeof(typename basic_trie_type::state_type)
+                * trie->compact_header()->size);
+    // old readers would miss keys behind chains, they must fail
+    if (trie->chain_size())
+        writer->add(SECTION_CHAIN, trie->chains(),
+                    sizeof(size_type) * trie->chain_size());
+    // old readers would take the value following a tail, they must fail
+    if (values)
+        writer->add(SECTION_TAIL_VALUE, values,
+                    sizeof(value_type) * trie->compact_header()->size);
+    if (header_->payload_size) {
+        writer->add(SECTION_PAYLOAD, payload_->data(), header_->payload_size);
+        flags->archive(writer);
+    }
+    if (header_->alphabet_size)
+        writer->add(SECTION_ALPHABET, alphabet_->table(),
+                    sizeof(label_type) * header_->alphabet_size);
+    if (filter_bits_) {
+        // the filter of a loaded archive is reused if it is as large
+        if (!mmap_ || filter_.bits_per_key() != filter_bits_)
+            build_filter(*this, filter_bits_, &filter_);
+        // old readers skip it
+        writer->add(SECTION_FILTER, filter_.data(), filter_.size(), 0);
+    }
+    if (use_root_table_) {
+        // so is the table of a loaded archive
+        if (!mmap_ || !root_table_.enabled())
+            root_table_.build(*trie);
+        writer->add(SECTION_ROOT, root_table_.data(), root_table_.size(), 0);
+    }
+}
+
+template<typename Traits>
+void single_trie_impl<Traits>::serialize(int fd)
+{
+    archive_writer writer(magic_);
+    archive(&writer);
+    writer.write(fd);
+    release_shared_tails();
+    sanity_delete(compressed_);
+    if (!mmap_) {
+        filter_.clear();
+        root_table_.clear();
+    }
+}
+
+template<typename Traits>
+void single_trie_impl<Traits>::build(const char *filename, bool verbose)
+{
+    if (!filename)
+        throw std::runtime_error("can not save to file (null)");
+
+    archive_writer writer(magic_);
+    archive(&writer);
+    writer.write(filename);
+    // the filter of keys in memory is stale after the next insert
+    if (!mmap_) {
+        filter_.clear();
+        root_table_.clear();
+    }
+    if (verbose) {
+        const basic_trie_type *trie = compressed_?compressed_:trie_;
+        char buf[256];
+        size_t size[3];
+        if (shared_.values.empty())
             size[0] = sizeof(suffix_type) * header_->suffix_size;
-            size[1] = sizeof(basic_trie::state_type)
-                      * trie_->compact_header()->size;
+        else
+            size[0] = sizeof(suffix_type) * shared_.suffix.size()
+                      + sizeof(value_type) * shared_.values.size();
+        size[1] = sizeof(typename basic_trie_type::state_type)
+                  * trie->compact_header()->size
+                  + sizeof(size_type) * trie->chain_size();
+        size[2] = header_->payload_size;
+
+        std::cerr << "suffix = " << pretty_size(size[0], buf, sizeof(buf));
+        std::cerr << ", trie = " << pretty_size(size[1], buf, sizeof(buf));
+        std::cerr << ", payload = "
+                  << pretty_size(size[2], buf, sizeof(buf));
+        std::cerr << ", total = "
+                  << pretty_size(size[0] + size[1] + size[2],
+                                 buf, sizeof(buf))
+                  << std::endl;
+    }
+    release_shared_tails();
+    sanity_delete(compressed_);
+}
+
+template<typename Traits>
+bool single_trie_impl<Traits>::share_tails(size_type suffixes)
+{
+    std::vector<tail_entry> tails;
+    size_type max_state = trie_->max_state();
+
+    // values alone would take more room than the tails
+    if (sizeof(value_type) * (max_state + 1)
+        >= sizeof(suffix_type) * suffixes)
+        return false;
+    for (size_type s = 2; s <= max_state; s++) {
+        if (trie_->check(s) <= 0 || trie_->base(s) >= 0)
+            continue;
+        tail_entry tail = {s, -trie_->base(s), 0, -trie_->base(s), 0};
+        // a key ending at a terminator transition has its value only
+        if (!trie_->check_reverse_transition(s, Traits::kTerminator)) {
+            while (tail.start + tail.length < suffixes
+                   && suffix_[tail.start + tail.length] != Traits::kTerminator)
+                tail.length++;
+            tail.value = tail.start + tail.length + 1;
+        }
+        if (tail.value + kValueSize > suffixes)
+            return false;  // a corrupted archive is written as it is
+        // labels are not 0, a shorter tail comes first
+        for (size_t i = 0; i < sizeof(tail.last) / sizeof(suffix_type); i++) {
+            tail.last <<= 8 * sizeof(suffix_type);
+            if (static_cast<size_type>(i) < tail.length)
+                tail.last |= suffix_[tail.start + tail.length - 1 - i];
+        }
+        tails.push_back(tail);
+    }
+    // a tail ending the one after it in this order is stored in that one
+    std::sort(tails.begin(), tails.end(),
+              reversed_tail_less<suffix_type>(suffix_));
+
+    shared_.suffix.assign(1, 0);
+    shared_.values.assign(max_state + 1, 0);
+    shared_.states.assign(trie_->states(), trie_->states() + max_state + 1);
+    size_type offset = 0;
+    for (size_t i = tails.size(); i-- > 0; ) {
+        const tail_entry &tail = tails[i];
+        const suffix_type *labels = suffix_ + tail.start;
+        if (i + 1 < tails.size()
+            && tails[i + 1].length >= tail.length
+            && std::equal(labels, labels + tail.length,
+                          suffix_ + tails[i + 1].start + tails[i + 1].length
+                          - tail.length)) {
+            offset += tails[i + 1].length - tail.length;
+        } else {
+            offset = shared_.suffix.size();
+            shared_.suffix.insert(shared_.suffix.end(), labels,
+                                  labels + tail.length);
+            shared_.suffix.push_back(
+                static_cast<suffix_type>(Traits::kTerminator));
+        }
+        shared_.states[tail.state].base = -offset;
+        shared_.values[tail.state] = suffix_value(tail.value);
+        shared_.flags.set(tail.state, flags_->test(tail.value));
+    }
+
+    if (sizeof(suffix_type) * shared_.suffix.size()
+        + sizeof(value_type) * shared_.values.size()
+        < sizeof(suffix_type) * suffixes)
+        return true;
+    release_shared_tails();
+    return false;
+}
 
-            std::cerr << "suffix = " << pretty_size(size[0], buf, sizeof(buf));
-            std::cerr << ", trie = " << pretty_size(size[1], buf, sizeof(buf));
-            std::cerr << ", total = "
-                      << pretty_size(size[0] + size[1], buf, sizeof(buf))
-                      << std::endl;
+template<typename Traits>
+typename single_trie_impl<Traits>::suffix_type *
+single_trie_impl<Traits>::unshare_tails(size_type *size)
+{
+    std::vector<suffix_type> tails(1, 0);
+    suffix_type value[kValueSize];
+    payload_flags *flags = new payload_flags();
+
+    for (size_type s = 2; s <= trie_->max_state(); s++) {
+        if (trie_->check(s) <= 0 || trie_->base(s) >= 0)
+            continue;
+        size_type start = -trie_->base(s);
+        trie_->set_base(s, -static_cast<size_type>(tails.size()));
+        if (!trie_->check_reverse_transition(s, Traits::kTerminator)) {
+            suffix_type label;
+            while ((label = read_suffix(start++))
+                   && label != Traits::kTerminator)
+                tails.push_back(label);
+            tails.push_back(static_cast<suffix_type>(Traits::kTerminator));
         }
+        memcpy(value, values_ + s, sizeof(value_type));
+        flags->set(tails.size(), flags_->test(s));
+        tails.insert(tails.end(), value, value + kValueSize);
     }
+    delete flags_;
+    flags_ = flags;
+    *size = tails.size();
+    return duplicate(&tails[0], tails.size());
 }
 
+// ************************************************************************
+// * Instantiations                                                       *
+// ************************************************************************
+
+template class basic_trie_impl<byte_trie_traits>;
+template class basic_trie_impl<wide_trie_traits>;
+template class double_trie_impl<byte_trie_traits>;
+template class double_trie_impl<wide_trie_traits>;
+template class single_trie_impl<byte_trie_traits>;
+template class single_trie_impl<wide_trie_traits>;
+
 END_TRIE_NAMESPACE
 
 // vim: ts=4 sw=4 ai et
@@ -43,6 +43,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sched.h>
 #include <stdint.h>
 
 #include <cstring>
@@ -56,90 +57,1324 @@
 #include <map>
 #include <set>
 #include <deque>
+#include <queue>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
 #include "trie.h"
+#include "trie_archive.h"
+#include "trie_counters.h"
 
 BEGIN_TRIE_NAMESPACE
 
+/// Returns the counters of the calling thread, @see trie_counters.
+trie_counters *thread_counters();
+
+/// Adds n to a counter of the calling thread.
+inline void count_event(uint64_t *counter, uint64_t n)
+{
+    // only the owner thread writes, readers load it relaxed
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+#ifdef TRIE_COUNTERS
+/// Counts n events of a trie_counters field, @see trie_counters.
+#define TRIE_COUNT(field, n) count_event(&thread_counters()->field, (n))
+#else
+#define TRIE_COUNT(field, n) ((void)0)
+#endif
+
+/**
+ * Returns the number of labels walked from inputs to mismatch, all of
+ * them and the terminator if mismatch is NULL.
+ */
+inline size_t labels_walked(const trie::char_type *inputs,
+                            const trie::char_type *mismatch,
+                            trie::char_type terminator)
+{
+    if (mismatch)
+        return mismatch - inputs;
+    const trie::char_type *p = inputs;
+    while (*p != terminator)
+        p++;
+    return p - inputs + 1;
+}
+
+/**
+ * An interface to state relocator.
+ *
+ * A state relocator will be called when a state is being moved
+ * by relocate method of basic_trie during create_transition.
+ *
+ * @param T Type of state index.
+ */
+template<typename T> class trie_relocator_interface {
+  public:
+
+    /**
+     * Notifies state changing.
+     *
+     * @param s The original state index.
+     * @param t The target state index to be moved to.
+     */
+    virtual void relocate(T s, T t) = 0;
+
+    /**
+     * Destructs a trie_relocator.
+     */
+    virtual ~trie_relocator_interface() {}
+
+    /// @todo Disallow copy constructor and operator =.
+};
+
+/**
+ * Resizes a buffer.
+ * This function is a wrapper of realloc(3). If ptr is NULL, it will allocate
+ * a new buffer. If new_size is zero and ptr is not NULL, It frees ptr.
+ * In addition, this function sets all newly allocated units to zero.
+ *
+ * @param ptr Pointer to the buffer.
+ * @param old_size Original size of the buffer.
+ * @param new_size Expected size of the buffer.
+ * @return Pointer to the new buffer with expected size.
+ */
+template<typename T>
+T* resize(T *ptr, size_t old_size, size_t new_size)
+{
+    T *new_block = reinterpret_cast<T *>(realloc(ptr, new_size * sizeof(T)));
+    if (new_size && ptr) {
+        memset(new_block + old_size, 0, (new_size - old_size) * sizeof(T));
+    } else if (new_size) {
+        memset(new_block, 0, new_size * sizeof(T));
+    }
+    return new_block;
+#if 0
+    if (ptr) {
+        if (!new_size) {
+            delete []ptr;
+            return NULL;
+        } else {
+            T *new_block = new T[new_size];
+            std::copy(ptr, ptr + old_size, new_block);
+            delete []ptr;
+            memset(new_block + old_size, 0, (new_size - old_size) * sizeof(T));
+            return new_block;
+        }
+    } else {
+        T *new_block = new T[new_size];
+        memset(new_block, 0, new_size * sizeof(T));
+        return new_block;
+    }
+#endif
+}
+
+/**
+ * Copies a buffer into a newly allocated one, which can be resized by
+ * resize().
+ *
+ * @param ptr Pointer to the buffer.
+ * @param size Size of the buffer.
+ * @return Pointer to the copy.
+ */
+template<typename T>
+T* duplicate(const T *ptr, size_t size)
+{
+    T *new_block = resize(static_cast<T *>(NULL), 0, size);
+    if (size)
+        memcpy(new_block, ptr, size * sizeof(T));
+    return new_block;
+}
+
+/// Loads a value, ordered before the loads following it.
+template<typename T>
+inline T load_acquire(const T *ptr)
+{
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+/// Loads a value which a concurrent writer may store.
+template<typename T>
+inline T load_relaxed(const T *ptr)
+{
+    return __atomic_load_n(ptr, __ATOMIC_RELAXED);
+}
+
+/**
+ * Loads of a search no writer runs with, plain reads the compiler may
+ * combine, @see trie::set_concurrent().
+ */
+struct plain_loads {
+    /// Loads a slot of a buffer.
+    template<typename T>
+    static T relaxed(const T *ptr)
+    {
+        return *ptr;
+    }
+
+    /// Loads the pointer or the size of a buffer.
+    template<typename T>
+    static T acquire(const T *ptr)
+    {
+        return *ptr;
+    }
+};
+
+/// Loads of a search a writer may run with, @see sequence_lock.
+struct shared_loads {
+    /// Loads a slot of a buffer.
+    template<typename T>
+    static T relaxed(const T *ptr)
+    {
+        return load_relaxed(ptr);
+    }
+
+    /// Loads the pointer or the size of a buffer.
+    template<typename T>
+    static T acquire(const T *ptr)
+    {
+        return load_acquire(ptr);
+    }
+};
+
+/// Stores a value, ordered after the stores preceding it.
+template<typename T>
+inline void store_release(T *ptr, T value)
+{
+    __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+}
+
+/// Stores a value which concurrent readers may load.
+template<typename T>
+inline void store_relaxed(T *ptr, T value)
+{
+    __atomic_store_n(ptr, value, __ATOMIC_RELAXED);
+}
+
+/**
+ * A sequence lock, letting readers search a trie without locking while a
+ * single writer updates it, @see trie::set_concurrent().
+ *
+ * The sequence is odd while the writer updates. A reader takes the
+ * sequence before searching and validates it afterwards; if it changed,
+ * the reader may have seen a partial update and searches again. Readers
+ * must bound every index they read by the size of its buffer, since a
+ * partial update can hold anything.
+ */
+class sequence_lock {
+  public:
+    /// Represents a sequence.
+    typedef unsigned long sequence_type;
+
+    /// Makes the writer hold a sequence_lock while it is alive.
+    class writer {
+      public:
+        /// Starts an update.
+        explicit writer(sequence_lock *lock)
+            :lock_(lock)
+        {
+            store_relaxed(&lock_->sequence_, lock_->sequence_ + 1);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+        }
+
+        /// Finishes the update.
+        ~writer()
+        {
+            store_release(&lock_->sequence_, lock_->sequence_ + 1);
+        }
+
+      private:
+        /// Constructs a copy, not allowed.
+        writer(const writer &);
+
+        /// Copies a writer, not allowed.
+        writer &operator=(const writer &);
+
+        sequence_lock *lock_;  ///< The lock.
+    };
+
+    /// Constructs a sequence_lock.
+    sequence_lock()
+        :sequence_(0)
+    {
+    }
+
+    /// Returns the sequence to search with, waiting for an update.
+    sequence_type read_begin() const
+    {
+        sequence_type sequence;
+        for (size_t spins = 0;
+             (sequence = load_acquire(&sequence_)) & 1; spins++) {
+            if (spins > 64)
+                sched_yield();
+        }
+        return sequence;
+    }
+
+    /// Returns true if nothing changed since read_begin() returned sequence.
+    bool read_validate(sequence_type sequence) const
+    {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        return load_relaxed(&sequence_) == sequence;
+    }
+
+  private:
+    sequence_type sequence_;  ///< Odd while updating.
+
+    /// Constructs a copy of sequence_lock.
+    sequence_lock(const sequence_lock &);
+
+    /// Updates a sequence_lock.
+    void operator=(const sequence_lock &);
+};
+
+/**
+ * Buffers replaced while concurrent readers may still use them, @see
+ * trie::set_concurrent(). Once enabled, a buffer grows into a new copy
+ * and the old one is kept until reclaim().
+ */
+class retired_buffers {
+  public:
+    /// Constructs a disabled retired_buffers.
+    retired_buffers()
+        :enabled_(false)
+    {
+    }
+
+    /// Frees all buffers.
+    ~retired_buffers()
+    {
+        reclaim();
+    }
+
+    /// Enables or disables keeping buffers.
+    void enable(bool enabled)
+    {
+        enabled_ = enabled;
+    }
+
+    /**
+     * Resizes a buffer like resize() does. The caller publishes the
+     * result to readers.
+     *
+     * @param ptr Pointer to the buffer.
+     * @param old_size Original size of the buffer.
+     * @param new_size Expected size of the buffer, larger than old_size.
+     * @return Pointer to the new buffer with expected size.
+     */
+    template<typename T>
+    T* grow(T *ptr, size_t old_size, size_t new_size)
+    {
+        if (!enabled_ || !ptr)
+            return resize(ptr, old_size, new_size);
+        T *new_block = resize(static_cast<T *>(NULL), 0, new_size);
+        memcpy(new_block, ptr, old_size * sizeof(T));
+        buffers_.push_back(ptr);
+        return new_block;
+    }
+
+    /// Frees all kept buffers.
+    void reclaim()
+    {
+        for (size_t i = 0; i < buffers_.size(); i++)
+            free(buffers_[i]);
+        buffers_.clear();
+    }
+
+  private:
+    bool enabled_;                 ///< Keeps buffers if true.
+    std::vector<void *> buffers_;  ///< Kept buffers.
+
+    /// Constructs a copy of retired_buffers.
+    retired_buffers(const retired_buffers &);
+
+    /// Updates a retired_buffers.
+    void operator=(const retired_buffers &);
+};
+
+/**
+ * A byte heap for storing variable-length payloads.
+ *
+ * Each record is a 32-bit length followed by the payload bytes and is
+ * padded to 4 bytes. Offset 0 is reserved so that a record offset can be
+ * stored in a value slot of a trie. A payload_heap either owns a
+ * growable buffer or refers to an existing memory region (i.e. archive).
+ */
+class payload_heap {
+  public:
+    /// Represents the length field of a record.
+    typedef uint32_t length_type;
+
+    /// Constructs an empty payload_heap.
+    payload_heap()
+        :data_(NULL), size_(0), capacity_(0), owner_(true)
+    {
+    }
+
+    /**
+     * Constructs a payload_heap using existing memory region.
+     *
+     * @param data Pointer to an existing heap.
+     * @param size Size of the heap in bytes.
+     */
+    payload_heap(const void *data, size_t size)
+        :data_(static_cast<char *>(const_cast<void *>(data))),
+         size_(size), capacity_(size), owner_(false)
+    {
+    }
+
+    /// Destructs a payload_heap.
+    ~payload_heap()
+    {
+        if (owner_)
+            free(data_);
+    }
+
+    /**
+     * Appends a payload to the heap.
+     *
+     * @param payload Buffer of the payload.
+     * @param length Length of the payload buffer.
+     * @return Offset of the newly appended record.
+     */
+    trie::value_type append(const char *payload, size_t length)
+    {
+        if (!owner_)
+            throw std::runtime_error("payload_heap::append: read-only heap");
+        if (!size_)
+            size_ = sizeof(length_type);  // reserve offset 0
+        size_t offset = size_;
+        size_t nsize = offset + align(sizeof(length_type) + length);
+        if (nsize > static_cast<size_t>(INT32_MAX))
+            throw std::runtime_error("payload_heap::append: heap too large");
+        if (nsize > capacity_)
+            grow(nsize);
+        length_type len = static_cast<length_type>(length);
+        memcpy(data_ + offset, &len, sizeof(len));
+        memcpy(data_ + offset + sizeof(len), payload, length);
+        // readers see the record once they see size_
+        store_release(&size_, nsize);
+        return static_cast<trie::value_type>(offset);
+    }
+
+    /**
+     * Writes a payload record at a given offset, e.g. to keep the offset
+     * a record has in another heap. Records appended later go after it.
+     *
+     * @param offset Offset of the record.
+     * @param payload Buffer of the payload.
+     * @param length Length of the payload buffer.
+     */
+    void put(trie::value_type offset, const char *payload, size_t length)
+    {
+        if (!owner_)
+            throw std::runtime_error("payload_heap::put: read-only heap");
+        if (offset < static_cast<trie::value_type>(sizeof(length_type))
+            || offset % sizeof(length_type))
+            throw std::runtime_error("payload_heap::put: bad offset");
+        size_t nsize = std::max(size_, offset
+                                       + align(sizeof(length_type) + length));
+        if (nsize > static_cast<size_t>(INT32_MAX))
+            throw std::runtime_error("payload_heap::put: heap too large");
+        if (nsize > capacity_)
+            grow(nsize);
+        length_type len = static_cast<length_type>(length);
+        memcpy(data_ + offset, &len, sizeof(len));
+        memcpy(data_ + offset + sizeof(len), payload, length);
+        store_release(&size_, nsize);
+    }
+
+    /**
+     * Retrieves a payload by the offset of its record.
+     *
+     * @param offset Offset of the record.
+     * @param[out] payload Pointer to the payload buffer.
+     * @param[out] length Length of the payload buffer.
+     * @return false if offset does not refer to a valid record.
+     */
+    bool get(trie::value_type offset,
+             const char **payload, size_t *length) const
+    {
+        length_type len;
+        // size_ goes first, data_ is at least as large then
+        size_t size = load_acquire(&size_);
+        const char *data = load_acquire(&data_);
+        if (offset < static_cast<trie::value_type>(sizeof(length_type))
+            || offset % sizeof(length_type)
+            || static_cast<size_t>(offset) + sizeof(len) > size)
+            return false;
+        memcpy(&len, data + offset, sizeof(len));
+        if (len > size - offset - sizeof(len))
+            return false;
+        if (payload)
+            *payload = data + offset + sizeof(len);
+        if (length)
+            *length = len;
+        return true;
+    }
+
+    /**
+     * Copies a heap using an existing memory region into a buffer of its
+     * own, so that it can grow.
+     */
+    void detach()
+    {
+        if (owner_)
+            return;
+        data_ = duplicate(data_, size_);
+        capacity_ = size_;
+        owner_ = true;
+    }
+
+    /**
+     * Keeps buffers replaced while growing for concurrent readers, @see
+     * trie::set_concurrent().
+     */
+    void set_concurrent(bool concurrent)
+    {
+        retired_.enable(concurrent);
+    }
+
+    /// Frees buffers kept for concurrent readers.
+    void reclaim()
+    {
+        retired_.reclaim();
+    }
+
+    /// Returns a pointer to the heap.
+    const char *data() const
+    {
+        return data_;
+    }
+
+    /// Returns the number of bytes used in the heap.
+    size_t size() const
+    {
+        return size_;
+    }
+
+  private:
+    /// Rounds size up to the alignment of records.
+    static size_t align(size_t size)
+    {
+        return (size + sizeof(length_type) - 1) & ~(sizeof(length_type) - 1);
+    }
+
+    /// Grows the heap buffer to hold size bytes at least.
+    void grow(size_t size)
+    {
+        // align with 4k
+        size_t ncapacity = (((capacity_ * 2 + size) >> 12) + 1) << 12;
+        store_release(&data_, retired_.grow(data_, capacity_, ncapacity));
+        capacity_ = ncapacity;
+    }
+
+    char *data_;       ///< Heap buffer.
+    size_t size_;      ///< Bytes used in data_.
+    size_t capacity_;  ///< Size of data_.
+    bool owner_;       ///< Ownership of data.
+    retired_buffers retired_;  ///< Buffers kept for concurrent readers.
+
+    /// Constructs a copy of payload_heap.
+    payload_heap(const payload_heap &);
+
+    /// Updates a payload_heap.
+    void operator=(const payload_heap &);
+};
+
+/**
+ * Flags telling which values of a trie refer to payloads.
+ *
+ * A trie numbers the slots of its values, e.g. by index entry or by
+ * position in suffix, and keeps a bit per slot here, so a plain value
+ * equal to the offset of a record is not taken for a payload. A
+ * payload_flags either owns a growable buffer or refers to an existing
+ * memory region (i.e. archive).
+ */
+class payload_flags {
+  public:
+    /// Represents a word of flags.
+    typedef uint32_t word_type;
+
+    /// Number of flags in a word.
+    static const size_t kWordBits = 8 * sizeof(word_type);
+
+    /// Constructs an empty payload_flags.
+    payload_flags()
+        :words_(NULL), size_(0), owner_(true)
+    {
+    }
+
+    /**
+     * Constructs a payload_flags using existing memory region.
+     *
+     * @param data Pointer to existing flags, NULL if there are none.
+     * @param length Length of the flags in bytes.
+     */
+    payload_flags(const void *data, size_t length)
+        :words_(static_cast<word_type *>(const_cast<void *>(data))),
+         size_(length / sizeof(word_type)), owner_(false)
+    {
+    }
+
+    /// Destructs a payload_flags.
+    ~payload_flags()
+    {
+        if (owner_)
+            free(words_);
+    }
+
+    /// Returns true if the value in a slot refers to a payload.
+    bool test(trie::size_type slot) const
+    {
+        return test<shared_loads>(slot);
+    }
+
+    /// Tests a slot with loads L, @see plain_loads.
+    template<typename L>
+    bool test(trie::size_type slot) const
+    {
+        size_t w = slot / kWordBits;
+        // the size goes first, words_ is at least as large then
+        if (slot < 0 || w >= L::acquire(&size_))
+            return false;
+        return (L::relaxed(L::acquire(&words_) + w) >> (slot % kWordBits)) & 1;
+    }
+
+    /**
+     * Flags the value in a slot.
+     *
+     * @param slot The slot.
+     * @param payload true if the value refers to a payload.
+     */
+    void set(trie::size_type slot, bool payload)
+    {
+        if (!owner_)
+            throw std::runtime_error("payload_flags::set: read-only flags");
+        size_t w = slot / kWordBits;
+        if (w >= size_) {
+            if (!payload)
+                return;
+            grow(w + 1);
+        }
+        word_type bit = static_cast<word_type>(1) << (slot % kWordBits);
+        store_relaxed(words_ + w, payload?(words_[w] | bit)
+                                         :(words_[w] & ~bit));
+    }
+
+    /// Clears all flags, they are set slot by slot again.
+    void clear()
+    {
+        if (owner_)
+            free(words_);
+        words_ = NULL;
+        size_ = 0;
+        owner_ = true;
+    }
+
+    /**
+     * Copies flags using an existing memory region into a buffer of
+     * their own, so that they can grow.
+     */
+    void detach()
+    {
+        if (owner_)
+            return;
+        words_ = duplicate(words_, size_);
+        owner_ = true;
+    }
+
+    /**
+     * Adds the flags to an archive as an optional section. An archive
+     * with a payload heap needs it, it is rejected otherwise.
+     *
+     * @param writer The archive writer.
+     */
+    void archive(archive_writer *writer) const
+    {
+        static const word_type kNone = 0;
+        // old readers skip it
+        writer->add(SECTION_PAYLOAD_FLAG, size_?words_:&kNone,
+                    size_?size():sizeof(kNone), 0);
+    }
+
+    /// Keeps buffers replaced while growing for concurrent readers.
+    void set_concurrent(bool concurrent)
+    {
+        retired_.enable(concurrent);
+    }
+
+    /// Frees buffers kept for concurrent readers.
+    void reclaim()
+    {
+        retired_.reclaim();
+    }
+
+    /// Returns a pointer to the flags.
+    const word_type *data() const
+    {
+        return words_;
+    }
+
+    /// Returns the size of the flags in bytes.
+    size_t size() const
+    {
+        return sizeof(word_type) * size_;
+    }
+
+  private:
+    /// Grows the buffer to hold size words at least.
+    void grow(size_t size)
+    {
+        size_t nsize = std::max(size_ * 2, size);
+        store_release(&words_, retired_.grow(words_, size_, nsize));
+        store_release(&size_, nsize);
+    }
+
+    word_type *words_;  ///< Flags, a bit per slot.
+    size_t size_;       ///< Number of words.
+    bool owner_;        ///< Ownership of words_.
+    retired_buffers retired_;  ///< Buffers kept for concurrent readers.
+
+    /// Constructs a copy of payload_flags.
+    payload_flags(const payload_flags &);
+
+    /// Updates a payload_flags.
+    void operator=(const payload_flags &);
+};
+
+/**
+ * A blocked Bloom filter over the keys of an archive.
+ *
+ * A key sets probes bits in one 64-byte block chosen by its hash, so
+ * asking for a key reads a single cache line. It is built when an
+ * archive is written and answers most searches for missing keys before
+ * the trie is walked. A key_filter either owns its buffer or refers to
+ * an existing memory region (i.e. archive).
+ */
+class key_filter {
+  public:
+    /// Represents the header in front of the blocks.
+    typedef struct {
+        uint64_t blocks;        ///< Number of blocks.
+        uint32_t bits_per_key;  ///< Bits per key the filter is sized for.
+        uint32_t probes;        ///< Bits set by a key.
+        char unused[48];        ///< Pads the header to a block.
+    } header_type;
+
+    /// Bits of a block, a cache line.
+    static const size_t kBlockBits = 512;
+
+    /// 64-bit words of a block.
+    static const size_t kBlockWords = kBlockBits / 64;
+
+    /// Constructs an empty key_filter, which is disabled.
+    key_filter()
+        :header_(NULL), blocks_(NULL)
+    {
+    }
+
+    /**
+     * Builds a filter owning its buffer.
+     *
+     * @param hashes Hashes of all keys, @see hash().
+     * @param bits_per_key Bits of the filter per key.
+     */
+    void build(const std::vector<uint64_t> &hashes, size_t bits_per_key)
+    {
+        size_t blocks = (hashes.size() * bits_per_key + kBlockBits - 1)
+                        / kBlockBits;
+        blocks = std::max<size_t>(blocks, 1);
+        buffer_.assign((sizeof(header_type) + blocks * kBlockBits / 8)
+                       / sizeof(uint64_t), 0);
+        header_ = reinterpret_cast<header_type *>(&buffer_[0]);
+        blocks_ = reinterpret_cast<uint64_t *>(header_ + 1);
+        header_->blocks = blocks;
+        header_->bits_per_key = bits_per_key;
+        // ln 2 bits per key minimize false positives
+        header_->probes = std::min<uint32_t>(
+            std::max<uint32_t>(bits_per_key * 69 / 100, 1), 16);
+        for (size_t i = 0; i < hashes.size(); i++) {
+            uint64_t *block = find_block(hashes[i]);
+            uint32_t h = static_cast<uint32_t>(hashes[i]);
+            uint32_t delta = step(h);
+            for (uint32_t k = 0; k < header_->probes; k++, h += delta)
+                block[(h >> 23) / 64] |= 1ULL << ((h >> 23) % 64);
+        }
+    }
+
+    /**
+     * Refers to a filter in an existing memory region.
+     *
+     * @param data Pointer to the filter.
+     * @param length Length of the filter in bytes.
+     */
+    void attach(const void *data, size_t length)
+    {
+        const header_type *header = static_cast<const header_type *>(data);
+        if (length < sizeof(header_type)
+            || reinterpret_cast<uintptr_t>(data) % sizeof(uint64_t)
+            || !header->blocks || !header->probes || header->probes > 64
+            || (length - sizeof(header_type)) / (kBlockBits / 8)
+               != header->blocks
+            || (length - sizeof(header_type)) % (kBlockBits / 8))
+            throw bad_trie_archive("file corrupted");
+        clear();
+        header_ = const_cast<header_type *>(header);
+        blocks_ = reinterpret_cast<uint64_t *>(header_ + 1);
+    }
+
+    /// Disables the filter and frees its buffer.
+    void clear()
+    {
+        std::vector<uint64_t>().swap(buffer_);
+        header_ = NULL;
+        blocks_ = NULL;
+    }
+
+    /// Returns true if the filter is built or attached.
+    bool enabled() const
+    {
+        return header_ != NULL;
+    }
+
+    /**
+     * Tells whether a key may be in the trie.
+     *
+     * @param hash Hash of the key, @see hash().
+     * @return false if the key is certainly not in the trie.
+     */
+    bool may_contain(uint64_t hash) const
+    {
+        const uint64_t *block = find_block(hash);
+        uint32_t h = static_cast<uint32_t>(hash);
+        uint32_t delta = step(h);
+        for (uint32_t k = 0; k < header_->probes; k++, h += delta) {
+            if (!(block[(h >> 23) / 64] & (1ULL << ((h >> 23) % 64))))
+                return false;
+        }
+        return true;
+    }
+
+    /// Returns a pointer to the filter.
+    const void *data() const
+    {
+        return header_;
+    }
+
+    /// Returns the size of the filter in bytes.
+    size_t size() const
+    {
+        return header_?sizeof(header_type)
+                       + header_->blocks * kBlockBits / 8:0;
+    }
+
+    /// Returns the bits per key the filter is sized for, 0 if disabled.
+    size_t bits_per_key() const
+    {
+        return header_?header_->bits_per_key:0;
+    }
+
+    /**
+     * Hashes the labels of a key, ignoring trailing terminators, so keys
+     * found by prefix_search() hash as the keys searched for.
+     *
+     * @param key The key.
+     * @return 64-bit hash of the key.
+     */
+    static uint64_t hash(const trie::key_type &key)
+    {
+        const trie::char_type *data = key.data();
+        size_t length = key.length();
+        while (length && data[length - 1] == trie::key_type::kTerminator)
+            length--;
+        // FNV-1a and the finalizer of MurmurHash3
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (size_t i = 0; i < length; i++)
+            h = (h ^ static_cast<uint32_t>(data[i])) * 0x100000001b3ULL;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+  private:
+    /// Chooses the block of a hash by its high 32 bits.
+    uint64_t *find_block(uint64_t hash) const
+    {
+        return blocks_ + ((hash >> 32) * header_->blocks >> 32)
+                         * kBlockWords;
+    }
+
+    /// Returns the distance between probes, odd so that probes differ.
+    static uint32_t step(uint32_t h)
+    {
+        return ((h >> 16) | (h << 16)) * 0x9e3779b9U | 1;
+    }
+
+    header_type *header_;            ///< Header of the filter.
+    uint64_t *blocks_;               ///< Blocks after header_.
+    std::vector<uint64_t> buffer_;   ///< Buffer of a built filter.
+
+    /// Constructs a copy of key_filter.
+    key_filter(const key_filter &);
+
+    /// Updates a key_filter.
+    void operator=(const key_filter &);
+};
+
+/**
+ * A table of the states reached from the root by the first two labels of
+ * a key.
+ *
+ * It is indexed by the first two codes of a key, so a search skips the
+ * two top levels of the trie, whose states are read by every search, and
+ * a key starting with a pair no key starts with is refused by the table
+ * alone. It is built when an archive is written. A root_table either owns
+ * its buffer or refers to an existing memory region (i.e. archive).
+ */
+class root_table {
+  public:
+    /// Shortcut for trie::size_type.
+    typedef trie::size_type size_type;
+
+    /// Shortcut for trie::char_type.
+    typedef trie::char_type char_type;
+
+    /// Codes of the table, [1, kCodes].
+    static const char_type kCodes = 256;
+
+    /// Number of entries, one for every pair of codes.
+    static const size_t kEntries = kCodes * kCodes;
+
+    /// Constructs an empty root_table, which is disabled.
+    root_table()
+        :entries_(NULL), states_(0)
+    {
+    }
+
+    /**
+     * Builds a table owning its buffer. An entry is the state reached by
+     * both codes, minus the state reached by the first code only, or 0
+     * if the root has no transition by the first code. An entry inside a
+     * chain is the number of states, which is searched from the root.
+     *
+     * @param trie The trie searched from its root, state 1.
+     */
+    template<typename T>
+    void build(const T &trie)
+    {
+        states_ = trie.max_state() + 1;
+        buffer_.assign(kEntries, trie.chain(1)?states_:0);
+        entries_ = &buffer_[0];
+        if (trie.chain(1))
+            return;
+        for (char_type a = 1; a <= kCodes; a++) {
+            size_type s = trie.next(1, a);
+            if (!trie.check_transition(1, s))
+                continue;
+            const size_type *chain = trie.chain(s);
+            for (char_type b = 1; b <= kCodes; b++) {
+                size_type t = trie.next(s, b);
+                if (chain)
+                    buffer_[index(a, b)] = b == chain[2]?states_:-s;
+                else
+                    buffer_[index(a, b)] = trie.check_transition(s, t)?t:-s;
+            }
+        }
+    }
+
+    /**
+     * Refers to a table in an existing memory region.
+     *
+     * @param data Pointer to the table.
+     * @param length Length of the table in bytes.
+     * @param states Number of states of the trie.
+     */
+    void attach(const void *data, size_t length, size_type states)
+    {
+        if (length != sizeof(size_type) * kEntries
+            || reinterpret_cast<uintptr_t>(data) % sizeof(size_type))
+            throw bad_trie_archive("file corrupted");
+        clear();
+        entries_ = static_cast<const size_type *>(data);
+        states_ = states;
+    }
+
+    /// Disables the table and frees its buffer.
+    void clear()
+    {
+        std::vector<size_type>().swap(buffer_);
+        entries_ = NULL;
+        states_ = 0;
+    }
+
+    /// Returns true if the table is built or attached.
+    bool enabled() const
+    {
+        return entries_ != NULL;
+    }
+
+    /**
+     * Goes forward from the root with inputs as trie.go_forward(1, ...)
+     * does, taking the first two steps from the table if it is enabled.
+     */
+    template<typename T>
+    size_type go_forward(const T &trie, const char_type *inputs,
+                         const char_type **mismatch) const
+    {
+        return go_forward<shared_loads>(trie, inputs, mismatch);
+    }
+
+    /// Goes forward as go_forward() does with loads L, @see plain_loads.
+    template<typename L, typename T>
+    size_type go_forward(const T &trie, const char_type *inputs,
+                         const char_type **mismatch) const
+    {
+        // unsigned, so that the terminator and 0 are out of range too
+        if (!entries_ || static_cast<uint32_t>(inputs[0] - 1) >= kCodes
+            || static_cast<uint32_t>(inputs[1] - 1) >= kCodes)
+            return trie.template go_forward<L>(1, inputs, mismatch);
+        size_type s = entries_[index(inputs[0], inputs[1])];
+        // entries inside chains are out of range, so may damaged ones be
+        if (s >= states_ || s <= -states_)
+            return trie.template go_forward<L>(1, inputs, mismatch);
+        if (s > 0)
+            return trie.template go_forward<L>(s, inputs + 2, mismatch);
+        *mismatch = s?inputs + 1:inputs;
+        return s?-s:1;
+    }
+
+    /// Returns a pointer to the table.
+    const void *data() const
+    {
+        return entries_;
+    }
+
+    /// Returns the size of the table in bytes.
+    size_t size() const
+    {
+        return entries_?sizeof(size_type) * kEntries:0;
+    }
+
+  private:
+    /// Returns the entry of codes a and b.
+    static size_t index(char_type a, char_type b)
+    {
+        return (a - 1) * kCodes + (b - 1);
+    }
+
+    const size_type *entries_;       ///< Entries of the table.
+    size_type states_;               ///< Number of states of the trie.
+    std::vector<size_type> buffer_;  ///< Buffer of a built table.
+
+    /// Constructs a copy of root_table.
+    root_table(const root_table &);
+
+    /// Updates a root_table.
+    void operator=(const root_table &);
+};
+
 /**
- * An interface to state relocator.
+ * Describes the alphabet of a trie.
  *
- * A state relocator will be called when a state is being moved
- * by relocate method of basic_trie during create_transition.
+ * Labels of an alphabet are in [1, N) and N itself is the terminator, which
+ * is the same convention as trie::key_type. A trie stores labels (e.g. in
+ * tails and transition buffers) using L, so L must be able to hold N.
  *
- * @param T Type of state index.
+ * @param L Type of a stored label.
+ * @param N Size of the alphabet including the terminator.
  */
-template<typename T> class trie_relocator_interface {
+template<typename L, trie::char_type N>
+struct trie_traits {
+    /// Represents a stored label.
+    typedef L label_type;
+
+    /// Charset size
+    static const trie::char_type kCharsetSize = N;
+
+    /// Terminator character (character not in charset).
+    static const trie::char_type kTerminator = N;
+};
+
+/**
+ * Alphabet of byte keys. Bytes are shifted by one by key_type::char_in,
+ * so together with the terminator they need 9 bits.
+ */
+typedef trie_traits<uint16_t, trie::key_type::kCharsetSize> byte_trie_traits;
+
+/**
+ * Alphabet of byte keys with 32-bit labels. This is the layout used by
+ * archives built before trie_traits was introduced.
+ */
+typedef trie_traits<int32_t, trie::key_type::kCharsetSize> wide_trie_traits;
+
+/**
+ * A table remapping labels to codes.
+ *
+ * The terminator is always mapped to itself since it is fixed by
+ * key_type. An empty table stands for the identity mapping.
+ *
+ * @param Traits Alphabet of the trie, @see trie_traits.
+ */
+template<typename Traits>
+class trie_alphabet {
   public:
+    /// Represents a stored label.
+    typedef typename Traits::label_type label_type;
+
+    /// Shortcut for trie::char_type.
+    typedef trie::char_type char_type;
+
+    /// Number of elements in a table.
+    static const size_t kTableSize = Traits::kCharsetSize + 1;
+
+    /// Constructs an identity trie_alphabet.
+    trie_alphabet()
+        :code_(NULL), label_(NULL), owner_(false)
+    {
+    }
+
+    /// Destructs a trie_alphabet.
+    ~trie_alphabet()
+    {
+        clear();
+    }
 
     /**
-     * Notifies state changing.
+     * Builds the table from label frequencies. The most frequent label
+     * gets the code next to the terminator.
      *
-     * @param s The original state index.
-     * @param t The target state index to be moved to.
+     * @param frequency Occurrences of each byte, 256 elements.
      */
-    virtual void relocate(T s, T t) = 0;
+    void assign(const size_t *frequency)
+    {
+        std::vector<std::pair<size_t, char_type> > order;
+        char_type ch;
+
+        for (ch = 1; ch < Traits::kTerminator; ch++) {
+            size_t count = (ch <= 256)?frequency[ch - 1]:0;
+            // sort by descending frequency then ascending label
+            order.push_back(std::make_pair(~count, ch));
+        }
+        std::sort(order.begin(), order.end());
+        clear();
+        code_ = resize(code_, 0, kTableSize);
+        owner_ = true;
+        code_[Traits::kTerminator] = Traits::kTerminator;
+        for (size_t i = 0; i < order.size(); i++)
+            code_[order[i].second] = Traits::kTerminator - 1 - i;
+        build_labels();
+    }
 
     /**
-     * Destructs a trie_relocator.
+     * Uses an existing table, e.g. from an archive.
+     *
+     * @param table Pointer to a table with kTableSize elements.
      */
-    virtual ~trie_relocator_interface() {}
+    void attach(const label_type *table)
+    {
+        clear();
+        code_ = const_cast<label_type *>(table);
+        owner_ = false;
+        build_labels();
+    }
 
-    /// @todo Disallow copy constructor and operator =.
+    /// Copies an attached table, so it no longer refers to an archive.
+    void detach()
+    {
+        if (code_ && !owner_) {
+            code_ = duplicate(code_, kTableSize);
+            owner_ = true;
+        }
+    }
+
+    /// Returns true if it is an identity mapping.
+    bool identity() const
+    {
+        return !code_;
+    }
+
+    /// Converts a label to its code.
+    char_type encode(char_type ch) const
+    {
+        return code_[ch];
+    }
+
+    /// Converts a code back to its label.
+    char_type decode(char_type code) const
+    {
+        return label_[code];
+    }
+
+    /// Returns the table, NULL if it is an identity mapping.
+    const label_type *table() const
+    {
+        return code_;
+    }
+
+    /// Returns the number of elements in the table.
+    size_t size() const
+    {
+        return code_?kTableSize:0;
+    }
+
+    /**
+     * Decodes keys of a result set.
+     *
+     * @param[out] result Result set to be decoded.
+     * @param first Index of the first key to decode, keys before it
+     *              are left as they are.
+     */
+    void decode(trie::result_type *result, size_t first = 0) const
+    {
+        std::vector<char_type> buf;
+        trie::result_type::iterator it;
+        for (it = result->begin() + first; it != result->end(); it++) {
+            const char_type *p = it->first.data();
+            buf.assign(p, p + it->first.length());
+            for (size_t i = 0; i < buf.size(); i++)
+                buf[i] = decode(buf[i]);
+            it->first.assign(&buf[0], buf.size());
+        }
+    }
+
+  private:
+    /// Rebuilds the inversed table of code_.
+    void build_labels()
+    {
+        label_ = resize(label_, 0, kTableSize);
+        for (size_t i = 1; i < kTableSize; i++) {
+            if (code_[i] <= 0 || code_[i] > Traits::kTerminator
+                || label_[code_[i]])
+                throw bad_trie_archive("file corrupted");
+            label_[code_[i]] = i;
+        }
+    }
+
+    /// Frees the tables.
+    void clear()
+    {
+        // realloc() of NULL to 0 bytes would allocate
+        if (owner_)
+            free(code_);
+        free(label_);
+        code_ = NULL;
+        label_ = NULL;
+        owner_ = false;
+    }
+
+    label_type *code_;   ///< Table from label to code.
+    label_type *label_;  ///< Table from code to label.
+    bool owner_;         ///< Ownership of code_.
+
+    /// Constructs a copy of trie_alphabet.
+    trie_alphabet(const trie_alphabet &);
+
+    /// Updates a trie_alphabet.
+    void operator=(const trie_alphabet &);
 };
 
 /**
- * Resizes a buffer.
- * This function is a wrapper of realloc(3). If ptr is NULL, it will allocate
- * a new buffer. If new_size is zero and ptr is not NULL, It frees ptr.
- * In addition, this function sets all newly allocated units to zero.
+ * A key encoded by a trie_alphabet.
  *
- * @param ptr Pointer to the buffer.
- * @param old_size Original size of the buffer.
- * @param new_size Expected size of the buffer.
- * @return Pointer to the new buffer with expected size.
+ * Keys shorter than kInlineSize are encoded into an inline buffer so that
+ * searching does not allocate. Nothing is copied for an identity mapping.
+ *
+ * @param Traits Alphabet of the trie, @see trie_traits.
  */
-template<typename T>
-T* resize(T *ptr, size_t old_size, size_t new_size)
-{
-    T *new_block = reinterpret_cast<T *>(realloc(ptr, new_size * sizeof(T)));
-    if (new_size && ptr) {
-        memset(new_block + old_size, 0, (new_size - old_size) * sizeof(T));
-    } else if (new_size) {
-        memset(new_block, 0, new_size * sizeof(T));
+template<typename Traits>
+class encoded_key {
+  public:
+    /// Shortcut for trie::char_type.
+    typedef trie::char_type char_type;
+
+    /// Size of the inline buffer.
+    static const size_t kInlineSize = 128;
+
+    /**
+     * Constructs an encoded_key.
+     *
+     * @param alphabet The alphabet.
+     * @param key The key to be encoded.
+     */
+    encoded_key(const trie_alphabet<Traits> &alphabet,
+                const trie::key_type &key)
+        :data_(key.data()), heap_(NULL), length_(key.length())
+    {
+        if (alphabet.identity())
+            return;
+        char_type *p = inline_;
+        if (length_ + 1 > kInlineSize)
+            p = heap_ = resize(heap_, 0, length_ + 1);
+        for (size_t i = 0; i < length_; i++)
+            p[i] = alphabet.encode(data_[i]);
+        p[length_] = Traits::kTerminator;
+        data_ = p;
     }
-    return new_block;
-#if 0
-    if (ptr) {
-        if (!new_size) {
-            delete []ptr;
-            return NULL;
-        } else {
-            T *new_block = new T[new_size];
-            std::copy(ptr, ptr + old_size, new_block);
-            delete []ptr;
-            memset(new_block + old_size, 0, (new_size - old_size) * sizeof(T));
-            return new_block;
-        }
-    } else {
-        T *new_block = new T[new_size];
-        memset(new_block, 0, new_size * sizeof(T));
-        return new_block;
+
+    /// Destructs an encoded_key.
+    ~encoded_key()
+    {
+        free(heap_);
     }
-#endif
-}
 
-/// A double-array with basic operations.
-class basic_trie: public trie
+    /// Returns the encoded data terminated by the terminator.
+    const char_type *data() const
+    {
+        return data_;
+    }
+
+    /// Returns length of the encoded data.
+    size_t length() const
+    {
+        return length_;
+    }
+
+  private:
+    const char_type *data_;           ///< Encoded data.
+    char_type inline_[kInlineSize];   ///< Buffer for short keys.
+    char_type *heap_;                 ///< Buffer for long keys.
+    size_t length_;                   ///< Length of data_.
+
+    /// Constructs a copy of encoded_key.
+    encoded_key(const encoded_key &);
+
+    /// Updates an encoded_key.
+    void operator=(const encoded_key &);
+};
+
+/**
+ * A double-array with basic operations.
+ *
+ * @param Traits Alphabet of the trie, @see trie_traits.
+ */
+template<typename Traits>
+class basic_trie_impl: public trie
 {
   public:
+    /// Alphabet of the trie.
+    typedef Traits traits_type;
+
+    /// Represents a stored label.
+    typedef typename Traits::label_type label_type;
+
     /// Default initial size of state buffer.
     static const size_t kDefaultStateSize = 4096;
 
+    /// BASE of a state starting a chain, plus the offset of the chain.
+    static const size_type kChainBase = 1 << 30;
+
+    /// Shortest chain collapsed, a shorter one is larger than its states.
+    static const size_type kMinChain = 4;
+
+    /// Levels copy_from() places breadth first, deeper ones depth first.
+    static const size_type kBreadthLevels = 3;
+
     /// Represents a state in double-array
     typedef struct {
         size_type base;  ///< The BASE value.
@@ -164,46 +1399,48 @@ class basic_trie: public trie
     } extremum_type;
 
     /**
-     * Constructs an empty basic_trie.
+     * Constructs an empty basic_trie_impl.
      *
      * @param size Initial size of state buffer.
      * @param relocator A trie relocator if needed, @see
      *                  trie_relocator_interface.
      */
-    explicit basic_trie(size_type size = kDefaultStateSize,
-                        trie_relocator_interface<size_type> *relocator = NULL);
+    explicit basic_trie_impl(size_type size = kDefaultStateSize,
+                             trie_relocator_interface<size_type> *relocator
+                                 = NULL);
 
     /**
-     * Constructs a basic_trie using existing memory region.
+     * Constructs a basic_trie_impl using existing memory region. All
+     * states in it are taken as used.
      *
      * @param header Pointer to an existing header data.
      * @param states Pointer to an existing state buffer.
      */
-    explicit basic_trie(void *header, void *states);
+    explicit basic_trie_impl(void *header, void *states);
 
     /**
      * Constructs a copy from trie.
      *
-     * @param trie A basic_trie to be copied from.
+     * @param trie A basic_trie_impl to be copied from.
      */
-    basic_trie(const basic_trie &trie);
+    basic_trie_impl(const basic_trie_impl &trie);
 
     /**
      * Copies from a trie.
      *
-     * @param trie a basic_trie to be copied from.
+     * @param trie a basic_trie_impl to be copied from.
      */
-    basic_trie &operator=(const basic_trie &trie);
+    basic_trie_impl &operator=(const basic_trie_impl &trie);
 
     /**
      * Copies from a trie. see also copy constructor and operator =.
      *
-     * @param trie a basic_trie to be copied from.
+     * @param trie a basic_trie_impl to be copied from.
      */
-    void clone(const basic_trie &trie);
+    void clone(const basic_trie_impl &trie);
 
-    /// Destructs a basic_trie.
-    ~basic_trie();
+    /// Destructs a basic_trie_impl.
+    ~basic_trie_impl();
 
     void insert(const key_type &key, const value_type &value);
     bool search(const key_type &key, value_type *value) const;
@@ -215,25 +1452,66 @@ class basic_trie: public trie
         throw std::runtime_error("not implement");
     }
 
-    void read_from_text(const char *source, bool verbose)
+    void serialize(int fd)
+    {
+        /// @todo implement serialize for basic_trie
+        throw std::runtime_error("not implement");
+    }
+
+    void read_from_text(const char *source, bool verbose, bool remap)
     {
         /// @todo implement build for basic_trie
         throw std::runtime_error("not implement");
     }
 
+    void remap_labels(const size_t *frequency)
+    {
+        /// @todo implement remapping for basic_trie
+        throw std::runtime_error("not implement");
+    }
+
+    void insert_payload(const key_type &key,
+                        const char *payload, size_t length)
+    {
+        /// @todo implement payload for basic_trie
+        throw std::runtime_error("not implement");
+    }
+
+    bool search_payload(const key_type &key,
+                        const char **payload, size_t *length) const
+    {
+        /// @todo implement payload for basic_trie
+        throw std::runtime_error("not implement");
+    }
+
+    void set_concurrent(bool concurrent)
+    {
+        retired_.enable(concurrent);
+    }
+
+    void reclaim()
+    {
+        retired_.reclaim();
+    }
+
     /**
-     * Retrieves all key-value pairs match given prefix from state s.
+     * Retrieves all key-value pairs match given prefix from state s. The
+     * value of a pair is the leaf state the key ends at.
      *
      * @param s Start state.
      * @param p Mismatch character buffer.
      * @param[out] store Temporary storage for found keys.
      * @param[out] result Result set.
-     * @return The number of elements in the result set.
+     * @param lock Lock of the owner trie if it is updated concurrently.
+     * @param sequence Sequence taken from lock before searching.
+     * @return false if the owner trie is updated while retrieving.
      */
-    size_t prefix_search_aux(size_type s,
-                             const char_type *p,
-                             key_type *store,
-                             result_type *result) const;
+    bool prefix_search_aux(size_type s,
+                           const char_type *p,
+                           key_type *store,
+                           result_type *result,
+                           const sequence_lock *lock = NULL,
+                           sequence_lock::sequence_type sequence = 0) const;
 
     /**
      * Creates a new tranisition from state s with input char_type.
@@ -250,9 +1528,57 @@ class basic_trie: public trie
      * @param extremum The max and min value in inputs.
      * @return The proper BASE value.
      */
-    size_type find_base(const char_type *inputs,
+    size_type find_base(const label_type *inputs,
                         const extremum_type &extremum);
 
+    /**
+     * Copies the keys of source into this empty trie. The first
+     * kBreadthLevels levels are placed breadth first, so they share few
+     * cache lines, and the subtrie of a deeper state depth first, so
+     * children are placed right after their parent. States with more
+     * heat are placed before all others.
+     *
+     * A run of states with a single transition each, none by the
+     * terminator, is a chain. A chain of min_chain labels or more is
+     * collapsed: the state it starts at keeps its labels and the state it
+     * ends at in chains(), and the states inside it are left out. Chains
+     * of source are expanded to single transitions if min_chain is 0.
+     *
+     * @param source The trie to be copied from.
+     * @param min_chain Shortest chain to be collapsed, 0 to collapse none.
+     * @param[out] renumber If not NULL, the state each state of source is
+     *                      copied to, by the state of source, 0 for the
+     *                      states inside collapsed chains.
+     * @param heat If not NULL, visits of each state of source,
+     *             @see count_path().
+     */
+    void copy_from(const basic_trie_impl &source, size_type min_chain,
+                   std::vector<size_type> *renumber,
+                   const std::vector<size_type> *heat);
+
+    /**
+     * Counts a visit of every state from s back to, and including, stop
+     * in heat, which grows to hold them.
+     *
+     * @param s The last state visited.
+     * @param stop An ancestor of s, the first state visited.
+     * @param[out] heat Visits by state.
+     */
+    void count_path(size_type s, size_type stop,
+                    std::vector<size_type> *heat) const
+    {
+        if (heat->size() <= static_cast<size_t>(max_state()))
+            heat->resize(max_state() + 1, 0);
+        for (;;) {
+            if (s <= 0 || s > max_state())
+                return;
+            (*heat)[s]++;
+            if (s == stop)
+                return;
+            s = prev(s);
+        }
+    }
+
     /**
      * Prints all outcome transition from state s.
      *
@@ -261,16 +1587,16 @@ class basic_trie: public trie
     void trace(size_type s) const;
 
     /**
-     * Returns a pointer to a newly created basic_trie.
+     * Returns a pointer to a newly created basic_trie_impl.
      *
      * @param header Pointer to an existing header data.
      * @param states Pointer to an existing state data buffer.
-     * @return Pointer to the newly created basic_trie.
+     * @return Pointer to the newly created basic_trie_impl.
      */
-    static const basic_trie *create_from_memory(void *header,
-                                                void *states)
+    static const basic_trie_impl *create_from_memory(void *header,
+                                                     void *states)
     {
-        return new basic_trie(header, states);
+        return new basic_trie_impl(header, states);
     }
 
     /**
@@ -297,63 +1623,171 @@ class basic_trie: public trie
     /// Get the BASE value of state s.
     size_type base(size_type s) const
     {
-        return states_[s].base;
+        return base<shared_loads>(s);
+    }
+
+    /// Get the BASE value of state s with loads L, @see plain_loads.
+    template<typename L>
+    size_type base(size_type s) const
+    {
+        return L::relaxed(&L::acquire(&states_)[s].base);
     }
 
     /// Get the CHECK value of state s.
     size_type check(size_type s) const
     {
-        return states_[s].check;
+        return check<shared_loads>(s);
+    }
+
+    /// Get the CHECK value of state s with loads L.
+    template<typename L>
+    size_type check(size_type s) const
+    {
+        return L::relaxed(&L::acquire(&states_)[s].check);
+    }
+
+    /// Set a new BASE value of state s.
+    void set_base(size_type s, size_type val)
+    {
+        store_relaxed(&states_[s].base, val);
+        if (s > max_state_)
+            max_state_ = s;
+    }
+
+    /// Set a new CHECK value of state s.
+    void set_check(size_type s, size_type val)
+    {
+        store_relaxed(&states_[s].check, val);
+        // a leaf may have no BASE value
+        if (s > max_state_)
+            max_state_ = s;
+    }
+
+    /// Gets next state from s with input ch.
+    size_type next(size_type s, char_type ch) const
+    {
+        return base(s) + ch;
+    }
+
+    /// Gets next state from s with input ch with loads L.
+    template<typename L>
+    size_type next(size_type s, char_type ch) const
+    {
+        return base<L>(s) + ch;
+    }
+
+    /// Get previous state from s with input ch.
+    size_type prev(size_type s) const
+    {
+        return check(s);
+    }
+
+    /// Get previous state from s with input ch with loads L.
+    template<typename L>
+    size_type prev(size_type s) const
+    {
+        return check<L>(s);
     }
 
-    /// Set a new BASE value of state s.
-    void set_base(size_type s, size_type val)
+    /**
+     * Returns the chain starting at state s, NULL if there is none. A
+     * chain is the state it ends at, the number of its labels and the
+     * labels, @see copy_from().
+     */
+    const size_type *chain(size_type s) const
     {
-        states_[s].base = val;
-        if (s > max_state_)
-            max_state_ = s;
+        return chain_at(base(s));
     }
 
-    /// Set a new CHECK value of state s.
-    void set_check(size_type s, size_type val)
+    /// Returns the chains, NULL if the trie has none.
+    const size_type *chains() const
     {
-        states_[s].check = val;
+        return chains_;
     }
 
-    /// Gets next state from s with input ch.
-    size_type next(size_type s, char_type ch) const
+    /// Returns the number of elements of chains().
+    size_t chain_size() const
     {
-        return base(s) + ch;
+        return chain_size_;
     }
 
-    /// Get previous state from s with input ch.
-    size_type prev(size_type s) const
+    /**
+     * Uses chains in an existing memory region (i.e. archive).
+     *
+     * @param chains Pointer to the chains.
+     * @param size Number of elements of chains.
+     */
+    void attach_chains(const size_type *chains, size_t size)
     {
-        return check(s);
+        std::vector<size_type>().swap(chain_buffer_);
+        chains_ = size?chains:NULL;
+        chain_size_ = size;
     }
 
     /**
      * Goes forward from state s with inputs. Returns the last arrived
-     * state and sets mismatch to mismatch position.
+     * state and sets mismatch to mismatch position. A chain is taken as
+     * a whole, a mismatch inside it stops at the state it starts at.
      */
+    size_type go_forward(size_type s,
+                         const char_type *inputs,
+                         const char_type **mismatch) const
+    {
+        return go_forward<shared_loads>(s, inputs, mismatch);
+    }
+
+    /// Goes forward as go_forward() does with loads L.
+    template<typename L>
     size_type go_forward(size_type s,
                          const char_type *inputs,
                          const char_type **mismatch) const
     {
         assert(mismatch);
         const char_type *p = inputs;
-        do {
-            size_type t = next(s, *p);
-            if (!check_transition(s, t)) {
+        for (;;) {
+            size_type b = base<L>(s);
+            if (b >= kChainBase) {
+                const size_type *chain = chain_at(b);
+                size_type i, length = chain?chain[1]:0;
+                // the terminator ends inputs and is never a chain label
+                for (i = 0; i < length && p[i] == chain[i + 2]
+                            && p[i] != Traits::kTerminator; i++)
+                    continue;
+                if (!chain || i < length
+                    || !check_transition<L>(s, chain[0])) {
+                    *mismatch = p;
+                    return s;
+                }
+                s = chain[0];
+                p += length;
+                continue;
+            }
+            size_type t = b + *p;
+            if (!check_transition<L>(s, t)) {
                 *mismatch = p;
                 return s;
             }
             s = t;
-        } while (*p++ != key_type::kTerminator);
+            if (*p++ == Traits::kTerminator)
+                break;
+        }
         *mismatch = NULL;
         return s;
     }
 
+    /**
+     * Returns where inputs end if they run out inside the chain starting
+     * at state s, NULL if they leave it by a mismatch.
+     */
+    const char_type *chain_end(size_type s, const char_type *inputs) const
+    {
+        const size_type *chain = this->chain(s);
+        size_type i;
+        for (i = 0; i < chain[1] && inputs[i] == chain[i + 2]; i++)
+            continue;
+        return inputs[i] == Traits::kTerminator?inputs + i:NULL;
+    }
+
     /**
      * Goes forward from state s with reverse inputs. Returns the last
      * arrived state and sets mismatch to mismatch position.
@@ -364,7 +1798,7 @@ class basic_trie: public trie
     {
         assert(mismatch);
         const char_type *p = inputs;
-        while (*p != key_type::kTerminator)
+        while (*p != Traits::kTerminator)
             p++;
         do {
             size_type t = next(s, *p);
@@ -382,6 +1816,15 @@ class basic_trie: public trie
      * Goes backward from state s with inputs. Returns the last arrived
      * state and sets mismatch to mismatch position.
      */
+    size_type go_backward(size_type s,
+                          const char_type *inputs,
+                          const char_type **mismatch) const
+    {
+        return go_backward<shared_loads>(s, inputs, mismatch);
+    }
+
+    /// Goes backward as go_backward() does with loads L.
+    template<typename L>
     size_type go_backward(size_type s,
                           const char_type *inputs,
                           const char_type **mismatch) const
@@ -389,19 +1832,20 @@ class basic_trie: public trie
         assert(mismatch);
         const char_type *p = inputs;
         do {
-            size_type t = prev(s);
-            if (next(t, *p) != s || !check_transition(t, next(t, *p))) {
+            size_type t = prev<L>(s);
+            if (next<L>(t, *p) != s
+                || !check_transition<L>(t, next<L>(t, *p))) {
                 *mismatch = p;
                 return s;
             }
             s = t;
-        } while (*p++ != key_type::kTerminator);
+        } while (*p++ != Traits::kTerminator);
         *mismatch = NULL;
         return s;
     }
 
     /**
-     * Returns a pointer to a basic_trie header whose size is
+     * Returns a pointer to a basic_trie_impl header whose size is
      * exactly the number of used items in state buffer.
      */
     const header_type *compact_header() const
@@ -429,7 +1873,47 @@ class basic_trie: public trie
         return max_state_;
     }
 
-    /// Returns true if a basic_trie owns the memory of its data.
+    /**
+     * Collects statistics of the double-array, @see trie::stats().
+     *
+     * @param[out] stats The statistics.
+     */
+    void collect_stats(array_stats *stats) const
+    {
+        stats->used = max_state_ >= 1?1:0;  // the root has no CHECK
+        for (size_type s = 2; s <= max_state_; s++)
+            if (check(s) > 0)
+                stats->used++;
+        stats->allocated = header_->size;
+        stats->holes = max_state_ >= 1?max_state_ - stats->used:0;
+        stats->fill = stats->allocated
+                      ?static_cast<double>(stats->used) / stats->allocated:0;
+    }
+
+    /**
+     * Returns the number of transitions from the root to state s.
+     *
+     * @param s The state.
+     * @param[in,out] depths Depths of states found so far, -1 if unknown.
+     *                       It has max_state() + 1 elements.
+     * @return The depth.
+     */
+    size_type depth(size_type s, std::vector<size_type> *depths) const
+    {
+        std::vector<size_type> &known = *depths;
+        size_type t, n = 0;
+        // climb to a state whose depth is known, then fill in the way
+        for (t = s; t > 1 && known[t] < 0; t = check(t))
+            n += labels_to(t);
+        size_type top = t > 1?known[t]:0;
+        for (t = s; t > 1 && known[t] < 0; t = check(t)) {
+            known[t] = top + n;
+            n -= labels_to(t);
+        }
+        return s > 1?known[s]:0;
+    }
+
+    /// Returns true if a basic_trie_impl owns the memory of its data.
     bool owner() const
     {
         return owner_;
@@ -438,16 +1922,32 @@ class basic_trie: public trie
     /// Returns true if there is a transition from s to t.
     bool check_transition(size_type s, size_type t) const
     {
+        return check_transition<shared_loads>(s, t);
+    }
+
+    /// Returns true if there is a transition from s to t with loads L.
+    template<typename L>
+    bool check_transition(size_type s, size_type t) const
+    {
+        // the size goes first, states_ is at least as large then
         return (s > 0
                 && t > 0
-                && t < header_->size && check(t) == s)?true:false;
+                && t < L::acquire(&header_->size)
+                && check<L>(t) == s)?true:false;
     }
 
     /// Returns true if s can be traced back by input ch.
     bool check_reverse_transition(size_type s, char_type ch) const
     {
-        return ((next(prev(s), ch) == s)
-                && check_transition(prev(s), next(prev(s), ch)));
+        return check_reverse_transition<shared_loads>(s, ch);
+    }
+
+    /// Returns true if s can be traced back by input ch with loads L.
+    template<typename L>
+    bool check_reverse_transition(size_type s, char_type ch) const
+    {
+        size_type t = prev<L>(s);
+        return next<L>(t, ch) == s && check_transition<L>(t, next<L>(t, ch));
     }
 
   protected:
@@ -463,7 +1963,7 @@ class basic_trie: public trie
      */
     size_type relocate(size_type stand,
                        size_type s,
-                       const char_type *inputs,
+                       const label_type *inputs,
                        const extremum_type &extremum);
 
     /// Resizes state buffer.
@@ -471,8 +1971,10 @@ class basic_trie: public trie
     {
         // align with 4k
         size_type nsize = (((header_->size * 2 + size) >> 12) + 1) << 12;
-        states_ = resize(states_, header_->size, nsize);
-        header_->size = nsize;
+        TRIE_COUNT(state_grows, 1);
+        TRIE_COUNT(bytes_copied, sizeof(state_type) * header_->size);
+        store_release(&states_, retired_.grow(states_, header_->size, nsize));
+        store_release(&header_->size, nsize);
     }
 
     /**
@@ -481,15 +1983,15 @@ class basic_trie: public trie
      * stored into it.
      */
     size_type find_exist_target(size_type s,
-                                char_type *targets,
+                                label_type *targets,
                                 extremum_type *extremum) const
     {
         char_type ch;
-        char_type *p;
+        label_type *p;
 
-        for (ch = 1, p = targets; ch < key_type::kCharsetSize + 1; ch++) {
+        for (ch = 1, p = targets; ch < Traits::kCharsetSize + 1; ch++) {
             size_type t = next(s, ch);
-            if (t >= header_->size)
+            if (t >= load_acquire(&header_->size))
                 break;
             if (check_transition(s, t)) {
                 *(p++) = ch;
@@ -507,19 +2009,77 @@ class basic_trie: public trie
         return p - targets;
     }
   private:
+    /// A state of a source waiting to be copied by copy_from().
+    struct placement {
+        size_type from;   ///< The state of the source.
+        size_type to;     ///< The state it is copied to.
+        size_type level;  ///< Number of states above it.
+        size_type order;  ///< Number of states queued before it.
+        size_type heat;   ///< Visits of the source state.
+
+        placement(const std::vector<size_type> *heat, size_type s,
+                  size_type t, size_type level, size_type order)
+            :from(s), to(t), level(level), order(order),
+             heat(heat && static_cast<size_t>(s) < heat->size()?
+                  (*heat)[s]:0)
+        {
+        }
+
+        /// Returns true if the state is placed after rhs.
+        bool operator<(const placement &rhs) const
+        {
+            if (heat != rhs.heat)
+                return heat < rhs.heat;
+            bool deep = level >= kBreadthLevels;
+            if (deep != (rhs.level >= kBreadthLevels))
+                return deep;
+            // first in first out at the top, last in first out below
+            return deep?order < rhs.order:order > rhs.order;
+        }
+    };
+
+    /// Returns the chain of BASE value b, NULL if b starts none.
+    const size_type *chain_at(size_type b) const
+    {
+        if (b < kChainBase)
+            return NULL;
+        // a damaged chain is taken as a state without transitions
+        size_t offset = b - kChainBase;
+        if (offset + 2 > chain_size_
+            || static_cast<size_t>(chains_[offset + 1]) - 1
+               >= chain_size_ - offset - 2)
+            return NULL;
+        return chains_ + offset;
+    }
+
+    /// Returns the number of labels from the previous state to s.
+    size_type labels_to(size_type s) const
+    {
+        const size_type *chain = this->chain(check(s));
+        return chain?chain[1]:1;
+    }
+
     header_type *header_;  ///< Pointer to header.
     state_type *states_;   ///< Pointer to state buffer.
     size_type last_base_;  ///< Last avaiable BASE value.
     size_type max_state_;  ///< Number of state being used.
     bool owner_;           ///< Ownership of data.
+    retired_buffers retired_;  ///< Buffers kept for concurrent readers.
 
     /// Relocator for notifying state changing.
     trie_relocator_interface<size_type> *relocator_;
 
     /// @see compact_header().
     mutable header_type compact_header_;
+
+    const size_type *chains_;  ///< Chains, @see chain().
+    size_t chain_size_;        ///< Number of elements of chains_.
+    std::vector<size_type> chain_buffer_;  ///< Chains made by copy_from().
 };
 
+/// A double-array over byte keys.
+typedef basic_trie_impl<byte_trie_traits> basic_trie;
+
 /**
  * An relocator adaptor @see trie_relocator_interface.
  *
@@ -567,49 +2127,106 @@ class trie_relocator: public trie_relocator_interface<trie::size_type> {
 
 /**
  * A two-trie.
+ *
+ * @param Traits Alphabet of the trie, @see trie_traits.
  */
-class double_trie: public trie {
+template<typename Traits>
+class double_trie_impl: public trie {
   public:
+    /// Represents the front and rear trie.
+    typedef basic_trie_impl<Traits> basic_trie_type;
+
+    /// Represents a stored label.
+    typedef typename Traits::label_type label_type;
     /**
-     * Represents some information about double_trie.
+     * Represents some information about double_trie_impl.
      */
     typedef struct {
         char magic[16];  ///< Archive magic.
         size_type index_size;  ///< Index array size.
         size_type accept_size; ///< Accept array size.
-        char unused[40]; ///< for 32/64bits compatible.
+        size_type payload_size; ///< Payload heap size in bytes.
+        size_type alphabet_size; ///< Number of elements in alphabet.
+        char unused[32]; ///< for 32/64bits compatible.
     } header_type;
 
     /**
-     * Constructs a double_trie.
+     * Constructs a double_trie_impl.
      *
      * @param size Initial size of state buffer.
      */
-    explicit double_trie(size_t size = basic_trie::kDefaultStateSize);
+    explicit double_trie_impl(size_t size
+                                  = basic_trie_type::kDefaultStateSize);
 
     /**
-     * Constructs a double_trie using a trie archive.
+     * Constructs a double_trie_impl using a trie archive.
      *
      * @param filename Filename of the archive.
+     * @param options Options for loading the archive.
      */
-    explicit double_trie(const char *filename);
+    explicit double_trie_impl(const char *filename,
+                              const load_options &options = load_options());
 
-    /// Destructs a double_trie.
-    ~double_trie();
+    /**
+     * Constructs a double_trie_impl from a trie archive in memory, without copying.
+     *
+     * @param data Pointer to the archive.
+     * @param size Size of the archive.
+     * @param ownership Who releases the memory, it applies only if
+     *                  constructing succeeds.
+     * @param options Options for loading the archive.
+     */
+    double_trie_impl(const void *data, size_t size, ownership_type ownership,
+                     const load_options &options = load_options());
+
+    /// Destructs a double_trie_impl.
+    ~double_trie_impl();
 
     void insert(const key_type &key, const value_type &value);
     bool search(const key_type &key, value_type *value) const;
     size_t prefix_search(const key_type &key, result_type *result) const;
     void build(const char *filename, bool verbose = false);
+    void serialize(int fd);
+    void insert_payload(const key_type &key,
+                        const char *payload, size_t length);
+    bool search_payload(const key_type &key,
+                        const char **payload, size_t *length) const;
+    void remap_labels(const size_t *frequency);
+    void set_filter(size_t bits_per_key);
+    void set_root_table(bool enable);
+    void set_compress_chains(bool enable);
+    void set_relayout(bool enable);
+    void profile(const key_type &key);
+    void set_concurrent(bool concurrent);
+    void reclaim();
+    stats_type stats() const;
+
+    /**
+     * Inserts a key referring to a payload record of another trie, which
+     * is copied to the same offset in the payload heap, so the value of
+     * the key is kept. Copy all records before inserting new payloads.
+     *
+     * @param key The key.
+     * @param offset Offset of the record in the other trie.
+     * @param payload Buffer of the payload.
+     * @param length Length of the payload buffer.
+     */
+    void copy_payload(const key_type &key, value_type offset,
+                      const char *payload, size_t length)
+    {
+        detach_archive();
+        payload_->put(offset, payload, length);
+        store(key, offset, true);
+    }
 
     /// Returns a pointer to front trie.
-    const basic_trie *front_trie() const
+    const basic_trie_type *front_trie() const
     {
         return lhs_;
     }
 
     /// Returns a pointer to rear trie.
-    const basic_trie *rear_trie() const
+    const basic_trie_type *rear_trie() const
     {
         return rhs_;
     }
@@ -638,7 +2255,7 @@ class double_trie: public trie {
             fprintf(stderr, "%4d ", accept_[i].accept);
         fprintf(stderr, "\n========================================\n");
         std::set<size_type>::const_iterator it;
-        std::map<size_type, refer_type>::const_iterator mit;
+        typename std::map<size_type, refer_type>::const_iterator mit;
         for (mit = refer_.begin(); mit != refer_.end(); mit++) {
             fprintf(stderr, "%4d: ", mit->first);
             for (it = mit->second.referer.begin();
@@ -654,14 +2271,25 @@ class double_trie: public trie {
     /// Appends inputs to rear trie.
     size_type rhs_append(const char_type *inputs);
 
+    /**
+     * Stores the value of a key, @see insert().
+     *
+     * @param key The key.
+     * @param value The value.
+     * @param payload true if the value refers to a payload.
+     */
+    void store(const key_type &key, value_type value, bool payload);
+
     /**
      * Inserts inputs into front trie.
      *
      * @param s Mismatch state.
      * @param inputs Buffer of char_type to be inserted.
      * @param value Value for current key.
+     * @param payload true if the value refers to a payload.
      */
-    void lhs_insert(size_type s, const char_type *inputs, value_type value);
+    void lhs_insert(size_type s, const char_type *inputs, value_type value,
+                    bool payload);
 
     /// cleans all unused states in rear trie from state t.
     void rhs_clean_more(size_type t);
@@ -676,10 +2304,12 @@ class double_trie: public trie {
      * @param remain All char_types of inserting key not in rear trie.
      * @param ch Mismatch char_type of the existing key.
      * @param value Value for current key.
+     * @param payload true if the value refers to a payload.
      */
     void rhs_insert(size_type s, size_type r,
-                    const std::vector<char_type> &match,
-                    const char_type *remain, char_type ch, size_type value);
+                    const std::vector<label_type> &match,
+                    const char_type *remain, char_type ch, size_type value,
+                    bool payload);
 
     /// Removes a accept state.
     void remove_accept_state(size_type s)
@@ -714,11 +2344,11 @@ class double_trie: public trie {
 
         if (refer_.find(t) != refer_.end() && refer_[t].referer.size()) {
             i = find_index_entry(s);
-            index_[i].index = refer_[t].accept_index;
+            set_index_accept(i, refer_[t].accept_index);
         } else {
             i = find_index_entry(s);
             size_type acc = find_accept_entry(i);
-            accept_[acc].accept = t;
+            set_accept(acc, t);
             assert(acc > 0 && acc < header_->accept_size);
             refer_[t].accept_index = acc;
         }
@@ -732,7 +2362,8 @@ class double_trie: public trie {
     /// Returns how many separated state linked to accept state s.
     size_t count_referer(size_type s) const
     {
-        std::map<size_type, refer_type>::const_iterator found(refer_.find(s));
+        typename std::map<size_type, refer_type>::const_iterator
+            found(refer_.find(s));
         if (found == refer_.end())
             return 0;
         else
@@ -754,9 +2385,11 @@ class double_trie: public trie {
             }
             if (next >= header_->index_size) {
                 size_type nsize = (((next * 2) >> 12) + 1) << 12;
-                index_ = resize(index_, header_->index_size, nsize);
+                store_release(&index_, retired_.grow(index_,
+                                                     header_->index_size,
+                                                     nsize));
                 assert(index_[next].index == 0);
-                header_->index_size = nsize;
+                store_release(&header_->index_size, nsize);
             }
             lhs_->set_base(s, -next);
         }
@@ -781,10 +2414,12 @@ class double_trie: public trie {
             }
             if (next >= header_->accept_size) {
                 size_type nsize = (((next * 2) >> 12) + 1) << 12;
-                accept_ = resize(accept_, header_->accept_size, nsize);
-                header_->accept_size = nsize;
+                store_release(&accept_, retired_.grow(accept_,
+                                                      header_->accept_size,
+                                                      nsize));
+                store_release(&header_->accept_size, nsize);
             }
-            index_[i].index = next;
+            set_index_accept(i, next);
         }
         return index_[i].index;
     }
@@ -794,7 +2429,7 @@ class double_trie: public trie {
     {
         char_type ch;
         size_t degree = 0;
-        for (ch = 1; ch < key_type::kCharsetSize + 1; ch++) {
+        for (ch = 1; ch < Traits::kCharsetSize + 1; ch++) {
             size_type t = rhs_->next(s, ch);
             if (t >= rhs_->header()->size)
                 break;
@@ -816,7 +2451,7 @@ class double_trie: public trie {
         assert(rhs_->check(t) > 0);
         size_type s = rhs_->prev(t);
         if (s > 0
-            && t == rhs_->next(s, key_type::kTerminator)
+            && t == rhs_->next(s, Traits::kTerminator)
             && count_referer(t) == 0) {
             // delete one
             remove_accept_state(t);
@@ -857,7 +2492,7 @@ class double_trie: public trie {
     void relocate_rear(size_type s, size_type t)
     {
         if (refer_.find(s) != refer_.end()) {
-            accept_[refer_[s].accept_index].accept = t;
+            set_accept(refer_[s].accept_index, t);
             refer_[t] = refer_[s];
             free_accept_entry(s);
         }
@@ -877,7 +2512,7 @@ class double_trie: public trie {
             if (s > 0 && count_referer(s) == 0) {
                 if (refer_[s].accept_index < header_->accept_size) {
                     if (refer_[s].accept_index > 0) {
-                        accept_[refer_[s].accept_index].accept = 0;
+                        set_accept(refer_[s].accept_index, 0);
                         free_accept_.push_back(refer_[s].accept_index);
                     }
                 }
@@ -886,6 +2521,106 @@ class double_trie: public trie {
         }
     }
 
+    /// Sets the value of the (i)th index entry and its payload flag.
+    void set_index_data(size_type i, value_type value, bool payload)
+    {
+        store_relaxed(&index_[i].data, value);
+        flags_->set(i, payload);
+    }
+
+    /// Links the (i)th index entry to the (a)th accept entry.
+    void set_index_accept(size_type i, size_type a)
+    {
+        store_relaxed(&index_[i].index, a);
+    }
+
+    /// Sets the accept state of the (a)th accept entry.
+    void set_accept(size_type a, size_type r)
+    {
+        store_relaxed(&accept_[a].accept, r);
+    }
+
+    /**
+     * Reads the (i)th index entry while the trie may be updated
+     * concurrently.
+     *
+     * @param i The index entry.
+     * @param[out] data The value.
+     * @param[out] a The accept entry, 0 if there is none.
+     * @return false if i is out of range, seen only in a partial update.
+     */
+    bool read_index(size_type i, value_type *data, size_type *a) const
+    {
+        return read_index<shared_loads>(i, data, a);
+    }
+
+    /// Reads the (i)th index entry with loads L, @see plain_loads.
+    template<typename L>
+    bool read_index(size_type i, value_type *data, size_type *a) const
+    {
+        // the size goes first, index_ is at least as large then
+        if (i <= 0 || i >= L::acquire(&header_->index_size))
+            return false;
+        const index_type *entry = L::acquire(&index_) + i;
+        *data = L::relaxed(&entry->data);
+        *a = L::relaxed(&entry->index);
+        return true;
+    }
+
+    /**
+     * Reads the accept state of the (a)th accept entry while the trie may
+     * be updated concurrently. Returns 0 if a is out of range.
+     */
+    size_type read_accept(size_type a) const
+    {
+        return read_accept<shared_loads>(a);
+    }
+
+    /// Reads the accept state of the (a)th accept entry with loads L.
+    template<typename L>
+    size_type read_accept(size_type a) const
+    {
+        if (a <= 0 || a >= L::acquire(&header_->accept_size))
+            return 0;
+        return L::relaxed(&L::acquire(&accept_)[a].accept);
+    }
+
+    /**
+     * Retrieves the value of a key, @see search().
+     *
+     * @param key The key.
+     * @param[out] value The value if found, can be NULL.
+     * @param[out] payload Whether the value refers to a payload, can be
+     *                     NULL.
+     * @return true if found.
+     */
+    bool lookup(const key_type &key, value_type *value, bool *payload) const;
+
+    /**
+     * Searches an encoded key with loads L, @see search().
+     *
+     * @param inputs The encoded key.
+     * @param[out] value The value if found.
+     * @param[out] payload The payload flag of the value, can be NULL.
+     * @return true if found.
+     */
+    template<typename L>
+    bool search_aux(const char_type *inputs, value_type *value,
+                    bool *payload) const;
+
+    /**
+     * Retrieves all key-value pairs matching an encoded prefix, @see
+     * prefix_search().
+     *
+     * @param code The encoded prefix.
+     * @param[out] result Result set.
+     * @param sequence Sequence taken from lock_ before searching.
+     * @return false if the trie is updated while retrieving.
+     */
+    bool prefix_search_aux(const encoded_key<Traits> &code,
+                           result_type *result,
+                           sequence_lock::sequence_type sequence) const;
+
   private:
     /// Represents a separated state index.
     typedef struct {
@@ -909,7 +2644,7 @@ class double_trie: public trie {
     header_type *header_;
 
     /// Pointer to front trie(lhs_) and rear trie(rhs_).
-    basic_trie *lhs_, *rhs_;
+    basic_trie_type *lhs_, *rhs_;
 
     /// Pointer to index to accept_type index.
     index_type *index_;
@@ -921,13 +2656,13 @@ class double_trie: public trie {
     std::map<size_type, refer_type> refer_;
 
     /// Temporary buffer for storing exising char_types while inserting.
-    std::vector<char_type> exists_;
+    std::vector<label_type> exists_;
 
     /// Next available entry in accept_/index_.
     size_type next_accept_, next_index_;
 
     /// Relocator for front and rear trie.
-    trie_relocator<double_trie> *front_relocator_, *rear_relocator_;
+    trie_relocator<double_trie_impl> *front_relocator_, *rear_relocator_;
 
     /// States to be monitored by relocator
     size_type watcher_[2];
@@ -938,32 +2673,125 @@ class double_trie: public trie {
     /// List of freed index entry.
     std::deque<size_type> free_index_;
 
+    /// Heap of payloads referred by values in index_.
+    payload_heap *payload_;
+
+    /// Flags of values in index_ referring to payloads, by index entry.
+    payload_flags *flags_;
+
+    /// Table remapping labels of keys to codes in both tries.
+    trie_alphabet<Traits> *alphabet_;
+
+    /// Filter of missing keys, consulted while the archive is loaded.
+    key_filter filter_;
+
+    /// Bits per key of the filter written by build(), 0 for none.
+    size_t filter_bits_;
+
+    /// States of the front trie by the first two labels.
+    root_table root_table_;
+
+    /// Writes root_table_ into the archive.
+    bool use_root_table_;
+
+    /// Collapses chains of the front trie written by build().
+    bool compress_chains_;
+
+    /// Front trie with chains collapsed or renumbered while an archive
+    /// is written.
+    basic_trie_type *compressed_;
+
+    /// Renumbers the states of both tries written by build().
+    bool relayout_;
+
+    /// Visits of the states of the front and rear trie, @see profile().
+    std::vector<size_type> front_heat_, rear_heat_;
+
+    /// Rear trie renumbered while an archive is written.
+    basic_trie_type *relaid_rear_;
+
+    /// Copy of accept_ with the states of relaid_rear_.
+    std::vector<accept_type> relaid_accept_;
+
+    /// Searches validate what they read, @see set_concurrent().
+    bool concurrent_;
+
+    /// Lock letting readers search while inserting.
+    sequence_lock lock_;
+
+    /// Buffers of index_ and accept_ kept for concurrent readers.
+    retired_buffers retired_;
+
     /// Pointer to mmapped buffer
     void *mmap_;
 
     /// Length of mmapped buffer
     size_t mmap_size_;
 
+    /// Who releases mmap_.
+    ownership_type ownership_;
+
     /// Archive magic.
     static const char magic_[16];
+
+    /// Loads the archive in mmap_ and makes it ready as options asks for.
+    void load(const load_options &options, const struct timeval &start);
+
+    /// Loads the sectioned archive in mmap_.
+    void load_sections(const archive_reader &reader);
+
+    /// Loads the archive in mmap_ which is written before sections exist.
+    void load_legacy();
+
+    /// Adds all sections of the trie to writer.
+    void archive(archive_writer *writer);
+
+    /// Frees the copies of the tries made by archive().
+    void release_relayout();
+
+    /**
+     * Copies the loaded archive into buffers of its own and rebuilds the
+     * back references and free lists, so that the trie can be updated.
+     * The archive is released then. It does nothing for a trie not
+     * loaded from an archive.
+     */
+    void detach_archive();
 };
 
+/// A two-trie over byte keys.
+typedef double_trie_impl<byte_trie_traits> double_trie;
+
 /**
  * A tail-trie.
+ *
+ * @param Traits Alphabet of the trie, @see trie_traits.
  */
-class single_trie: public trie
+template<typename Traits>
+class single_trie_impl: public trie
 {
   public:
+    /// Represents the trie of single_trie_impl.
+    typedef basic_trie_impl<Traits> basic_trie_type;
+
+    /// Represents a stored label.
+    typedef typename Traits::label_type label_type;
+
     /// Represents an element in suffix buffer.
-    typedef size_type suffix_type;
+    typedef label_type suffix_type;
+
+    /// Number of suffix elements used to store a value.
+    static const size_type kValueSize =
+        (sizeof(value_type) + sizeof(suffix_type) - 1) / sizeof(suffix_type);
 
     /**
-     * Represents some information about single_trie.
+     * Represents some information about single_trie_impl.
      */
     typedef struct {
         char magic[16];  ///< Archive magic.
         size_type suffix_size;  ///< Size of suffix buffer.
-        char unused[44];  ///< for 32/64 bits compatible.
+        size_type payload_size;  ///< Payload heap size in bytes.
+        size_type alphabet_size;  ///< Number of elements in alphabet.
+        char unused[36];  ///< for 32/64 bits compatible.
     } header_type;
 
     /**
@@ -971,7 +2799,7 @@ class single_trie: public trie
      * newly inserting key and an existing one.
      */
     typedef struct {
-        char_type *data; ///< Data buffer.
+        label_type *data; ///< Data buffer.
         size_t size;     ///< Buffer size.
     } common_type;
 
@@ -979,35 +2807,81 @@ class single_trie: public trie
     static const size_t kDefaultCommonSize = 256;
 
     /**
-     * Constructs an empty single_trie.
+     * Constructs an empty single_trie_impl.
      *
      * @param size Initial size of state.
      */
     /// @todo should default size be kDefaultStateSize?
-    explicit single_trie(size_t size = 0);
+    explicit single_trie_impl(size_t size = 0);
 
     /**
-     * Constructs an single_trie from archive.
+     * Constructs an single_trie_impl from archive.
      *
      * @param filename Filename of the archive.
+     * @param options Options for loading the archive.
+     */
+    explicit single_trie_impl(const char *filename,
+                              const load_options &options = load_options());
+
+    /**
+     * Constructs a single_trie_impl from a trie archive in memory, without copying.
+     *
+     * @param data Pointer to the archive.
+     * @param size Size of the archive.
+     * @param ownership Who releases the memory, it applies only if
+     *                  constructing succeeds.
+     * @param options Options for loading the archive.
      */
-    explicit single_trie(const char *filename);
+    single_trie_impl(const void *data, size_t size, ownership_type ownership,
+                     const load_options &options = load_options());
 
-    /// Destructs a single_trie.
-    ~single_trie();
+    /// Destructs a single_trie_impl.
+    ~single_trie_impl();
 
     void insert(const key_type &key, const value_type &value);
     bool search(const key_type &key, value_type *value) const;
     size_t prefix_search(const key_type &key, result_type *result) const;
     void build(const char *filename, bool verbose);
+    void serialize(int fd);
+    void insert_payload(const key_type &key,
+                        const char *payload, size_t length);
+    bool search_payload(const key_type &key,
+                        const char **payload, size_t *length) const;
+    void remap_labels(const size_t *frequency);
+    void set_filter(size_t bits_per_key);
+    void set_root_table(bool enable);
+    void set_compress_chains(bool enable);
+    void set_relayout(bool enable);
+    void profile(const key_type &key);
+    void set_concurrent(bool concurrent);
+    void reclaim();
+    stats_type stats() const;
 
-    /// Returns a pointer to the trie of single_trie.
-    const basic_trie *trie()
+    /**
+     * Inserts a key referring to a payload record of another trie, which
+     * is copied to the same offset in the payload heap, so the value of
+     * the key is kept. Copy all records before inserting new payloads.
+     *
+     * @param key The key.
+     * @param offset Offset of the record in the other trie.
+     * @param payload Buffer of the payload.
+     * @param length Length of the payload buffer.
+     */
+    void copy_payload(const key_type &key, value_type offset,
+                      const char *payload, size_t length)
+    {
+        detach_archive();
+        payload_->put(offset, payload, length);
+        store(key, offset, true);
+    }
+
+    /// Returns a pointer to the trie of single_trie_impl.
+    const basic_trie_type *trie()
     {
         return trie_;
     }
 
-    /// Returns a pointer to the tail of single_trie.
+    /// Returns a pointer to the tail of single_trie_impl.
     const suffix_type *suffix()
     {
         return suffix_;
@@ -1018,7 +2892,7 @@ class single_trie: public trie
     {
         size_type i;
         for (i = start; i < header_->suffix_size && i < count; i++) {
-            if (suffix_[i] == key_type::kTerminator)
+            if (suffix_[i] == Traits::kTerminator)
                 fprintf(stderr, "[%d:#]", i);
             else if (isgraph(key_type::char_out(suffix_[i])))
                 fprintf(stderr, "[%d:%c]",
@@ -1039,8 +2913,107 @@ class single_trie: public trie
     {
         // align with 4k
         size_type nsize = (((header_->suffix_size * 2 + size) >> 12) + 1) << 12;
-        suffix_ = resize(suffix_, header_->suffix_size, nsize);
-        header_->suffix_size = nsize;
+        TRIE_COUNT(suffix_grows, 1);
+        TRIE_COUNT(bytes_copied, sizeof(suffix_type) * header_->suffix_size);
+        store_release(&suffix_, retired_.grow(suffix_, header_->suffix_size,
+                                              nsize));
+        store_release(&header_->suffix_size, nsize);
+    }
+
+    /**
+     * Returns the (i)th element of suffix while the trie may be updated
+     * concurrently. Returns 0, which is not a label, if i is out of
+     * range; it is seen only in a partial update.
+     */
+    suffix_type read_suffix(size_type i) const
+    {
+        return read_suffix<shared_loads>(i);
+    }
+
+    /// Returns the (i)th element of suffix with loads L, @see plain_loads.
+    template<typename L>
+    suffix_type read_suffix(size_type i) const
+    {
+        // the size goes first, suffix_ is at least as large then
+        if (i <= 0 || i >= L::acquire(&header_->suffix_size))
+            return 0;
+        return L::relaxed(L::acquire(&suffix_) + i);
+    }
+
+    /// Stores an element of suffix.
+    void set_suffix(size_type i, suffix_type label)
+    {
+        store_relaxed(suffix_ + i, label);
+    }
+
+    /// Returns the value stored at start of suffix.
+    value_type suffix_value(size_type start) const
+    {
+        return suffix_value<shared_loads>(start);
+    }
+
+    /// Returns the value stored at start of suffix with loads L.
+    template<typename L>
+    value_type suffix_value(size_type start) const
+    {
+        suffix_type buf[kValueSize];
+        value_type value;
+        for (size_type i = 0; i < kValueSize; i++)
+            buf[i] = read_suffix<L>(start + i);
+        memcpy(&value, buf, sizeof(value));
+        return value;
+    }
+
+    /**
+     * Returns the value of leaf state s, which is kept by state when tails
+     * are shared, at start of suffix otherwise.
+     */
+    value_type tail_value(size_type s, size_type start) const
+    {
+        return tail_value<shared_loads>(s, start);
+    }
+
+    /// Returns the value of leaf state s with loads L.
+    template<typename L>
+    value_type tail_value(size_type s, size_type start) const
+    {
+        return values_?values_[s]:suffix_value<L>(start);
+    }
+
+    /**
+     * Returns true if the value of leaf state s refers to a payload. Flags
+     * are kept by state when tails are shared, by the position of the
+     * value in suffix otherwise.
+     */
+    template<typename L>
+    bool tail_flag(size_type s, size_type start) const
+    {
+        return flags_->template test<L>(values_?s:start);
+    }
+
+    /// Stores a value at start of suffix and its payload flag.
+    void set_suffix_value(size_type start, value_type value, bool payload)
+    {
+        suffix_type buf[kValueSize];
+        memcpy(buf, &value, sizeof(value));
+        for (size_type i = 0; i < kValueSize; i++)
+            set_suffix(start + i, buf[i]);
+        flags_->set(start, payload);
+    }
+
+    /**
+     * Appends a value to the end of suffix.
+     *
+     * @return The position of the value.
+     */
+    size_type append_suffix_value(value_type value, bool payload)
+    {
+        size_type start = next_suffix_;
+        if (next_suffix_ + kValueSize >= header_->suffix_size)
+            resize_suffix(kValueSize);
+        set_suffix_value(start, value, payload);
+        next_suffix_ += kValueSize;
+        return start;
     }
 
     /**
@@ -1056,14 +3029,25 @@ class single_trie: public trie
         common_.size = nsize;
     }
 
+    /**
+     * Stores the value of a key, @see insert().
+     *
+     * @param key The key.
+     * @param value The value.
+     * @param payload true if the value refers to a payload.
+     */
+    void store(const key_type &key, value_type value, bool payload);
+
     /**
      * Inserts inputs into suffix.
      *
      * @param s Separated state in trie
      * @param inputs The inputs
      * @param value The value
+     * @param payload true if the value refers to a payload.
      */
-    void insert_suffix(size_type s, const char_type *inputs, value_type value);
+    void insert_suffix(size_type s, const char_type *inputs, value_type value,
+                       bool payload);
 
     /**
      * Creates a branch in trie. This function creates a branch in trie
@@ -1073,14 +3057,106 @@ class single_trie: public trie
      * @param s Separated state in trie
      * @param inputs The inputs
      * @param value The value
+     * @param payload true if the value refers to a payload.
+     */
+    void create_branch(size_type s, const char_type *inputs, value_type value,
+                       bool payload);
+
+    /**
+     * Retrieves the value of a key, @see search().
+     *
+     * @param key The key.
+     * @param[out] value The value if found, can be NULL.
+     * @param[out] payload Whether the value refers to a payload, can be
+     *                     NULL.
+     * @return true if found.
+     */
+    bool lookup(const key_type &key, value_type *value, bool *payload) const;
+
+    /**
+     * Searches an encoded key with loads L, @see search().
+     *
+     * @param inputs The encoded key.
+     * @param[out] value The value if found.
+     * @param[out] payload The payload flag of the value, can be NULL.
+     * @return true if found.
+     */
+    template<typename L>
+    bool search_aux(const char_type *inputs, value_type *value,
+                    bool *payload) const;
+
+    /**
+     * Retrieves all key-value pairs matching an encoded prefix, @see
+     * prefix_search().
+     *
+     * @param code The encoded prefix.
+     * @param[out] result Result set.
+     * @param sequence Sequence taken from lock_ before searching.
+     * @return false if the trie is updated while retrieving.
+     */
+    bool prefix_search_aux(const encoded_key<Traits> &code,
+                           result_type *result,
+                           sequence_lock::sequence_type sequence) const;
+
+    /**
+     * Lays out the tails for an archive in shared_, so a tail which ends
+     * another one is stored once and values are kept by state.
+     *
+     * @param suffixes Number of suffix elements in use.
+     * @return false if the shared layout is not smaller.
+     */
+    bool share_tails(size_type suffixes);
+
+    /**
+     * Copies shared tails back to a suffix buffer which holds each tail
+     * followed by its value, and points leaf states at them. Payload
+     * flags move from the states to the values.
+     *
+     * @param[out] size Size of the new suffix buffer.
+     * @return The new suffix buffer.
      */
-    void create_branch(size_type s, const char_type *inputs, value_type value);
+    suffix_type *unshare_tails(size_type *size);
+
+    /// Frees the buffers of shared_.
+    void release_shared_tails()
+    {
+        std::vector<typename basic_trie_type::state_type>().swap(
+            shared_.states);
+        std::vector<suffix_type>().swap(shared_.suffix);
+        std::vector<value_type>().swap(shared_.values);
+        shared_.flags.clear();
+    }
 
   private:
-    basic_trie *trie_;      ///< Pointer to trie.
+    /// Tails laid out for an archive, @see share_tails().
+    typedef struct {
+        header_type header;  ///< Header holding the shared suffix size.
+        std::vector<typename basic_trie_type::state_type> states;  ///< States.
+        std::vector<suffix_type> suffix;  ///< Shared tails.
+        std::vector<value_type> values;   ///< Values by leaf state.
+        payload_flags flags;              ///< Payload flags by leaf state.
+    } shared_tails_type;
+
+    basic_trie_type *trie_; ///< Pointer to trie.
     suffix_type *suffix_;   ///< Pointer to suffix.
     header_type *header_;   ///< Pointer to header
     size_type next_suffix_; ///< Next available suffix
+    payload_heap *payload_; ///< Heap of payloads referred by values.
+    payload_flags *flags_;  ///< Payload flags of values, @see tail_flag().
+    trie_alphabet<Traits> *alphabet_; ///< Table remapping labels to codes.
+    key_filter filter_;     ///< Filter of missing keys in a loaded archive.
+    size_t filter_bits_;    ///< Bits per key of the filter to write.
+    root_table root_table_; ///< States by the first two labels.
+    bool use_root_table_;   ///< Writes root_table_ into the archive.
+    bool compress_chains_;  ///< Collapses chains of the trie written.
+    basic_trie_type *compressed_;  ///< Trie written if not trie_.
+    bool relayout_;         ///< Renumbers the states of the trie written.
+    std::vector<size_type> heat_;  ///< Visits by state, @see profile().
+    const value_type *values_;  ///< Values by state of loaded shared tails.
+    shared_tails_type shared_;  ///< Shared tails of the archive to write.
+    bool concurrent_;       ///< Searches validate what they read.
+    sequence_lock lock_;    ///< Lock letting readers search while inserting.
+    retired_buffers retired_;  ///< Buffers of suffix_ kept for readers.
 
     /**
      * Temporary buffer to store common part betwee newly
@@ -1091,11 +3167,40 @@ class single_trie: public trie
     void *mmap_;
     size_t mmap_size_;
 
+    /// Who releases mmap_.
+    ownership_type ownership_;
+
     /// Archive magic
     static const char magic_[16];
+
+    /// Loads the archive in mmap_ and makes it ready as options asks for.
+    void load(const load_options &options, const struct timeval &start);
+
+    /// Loads the sectioned archive in mmap_.
+    void load_sections(const archive_reader &reader);
+
+    /// Loads the archive in mmap_ which is written before sections exist.
+    void load_legacy();
+
+    /// Adds all sections of the trie to writer.
+    void archive(archive_writer *writer);
+
+    /**
+     * Copies the loaded archive into buffers of its own, so that the trie
+     * can be updated. The archive is released then. It does nothing for
+     * a trie not loaded from an archive.
+     */
+    void detach_archive();
 };
-#endif  // TRIE_IMPL_H_
+
+/// A tail-trie over byte keys with 16-bit tails.
+typedef single_trie_impl<byte_trie_traits> single_trie;
+
+/// A tail-trie over byte keys with 32-bit tails, @see wide_trie_traits.
+typedef single_trie_impl<wide_trie_traits> wide_single_trie;
 
 END_TRIE_NAMESPACE
 
+#endif  // TRIE_IMPL_H_
+
 // vim: ts=4 sw=4 ai et
@@ -0,0 +1,357 @@
+/*
+ * Copyright (c) 2009, Jianing Yang<jianingy.yang@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The names of its contributors may not be used to endorse or promote
+ *       products derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY detrox@gmail.com ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL detrox@gmail.com BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "trie_log.h"
+#include "layered_trie.h"
+#include "trie_archive.h"
+
+BEGIN_TRIE_NAMESPACE
+
+/**
+ * Represents the header of a log file.
+ */
+typedef struct {
+    char magic[8];     ///< Log magic, kLogMagic.
+    uint32_t version;  ///< Format version.
+    char unused[4];    ///< for 32/64 bits compatible.
+} log_header;
+
+/**
+ * Represents the header of a record. It is followed by the operation in
+ * a byte, the key length in 4 bytes, the key and the data of the
+ * operation: a value_type for LOG_INSERT, the payload for LOG_PAYLOAD
+ * and nothing for LOG_REMOVE.
+ */
+typedef struct {
+    uint32_t crc;     ///< CRC32C of length and everything following it.
+    uint32_t length;  ///< Length of the record after this header.
+} record_header;
+
+/// Log magic.
+static const char kLogMagic[8] = "TRIELOG";
+
+/// Latest log version.
+static const uint32_t kLogVersion = 1;
+
+/// Bytes of a record before the key.
+static const size_t kRecordPrefix = sizeof(record_header) + 1
+                                    + sizeof(uint32_t);
+
+/// Syncs data of a file to disk.
+static int sync_data(int fd)
+{
+#ifdef __linux__
+    return fdatasync(fd);
+#else
+    return fsync(fd);
+#endif
+}
+
+/// Writes a whole buffer at the end of a file, returns 0 or errno.
+static int write_all(int fd, const char *data, size_t length)
+{
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return errno;
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+trie_log::trie_log(const char *filename, size_t group_size)
+    :filename_(filename), fd_(-1), group_size_(group_size), base_(0),
+     appended_(0), durable_(0), syncs_(0), syncing_(false), error_(0)
+{
+    struct stat sb;
+    log_header header;
+
+    fd_ = open(filename, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd_ < 0)
+        throw std::runtime_error(strerror(errno));
+    if (fstat(fd_, &sb) < 0) {
+        close(fd_);
+        throw std::runtime_error(strerror(errno));
+    }
+    if (static_cast<size_t>(sb.st_size) < sizeof(header)) {
+        // a new log, or one torn while being created
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, kLogMagic, sizeof(header.magic));
+        header.version = kLogVersion;
+        if (ftruncate(fd_, 0) < 0) {
+            close(fd_);
+            throw std::runtime_error(strerror(errno));
+        }
+        if (write_all(fd_, reinterpret_cast<char *>(&header), sizeof(header))
+            || sync_data(fd_) < 0) {
+            close(fd_);
+            throw std::runtime_error(strerror(errno));
+        }
+        sync_directory(filename);
+        sb.st_size = sizeof(header);
+    } else if (pread(fd_, &header, sizeof(header), 0) != sizeof(header)
+               || memcmp(header.magic, kLogMagic, sizeof(header.magic))
+               || header.version > kLogVersion) {
+        close(fd_);
+        throw bad_trie_archive("bad log magic");
+    }
+    appended_ = durable_ = sb.st_size;
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&synced_, NULL);
+}
+
+trie_log::~trie_log()
+{
+    try {
+        commit();
+    } catch (...) {
+        // a destructor must not throw, records not committed are lost
+    }
+    close(fd_);
+    pthread_cond_destroy(&synced_);
+    pthread_mutex_destroy(&mutex_);
+}
+
+uint64_t trie_log::append(op_type op, const trie::key_type &key,
+                          const void *data, size_t length)
+{
+    std::string record(kRecordPrefix, '\0');
+    record_header header;
+    uint32_t key_length;
+    uint64_t sequence;
+
+    for (size_t i = 0; i < key.length()
+                       && key.data()[i] != trie::key_type::kTerminator; i++)
+        record.push_back(trie::key_type::char_out(key.data()[i]));
+    key_length = record.size() - kRecordPrefix;
+    record[sizeof(header)] = static_cast<char>(op);
+    memcpy(&record[sizeof(header) + 1], &key_length, sizeof(key_length));
+    record.append(static_cast<const char *>(data), length);
+    header.length = record.size() - sizeof(header);
+    header.crc = crc32c(crc32c(0, &header.length, sizeof(header.length)),
+                        &record[sizeof(header)], header.length);
+    memcpy(&record[0], &header, sizeof(header));
+
+    pthread_mutex_lock(&mutex_);
+    if (error_) {
+        int error = error_;
+        pthread_mutex_unlock(&mutex_);
+        throw std::runtime_error(strerror(error));
+    }
+    buffer_.append(record);
+    appended_ += record.size();
+    sequence = appended_;
+    bool full = buffer_.size() >= group_size_;
+    pthread_mutex_unlock(&mutex_);
+    if (full)
+        commit(sequence);
+    return sequence;
+}
+
+uint64_t trie_log::insert(const trie::key_type &key, trie::value_type value)
+{
+    return append(LOG_INSERT, key, &value, sizeof(value));
+}
+
+uint64_t trie_log::insert_payload(const trie::key_type &key,
+                                  const char *payload, size_t length)
+{
+    return append(LOG_PAYLOAD, key, payload, length);
+}
+
+uint64_t trie_log::remove(const trie::key_type &key)
+{
+    return append(LOG_REMOVE, key, NULL, 0);
+}
+
+void trie_log::commit(uint64_t sequence)
+{
+    pthread_mutex_lock(&mutex_);
+    while (durable_ < sequence && !error_) {
+        if (syncing_) {
+            pthread_cond_wait(&synced_, &mutex_);
+            continue;
+        }
+        // lead a sync for everything appended so far
+        std::string batch;
+        batch.swap(buffer_);
+        uint64_t end = appended_;
+        syncing_ = true;
+        pthread_mutex_unlock(&mutex_);
+        int error = write_all(fd_, batch.data(), batch.size());
+        if (!error && sync_data(fd_) < 0)
+            error = errno;
+        pthread_mutex_lock(&mutex_);
+        syncing_ = false;
+        if (error)
+            error_ = error;  // the file may end in a torn record now
+        else
+            durable_ = end;
+        syncs_++;
+        pthread_cond_broadcast(&synced_);
+    }
+    int error = durable_ < sequence?error_:0;
+    pthread_mutex_unlock(&mutex_);
+    if (error)
+        throw std::runtime_error(strerror(error));
+}
+
+void trie_log::commit()
+{
+    uint64_t sequence;
+    pthread_mutex_lock(&mutex_);
+    sequence = appended_;
+    pthread_mutex_unlock(&mutex_);
+    commit(sequence);
+}
+
+size_t trie_log::replay(layered_trie *target)
+{
+    struct stat sb;
+    std::string data;
+    size_t offset = sizeof(log_header), count = 0;
+
+    commit();
+    if (fstat(fd_, &sb) < 0)
+        throw std::runtime_error(strerror(errno));
+    data.resize(sb.st_size);
+    for (size_t done = 0; done < data.size(); ) {
+        ssize_t n = pread(fd_, &data[done], data.size() - done, done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            throw std::runtime_error(n?strerror(errno):"log truncated");
+        done += n;
+    }
+
+    while (offset + kRecordPrefix <= data.size()) {
+        record_header header;
+        uint32_t key_length;
+        memcpy(&header, &data[offset], sizeof(header));
+        if (header.length < kRecordPrefix - sizeof(header)
+            || header.length > data.size() - offset - sizeof(header)
+            || crc32c(crc32c(0, &header.length, sizeof(header.length)),
+                      &data[offset + sizeof(header)], header.length)
+               != header.crc)
+            break;
+        const char *body = &data[offset + sizeof(header)];
+        memcpy(&key_length, body + 1, sizeof(key_length));
+        size_t rest = header.length - 1 - sizeof(key_length);
+        if (key_length > rest)
+            break;
+        trie::key_type key(body + 1 + sizeof(key_length), key_length);
+        const char *extra = body + 1 + sizeof(key_length) + key_length;
+        rest -= key_length;
+        trie::value_type value;
+        switch (body[0]) {
+            case LOG_INSERT:
+                if (rest != sizeof(value))
+                    throw bad_trie_archive("log corrupted");
+                memcpy(&value, extra, sizeof(value));
+                target->insert(key, value);
+                break;
+            case LOG_PAYLOAD:
+                target->insert_payload(key, extra, rest);
+                break;
+            case LOG_REMOVE:
+                target->remove(key);
+                break;
+            default:
+                throw bad_trie_archive("log corrupted");
+        }
+        offset += sizeof(header) + header.length;
+        count++;
+    }
+
+    if (offset < data.size()) {
+        // drop the torn tail, later records must not follow it
+        if (ftruncate(fd_, offset) < 0 || sync_data(fd_) < 0)
+            throw std::runtime_error(strerror(errno));
+        pthread_mutex_lock(&mutex_);
+        appended_ = durable_ = base_ + offset;
+        pthread_mutex_unlock(&mutex_);
+    }
+    return count;
+}
+
+void trie_log::checkpoint(layered_trie *target, const char *archive,
+                          const trie::load_options &options)
+{
+    commit();
+    // the archive is replaced atomically and durably by compact()
+    target->compact(archive, options);
+    // the snapshot holds every record now
+    reset();
+}
+
+void trie_log::reset()
+{
+    pthread_mutex_lock(&mutex_);
+    while (syncing_)
+        pthread_cond_wait(&synced_, &mutex_);
+    buffer_.clear();
+    if (ftruncate(fd_, sizeof(log_header)) < 0 || sync_data(fd_) < 0) {
+        int error = errno;
+        pthread_mutex_unlock(&mutex_);
+        throw std::runtime_error(strerror(error));
+    }
+    // records appended before are in the snapshot, later sequence
+    // numbers go on from them
+    base_ = appended_ - sizeof(log_header);
+    durable_ = appended_;
+    error_ = 0;
+    pthread_mutex_unlock(&mutex_);
+}
+
+uint64_t trie_log::syncs() const
+{
+    uint64_t count;
+    pthread_mutex_lock(&mutex_);
+    count = syncs_;
+    pthread_mutex_unlock(&mutex_);
+    return count;
+}
+
+END_TRIE_NAMESPACE
+
+// vim: ts=4 sw=4 ai et
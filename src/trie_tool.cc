@@ -1,23 +1,40 @@
 // Copyright Jianing Yang <jianingy.yang@gmail.com>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <limits.h>
 #include <errno.h>
 #include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <algorithm>
 #include <iostream>
+#include <string>
+#include <vector>
 #include <stdexcept>
 #include <cstring>
 #include <cstdio>
 #include <cstdlib>
 
 #include "trie.h"
+#include "trie_counters.h"
 
 using namespace dutil;
 
 static void *
-query_trie(const char *query, const char *index, bool prefix, bool verbose)
+query_trie(const char *query, const char *index, bool prefix, bool verbose,
+           trie::load_options options)
 {
     int retval = 0;
     trie::value_type value;
-    trie *mtrie = trie::create_trie(index);
+    trie::load_metrics metrics;
+    options.metrics = &metrics;
+    trie *mtrie = trie::create_trie(index, options);
+    if (verbose)
+        std::cerr << "loaded in " << metrics.ready_time * 1000 << "ms, "
+                  << metrics.resident_bytes << " of "
+                  << metrics.mapped_bytes << " bytes resident" << std::endl;
     trie::key_type key(query, strlen(query));
     if (prefix) {
         trie::result_type result;
@@ -37,17 +54,416 @@ query_trie(const char *query, const char *index, bool prefix, bool verbose)
     exit(retval);
 }
 
-static void *
-build_trie(const char *source, const char *index, trie::trie_type type, bool verbose)
+static void check_trie(const char *index, trie::load_options options)
+{
+    options.verify = true;
+    try {
+        trie *mtrie = trie::create_trie(index, options);
+        delete mtrie;
+    } catch (const std::exception &e) {
+        std::cerr << index << ": " << e.what() << std::endl;
+        exit(1);
+    }
+    std::cout << index << ": ok" << std::endl;
+    exit(0);
+}
+
+static void print_array_stats(const char *name,
+                              const trie::array_stats &stats)
 {
+    printf("  \"%s\": {\"used\": %lu, \"allocated\": %lu, "
+           "\"holes\": %lu, \"fill\": %.4f},\n", name,
+           static_cast<unsigned long>(stats.used),
+           static_cast<unsigned long>(stats.allocated),
+           static_cast<unsigned long>(stats.holes), stats.fill);
+}
+
+static void stats_trie(const char *index, trie::load_options options)
+{
+    static const char *names[] = {"unknown", "tail", "two", "louds"};
+    trie *mtrie = trie::create_trie(index, options);
+    trie::stats_type stats = mtrie->stats();
+    delete mtrie;
+
+    // JSON for capacity dashboards
+    printf("{\n  \"archive\": \"%s\",\n  \"type\": \"%s\",\n",
+           index, names[stats.type]);
+    printf("  \"keys\": %lu,\n", static_cast<unsigned long>(stats.keys));
+    print_array_stats("front", stats.front);
+    print_array_stats("rear", stats.rear);
+    printf("  \"index\": {\"live\": %lu, \"allocated\": %lu},\n",
+           static_cast<unsigned long>(stats.index_live),
+           static_cast<unsigned long>(stats.index_allocated));
+    printf("  \"accept\": {\"live\": %lu, \"allocated\": %lu},\n",
+           static_cast<unsigned long>(stats.accept_live),
+           static_cast<unsigned long>(stats.accept_allocated));
+    printf("  \"rear_sharing\": %.4f,\n", stats.rear_sharing);
+    printf("  \"tail_bytes\": %lu,\n",
+           static_cast<unsigned long>(stats.tail_bytes));
+    printf("  \"average_depth\": %.4f,\n", stats.average_depth);
+    printf("  \"max_depth\": %lu,\n",
+           static_cast<unsigned long>(stats.max_depth));
+    printf("  \"bytes\": %lu,\n", static_cast<unsigned long>(stats.bytes));
+    printf("  \"bytes_per_key\": %.2f\n}\n", stats.bytes_per_key);
+    exit(0);
+}
+
+static off_t file_size(const char *filename)
+{
+    struct stat sb;
+    if (stat(filename, &sb) < 0)
+        throw std::runtime_error(strerror(errno));
+    return sb.st_size;
+}
+
+static double average_lookup(const char *source, const char *index)
+{
+    char fmt[LINE_MAX];
+    char cstr[LINE_MAX];
+    int val;
+    size_t count = 0;
+    struct timezone tz;
+    struct timeval total = {0, 0}, tv[2];
+    trie::value_type value;
+    trie::key_type key;
+    FILE *file;
+
+    if (!(file = fopen(source, "r")))
+        throw std::runtime_error(strerror(errno));
+    trie *mtrie = trie::create_trie(index);
+    snprintf(fmt, LINE_MAX, "%%d %%%d[^\n] ", LINE_MAX);
+    while (!feof(file) && fscanf(file, fmt, &val, cstr) == 2) {
+        key.assign(cstr, strlen(cstr));
+        gettimeofday(&tv[0], &tz);
+        mtrie->search(key, &value);
+        gettimeofday(&tv[1], &tz);
+        total.tv_sec += tv[1].tv_sec - tv[0].tv_sec;
+        total.tv_usec += tv[1].tv_usec - tv[0].tv_usec;
+        ++count;
+    }
+    fclose(file);
+    delete mtrie;
+    return count?(total.tv_sec * 1000000.0 + total.tv_usec) / count:0;
+}
+
+static void
+compare_remap(const char *source, const char *index, trie::trie_type type)
+{
+    std::string plain = std::string(index) + ".plain";
     trie *mtrie = trie::create_trie(type);
+    mtrie->read_from_text(source, false);
+    mtrie->build(plain.c_str());
+    delete mtrie;
+
+    off_t size[2] = {file_size(plain.c_str()), file_size(index)};
+    double lookup[2] = {average_lookup(source, plain.c_str()),
+                        average_lookup(source, index)};
+    remove(plain.c_str());
+    std::cerr.precision(4);
+    std::cerr << "remap: archive " << size[0] << " -> " << size[1]
+              << " bytes (" << (size[1] - size[0]) * 100.0 / size[0]
+              << "%), average lookup " << lookup[0] << "us -> "
+              << lookup[1] << "us" << std::endl;
+}
+
+static void
+compare_louds(const char *source, const char *index)
+{
+    static const char *names[] = {"tail-trie", "two-trie"};
+    static const trie::trie_type types[] = {trie::SINGLE_TRIE,
+                                            trie::DOUBLE_TRIE};
+    std::string other = std::string(index) + ".other";
+    off_t size = file_size(index);
+    double lookup = average_lookup(source, index);
+
+    std::cerr.precision(4);
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        trie *mtrie = trie::create_trie(types[i]);
+        mtrie->read_from_text(source, false);
+        mtrie->build(other.c_str());
+        delete mtrie;
+        off_t osize = file_size(other.c_str());
+        double olookup = average_lookup(source, other.c_str());
+        remove(other.c_str());
+        std::cerr << "louds vs " << names[i] << ": archive " << osize
+                  << " -> " << size << " bytes ("
+                  << static_cast<double>(osize) / size
+                  << "x smaller), average lookup " << olookup << "us -> "
+                  << lookup << "us" << std::endl;
+    }
+}
+
+/// Prints what inserting cost, if counting is compiled in.
+static void print_counters()
+{
+    trie_counters counters;
+    if (!counters_enabled())
+        return;
+    read_counters(&counters);
+    std::cerr << "counters: " << counters.relocations << " relocations, "
+              << counters.states_moved << " states moved, "
+              << counters.base_probes << " base probes, "
+              << counters.state_grows + counters.suffix_grows
+              << " growths copying " << counters.bytes_copied << " bytes, "
+              << counters.rear_cleans << " rear cleans, "
+              << counters.branches << " branches" << std::endl;
+}
+
+/// Reads the queries of (source), one per line, into (queries).
+static void read_queries(const char *source, std::vector<std::string> *queries)
+{
+    char cstr[LINE_MAX];
+    FILE *file;
+    if (!(file = fopen(source, "r"))) {
+        std::cerr << source << ": " << strerror(errno) << std::endl;
+        exit(1);
+    }
+    while (fgets(cstr, sizeof(cstr), file)) {
+        size_t length = strcspn(cstr, "\r\n");
+        if (length)
+            queries->push_back(std::string(cstr, length));
+    }
+    fclose(file);
+}
+
+static void *
+build_trie(const char *source, const char *index, trie::trie_type type,
+           bool remap, size_t filter, bool root, bool chains, bool relayout,
+           const char *profile, bool verbose)
+{
+    trie *mtrie = trie::create_trie(type == trie::LOUDS_TRIE?
+                                    trie::DOUBLE_TRIE:type);
+    mtrie->read_from_text(source, verbose, remap);
+    if (verbose)
+        print_counters();
+    if (type == trie::LOUDS_TRIE) {
+        trie *louds = trie::create_trie(*mtrie, type);
+        delete mtrie;
+        mtrie = louds;
+    }
+    mtrie->set_filter(filter);
+    mtrie->set_root_table(root);
+    mtrie->set_compress_chains(chains);
+    mtrie->set_relayout(relayout);
+    if (profile) {
+        // states the queries visit are placed first
+        std::vector<std::string> queries;
+        read_queries(profile, &queries);
+        for (size_t i = 0; i < queries.size(); i++)
+            mtrie->profile(trie::key_type(queries[i].data(),
+                                          queries[i].size()));
+    }
+    if (!strcmp(index, "-")) {
+        // stream to a pipe, e.g. into a compressor
+        mtrie->serialize(STDOUT_FILENO);
+        delete mtrie;
+        exit(0);
+    }
+    if (verbose)
+        std::cerr << "writing to disk..." << std::endl;
+    mtrie->build(index, verbose);
+    delete mtrie;
+    if (verbose && remap && type != trie::LOUDS_TRIE)
+        compare_remap(source, index, type);
+    if (verbose && type == trie::LOUDS_TRIE)
+        compare_louds(source, index);
+    if (verbose)
+        std::cerr << "done" << std::endl;
+    exit(0);
+}
+
+static void *
+append_trie(const char *source, const char *index, bool verbose)
+{
+    trie *mtrie = trie::create_trie(index);
     mtrie->read_from_text(source, verbose);
     if (verbose)
         std::cerr << "writing to disk..." << std::endl;
     mtrie->build(index, verbose);
+    delete mtrie;
     if (verbose)
         std::cerr << "done" << std::endl;
+    exit(0);
+}
+
+static void help_message();
+
+/// Latencies in buckets of 1/8 of a power of two nanoseconds.
+class latency_histogram {
+  public:
+    static const int kSubBits = 3;
+    static const int kBuckets = 64 << kSubBits;
+
+    latency_histogram() :count_(0), total_(0), max_(0)
+    {
+        memset(buckets_, 0, sizeof(buckets_));
+    }
+
+    void add(uint64_t ns)
+    {
+        buckets_[bucket(ns)]++;
+        count_++;
+        total_ += ns;
+        if (ns > max_)
+            max_ = ns;
+    }
+
+    void merge(const latency_histogram &other)
+    {
+        for (int i = 0; i < kBuckets; i++)
+            buckets_[i] += other.buckets_[i];
+        count_ += other.count_;
+        total_ += other.total_;
+        if (other.max_ > max_)
+            max_ = other.max_;
+    }
+
+    /// Returns the upper bound of the bucket holding the (q)th quantile.
+    uint64_t quantile(double q) const
+    {
+        uint64_t rank = static_cast<uint64_t>(q * count_), seen = 0;
+        for (int i = 0; i < kBuckets; i++) {
+            seen += buckets_[i];
+            if (seen > rank)
+                return std::min(upper(i), max_);
+        }
+        return max_;
+    }
+
+    void print(const char *name, bool last) const
+    {
+        printf("  \"%s\": {\"count\": %llu, \"mean_ns\": %.1f, "
+               "\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, "
+               "\"p999_ns\": %llu, \"max_ns\": %llu,\n    \"buckets\": [",
+               name, static_cast<unsigned long long>(count_),
+               count_?static_cast<double>(total_) / count_:0.0,
+               static_cast<unsigned long long>(quantile(0.5)),
+               static_cast<unsigned long long>(quantile(0.9)),
+               static_cast<unsigned long long>(quantile(0.99)),
+               static_cast<unsigned long long>(quantile(0.999)),
+               static_cast<unsigned long long>(max_));
+        // [upper bound in ns, count] of each non-empty bucket
+        const char *separator = "";
+        for (int i = 0; i < kBuckets; i++) {
+            if (!buckets_[i])
+                continue;
+            printf("%s[%llu, %llu]", separator,
+                   static_cast<unsigned long long>(upper(i)),
+                   static_cast<unsigned long long>(buckets_[i]));
+            separator = ", ";
+        }
+        printf("]}%s\n", last?"":",");
+    }
+
+  protected:
+    static int bucket(uint64_t ns)
+    {
+        if (ns < (1U << kSubBits))
+            return static_cast<int>(ns);
+        int exponent = 63 - __builtin_clzll(ns);
+        return ((exponent - kSubBits + 1) << kSubBits)
+               + static_cast<int>((ns >> (exponent - kSubBits))
+                                  & ((1U << kSubBits) - 1));
+    }
+
+    static uint64_t upper(int bucket)
+    {
+        if (bucket < (1 << kSubBits))
+            return bucket;
+        int exponent = (bucket >> kSubBits) + kSubBits - 1;
+        uint64_t sub = (bucket & ((1 << kSubBits) - 1)) + (1 << kSubBits) + 1;
+        return (sub << (exponent - kSubBits)) - 1;
+    }
+
+  private:
+    uint64_t buckets_[kBuckets];
+    uint64_t count_;
+    uint64_t total_;
+    uint64_t max_;
+};
+
+typedef struct {
+    const trie *mtrie;
+    const std::vector<std::string> *queries;
+    size_t start;
+    int repeat;
+    latency_histogram hits;
+    latency_histogram misses;
+} bench_worker;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *run_queries(void *arg)
+{
+    bench_worker *worker = static_cast<bench_worker *>(arg);
+    const std::vector<std::string> &queries = *worker->queries;
+    trie::value_type value;
+
+    for (int r = 0; r < worker->repeat; r++) {
+        // each thread starts elsewhere so that they do not run in lockstep
+        for (size_t i = 0; i < queries.size(); i++) {
+            const std::string &query =
+                queries[(worker->start + i) % queries.size()];
+            uint64_t start = now_ns();
+            bool found = worker->mtrie->search(query.data(), query.size(),
+                                               &value);
+            uint64_t elapsed = now_ns() - start;
+            if (found)
+                worker->hits.add(elapsed);
+            else
+                worker->misses.add(elapsed);
+        }
+    }
+    return NULL;
+}
+
+/// Runs the queries of (source), one per line, from (threads) threads
+/// against one mapping of (index) and prints latencies as JSON.
+static void bench_trie(const char *source, const char *index, int threads,
+                       int repeat, trie::load_options options)
+{
+    std::vector<std::string> queries;
+    read_queries(source, &queries);
+    if (queries.empty() || threads < 1 || repeat < 1) {
+        help_message();
+        exit(1);
+    }
+
+    trie *mtrie = trie::create_trie(index, options);
+    std::vector<bench_worker> workers(threads);
+    std::vector<pthread_t> ids(threads);
+    for (int i = 0; i < threads; i++) {
+        workers[i].mtrie = mtrie;
+        workers[i].queries = &queries;
+        workers[i].start = queries.size() * i / threads;
+        workers[i].repeat = repeat;
+    }
+    uint64_t start = now_ns();
+    for (int i = 0; i < threads; i++)
+        pthread_create(&ids[i], NULL, run_queries, &workers[i]);
+    latency_histogram hits, misses;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+        hits.merge(workers[i].hits);
+        misses.merge(workers[i].misses);
+    }
+    double seconds = (now_ns() - start) / 1e9;
     delete mtrie;
+
+    uint64_t total = static_cast<uint64_t>(queries.size()) * threads * repeat;
+    printf("{\n  \"archive\": \"%s\",\n  \"queries\": %llu,\n"
+           "  \"threads\": %d,\n  \"repeat\": %d,\n  \"seconds\": %.3f,\n"
+           "  \"queries_per_sec\": %.0f,\n", index,
+           static_cast<unsigned long long>(total), threads, repeat,
+           seconds, seconds > 0?total / seconds:0.0);
+    hits.print("hits", false);
+    misses.print("misses", true);
+    printf("}\n");
     exit(0);
 }
 
@@ -56,17 +472,35 @@ static void help_message()
     std::cout << "Usage: trie_tool [OPTIONS] archive\n"
                  "Utility to manage archive of libxtree \n"
                  "OPTIONS:\n"
-                 "        -b|--build SOURCE     build from SOURCE\n"
+                 "        -a|--append SOURCE    append SOURCE to archive\n"
+                 "        --bench QUERIES       time QUERIES, one per line\n"
+                 "        -j|--threads N        bench from N threads\n"
+                 "        --repeat R            bench QUERIES R times\n"
+                 "        -b|--build SOURCE     build from SOURCE, - for stdout\n"
+                 "        -c|--check            verify checksums of archive\n"
+                 "        -f|--filter BITS      build a filter of missing keys\n"
+                 "        --root-table          build a table of the first two bytes\n"
+                 "        --compress-chains     collapse chains of single transitions\n"
+                 "        --relayout            renumber states by visits\n"
+                 "        --relayout-profile QUERIES\n"
+                 "                              relayout, QUERIES visit first\n"
                  "        -h|--help             help message\n"
                  "        -q|--query QUERY      lookup QUERY in archive\n"
                  "        -p|--prefix           prefix mode query\n"
+                 "        -r|--remap            remap labels by frequency\n"
+                 "        -s|--stats            print statistics as JSON\n"
                  "        -t|--type TYPE        archive type\n"
-                 "        -v|--verbose          verbose\n\n"
+                 "        -v|--verbose          verbose\n"
+                 "        --populate            prefault archive while loading\n"
+                 "        --mlock               lock archive in memory\n"
+                 "        --advice ADVICE       random, sequential or willneed\n"
+                 "        --warmup THREADS      touch archive from THREADS\n\n"
                  "SOURCE FORMAT:\n"
                  "        value word\n\n"
                  "ARCHIVE TYPE:\n"
                  "        1: tail-trie\n"
                  "        2: two-trie (default value)\n"
+                 "        3: louds-trie (read-only, succinct)\n"
                  "\n"
                  "Report bugs to jianing.yang@alibaba-inc.com\n"
               << std::endl;
@@ -76,44 +510,108 @@ int main(int argc, char *argv[])
 {
     int c;
     const char *index = NULL, *source = NULL, *query = NULL;
+    const char *append = NULL, *bench = NULL;
+    int threads = 1, repeat = 1;
+    size_t filter = 0;
+    bool root = false;
+    bool chains = false;
+    bool relayout = false;
+    const char *profile = NULL;
     trie::trie_type type = trie::DOUBLE_TRIE;
     bool verbose = false;
     bool prefix = false;
+    bool remap = false;
     bool dump = false;
+    bool check = false;
+    bool stats = false;
+    trie::load_options options;
 
     while (true) {
         static struct option long_options[] =
         {
+            {"append", required_argument, 0, 'a'},
             {"build", required_argument, 0, 'b'},
+            {"bench", required_argument, 0, 'B'},
+            {"check", no_argument, 0, 'c'},
+            {"compress-chains", no_argument, 0, 'C'},
             {"dump", no_argument, 0, 'd'},
+            {"filter", required_argument, 0, 'f'},
             {"help", no_argument, 0, 'h'},
             {"prefix", no_argument, 0, 'p'},
             {"query", required_argument, 0, 'q'},
+            {"relayout", no_argument, 0, 'l'},
+            {"relayout-profile", required_argument, 0, 'Q'},
+            {"remap", no_argument, 0, 'r'},
+            {"repeat", required_argument, 0, 'R'},
+            {"root-table", no_argument, 0, 'T'},
+            {"stats", no_argument, 0, 's'},
+            {"threads", required_argument, 0, 'j'},
             {"type", required_argument, 0, 't'},
             {"verbose", no_argument, 0, 'v'},
+            {"populate", no_argument, 0, 'P'},
+            {"mlock", no_argument, 0, 'L'},
+            {"advice", required_argument, 0, 'A'},
+            {"warmup", required_argument, 0, 'W'},
             {0, 0, 0, 0}
         };
         int option_index;
 
-        c = getopt_long(argc, argv, "b:dhpq:t:v", long_options, &option_index);
+        c = getopt_long(argc, argv, "a:b:cdf:hj:pq:rst:v", long_options, &option_index);
         if (c == -1) break;
 
         switch (c) {
             case 'h':
                 help_message();
                 return 0;
+            case 'a':
+                append = optarg;
+                break;
             case 'b':
                 source = optarg;
                 break;
+            case 'B':
+                bench = optarg;
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'R':
+                repeat = atoi(optarg);
+                break;
+            case 'c':
+                check = true;
+                break;
             case 'd':
                 dump = true;
                 break;
+            case 'f':
+                filter = strtoul(optarg, NULL, 10);
+                break;
+            case 'T':
+                root = true;
+                break;
+            case 'C':
+                chains = true;
+                break;
+            case 'l':
+                relayout = true;
+                break;
+            case 'Q':
+                relayout = true;
+                profile = optarg;
+                break;
             case 'p':
                 prefix = true;
                 break;
             case 'q':
                 query = optarg;
                 break;
+            case 'r':
+                remap = true;
+                break;
+            case 's':
+                stats = true;
+                break;
             case 't':
                 switch (atoi(optarg)) {
                     case 1:
@@ -122,6 +620,9 @@ int main(int argc, char *argv[])
                     case 2:
                         type = trie::DOUBLE_TRIE;
                         break;
+                    case 3:
+                        type = trie::LOUDS_TRIE;
+                        break;
                     default:
                         help_message();
                         exit(0);
@@ -130,17 +631,48 @@ int main(int argc, char *argv[])
             case 'v':
                 verbose = true;
                 break;
+            case 'P':
+                options.populate = true;
+                break;
+            case 'L':
+                options.lock = true;
+                break;
+            case 'A':
+                if (!strcmp(optarg, "random")) {
+                    options.advice = trie::ADVICE_RANDOM;
+                } else if (!strcmp(optarg, "sequential")) {
+                    options.advice = trie::ADVICE_SEQUENTIAL;
+                } else if (!strcmp(optarg, "willneed")) {
+                    options.advice = trie::ADVICE_WILLNEED;
+                } else {
+                    help_message();
+                    exit(0);
+                }
+                break;
+            case 'W':
+                options.warmup_threads = atoi(optarg);
+                break;
         }
     }
 
-    if (optind < argc) {
+    // one archive only, a stray argument is never taken for it
+    if (optind + 1 == argc) {
         index = argv[optind];
         if (source)
-            build_trie(source, index, type, verbose);
+            build_trie(source, index, type, remap, filter, root, chains,
+                       relayout, profile, verbose);
+        else if (append)
+            append_trie(append, index, verbose);
         else if (query)
-            query_trie(query, index, prefix, verbose);
+            query_trie(query, index, prefix, verbose, options);
         else if (dump)
-            query_trie("", index, true, verbose);
+            query_trie("", index, true, verbose, options);
+        else if (check)
+            check_trie(index, options);
+        else if (stats)
+            stats_trie(index, options);
+        else if (bench)
+            bench_trie(bench, index, threads, repeat, options);
     }
     help_message();
 
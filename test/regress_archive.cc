@@ -0,0 +1,883 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "trie.h"
+#include "trie_archive.h"
+#include "trie_impl.h"
+
+using namespace dutil;
+
+static const char *archive = "/tmp/regress_archive.idx";
+
+static void fail(const char *message)
+{
+    printf("\nTEST FAILED on %s!\n", message);
+    exit(1);
+}
+
+static bool loads(const trie::load_options &options)
+{
+    try {
+        trie *mtrie = trie::create_trie(archive, options);
+        delete mtrie;
+    } catch (const bad_trie_archive &e) {
+        printf("(%s) ", e.what());
+        return false;
+    }
+    return true;
+}
+
+/// Overwrites a byte of the archive, returns the original one.
+static int poke(long offset, int ch)
+{
+    FILE *fp = fopen(archive, "r+");
+    fseek(fp, offset, SEEK_SET);
+    int orig = fgetc(fp);
+    fseek(fp, offset, SEEK_SET);
+    fputc(ch, fp);
+    fclose(fp);
+    return orig;
+}
+
+/// Reads offset of the last byte of the last section.
+static long last_byte()
+{
+    archive_header header;
+    section_entry entry;
+    FILE *fp = fopen(archive, "r");
+    if (fread(&header, sizeof(header), 1, fp) != 1)
+        fail("reading header");
+    fseek(fp, sizeof(entry) * (header.section_count - 1), SEEK_CUR);
+    if (fread(&entry, sizeof(entry), 1, fp) != 1)
+        fail("reading section table");
+    fclose(fp);
+    return entry.offset + entry.length - 1;
+}
+
+/// Reads the archive into an aligned buffer allocated by malloc.
+static char *read_archive(size_t *size)
+{
+    struct stat sb;
+    void *buffer;
+    FILE *fp = fopen(archive, "r");
+    if (!fp || stat(archive, &sb) < 0
+        || posix_memalign(&buffer, 64, sb.st_size)
+        || fread(buffer, 1, sb.st_size, fp) != static_cast<size_t>(sb.st_size))
+        fail("reading archive");
+    fclose(fp);
+    *size = sb.st_size;
+    return static_cast<char *>(buffer);
+}
+
+/// Serializes a trie through a pipe, returns what comes out of it.
+static std::string serialize_pipe(trie *mtrie)
+{
+    std::string data;
+    char buffer[4096];
+    ssize_t n;
+    int fds[2], status;
+
+    if (pipe(fds) < 0)
+        fail("pipe");
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        mtrie->serialize(fds[1]);
+        _exit(0);
+    }
+    close(fds[1]);
+    while ((n = read(fds[0], buffer, sizeof(buffer))) > 0)
+        data.append(buffer, n);
+    close(fds[0]);
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status)
+        || WEXITSTATUS(status))
+        fail("serializing");
+    return data;
+}
+
+/// Returns true if a trie can be created from the memory.
+static bool loads_memory(const void *data, size_t size)
+{
+    try {
+        trie *mtrie = trie::create_trie_from_memory(data, size);
+        delete mtrie;
+    } catch (const std::runtime_error &e) {
+        printf("(%s) ", e.what());
+        return false;
+    }
+    return true;
+}
+
+/// Returns true if all words are found with their values.
+static bool find_words(const trie *mtrie, const char **words)
+{
+    for (size_t i = 0; words[i]; i++) {
+        trie::value_type value;
+        if (!mtrie->search(words[i], strlen(words[i]), &value)
+            || value != static_cast<trie::value_type>(i + 1))
+            return false;
+    }
+    return true;
+}
+
+/// Returns true if statistics agree with a trie of keys words.
+static bool check_stats(const trie *mtrie, trie::trie_type type, size_t keys)
+{
+    trie::stats_type stats = mtrie->stats();
+    if (stats.type != type || stats.keys != keys || !stats.bytes
+        || static_cast<size_t>(stats.bytes_per_key * keys + 0.5)
+           != stats.bytes
+        || stats.average_depth <= 0
+        || stats.max_depth < stats.average_depth)
+        return false;
+    if (type == trie::LOUDS_TRIE)
+        return true;
+    if (!stats.front.used || stats.front.used > stats.front.allocated
+        || stats.front.fill <= 0 || stats.front.fill > 1)
+        return false;
+    if (type == trie::SINGLE_TRIE)
+        return !stats.rear.used && !stats.index_live;
+    // every key has an index entry, at most one accept state
+    return stats.index_live == keys
+           && stats.index_live <= stats.index_allocated
+           && stats.accept_live <= stats.accept_allocated
+           && stats.accept_live <= keys
+           && stats.rear_sharing >= 1 && stats.tail_bytes;
+}
+
+/**
+ * Appends keys to the archive through a loaded trie and rebuilds the
+ * archive over itself, the first words are kept.
+ */
+static void extend_archive(const char **words)
+{
+    static const int kExtra = 3000;
+    char key[32];
+    int i;
+
+    trie *loaded = trie::create_trie(archive);
+    for (i = 0; i < kExtra; i++) {
+        // share prefixes with words and each other
+        snprintf(key, sizeof(key), "%s%d", words[i % 5], i);
+        if (i % 3)
+            loaded->insert(key, strlen(key), kExtra + i);
+        else
+            loaded->insert_payload(trie::key_type(key, strlen(key)),
+                                   key, strlen(key));
+    }
+    loaded->insert("ba", 2, 2 * kExtra);
+    if (!find_words(loaded, words))
+        fail("reopened archive");
+    loaded->build(archive);
+    delete loaded;
+
+    loaded = trie::create_trie(archive);
+    for (i = 0; i < kExtra; i++) {
+        trie::value_type value;
+        const char *payload;
+        size_t length;
+        snprintf(key, sizeof(key), "%s%d", words[i % 5], i);
+        if (i % 3) {
+            if (!loaded->search(key, strlen(key), &value)
+                || value != kExtra + i)
+                fail(key);
+        } else if (!loaded->search_payload(trie::key_type(key, strlen(key)),
+                                           &payload, &length)
+                   || std::string(payload, length) != key) {
+            fail(key);
+        }
+    }
+    trie::value_type value;
+    if (!find_words(loaded, words) || !loaded->search("ba", 2, &value)
+        || value != 2 * kExtra)
+        fail("extended archive");
+    delete loaded;
+}
+
+/// Returns true if the archive has a section.
+static bool has_section(uint32_t id)
+{
+    size_t size, length;
+    char *buffer = read_archive(&size);
+    archive_reader reader(buffer, size, true);
+    bool found = reader.section(id, &length) != NULL;
+    free(buffer);
+    return found;
+}
+
+/**
+ * Checks that an archive built with a filter finds every key, also
+ * after keys are inserted into it and it is built again.
+ */
+static void check_filter(trie::trie_type type)
+{
+    static const int kKeys = 5000;
+    char key[32];
+    int i;
+
+    trie *mtrie = trie::create_trie(type);
+    mtrie->set_filter(10);
+    for (i = 0; i < kKeys; i++) {
+        snprintf(key, sizeof(key), "f%d", i);
+        mtrie->insert(key, strlen(key), i + 1);
+    }
+    mtrie->build(archive);
+    delete mtrie;
+    if (!has_section(SECTION_FILTER))
+        fail("writing filter");
+
+    trie *loaded = trie::create_trie(archive);
+    for (i = 0; i < kKeys; i++) {
+        trie::value_type value;
+        snprintf(key, sizeof(key), "f%d", i);
+        if (!loaded->search(key, strlen(key), &value) || value != i + 1)
+            fail("searching with filter");
+        snprintf(key, sizeof(key), "g%d", i);
+        if (loaded->search(key, strlen(key), NULL))
+            fail("missing key with filter");
+    }
+    // inserting drops the filter, building writes a new one
+    loaded->insert("g0", 2, 1);
+    if (!loaded->search("g0", 2, NULL))
+        fail("inserting with filter");
+    loaded->build(archive);
+    delete loaded;
+    loaded = trie::create_trie(archive);
+    if (!has_section(SECTION_FILTER) || !loaded->search("g0", 2, NULL)
+        || !loaded->search("f0", 2, NULL))
+        fail("rebuilding filter");
+    // and none is written once it is turned off
+    loaded->set_filter(0);
+    loaded->build(archive);
+    delete loaded;
+    if (has_section(SECTION_FILTER))
+        fail("turning filter off");
+    printf("[filter] ");
+}
+
+/// Returns true if the (i)th host of check_shared_tails() is found.
+static bool find_host(const trie *mtrie, int i)
+{
+    char key[64];
+    trie::value_type value;
+    const char *payload;
+    size_t length;
+
+    snprintf(key, sizeof(key), "host%04d.example.com/index.html", i);
+    if (i % 7)
+        return mtrie->search(key, strlen(key), &value) && value == i + 1;
+    return mtrie->search_payload(trie::key_type(key, strlen(key)),
+                                 &payload, &length)
+           && std::string(payload, length) == key;
+}
+
+/**
+ * Checks that a tail-trie whose keys end alike is built with shared
+ * tails, and that it is searched and extended as any other.
+ */
+static void check_shared_tails()
+{
+    static const int kKeys = 2000;
+    char key[64];
+    int i;
+
+    trie *mtrie = trie::create_trie(trie::SINGLE_TRIE);
+    for (i = 0; i < kKeys; i++) {
+        snprintf(key, sizeof(key), "host%04d.example.com/index.html", i);
+        if (i % 7)
+            mtrie->insert(key, strlen(key), i + 1);
+        else
+            mtrie->insert_payload(trie::key_type(key, strlen(key)),
+                                  key, strlen(key));
+    }
+    // keys ending at a terminator transition have no tail
+    mtrie->insert("host", 4, kKeys + 1);
+    size_t tail_bytes = mtrie->stats().tail_bytes;
+    mtrie->build(archive);
+    delete mtrie;
+    if (!has_section(SECTION_TAIL_VALUE))
+        fail("sharing tails");
+
+    trie *loaded = trie::create_trie(archive);
+    trie::value_type value;
+    for (i = 0; i < kKeys; i++)
+        if (!find_host(loaded, i))
+            fail("searching shared tails");
+    if (!loaded->search("host", 4, &value) || value != kKeys + 1
+        || loaded->search("host0001.example.com", 20, NULL)
+        || loaded->search("host0001.example.com/index.htm", 30, NULL)
+        || loaded->stats().tail_bytes * 4 > tail_bytes)
+        fail("shared tails");
+    trie::result_type result;
+    loaded->prefix_search(trie::key_type("host01", 6), &result);
+    if (result.size() != 100 || result[0].first.c_str() != std::string(
+            "host0100.example.com/index.html") || result[0].second != 101)
+        fail("prefix search of shared tails");
+
+    // inserting copies the tails back, building shares them again
+    loaded->insert("host0001.example.org", 20, kKeys + 2);
+    loaded->insert("host0002.example.com/index.html", 31, kKeys + 3);
+    loaded->build(archive);
+    delete loaded;
+    loaded = trie::create_trie(archive);
+    if (!has_section(SECTION_TAIL_VALUE)
+        || !loaded->search("host0001.example.org", 20, &value)
+        || value != kKeys + 2
+        || !loaded->search("host0002.example.com/index.html", 31, &value)
+        || value != kKeys + 3 || !find_host(loaded, 1)
+        || !find_host(loaded, kKeys - 1) || !find_host(loaded, 7))
+        fail("extending shared tails");
+    delete loaded;
+    printf("[shared tails]\n");
+}
+
+/**
+ * Checks that an archive built with a table of the first two bytes finds
+ * the same keys as one without, also after keys are inserted into it.
+ */
+static void check_root_table(trie::trie_type type)
+{
+    static const int kKeys = 3000;
+    // keys shorter than two bytes, a key alone below its first byte
+    const char *shorts[] = {"", "r", "x", "xy", "qrs", NULL};
+    const char *misses[] = {"q", "qr", "qrt", "qrst", "rq", "xz", "xyz",
+                            "zz", "r3000", "\xff\xff", NULL};
+    char key[32];
+    int i;
+
+    trie *mtrie = trie::create_trie(type);
+    mtrie->set_root_table(true);
+    for (i = 0; i < kKeys; i++) {
+        snprintf(key, sizeof(key), "r%d", i);
+        mtrie->insert(key, strlen(key), i + 1);
+    }
+    for (i = 0; shorts[i]; i++)
+        mtrie->insert(shorts[i], strlen(shorts[i]), kKeys + i + 1);
+    mtrie->build(archive);
+    delete mtrie;
+    if (!has_section(SECTION_ROOT))
+        fail("writing root table");
+
+    trie *loaded = trie::create_trie(archive);
+    for (int pass = 0; pass < 2; pass++) {
+        trie::value_type value;
+        for (i = 0; i < kKeys; i++) {
+            snprintf(key, sizeof(key), "r%d", i);
+            if (!loaded->search(key, strlen(key), &value) || value != i + 1)
+                fail("searching with root table");
+        }
+        for (i = 0; shorts[i]; i++)
+            if (!loaded->search(shorts[i], strlen(shorts[i]), &value)
+                || value != kKeys + i + 1)
+                fail(shorts[i]);
+        for (i = 0; misses[i]; i++)
+            if (loaded->search(misses[i], strlen(misses[i]), NULL))
+                fail(misses[i]);
+        trie::result_type result;
+        loaded->prefix_search(trie::key_type("r12", 3), &result);
+        loaded->prefix_search(trie::key_type("qr", 2), &result);
+        loaded->prefix_search(trie::key_type("rq", 2), &result);
+        if (result.size() != 112)
+            fail("prefix search with root table");
+        // inserting drops the table
+        loaded->insert("r3000x", 6, 1);
+    }
+    loaded->build(archive);
+    delete loaded;
+    loaded = trie::create_trie(archive);
+    if (!has_section(SECTION_ROOT) || !loaded->search("r3000x", 6, NULL))
+        fail("rebuilding root table");
+    loaded->set_root_table(false);
+    loaded->build(archive);
+    delete loaded;
+    if (has_section(SECTION_ROOT))
+        fail("turning root table off");
+    printf("[root table] ");
+}
+
+/// Returns true if the (i)th page of check_chains() is found.
+static bool find_page(const trie *mtrie, int i)
+{
+    char key[64];
+    trie::value_type value;
+
+    snprintf(key, sizeof(key), "https://www.example.com/%04d/index.html", i);
+    return mtrie->search(key, strlen(key), &value) && value == i + 1;
+}
+
+/**
+ * Checks that an archive built with chains of single transitions
+ * collapsed finds the same keys with fewer states, also after keys are
+ * inserted into it.
+ */
+static void check_chains(trie::trie_type type)
+{
+    static const int kKeys = 2000;
+    // keys ending inside the chain of the others, or leaving it
+    const char *others[] = {"https://www.example", "http://example.com",
+                            "https://www.exampl", NULL};
+    const char *misses[] = {"https://www.exam", "https://www.examplf",
+                            "https://www.example.com/", "https://www.examplee",
+                            "https://www.example.com/0001/index.htmlx",
+                            "https://www.example.com/0001/index.htm", NULL};
+    char key[64];
+    int i;
+
+    trie *mtrie = trie::create_trie(type);
+    mtrie->set_compress_chains(true);
+    for (i = 0; i < kKeys; i++) {
+        snprintf(key, sizeof(key), "https://www.example.com/%04d/index.html",
+                 i);
+        mtrie->insert(key, strlen(key), i + 1);
+    }
+    for (i = 0; others[i]; i++)
+        mtrie->insert(others[i], strlen(others[i]), kKeys + i + 1);
+    trie::stats_type stats = mtrie->stats();
+    mtrie->build(archive);
+    delete mtrie;
+    if (!has_section(SECTION_CHAIN)
+        || (type == trie::SINGLE_TRIE && !has_section(SECTION_TAIL_VALUE)))
+        fail("writing chains");
+
+    trie *loaded = trie::create_trie(archive);
+    trie::value_type value;
+    for (i = 0; i < kKeys; i++)
+        if (!find_page(loaded, i))
+            fail("searching chains");
+    for (i = 0; others[i]; i++)
+        if (!loaded->search(others[i], strlen(others[i]), &value)
+            || value != kKeys + i + 1)
+            fail(others[i]);
+    for (i = 0; misses[i]; i++)
+        if (loaded->search(misses[i], strlen(misses[i]), NULL))
+            fail(misses[i]);
+    if (loaded->stats().front.used >= stats.front.used
+        || loaded->stats().average_depth != stats.average_depth)
+        fail("statistics of chains");
+    trie::result_type result;
+    loaded->prefix_search(trie::key_type("https://www.exa", 15), &result);
+    if (static_cast<int>(result.size()) != kKeys + 2)
+        fail("prefix search inside a chain");
+    result.clear();
+    loaded->prefix_search(trie::key_type("https://www.example.com/01", 26),
+                          &result);
+    loaded->prefix_search(trie::key_type("https://www.examplf", 19),
+                          &result);
+    loaded->prefix_search(trie::key_type("http:", 5), &result);
+    if (result.size() != 101 || result[0].second != 101)
+        fail("prefix search of chains");
+
+    // inserting expands the chains, building collapses them again
+    loaded->insert("https://www.example.org", 23, kKeys + 10);
+    loaded->build(archive);
+    delete loaded;
+    loaded = trie::create_trie(archive);
+    if (!has_section(SECTION_CHAIN) || !find_page(loaded, 0)
+        || !find_page(loaded, kKeys - 1)
+        || !loaded->search("https://www.example.org", 23, &value)
+        || value != kKeys + 10)
+        fail("extending chains");
+    loaded->set_compress_chains(false);
+    loaded->insert("https://www.example.net", 23, kKeys + 11);
+    loaded->build(archive);
+    delete loaded;
+    if (has_section(SECTION_CHAIN))
+        fail("turning chains off");
+    printf("[chains] ");
+}
+
+/**
+ * Checks that an archive with its states renumbered finds the same keys,
+ * profiled or not, also after keys are inserted into it.
+ */
+static void check_relayout(trie::trie_type type)
+{
+    static const int kKeys = 2000;
+    const char *misses[] = {"https://www.example.com/2000/index.html",
+                            "https://www.example.com/0001/index.htm",
+                            "https://www.example.com/", "", NULL};
+    char key[64];
+    int i;
+
+    trie *mtrie = trie::create_trie(type);
+    // scattered over the states as keys come in no order
+    for (i = 0; i < kKeys; i++) {
+        int n = i * 7919 % kKeys;
+        snprintf(key, sizeof(key), "https://www.example.com/%04d/index.html",
+                 n);
+        mtrie->insert(key, strlen(key), n + 1);
+    }
+    mtrie->insert_payload(trie::key_type("payload", 7), "relaid", 6);
+    trie::stats_type stats = mtrie->stats();
+    mtrie->set_relayout(true);
+    for (int pass = 0; pass < 2; pass++) {
+        mtrie->build(archive);
+        if (has_section(SECTION_CHAIN))
+            fail("format of relayout");
+        trie *loaded = trie::create_trie(archive);
+        const char *data;
+        size_t length;
+        for (i = 0; i < kKeys; i++)
+            if (!find_page(loaded, i))
+                fail("searching relayout");
+        for (i = 0; misses[i]; i++)
+            if (loaded->search(misses[i], strlen(misses[i]), NULL))
+                fail(misses[i]);
+        if (!loaded->search_payload(trie::key_type("payload", 7), &data,
+                                    &length)
+            || std::string(data, length) != "relaid")
+            fail("payload of relayout");
+        trie::stats_type relaid = loaded->stats();
+        if (relaid.keys != stats.keys || relaid.front.used != stats.front.used
+            || relaid.average_depth != stats.average_depth)
+            fail("statistics of relayout");
+        trie::result_type result;
+        loaded->prefix_search(trie::key_type("https://www.example.com/01",
+                                             26), &result);
+        if (result.size() != 100)
+            fail("prefix search of relayout");
+        delete loaded;
+        // the hottest keys are placed first, missing ones too
+        for (i = 0; misses[i]; i++)
+            mtrie->profile(trie::key_type(misses[i], strlen(misses[i])));
+        for (i = 0; i < kKeys; i += 3) {
+            snprintf(key, sizeof(key),
+                     "https://www.example.com/%04d/index.html", i);
+            mtrie->profile(trie::key_type(key, strlen(key)));
+        }
+    }
+    delete mtrie;
+
+    // inserting into a renumbered archive
+    trie *loaded = trie::create_trie(archive);
+    loaded->insert("https://www.example.com/0001/index.htm", 38, kKeys + 1);
+    loaded->insert("https://www.example.org/", 24, kKeys + 2);
+    loaded->build(archive);
+    delete loaded;
+    loaded = trie::create_trie(archive);
+    trie::value_type value;
+    for (i = 0; i < kKeys; i++)
+        if (!find_page(loaded, i))
+            fail("extending relayout");
+    if (!loaded->search("https://www.example.com/0001/index.htm", 38, &value)
+        || value != kKeys + 1
+        || !loaded->search("https://www.example.org/", 24, &value)
+        || value != kKeys + 2)
+        fail("extending relayout");
+    delete loaded;
+    printf("[relayout] ");
+}
+
+/// Checks the false positive rate of a filter of 10 bits per key.
+static void check_false_positives()
+{
+    static const int kKeys = 20000;
+    std::vector<uint64_t> hashes;
+    key_filter filter;
+    char key[32];
+    int i, positives = 0;
+
+    for (i = 0; i < kKeys; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        hashes.push_back(key_filter::hash(trie::key_type(key, strlen(key))));
+    }
+    filter.build(hashes, 10);
+    for (i = 0; i < kKeys; i++) {
+        if (!filter.may_contain(hashes[i]))
+            fail("filter losing keys");
+        snprintf(key, sizeof(key), "miss%d", i);
+        positives += filter.may_contain(
+            key_filter::hash(trie::key_type(key, strlen(key))));
+    }
+    // 0.8% in theory, blocks add a little
+    if (positives > kKeys / 50)
+        fail("false positives of filter");
+    printf("[filter: %.2f%% false positives]\n", positives * 100.0 / kKeys);
+}
+
+/**
+ * Writes the archive again with a section replaced.
+ *
+ * @param id Section identifier.
+ * @param data Contents of the section, NULL drops it.
+ * @param length Length of the section.
+ */
+static void replace_section(uint32_t id, const void *data, size_t length)
+{
+    size_t size;
+    char *buffer = read_archive(&size);
+    archive_reader reader(buffer, size, false);
+    archive_writer writer(reader.type());
+    for (size_t i = 0; i < reader.section_count(); i++) {
+        const section_entry &entry = reader.entry(i);
+        if (entry.id != id)
+            writer.add(entry.id, buffer + entry.offset, entry.length,
+                       entry.flags);
+        else if (data)
+            writer.add(entry.id, data, length, entry.flags);
+    }
+    writer.write(archive);
+    free(buffer);
+}
+
+/**
+ * Checks that an archive having payloads but no flags telling which
+ * values refer to them is rejected rather than guessed.
+ */
+static void check_missing_flags()
+{
+    trie::load_options options;
+    for (int t = 0; t < 3; t++) {
+        trie *mtrie = trie::create_trie(t?trie::DOUBLE_TRIE
+                                         :trie::SINGLE_TRIE);
+        mtrie->insert_payload(trie::key_type("bachelor", 8), "x", 1);
+        mtrie->insert("back", 4, 1);
+        if (t == 2) {
+            trie *louds = trie::create_trie(*mtrie, trie::LOUDS_TRIE);
+            delete mtrie;
+            mtrie = louds;
+        }
+        mtrie->build(archive);
+        delete mtrie;
+        replace_section(SECTION_PAYLOAD_FLAG, NULL, 0);
+        if (loads(options))
+            fail("payloads without flags");
+    }
+    printf("[missing flags]\n");
+}
+
+/// Checks that an alphabet mapping two labels to a code is rejected.
+static void check_bad_alphabet()
+{
+    typedef byte_trie_traits::label_type label_type;
+    trie::load_options options;
+    size_t frequency[256] = {0};
+    frequency['a'] = 2;
+    frequency['b'] = 1;
+    for (int t = 0; t < 2; t++) {
+        trie *mtrie = trie::create_trie(t?trie::DOUBLE_TRIE
+                                         :trie::SINGLE_TRIE);
+        mtrie->remap_labels(frequency);
+        mtrie->insert("ab", 2, 1);
+        mtrie->build(archive);
+        delete mtrie;
+        if (!loads(options) || !has_section(SECTION_ALPHABET))
+            fail("alphabet");
+
+        size_t size, length;
+        char *buffer = read_archive(&size);
+        archive_reader reader(buffer, size, false);
+        const label_type *table = static_cast<const label_type *>(
+                                      reader.section(SECTION_ALPHABET,
+                                                     &length));
+        std::vector<label_type> codes(table, table + length
+                                                     / sizeof(label_type));
+        free(buffer);
+        codes['b' + 1] = codes['a' + 1];
+        replace_section(SECTION_ALPHABET, &codes[0],
+                        codes.size() * sizeof(label_type));
+        if (loads(options))
+            fail("bad alphabet");
+    }
+    printf("[bad alphabet]\n");
+}
+
+/// Checks that files which can not be loaded or written leak nothing.
+static void check_bad_files()
+{
+    trie *mtrie = trie::create_trie(trie::DOUBLE_TRIE);
+    int before = dup(0), after;
+    close(before);
+    for (int i = 0; i < 3; i++) {
+        const char *filename = i?"/tmp":NULL;
+        try {
+            trie *loaded = trie::create_trie(filename);
+            delete loaded;
+            fail("loading a bad file");
+        } catch (const std::runtime_error &e) {
+        }
+        try {
+            mtrie->build(i?"/":NULL);
+            fail("building a bad file");
+        } catch (const std::runtime_error &e) {
+        }
+    }
+    // a source is read twice when labels are remapped
+    const char *source = "/tmp/regress_archive.txt";
+    FILE *fp = fopen(source, "w");
+    fputs("1 bachelor\nback\n", fp);
+    fclose(fp);
+    try {
+        mtrie->read_from_text(source, false, true);
+        fail("reading a bad source");
+    } catch (const bad_trie_source &e) {
+    }
+    remove(source);
+    after = dup(0);
+    close(after);
+    if (after != before)
+        fail("closing bad files");
+    delete mtrie;
+    printf("[bad files]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *words[] = {"bachelor", "back", "badge", "badger", "bcs", NULL};
+    trie::load_options fast, verify;
+    verify.verify = true;
+    size_t i, t;
+
+    printf("libtrie archive regress testing\n");
+    printf("===============================\n");
+    if (crc32c(0, "123456789", 9) != 0xe3069283
+        || crc32c(crc32c(0, "1234", 4), "56789", 5) != 0xe3069283)
+        fail("crc32c");
+    for (t = 0; t < 3; t++) {
+        static const char *names[] = {"single_trie", "double_trie",
+                                      "louds_trie"};
+        trie::trie_type type = t?trie::DOUBLE_TRIE:trie::SINGLE_TRIE;
+        trie *mtrie = trie::create_trie(type);
+        for (i = 0; words[i]; i++)
+            mtrie->insert(words[i], strlen(words[i]), i + 1);
+        if (t == 2) {
+            trie *louds = trie::create_trie(*mtrie, trie::LOUDS_TRIE);
+            delete mtrie;
+            mtrie = louds;
+            type = trie::LOUDS_TRIE;
+        }
+        if (!check_stats(mtrie, type, 5))
+            fail("statistics");
+        mtrie->build(archive);
+        std::string streamed = serialize_pipe(mtrie);
+        delete mtrie;
+        printf("\n%s\n", names[t]);
+        printf("-----------\n");
+
+        size_t size;
+        char *buffer = read_archive(&size);
+        if (streamed != std::string(buffer, size))
+            fail("streaming");
+        free(buffer);
+        printf("[stream] ");
+
+        if (!loads(fast) || !loads(verify))
+            fail("loading");
+
+        trie::load_options tuned;
+        trie::load_metrics metrics;
+        struct stat sb;
+        tuned.populate = true;
+        tuned.advice = trie::ADVICE_RANDOM;
+        tuned.warmup_threads = 3;
+        tuned.metrics = &metrics;
+        if (!loads(tuned) || stat(archive, &sb) < 0
+            || metrics.mapped_bytes != static_cast<size_t>(sb.st_size)
+            || metrics.resident_bytes > metrics.mapped_bytes
+            || metrics.ready_time < 0)
+            fail("load metrics");
+        trie *loaded = trie::create_trie(archive, verify);
+        for (i = 0; words[i]; i++) {
+            trie::value_type value;
+            if (!loaded->search(words[i], strlen(words[i]), &value)
+                || value != static_cast<trie::value_type>(i + 1))
+                fail(words[i]);
+            printf("[%s] ", words[i]);
+        }
+        trie::result_type result;
+        trie::key_type prefix("bad", 3);
+        loaded->prefix_search(prefix, &result);
+        if (result.size() != 2
+            || loaded->search("ba", 2, NULL)
+            || loaded->search("badgers", 7, NULL))
+            fail("prefix search");
+        if (!check_stats(loaded, type, 5))
+            fail("statistics of archive");
+        delete loaded;
+
+        // load from memory, borrowed and adopted
+        buffer = read_archive(&size);
+        loaded = trie::create_trie_from_memory(buffer, size,
+                                               trie::BORROW_MEMORY, verify);
+        if (!find_words(loaded, words))
+            fail("borrowed memory");
+        delete loaded;
+        if (loads_memory(buffer, size / 2) || loads_memory(buffer, 4)
+            || loads_memory(buffer + 8, size - 8)
+            || loads_memory(buffer + 1, size - 1))
+            fail("bad memory");
+        loaded = trie::create_trie_from_memory(buffer, size,
+                                               trie::ADOPT_MALLOC);
+        if (!find_words(loaded, words))
+            fail("adopted memory");
+        delete loaded;
+
+        // share a mapping between processes
+        int fd = open(archive, O_RDONLY);
+        void *shared = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (shared == MAP_FAILED)
+            fail("mapping archive");
+        loaded = trie::create_trie_from_memory(shared, size,
+                                               trie::ADOPT_MAPPING);
+        pid_t pid = fork();
+        if (pid == 0)
+            _exit(find_words(loaded, words)?0:1);
+        int status;
+        if (pid < 0 || waitpid(pid, &status, 0) != pid
+            || !WIFEXITED(status) || WEXITSTATUS(status)
+            || !find_words(loaded, words))
+            fail("shared memory");
+        delete loaded;
+        printf("[memory] ");
+
+        if (t < 2) {
+            extend_archive(words);
+            printf("[extend] ");
+            check_filter(type);
+            check_root_table(type);
+            check_chains(type);
+            check_relayout(type);
+        }
+
+        // damage the last section
+        long offset = last_byte();
+        int orig = poke(offset, 0xff);
+        if (!loads(fast) || loads(verify))
+            fail("damaged section");
+        poke(offset, orig);
+
+        // damage the section table
+        orig = poke(sizeof(archive_header) + 8, 0xff);
+        if (loads(fast))
+            fail("damaged table");
+        poke(sizeof(archive_header) + 8, orig);
+
+        // truncate the archive
+        if (truncate(archive, 2 * kSectionAlign) < 0 || loads(fast))
+            fail("truncated archive");
+        printf("\n");
+    }
+    check_false_positives();
+    check_shared_tails();
+    check_missing_flags();
+    check_bad_alphabet();
+    check_bad_files();
+    remove(archive);
+
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
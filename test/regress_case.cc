@@ -186,6 +186,124 @@ int main()
         }
         printf("\n");
     }
+
+/* remapped labels */
+    printf("\nremapped labels\n");
+    printf("---------------\n");
+    for (i = 0; dict[i][0]; i++) {
+        size_t frequency[256] = {0};
+        double_trie dtrie;
+        single_trie strie;
+        trie::result_type result;
+        printf("wordset %lu: ", i);
+        for (j = 0; dict[i][j]; j++)
+            for (const char *p = dict[i][j]; *p; p++)
+                frequency[static_cast<unsigned char>(*p)]++;
+        dtrie.remap_labels(frequency);
+        strie.remap_labels(frequency);
+        for (j = 0; dict[i][j]; j++) {
+            key.assign(dict[i][j], length(dict[i][j]));
+            dtrie.insert(key, signed_value(j, i));
+            strie.insert(key, signed_value(j, i));
+        }
+        for (j = 0; dict[i][j]; j++) {
+            key.assign(dict[i][j], length(dict[i][j]));
+            if (dtrie.search(key, &val) && val == signed_value(j, i)
+                && strie.search(key, &val) && val == signed_value(j, i)) {
+                printf("[%d] ", val);
+            } else {
+                printf("\nTEST FAILED on '%s' = %d!\n", dict[i][j], val);
+                exit(0);
+            }
+        }
+        key.assign("", 0);
+        if (strie.prefix_search(key, &result) != j) {
+            printf("\nTEST FAILED on prefix_search!\n");
+            exit(0);
+        }
+        for (trie::result_type::const_iterator it = result.begin();
+             it != result.end(); it++) {
+            if (!dtrie.search(it->first, &val) || val != it->second) {
+                printf("\nTEST FAILED on '%s'!\n", it->first.c_str());
+                exit(0);
+            }
+        }
+        printf("\n");
+    }
+
+/* single_trie with 32-bit tails */
+    printf("\nwide_single_trie\n");
+    printf("----------------\n");
+    for (i = 0; dict[i][0]; i++) {
+        wide_single_trie btrie;
+        printf("wordset %lu: ", i);
+        for (j = 0; dict[i][j]; j++) {
+            key.assign(dict[i][j], length(dict[i][j]));
+            btrie.insert(key, signed_value(j, i));
+        }
+        for (j = 0; dict[i][j]; j++) {
+            key.assign(dict[i][j], length(dict[i][j]));
+            if (btrie.search(key, &val) && val == signed_value(j, i)) {
+                printf("[%d] ", val);
+            } else {
+                printf("\nTEST FAILED on '%s' = %d!\n", dict[i][j], val);
+                std::cout << "TRIE: \n";
+                btrie.trie()->trace(1);
+                btrie.trace_suffix(0, 100);
+                exit(0);
+            }
+        }
+        printf("\n");
+    }
+
+    printf("\nkey_type\n");
+    printf("--------\n");
+    {
+        std::string text;
+        for (i = 0; i < 3 * trie::key_type::kInlineSize; i++) {
+            text.push_back('a' + i % 26);
+            trie::key_type small(text.data(), text.size());
+            const char *inside = reinterpret_cast<const char *>(&small);
+            const char *data = reinterpret_cast<const char *>(small.data());
+            // short keys are stored inline
+            if (text != small.c_str()
+                || (i < trie::key_type::kInlineSize)
+                   != (data >= inside && data < inside + sizeof(small))) {
+                printf("\nTEST FAILED on key of %lu labels!\n", i + 1);
+                exit(1);
+            }
+            trie::key_type copy(small);
+            copy.push(trie::key_type::char_in('!'));
+            if (text + "!" != copy.c_str()
+                || copy.pop() != trie::key_type::char_in('!')
+                || text != copy.c_str()) {
+                printf("\nTEST FAILED on changing key of %lu labels!\n",
+                       i + 1);
+                exit(1);
+            }
+#if __cplusplus >= 201103L
+            trie::key_type moved(static_cast<trie::key_type &&>(copy));
+            copy = static_cast<trie::key_type &&>(moved);
+            if (text != copy.c_str()
+                || moved.data()[0] != trie::key_type::kTerminator) {
+                printf("\nTEST FAILED on moving key of %lu labels!\n",
+                       i + 1);
+                exit(1);
+            }
+#endif
+        }
+        printf("[%lu keys] ", i);
+        key.assign("abc", 3);
+        const trie::key_type &same = key;
+        key = same;
+        key.clear();
+        key.push(trie::key_type::char_in('x'));
+        if (strcmp(key.c_str(), "x")) {
+            printf("\nTEST FAILED on reusing a key!\n");
+            exit(1);
+        }
+        printf("[reuse]\n");
+    }
 }
 
 // vim: ts=4 sw=4 ai et
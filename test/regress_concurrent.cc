@@ -0,0 +1,169 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include "trie.h"
+
+using namespace dutil;
+
+static const int kReaders = 4;
+static const int kKeys = 20000;
+static const int kPrefixEvery = 64;
+
+static int inserted = 0;
+static int stop = 0;
+static int failed = 0;
+
+typedef struct {
+    trie *mtrie;
+    unsigned seed;
+    long searches;
+    long prefixes;
+} reader_type;
+
+/// Returns the (n)th key inserted, its payload if it has one.
+static void make_key(int n, char *key, size_t size, std::string *payload)
+{
+    snprintf(key, size, "k%07d", (n * 7919) % kKeys);
+    payload->clear();
+    if (n % 5 == 0) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "payload-%d", n);
+        payload->assign(buf);
+    }
+}
+
+static void fail()
+{
+    __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+}
+
+/// Returns true if the (n)th key is found as it was inserted.
+static bool check_key(const trie *mtrie, int n)
+{
+    char key[32];
+    std::string payload;
+    trie::value_type value;
+    const char *data;
+    size_t length;
+
+    make_key(n, key, sizeof(key), &payload);
+    trie::key_type tkey(key, strlen(key));
+    if (payload.empty())
+        return mtrie->search(tkey, &value) && value == n + 1;
+    return mtrie->search_payload(tkey, &data, &length)
+           && payload == std::string(data, length);
+}
+
+static void *read_trie(void *arg)
+{
+    reader_type *reader = static_cast<reader_type *>(arg);
+    trie::key_type missing("m0000000", 8);
+    trie::key_type prefix("k001", 4);
+    trie::result_type result;
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        int n = __atomic_load_n(&inserted, __ATOMIC_ACQUIRE);
+        if (!n) {
+            sched_yield();
+            continue;
+        }
+        if (!check_key(reader->mtrie, rand_r(&reader->seed) % n)
+            || reader->mtrie->search(missing, NULL)) {
+            fail();
+            break;
+        }
+        reader->searches++;
+        if (reader->searches % kPrefixEvery)
+            continue;
+        // every key found must be one inserted with its value
+        result.clear();
+        reader->mtrie->prefix_search(prefix, &result);
+        trie::result_type::const_iterator it;
+        for (it = result.begin(); it != result.end(); it++) {
+            int k = atoi(it->first.c_str() + 1), i;
+            for (i = 0; (i * 7919) % kKeys != k; i++) {
+                // empty
+            }
+            if (strncmp(it->first.c_str(), "k001", 4)
+                || (i % 5 && it->second != i + 1)) {
+                fail();
+                return NULL;
+            }
+        }
+        reader->prefixes++;
+    }
+    return NULL;
+}
+
+static void test_concurrent(trie::trie_type type, const char *name)
+{
+    pthread_t tids[kReaders];
+    reader_type readers[kReaders];
+    char key[32];
+    std::string payload;
+    long searches = 0, prefixes = 0;
+    int i;
+
+    trie *mtrie = trie::create_trie(type);
+    mtrie->set_concurrent(true);
+    inserted = 0;
+    stop = 0;
+    for (i = 0; i < kReaders; i++) {
+        readers[i].mtrie = mtrie;
+        readers[i].seed = i + 1;
+        readers[i].searches = 0;
+        readers[i].prefixes = 0;
+        pthread_create(&tids[i], NULL, read_trie, &readers[i]);
+    }
+    for (i = 0; i < kKeys && !__atomic_load_n(&failed, __ATOMIC_RELAXED);
+         i++) {
+        make_key(i, key, sizeof(key), &payload);
+        trie::key_type tkey(key, strlen(key));
+        if (payload.empty())
+            mtrie->insert(tkey, i + 1);
+        else
+            mtrie->insert_payload(tkey, payload.data(), payload.size());
+        __atomic_store_n(&inserted, i + 1, __ATOMIC_RELEASE);
+        // let readers run in the middle of inserting
+        if (i % 256 == 0)
+            sched_yield();
+    }
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < kReaders; i++) {
+        pthread_join(tids[i], NULL);
+        searches += readers[i].searches;
+        prefixes += readers[i].prefixes;
+    }
+    if (failed) {
+        printf("\nTEST FAILED on searching %s while inserting!\n", name);
+        exit(1);
+    }
+    mtrie->reclaim();
+    for (i = 0; i < kKeys; i++) {
+        if (!check_key(mtrie, i)) {
+            printf("\nTEST FAILED on searching %s after inserting!\n", name);
+            exit(1);
+        }
+    }
+    printf("[%s] %d inserts, %d readers, %ld searches, %ld prefix searches\n",
+           name, kKeys, kReaders, searches, prefixes);
+    delete mtrie;
+}
+
+int main(int argc, char *argv[])
+{
+    printf("libtrie concurrent regress testing\n");
+    printf("==================================\n");
+    test_concurrent(trie::SINGLE_TRIE, "tail");
+    test_concurrent(trie::DOUBLE_TRIE, "two");
+
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
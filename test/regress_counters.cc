@@ -0,0 +1,97 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <pthread.h>
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include "trie.h"
+#include "trie_counters.h"
+
+using namespace dutil;
+
+static const int kThreads = 2;
+static const int kKeys = 3000;
+
+static void fail(const char *message)
+{
+    printf("\nTEST FAILED on %s!\n", message);
+    exit(1);
+}
+
+/// Inserts and searches keys in a trie of its own, type by argument.
+static void *count_trie(void *arg)
+{
+    trie::trie_type type = *static_cast<trie::trie_type *>(arg);
+    trie *mtrie = trie::create_trie(type);
+    char key[32];
+    int i;
+
+    for (i = 0; i < kKeys; i++) {
+        snprintf(key, sizeof(key), "k%dx%d", i % 97, i);
+        mtrie->insert(key, strlen(key), i + 1);
+    }
+    for (i = 0; i < kKeys; i++) {
+        snprintf(key, sizeof(key), "k%dx%d", i % 97, i);
+        if (!mtrie->search(key, strlen(key), NULL))
+            fail(key);
+    }
+    delete mtrie;
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    trie::trie_type types[kThreads] = {trie::DOUBLE_TRIE, trie::SINGLE_TRIE};
+    pthread_t threads[kThreads];
+    trie_counters counters;
+    int i;
+
+    printf("libtrie counters regress testing\n");
+    printf("================================\n");
+    reset_counters();
+    for (i = 0; i < kThreads; i++)
+        pthread_create(&threads[i], NULL, count_trie, &types[i]);
+    for (i = 0; i < kThreads; i++)
+        pthread_join(threads[i], NULL);
+
+    // threads have exited, their counts are kept
+    read_counters(&counters);
+    if (!counters_enabled()) {
+        if (counters.searches || counters.relocations)
+            fail("disabled counters");
+        printf("[disabled]\n");
+        return 0;
+    }
+    if (counters.searches != kThreads * kKeys
+        || counters.states_visited < counters.searches
+        || !counters.relocations
+        || counters.states_moved < counters.relocations
+        || counters.base_probes < counters.relocations
+        || !counters.state_grows || !counters.suffix_grows
+        || !counters.bytes_copied || !counters.rear_cleans
+        || !counters.branches)
+        fail("counting");
+    printf("[%d searches, %llu relocations, %llu states moved, "
+           "%llu probes]\n", static_cast<int>(counters.searches),
+           static_cast<unsigned long long>(counters.relocations),
+           static_cast<unsigned long long>(counters.states_moved),
+           static_cast<unsigned long long>(counters.base_probes));
+
+    reset_counters();
+    read_counters(&counters);
+    if (counters.searches || counters.relocations || counters.bytes_copied)
+        fail("resetting");
+    trie *mtrie = trie::create_trie(trie::DOUBLE_TRIE);
+    mtrie->insert("key", 3, 1);
+    mtrie->search("key", 3, NULL);
+    delete mtrie;
+    // 'k' in the front trie, then 'e', 'y' and the terminator in the rear
+    read_counters(&counters);
+    if (counters.searches != 1 || counters.states_visited != 4)
+        fail("counting after reset");
+    printf("[reset]\n");
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
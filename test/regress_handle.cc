@@ -0,0 +1,199 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include "trie.h"
+#include "trie_handle.h"
+
+using namespace dutil;
+
+static const int kReaders = 8;
+static const int kSwaps = 500;
+static const int kKeys = 64;
+static const int kAlive = 0x600d;
+static const int kDead = 0xdead;
+
+static int stop = 0;
+static int failed = 0;
+static int deleted = 0;
+
+/// Memory of every checked_trie, returned at exit.
+static std::vector<void *> graveyard;
+
+/// Wraps a trie and never returns its memory, so a reader using it
+/// after delete finds it marked dead instead of crashing.
+class checked_trie: public trie {
+  public:
+    using trie::insert;
+    using trie::search;
+
+    explicit checked_trie(trie *inner):inner_(inner), magic_(kAlive) {}
+
+    ~checked_trie()
+    {
+        delete inner_;
+        magic_ = kDead;
+        __atomic_add_fetch(&deleted, 1, __ATOMIC_RELAXED);
+    }
+
+    static void *operator new(size_t size)
+    {
+        // created by the main thread only
+        void *p = ::operator new(size);
+        graveyard.push_back(p);
+        return p;
+    }
+
+    static void operator delete(void *p)
+    {
+        // kept until exit on purpose, see above
+    }
+
+    bool alive() const
+    {
+        return magic_ == kAlive;
+    }
+
+    void insert(const key_type &key, const value_type &value)
+    {
+        inner_->insert(key, value);
+    }
+
+    bool search(const key_type &key, value_type *value) const
+    {
+        return inner_->search(key, value);
+    }
+
+    size_t prefix_search(const key_type &key, result_type *result) const
+    {
+        return inner_->prefix_search(key, result);
+    }
+
+    void build(const char *filename, bool verbose = false)
+    {
+        inner_->build(filename, verbose);
+    }
+
+    void serialize(int fd)
+    {
+        inner_->serialize(fd);
+    }
+
+    void insert_payload(const key_type &key,
+                        const char *payload, size_t length)
+    {
+        inner_->insert_payload(key, payload, length);
+    }
+
+    bool search_payload(const key_type &key,
+                        const char **payload, size_t *length) const
+    {
+        return inner_->search_payload(key, payload, length);
+    }
+
+    void remap_labels(const size_t *frequency)
+    {
+        inner_->remap_labels(frequency);
+    }
+
+  private:
+    trie *inner_;
+    volatile int magic_;
+};
+
+static trie *create_version(int version)
+{
+    trie *mtrie = trie::create_trie(version % 2?trie::SINGLE_TRIE
+                                               :trie::DOUBLE_TRIE);
+    char key[32];
+    for (int i = 0; i < kKeys; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        mtrie->insert(key, strlen(key), version * kKeys + i);
+    }
+    return new checked_trie(mtrie);
+}
+
+static void *read_handle(void *arg)
+{
+    trie_handle *handle = static_cast<trie_handle *>(arg);
+    char key[32];
+    long rounds = 0;
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        trie_handle::reader current(*handle);
+        const checked_trie *mtrie
+            = static_cast<const checked_trie *>(current.get());
+        trie::value_type value, first = -1;
+        for (int i = 0; i < kKeys; i++) {
+            snprintf(key, sizeof(key), "key%d", i);
+            if (!mtrie->search(key, strlen(key), &value)
+                || !mtrie->alive()
+                || (i && value != first + i)) {
+                __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+                return NULL;
+            }
+            if (!i)
+                first = value;
+        }
+        // nested readers share the outer pin
+        trie_handle::reader nested(*handle);
+        if (!nested->search("key0", 4, &value))
+            __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+        rounds++;
+    }
+    return reinterpret_cast<void *>(rounds);
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t readers[kReaders];
+    long rounds = 0;
+    int i;
+
+    printf("libtrie handle regress testing\n");
+    printf("==============================\n");
+    trie_handle *handle = new trie_handle(create_version(0));
+    for (i = 0; i < kReaders; i++)
+        pthread_create(&readers[i], NULL, read_handle, handle);
+    for (i = 1; i <= kSwaps && !__atomic_load_n(&failed, __ATOMIC_RELAXED);
+         i++) {
+        handle->publish(create_version(i));
+        if (i % 10 == 0)
+            usleep(100);
+    }
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < kReaders; i++) {
+        void *n;
+        pthread_join(readers[i], &n);
+        rounds += reinterpret_cast<long>(n);
+    }
+    if (failed) {
+        printf("\nTEST FAILED on reading a retired trie!\n");
+        exit(1);
+    }
+    handle->synchronize();
+    if (deleted != kSwaps) {
+        printf("\nTEST FAILED on reclaiming, %d of %d deleted!\n",
+               deleted, kSwaps);
+        exit(1);
+    }
+    delete handle;
+    if (deleted != kSwaps + 1) {
+        printf("\nTEST FAILED on destructing handle!\n");
+        exit(1);
+    }
+    printf("%d swaps, %d readers, %ld read rounds\n",
+           kSwaps, kReaders, rounds);
+    for (size_t n = 0; n < graveyard.size(); n++)
+        ::operator delete(graveyard[n]);
+
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,193 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <pthread.h>
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include "trie.h"
+#include "layered_trie.h"
+
+using namespace dutil;
+
+static const char *base_archive = "/tmp/regress_layered.idx";
+static const char *next_archive = "/tmp/regress_layered.idx.next";
+static const int kKeys = 2000;
+static const int kUpdates = 3000;
+
+/// Represents an expected entry, a payload if is_payload is set.
+typedef struct {
+    trie::value_type value;
+    bool is_payload;
+    std::string payload;
+} entry_type;
+
+typedef std::map<std::string, entry_type> expect_type;
+
+static void fail(const char *message, const std::string &key = "")
+{
+    printf("\nTEST FAILED on %s %s!\n", message, key.c_str());
+    exit(1);
+}
+
+static std::string make_key(int i)
+{
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%s%05d", i % 7?"key":"pay", i);
+    return buffer;
+}
+
+/// Applies a random update to both the trie and the expected entries.
+static void update(layered_trie *mtrie, expect_type *expect)
+{
+    std::string key = make_key(rand() % (kKeys * 2));
+    trie::key_type tkey(key.data(), key.size());
+    entry_type entry;
+    switch (rand() % 4) {
+        case 0:
+            if (mtrie->remove(tkey) != (expect->erase(key) > 0))
+                fail("remove", key);
+            break;
+        case 1:
+            entry.is_payload = true;
+            entry.payload = key + "/" + make_key(rand());
+            mtrie->insert_payload(tkey, entry.payload.data(),
+                                  entry.payload.size());
+            (*expect)[key] = entry;
+            break;
+        default:
+            entry.is_payload = false;
+            entry.value = rand() % 100000;
+            mtrie->insert(tkey, entry.value);
+            (*expect)[key] = entry;
+            break;
+    }
+}
+
+/// Checks every key and a prefix search against the expected entries.
+static void check(const layered_trie &mtrie, const expect_type &expect)
+{
+    for (int i = 0; i < kKeys * 2; i++) {
+        std::string key = make_key(i);
+        trie::key_type tkey(key.data(), key.size());
+        expect_type::const_iterator it = expect.find(key);
+        trie::value_type value;
+        const char *payload;
+        size_t length;
+        if (it == expect.end()) {
+            if (mtrie.search(tkey, &value))
+                fail("removed key found", key);
+        } else if (it->second.is_payload) {
+            if (!mtrie.search_payload(tkey, &payload, &length)
+                || std::string(payload, length) != it->second.payload)
+                fail("payload", key);
+        } else {
+            if (!mtrie.search(tkey, &value) || value != it->second.value)
+                fail("value", key);
+        }
+    }
+
+    trie::result_type result;
+    trie::key_type prefix("key0", 4);
+    expect_type::const_iterator it = expect.lower_bound("key0");
+    mtrie.prefix_search(prefix, &result);
+    for (size_t i = 0; i < result.size(); i++, it++) {
+        if (it == expect.end() || it->first.compare(0, 4, "key0")
+            || it->first != result[i].first.c_str()
+            || (!it->second.is_payload
+                && it->second.value != result[i].second))
+            fail("prefix search", result[i].first.c_str());
+    }
+    if (it != expect.end() && !it->first.compare(0, 4, "key0"))
+        fail("prefix search", it->first);
+}
+
+static void *write_compact(void *arg)
+{
+    static_cast<layered_trie *>(arg)->write_compact(next_archive);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    expect_type expect;
+    int i, t;
+
+    printf("libtrie layered regress testing\n");
+    printf("===============================\n");
+    for (t = 0; t < 3; t++) {
+        static const char *names[] = {"single_trie", "double_trie",
+                                      "louds_trie"};
+        static const trie::trie_type types[] = {trie::SINGLE_TRIE,
+                                                trie::DOUBLE_TRIE,
+                                                trie::LOUDS_TRIE};
+        printf("\n%s\n", names[t]);
+        printf("-----------\n");
+        srand(t);
+        expect.clear();
+        trie *base = trie::create_trie(trie::DOUBLE_TRIE);
+        for (i = 0; i < kKeys; i++) {
+            std::string key = make_key(i);
+            entry_type entry;
+            entry.is_payload = !(i % 7);
+            entry.value = i;
+            entry.payload = key + "/base";
+            if (entry.is_payload)
+                base->insert_payload(trie::key_type(key.data(), key.size()),
+                                     entry.payload.data(),
+                                     entry.payload.size());
+            else
+                base->insert(key.data(), key.size(), entry.value);
+            expect[key] = entry;
+        }
+        if (types[t] == trie::LOUDS_TRIE) {
+            trie *louds = trie::create_trie(*base, trie::LOUDS_TRIE);
+            delete base;
+            base = louds;
+        }
+        base->build(base_archive);
+        delete base;
+
+        layered_trie mtrie(base_archive, trie::load_options(), types[t]);
+        check(mtrie, expect);
+        for (i = 0; i < kUpdates; i++)
+            update(&mtrie, &expect);
+        check(mtrie, expect);
+        printf("[overlay] ");
+
+        // compact in background while updating
+        pthread_t tid;
+        mtrie.begin_compact();
+        if (pthread_create(&tid, NULL, write_compact, &mtrie))
+            fail("pthread_create");
+        for (i = 0; i < kUpdates; i++)
+            update(&mtrie, &expect);
+        check(mtrie, expect);
+        pthread_join(tid, NULL);
+        mtrie.end_compact(next_archive);
+        check(mtrie, expect);
+        if (!mtrie.updates()
+            || mtrie.updates() > static_cast<size_t>(kUpdates))
+            fail("updates");
+        printf("[background] ");
+
+        mtrie.compact(next_archive);
+        if (mtrie.updates())
+            fail("updates");
+        check(mtrie, expect);
+        printf("[compact] ");
+
+        mtrie.build(next_archive);
+        layered_trie rebuilt(next_archive);
+        check(rebuilt, expect);
+        printf("[build]\n");
+    }
+    remove(base_archive);
+    remove(next_archive);
+
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
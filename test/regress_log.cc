@@ -0,0 +1,282 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include "trie.h"
+#include "layered_trie.h"
+#include "trie_log.h"
+
+using namespace dutil;
+
+static const char *archive = "/tmp/regress_log.idx";
+static const char *logfile = "/tmp/regress_log.log";
+static const int kKeys = 5000;
+static const int kUpdates = 20000;
+static const int kGroup = 64;
+static const int kThreads = 4;
+static const int kCommits = 500;
+
+typedef std::map<std::string, std::string> expect_type;
+
+static void fail(const char *message)
+{
+    printf("\nTEST FAILED on %s!\n", message);
+    exit(1);
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/**
+ * Applies the (n)th update to the log, the trie and the expected
+ * entries. Values are kept as strings, payloads start with '@'. The log
+ * and the trie can be NULL.
+ */
+static void update(int n, trie_log *log, layered_trie *mtrie,
+                   expect_type *expect)
+{
+    char key[32], value[32];
+    snprintf(key, sizeof(key), "key%05d", (n * 7919) % kKeys);
+    trie::key_type tkey(key, strlen(key));
+    if (n % 5 == 0) {
+        if (log)
+            log->remove(tkey);
+        if (mtrie)
+            mtrie->remove(tkey);
+        expect->erase(key);
+    } else if (n % 5 == 1) {
+        snprintf(value, sizeof(value), "@%d", n);
+        if (log)
+            log->insert_payload(tkey, value, strlen(value));
+        if (mtrie)
+            mtrie->insert_payload(tkey, value, strlen(value));
+        (*expect)[key] = value;
+    } else {
+        snprintf(value, sizeof(value), "%d", n);
+        if (log)
+            log->insert(tkey, n);
+        if (mtrie)
+            mtrie->insert(tkey, n);
+        (*expect)[key] = value;
+    }
+}
+
+static void check(const layered_trie &mtrie, const expect_type &expect)
+{
+    for (int i = 0; i < kKeys; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "key%05d", i);
+        trie::key_type tkey(key, strlen(key));
+        expect_type::const_iterator it = expect.find(key);
+        trie::value_type value;
+        const char *payload;
+        size_t length;
+        bool found = mtrie.search(tkey, &value);
+        if (it == expect.end()) {
+            if (found)
+                fail(key);
+        } else if (it->second[0] == '@') {
+            if (!mtrie.search_payload(tkey, &payload, &length)
+                || it->second != std::string(payload, length))
+                fail(key);
+        } else if (!found || value != atoi(it->second.c_str())) {
+            fail(key);
+        }
+    }
+}
+
+/// Builds the first snapshot, every key holding its number.
+static void build_snapshot(expect_type *expect)
+{
+    trie *mtrie = trie::create_trie(trie::DOUBLE_TRIE);
+    expect->clear();
+    for (int i = 0; i < kKeys; i += 2) {
+        char key[32], value[32];
+        snprintf(key, sizeof(key), "key%05d", i);
+        snprintf(value, sizeof(value), "%d", i);
+        mtrie->insert(key, strlen(key), i);
+        (*expect)[key] = value;
+    }
+    mtrie->build(archive);
+    delete mtrie;
+    remove(logfile);
+}
+
+typedef struct {
+    trie_log *log;
+    int id;
+} writer_type;
+
+static void *commit_records(void *arg)
+{
+    writer_type *writer = static_cast<writer_type *>(arg);
+    char key[32];
+    for (int i = 0; i < kCommits; i++) {
+        snprintf(key, sizeof(key), "thread%d-%d", writer->id, i);
+        trie::key_type tkey(key, strlen(key));
+        writer->log->commit(writer->log->insert(tkey, i));
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    expect_type expect;
+    double start;
+    int i;
+
+    printf("libtrie log regress testing\n");
+    printf("===========================\n");
+
+    // steady state, committing groups of records
+    build_snapshot(&expect);
+    {
+        layered_trie mtrie(archive);
+        trie_log log(logfile);
+        if (log.replay(&mtrie))
+            fail("replaying an empty log");
+        start = now();
+        for (i = 0; i < kUpdates; i++) {
+            update(i, &log, &mtrie, &expect);
+            if (i % kGroup == kGroup - 1)
+                log.commit();
+        }
+        log.commit();
+        printf("insert: %.0f records/s, %d records per commit, "
+               "%llu syncs\n", kUpdates / (now() - start), kGroup,
+               static_cast<unsigned long long>(log.syncs()));
+        check(mtrie, expect);
+    }
+
+    // recovery
+    {
+        layered_trie mtrie(archive);
+        trie_log log(logfile);
+        start = now();
+        if (log.replay(&mtrie) != static_cast<size_t>(kUpdates))
+            fail("replaying");
+        printf("recovery: %.0f records/s\n", kUpdates / (now() - start));
+        check(mtrie, expect);
+    }
+
+    // crash before committing the last records
+    build_snapshot(&expect);
+    pid_t pid = fork();
+    if (pid == 0) {
+        layered_trie mtrie(archive);
+        trie_log *log = new trie_log(logfile);
+        for (i = 0; i < kUpdates; i++) {
+            update(i, log, &mtrie, &expect);
+            if (i == kUpdates / 2)
+                log->commit();
+        }
+        _exit(0);  // the log is not closed, uncommitted records are lost
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+        fail("fork");
+    for (i = 0; i <= kUpdates / 2; i++)
+        update(i, NULL, NULL, &expect);
+    {
+        layered_trie mtrie(archive);
+        trie_log log(logfile);
+        if (log.replay(&mtrie) != static_cast<size_t>(kUpdates / 2 + 1))
+            fail("replaying committed records");
+        check(mtrie, expect);
+    }
+    printf("[crash] ");
+
+    // a torn record at the end
+    build_snapshot(&expect);
+    {
+        layered_trie mtrie(archive);
+        trie_log log(logfile);
+        for (i = 0; i < 100; i++)
+            update(i, &log, &mtrie, &expect);
+    }
+    FILE *fp = fopen(logfile, "a");
+    fwrite("\x10\x00\x00\x00garbage", 1, 11, fp);
+    fclose(fp);
+    {
+        layered_trie mtrie(archive);
+        trie_log log(logfile);
+        if (log.replay(&mtrie) != 100)
+            fail("replaying a torn log");
+        check(mtrie, expect);
+        update(100, &log, &mtrie, &expect);
+    }
+    {
+        layered_trie mtrie(archive);
+        trie_log log(logfile);
+        if (log.replay(&mtrie) != 101)
+            fail("appending after a torn record");
+        check(mtrie, expect);
+
+        // checkpoint
+        log.checkpoint(&mtrie, archive);
+        check(mtrie, expect);
+
+        // sequence numbers taken before a reset
+        trie::key_type tkey("reset", 5);
+        uint64_t sequence = log.insert(tkey, 1);
+        log.reset();
+        log.commit(sequence);
+        if (log.insert(tkey, 1) <= sequence)
+            fail("sequence numbers after reset");
+        log.reset();
+    }
+    {
+        layered_trie mtrie(archive);
+        trie_log log(logfile);
+        if (log.replay(&mtrie))
+            fail("replaying after checkpoint");
+        check(mtrie, expect);
+    }
+    printf("[torn] [checkpoint]\n");
+
+    // group commit from many threads
+    {
+        trie_log log(logfile);
+        pthread_t tids[kThreads];
+        writer_type writers[kThreads];
+        start = now();
+        for (i = 0; i < kThreads; i++) {
+            writers[i].log = &log;
+            writers[i].id = i;
+            pthread_create(&tids[i], NULL, commit_records, &writers[i]);
+        }
+        for (i = 0; i < kThreads; i++)
+            pthread_join(tids[i], NULL);
+        printf("group commit: %.0f commits/s from %d threads, "
+               "%d commits in %llu syncs\n",
+               kThreads * kCommits / (now() - start), kThreads,
+               kThreads * kCommits,
+               static_cast<unsigned long long>(log.syncs()));
+        if (log.syncs() > static_cast<uint64_t>(kThreads * kCommits))
+            fail("group commit");
+    }
+    {
+        layered_trie mtrie(archive);
+        trie_log log(logfile);
+        if (log.replay(&mtrie) != static_cast<size_t>(kThreads * kCommits))
+            fail("replaying group commits");
+    }
+    remove(archive);
+    remove(logfile);
+
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
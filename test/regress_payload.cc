@@ -0,0 +1,99 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include "trie.h"
+
+using namespace dutil;
+
+static bool check_payload(const trie *trie, const char *word,
+                          const char *expect)
+{
+    const char *payload;
+    size_t length;
+    trie::key_type key(word, strlen(word));
+    if (!trie->search_payload(key, &payload, &length))
+        return !expect;
+    return expect && length == strlen(expect)
+           && memcmp(payload, expect, length) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *archive = "/tmp/regress_payload.idx";
+    const char *louds_archive = "/tmp/regress_payload_louds.idx";
+    const char *dict[][2] = {
+        {"bachelor", "{\"id\": 1}"},
+        {"back", ""},
+        {"badge", "0123456789abcdef0123456789abcdef"},
+        {"badger", "x"},
+        {"bcs", "{\"features\": [0.1, 0.2, 0.3]}"},
+        {NULL, NULL}
+    };
+    size_t i, t;
+    trie::value_type offset;
+
+    printf("libtrie payload regress testing\n");
+    printf("===============================\n");
+    for (t = 0; t < 2; t++) {
+        trie::trie_type type = t?trie::DOUBLE_TRIE:trie::SINGLE_TRIE;
+        trie *mtrie = trie::create_trie(type);
+        for (i = 0; dict[i][0]; i++) {
+            trie::key_type key(dict[i][0], strlen(dict[i][0]));
+            mtrie->insert_payload(key, dict[i][1], strlen(dict[i][1]));
+        }
+        mtrie->insert("plain", 5, 7);
+        // a value equal to the offset of a record refers to nothing
+        mtrie->search("bachelor", 8, &offset);
+        mtrie->insert("count", 5, offset);
+        mtrie->insert("badger", 6, offset);
+        dict[3][1] = NULL;
+        mtrie->build(archive);
+
+        trie *loaded = trie::create_trie(archive);
+        trie *louds = trie::create_trie(*mtrie, trie::LOUDS_TRIE);
+        louds->build(louds_archive);
+        delete louds;
+        louds = trie::create_trie(louds_archive);
+        printf("\n%s\n", t?"double_trie":"single_trie");
+        printf("-----------\n");
+        for (i = 0; dict[i][0]; i++) {
+            if (!check_payload(mtrie, dict[i][0], dict[i][1])
+                || !check_payload(loaded, dict[i][0], dict[i][1])
+                || !check_payload(louds, dict[i][0], dict[i][1])) {
+                printf("\nTEST FAILED on '%s'!\n", dict[i][0]);
+                exit(1);
+            }
+            printf("[%s] ", dict[i][0]);
+        }
+        if (!check_payload(loaded, "badness", NULL)
+            || !check_payload(loaded, "plain", NULL)
+            || !check_payload(mtrie, "count", NULL)
+            || !check_payload(loaded, "count", NULL)
+            || !check_payload(louds, "count", NULL)) {
+            printf("\nTEST FAILED on missing payload!\n");
+            exit(1);
+        }
+        // so does it once the archive is updated
+        loaded->insert("plainer", 7, offset);
+        if (!check_payload(loaded, "bachelor", dict[0][1])
+            || !check_payload(loaded, "badger", NULL)
+            || !check_payload(loaded, "plainer", NULL)) {
+            printf("\nTEST FAILED on updated archive!\n");
+            exit(1);
+        }
+        dict[3][1] = "x";
+        printf("\n");
+        delete louds;
+        delete loaded;
+        delete mtrie;
+    }
+    remove(archive);
+    remove(louds_archive);
+
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
@@ -7,7 +7,6 @@
 #include <math.h>
 #include "trie_impl.h"
 
-#define length(x) (strlen(x))
 #define unsigned_value(x, y) (unsigned int)(j + 1)
 #define signed_value(x, y) (int)(3 - j)
 
@@ -42,6 +41,30 @@ int main(int argc, char *argv[])
 			std::cout << it->first.c_str() << " = " << it->second << std::endl;
 	}
 	std::cout << "== Done ==" << std::endl;
+
+	// every key found carries the labels it was inserted with, followed
+	// by terminators only, also one whose rear suffix is a terminator
+	result.clear();
+	trie->prefix_search(trie::key_type(), &result);
+	for (i = 0; i < sizeof(dict) / sizeof(char *); i++) {
+		trie::result_type::const_iterator it;
+		for (it = result.begin(); it != result.end(); it++)
+			if (it->second == static_cast<trie::value_type>(i + 1))
+				break;
+		key.assign(dict[i], strlen(dict[i]));
+		bool fail = it == result.end() || it->first.length() < key.length()
+		            || memcmp(it->first.data(), key.data(),
+		                      key.length() * sizeof(trie::char_type))
+		            || strcmp(it->first.c_str(), dict[i]);
+		for (size_t j = key.length(); !fail && j < it->first.length(); j++)
+			fail = it->first.data()[j] != trie::key_type::kTerminator;
+		if (fail) {
+			std::cout << "TEST FAILED on " << dict[i] << std::endl;
+			delete trie;
+			return 1;
+		}
+	}
 	delete trie;
 
+	return 0;
 }
@@ -0,0 +1,214 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include "trie.h"
+#include "sharded_trie.h"
+
+using namespace dutil;
+
+static const int kWriters = 4;
+static const int kKeys = 20000;
+
+typedef struct {
+    sharded_trie *mtrie;
+    int id;
+} writer_type;
+
+/// Returns the (n)th key, its payload if it has one.
+static void make_key(int n, char *key, size_t size, std::string *payload)
+{
+    snprintf(key, size, "s%d", n);
+    payload->clear();
+    if (n % 5 == 0) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "payload-%d", n);
+        payload->assign(buf);
+    }
+}
+
+/**
+ * Returns true if the (n)th key is found as it was inserted. Plain
+ * values are offsets of records in other shards and in merged archives,
+ * they must not be taken for payloads.
+ */
+static bool check_key(const trie *mtrie, int n)
+{
+    char key[32];
+    std::string payload;
+    trie::value_type value;
+    const char *data;
+    size_t length;
+
+    make_key(n, key, sizeof(key), &payload);
+    trie::key_type tkey(key, strlen(key));
+    if (payload.empty())
+        return mtrie->search(tkey, &value) && value == n + 1
+               && !mtrie->search_payload(tkey, &data, &length);
+    return mtrie->search_payload(tkey, &data, &length)
+           && payload == std::string(data, length);
+}
+
+static void *write_trie(void *arg)
+{
+    writer_type *writer = static_cast<writer_type *>(arg);
+    char key[32];
+    std::string payload;
+
+    for (int n = writer->id; n < kKeys; n += kWriters) {
+        make_key(n, key, sizeof(key), &payload);
+        trie::key_type tkey(key, strlen(key));
+        if (payload.empty())
+            writer->mtrie->insert(tkey, n + 1);
+        else
+            writer->mtrie->insert_payload(tkey, payload.data(),
+                                          payload.size());
+        if (n % 256 == writer->id)
+            sched_yield();
+    }
+    return NULL;
+}
+
+/// Checks that prefix_search() finds every key with a prefix once.
+static void check_prefix(const trie *mtrie, const char *prefix, int count)
+{
+    trie::result_type result;
+    trie::key_type key(prefix, strlen(prefix));
+    mtrie->prefix_search(key, &result);
+    if (static_cast<int>(result.size()) != count) {
+        printf("\nTEST FAILED on prefix searching %s, %d of %d found!\n",
+               prefix, static_cast<int>(result.size()), count);
+        exit(1);
+    }
+    trie::result_type::const_iterator it;
+    for (it = result.begin(); it != result.end(); it++) {
+        int n = atoi(it->first.c_str() + 1);
+        if (strncmp(it->first.c_str(), prefix, strlen(prefix))
+            || (n % 5 && it->second != n + 1)) {
+            printf("\nTEST FAILED on prefix searching %s, found %s!\n",
+                   prefix, it->first.c_str());
+            exit(1);
+        }
+    }
+}
+
+/// Checks that every key found by prefix_search() is found by search().
+static void check_found_keys()
+{
+    const char *words[] = {"a", "b", "abc", "xyz", NULL};
+    sharded_trie words_trie(8, 2);
+    trie::result_type result;
+    trie::key_type empty("", 0);
+    size_t i;
+
+    for (i = 0; words[i]; i++)
+        words_trie.insert(words[i], strlen(words[i]), i + 1);
+    words_trie.prefix_search(empty, &result);
+    if (result.size() != i) {
+        printf("\nTEST FAILED on prefix searching all shards!\n");
+        exit(1);
+    }
+    for (i = 0; i < result.size(); i++) {
+        trie::value_type value;
+        if (!words_trie.search(result[i].first, &value)
+            || value != result[i].second) {
+            printf("\nTEST FAILED on searching %s found by prefix!\n",
+                   result[i].first.c_str());
+            exit(1);
+        }
+    }
+    printf("[found keys] %d keys\n", static_cast<int>(result.size()));
+}
+
+static void test_archive(trie::trie_type type, const char *name)
+{
+    char filename[] = "/tmp/regress_sharded.XXXXXX";
+    int fd = mkstemp(filename);
+    if (fd < 0) {
+        perror("mkstemp");
+        exit(1);
+    }
+    close(fd);
+    sharded_trie words(4, 2, type);
+    for (int i = 0; i < kKeys; i++) {
+        char key[32];
+        std::string payload;
+        make_key(i, key, sizeof(key), &payload);
+        if (payload.empty())
+            words.insert(key, strlen(key), i + 1);
+        else
+            words.insert_payload(trie::key_type(key, strlen(key)),
+                                payload.data(), payload.size());
+    }
+    words.build(filename);
+    trie *loaded = trie::create_trie(filename);
+    for (int i = 0; i < kKeys; i++) {
+        if (!check_key(loaded, i)) {
+            printf("\nTEST FAILED on searching %s archive!\n", name);
+            exit(1);
+        }
+    }
+    check_prefix(loaded, "s12", 1111);
+    delete loaded;
+    unlink(filename);
+    printf("[%s] archive of %d keys\n", name, kKeys);
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t threads[kWriters];
+    writer_type writers[kWriters];
+    int i;
+
+    printf("libtrie sharded regress testing\n");
+    printf("===============================\n");
+    // shards chosen by the first three bytes, searching while inserting
+    // is checked by regress_concurrent
+    sharded_trie *mtrie = new sharded_trie(8, 3);
+    for (i = 0; i < kWriters; i++) {
+        writers[i].mtrie = mtrie;
+        writers[i].id = i;
+        pthread_create(&threads[i], NULL, write_trie, &writers[i]);
+    }
+    for (i = 0; i < kWriters; i++)
+        pthread_join(threads[i], NULL);
+    mtrie->reclaim();
+    for (i = 0; i < kKeys; i++) {
+        if (!check_key(mtrie, i)) {
+            printf("\nTEST FAILED on searching after inserting!\n");
+            exit(1);
+        }
+    }
+    // a key inserted again is a plain key
+    const char *data;
+    size_t length;
+    mtrie->insert("s0", 2, 1);
+    if (mtrie->search_payload(trie::key_type("s0", 2), &data, &length)) {
+        printf("\nTEST FAILED on replacing a payload!\n");
+        exit(1);
+    }
+    mtrie->insert_payload(trie::key_type("s0", 2), "payload-0", 9);
+    // one shard, then all shards
+    check_prefix(mtrie, "s123", 111);
+    check_prefix(mtrie, "s1", 11111);
+    check_prefix(mtrie, "", kKeys);
+    printf("[sharded] %d writers, %d shards\n", kWriters,
+           static_cast<int>(mtrie->shards()));
+
+    delete mtrie;
+
+    check_found_keys();
+    test_archive(trie::DOUBLE_TRIE, "two");
+    test_archive(trie::SINGLE_TRIE, "tail");
+    test_archive(trie::LOUDS_TRIE, "louds");
+
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
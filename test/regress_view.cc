@@ -0,0 +1,324 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "trie.h"
+#include "trie_view.h"
+
+using namespace dutil;
+
+static const int kKeys = 3000;
+
+typedef std::pair<std::string, trie::value_type> entry_type;
+
+/// Collects the keys visited by prefix().
+struct collect_keys {
+    std::vector<entry_type> *keys;
+
+    void operator()(const char *key, size_t length, trie::value_type value)
+    {
+        keys->push_back(entry_type(std::string(key, length), value));
+    }
+};
+
+/// Collects the lengths visited by common_prefix_search().
+struct collect_lengths {
+    std::vector<size_t> *lengths;
+
+    void operator()(size_t length, trie::value_type value)
+    {
+        lengths->push_back(length);
+    }
+};
+
+static void fail(const char *name, const char *what, const std::string &key)
+{
+    printf("\nTEST FAILED on %s of %s view, key '%s'!\n",
+           what, name, key.c_str());
+    exit(1);
+}
+
+/**
+ * Returns the keys to insert, some of them prefixes of others. Keys
+ * ending alike make a tail-trie share its tails.
+ */
+static std::vector<std::string> make_keys(const char *ending)
+{
+    std::vector<std::string> keys;
+    unsigned seed = 1;
+    char buf[32];
+    for (int i = 0; i < kKeys; i++) {
+        snprintf(buf, sizeof(buf), "s%d", i);
+        keys.push_back(buf);
+    }
+    for (int i = 0; i < kKeys; i++) {
+        std::string key;
+        int length = rand_r(&seed) % 8;
+        for (int j = 0; j < length; j++)
+            key.push_back("abc\x01\xff"[rand_r(&seed) % 5]);
+        keys.push_back(key);
+    }
+    for (size_t i = 0; i < keys.size(); i++)
+        keys[i].append(ending);
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    return keys;
+}
+
+/// Checks a view against the trie loaded from the same archive.
+template<typename View>
+static void check_view(const View &view, const trie *loaded,
+                       const std::vector<std::string> &keys,
+                       const char *name)
+{
+    std::vector<std::string>::const_iterator it;
+    for (it = keys.begin(); it != keys.end(); it++) {
+        trie::key_type key(it->data(), it->size());
+        trie::value_type expect = 0, value = 0;
+        const char *payload, *expect_payload;
+        size_t length, expect_length;
+        bool found = loaded->search(key, &expect);
+        if (!found || view.search(it->data(), it->size(), &value) != found
+            || value != expect || !view.search(key, &value)
+            || value != expect)
+            fail(name, "searching", *it);
+        found = loaded->search_payload(key, &expect_payload,
+                                       &expect_length);
+        if (view.search_payload(it->data(), it->size(), &payload, &length)
+            != found
+            || (found && (length != expect_length
+                          || memcmp(payload, expect_payload, length))))
+            fail(name, "searching payload", *it);
+        // a missing key next to one found
+        std::string miss = *it + "z";
+        if (view.search(miss.data(), miss.size(), NULL)
+            != loaded->search(miss.data(), miss.size(), NULL))
+            fail(name, "searching", miss);
+        if (!it->empty()) {
+            miss.assign(*it, 0, it->size() - 1);
+            if (view.search(miss.data(), miss.size(), NULL)
+                != loaded->search(miss.data(), miss.size(), NULL))
+                fail(name, "searching", miss);
+        }
+
+        // every key of the common prefixes is a prefix found in keys
+        std::vector<size_t> lengths;
+        collect_lengths visit_length = {&lengths};
+        std::string text = *it + "s1";
+        view.common_prefix_search(text.data(), text.size(), visit_length);
+        size_t expect_count = 0;
+        for (size_t i = 0; i <= text.size(); i++) {
+            if (loaded->search(text.data(), i, NULL)) {
+                if (expect_count >= lengths.size()
+                    || lengths[expect_count] != i)
+                    fail(name, "common prefix searching", text);
+                expect_count++;
+            }
+        }
+        if (expect_count != lengths.size())
+            fail(name, "common prefix searching", text);
+    }
+
+    // prefixes of every length, including the empty one
+    const char *prefixes[] = {"", "s", "s1", "s12", "s299", "a", "ab",
+                              "\xff", "\x01\x01", "s2999z", "q", NULL};
+    for (size_t i = 0; prefixes[i]; i++) {
+        trie::result_type result;
+        std::vector<entry_type> visited;
+        collect_keys visit_key = {&visited};
+        std::string prefix(prefixes[i]);
+        loaded->prefix_search(trie::key_type(prefix.data(), prefix.size()),
+                              &result);
+        if (view.prefix(prefix.data(), prefix.size(), visit_key)
+            != result.size() || visited.size() != result.size())
+            fail(name, "prefix searching", prefix);
+        for (size_t j = 0; j < result.size(); j++) {
+            // a key found may keep terminators, the view leaves them out
+            const trie::key_type &expect = result[j].first;
+            size_t length = expect.length();
+            while (length && expect.data()[length - 1]
+                             == trie::key_type::kTerminator)
+                length--;
+            trie::key_type key(visited[j].first.data(),
+                               visited[j].first.size());
+            if (key.length() != length
+                || memcmp(key.data(), expect.data(),
+                          sizeof(trie::char_type) * length)
+                || visited[j].second != result[j].second)
+                fail(name, "prefix searching", prefix);
+            trie::value_type value;
+            if (!view.search(expect, &value) || value != result[j].second)
+                fail(name, "searching a key found by prefix", prefix);
+        }
+    }
+}
+
+/// Maps an archive into memory.
+static void *map_archive(const char *filename, size_t *size)
+{
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(filename);
+        exit(1);
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    *size = st.st_size;
+    return data;
+}
+
+template<typename View>
+static void test_view(trie::trie_type type, bool remap, const char *name,
+                      const char *ending = "")
+{
+    const char *archive = "/tmp/regress_view.idx";
+    std::vector<std::string> keys = make_keys(ending);
+    trie *mtrie = trie::create_trie(type);
+    if (remap) {
+        size_t frequency[256] = {0};
+        for (size_t i = 0; i < keys.size(); i++)
+            for (size_t j = 0; j < keys[i].size(); j++)
+                frequency[static_cast<unsigned char>(keys[i][j])]++;
+        mtrie->remap_labels(frequency);
+    }
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (i % 7 == 0)
+            mtrie->insert_payload(trie::key_type(keys[i].data(),
+                                                 keys[i].size()),
+                                  keys[i].data(), keys[i].size());
+        else
+            mtrie->insert(keys[i].data(), keys[i].size(), i + 1);
+    }
+    // a value equal to the offset of a record refers to nothing
+    trie::value_type offset;
+    mtrie->search(keys[0].data(), keys[0].size(), &offset);
+    mtrie->insert(keys[1].data(), keys[1].size(), offset);
+    mtrie->build(archive);
+    delete mtrie;
+
+    size_t size;
+    void *data = map_archive(archive, &size);
+    trie *loaded = trie::create_trie(archive);
+    View view(data, size);
+    check_view(view, loaded, keys, name);
+    delete loaded;
+    munmap(data, size);
+
+    // the other type of archive is refused
+    mtrie = trie::create_trie(type == trie::DOUBLE_TRIE?trie::SINGLE_TRIE
+                                                       :trie::DOUBLE_TRIE);
+    mtrie->insert("key", 3, 1);
+    mtrie->build(archive);
+    delete mtrie;
+    data = map_archive(archive, &size);
+    try {
+        View other(data, size);
+        fail(name, "refusing", "key");
+    } catch (const bad_trie_archive &e) {
+    }
+    munmap(data, size);
+
+    // so is an archive requiring a section unknown to the format
+    mtrie = trie::create_trie(type);
+    mtrie->set_filter(10);
+    mtrie->insert("key", 3, 1);
+    mtrie->build(archive);
+    delete mtrie;
+    data = map_archive(archive, &size);
+    std::vector<uint64_t> copy(size / sizeof(uint64_t) + 1);
+    memcpy(&copy[0], data, size);
+    munmap(data, size);
+    archive_header *header = reinterpret_cast<archive_header *>(&copy[0]);
+    section_entry *table = reinterpret_cast<section_entry *>(header + 1);
+    View known(&copy[0], size);
+    for (uint32_t i = 0; i < header->section_count; i++) {
+        if (table[i].id == SECTION_FILTER) {
+            table[i].id = SECTION_MAX;
+            table[i].flags |= kSectionRequired;
+        }
+    }
+    try {
+        View unknown(&copy[0], size);
+        fail(name, "refusing unknown sections", "key");
+    } catch (const bad_trie_archive &e) {
+    }
+
+    // so is an archive with chains
+    mtrie = trie::create_trie(type);
+    mtrie->set_compress_chains(true);
+    mtrie->insert("https://www.example.com/a", 25, 1);
+    mtrie->insert("https://www.example.com/b", 25, 2);
+    mtrie->build(archive);
+    delete mtrie;
+    data = map_archive(archive, &size);
+    try {
+        View chained(data, size);
+        fail(name, "refusing chains", "https://www.example.com/a");
+    } catch (const bad_trie_archive &e) {
+    }
+    munmap(data, size);
+
+    // so is an empty trie in a view of its own
+    mtrie = trie::create_trie(type);
+    mtrie->build(archive);
+    delete mtrie;
+    data = map_archive(archive, &size);
+    View empty(data, size);
+    std::vector<entry_type> visited;
+    collect_keys visit_key = {&visited};
+    if (empty.search("", 0, NULL) || empty.search("key", 3, NULL)
+        || empty.prefix("", 0, visit_key))
+        fail(name, "searching empty", "key");
+    munmap(data, size);
+
+    // keys found by prefix_search() end in terminators
+    const char *words[] = {"a", "abc", "b", NULL};
+    mtrie = trie::create_trie(type);
+    for (size_t i = 0; words[i]; i++)
+        mtrie->insert(words[i], strlen(words[i]), i + 1);
+    mtrie->build(archive);
+    trie::result_type result;
+    mtrie->prefix_search(trie::key_type("", 0), &result);
+    delete mtrie;
+    data = map_archive(archive, &size);
+    View found(data, size);
+    for (size_t i = 0; i < result.size(); i++) {
+        trie::value_type value;
+        if (!found.search(result[i].first, &value)
+            || value != result[i].second)
+            fail(name, "searching a key found", result[i].first.c_str());
+    }
+    munmap(data, size);
+    unlink(archive);
+    printf("[%s%s%s] %d keys\n", name, remap?", remapped":"",
+           *ending?", same endings":"", static_cast<int>(keys.size()));
+}
+
+int main(int argc, char *argv[])
+{
+    printf("libtrie view regress testing\n");
+    printf("============================\n");
+    test_view<double_trie_view>(trie::DOUBLE_TRIE, false, "two");
+    test_view<double_trie_view>(trie::DOUBLE_TRIE, true, "two");
+    test_view<single_trie_view>(trie::SINGLE_TRIE, false, "tail");
+    test_view<single_trie_view>(trie::SINGLE_TRIE, true, "tail");
+    test_view<single_trie_view>(trie::SINGLE_TRIE, false, "tail",
+                                ".example.com/index.html");
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et